@@ -1,6 +1,9 @@
 @echo off
 pushd %~dp0
-wpr -start Tracing.wprp -filemode
+rem Pass "summary" to only collect the per-frame events and counters.
+set PROFILE=Tracing.wprp
+if /i "%1"=="summary" set PROFILE=Tracing.wprp!VRSInjectorSummary
+wpr -start %PROFILE% -filemode
 
 echo Reproduce your issue now, then
 pause
@@ -0,0 +1,784 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pch.h"
+
+#include "Check.h"
+#include "Statistics.h"
+#include "Tracing.h"
+
+#include <SceneVS.h>
+#include <ScenePS.h>
+
+namespace Tracing {
+
+    // {6ed74f89-8dc9-4893-828b-a05979f45ea9}
+    TRACELOGGING_DEFINE_PROVIDER(g_traceProvider,
+                                 "VRSBenchmark",
+                                 (0x6ed74f89, 0x8dc9, 0x4893, 0x82, 0x8b, 0xa0, 0x59, 0x79, 0xf4, 0x5e, 0xa9));
+
+} // namespace Tracing
+
+namespace {
+
+    constexpr UINT NumBackBuffers = 3;
+    constexpr UINT NumFramesInFlight = 2;
+    // The RTV of the scene color follows the ones of the back buffers.
+    constexpr UINT SceneColorRTV = NumBackBuffers;
+    constexpr float ClearColor[] = {0.f, 0.f, 0.f, 1.f};
+
+    struct Resolution {
+        UINT Width;
+        UINT Height;
+    };
+
+    struct Options {
+        // The swapchain is resized to the next resolution every ResolutionChangePeriod frames (0 to never change).
+        std::vector<Resolution> Resolutions;
+        UINT ResolutionChangePeriod{0};
+        UINT NumFrames{1000};
+        UINT NumWarmupFrames{100};
+        UINT NumCommandLists{4};
+        UINT NumThreads{1};
+        UINT NumDrawsPerCommandList{2};
+        UINT ShaderIterations{64};
+        bool VSync{false};
+        // Load the injector into the process before creating any D3D12 object.
+        std::string InjectorPath;
+        std::string CsvPath;
+    };
+
+    struct FrameStatistics {
+        Resolution Size{};
+        double FrameTime{0.0};
+        double CpuTime{0.0};
+        double GpuTime{-1.0};
+    };
+
+    void PrintUsage() {
+        fmt::print("Usage: VRSBenchmark [options]\n"
+                   "  --resolution WxH        Add a resolution (default 1920x1080). Repeat for multiple resolutions.\n"
+                   "  --resolution-period N   Switch to the next resolution every N frames (default 0: never).\n"
+                   "  --frames N              Number of measured frames (default 1000).\n"
+                   "  --warmup N              Number of frames before measuring (default 100).\n"
+                   "  --command-lists N       Number of command lists per frame (default 4).\n"
+                   "  --threads N             Number of threads recording the command lists (default 1).\n"
+                   "  --draws N               Number of full-screen draws per command list (default 2).\n"
+                   "  --iterations N          Cost of the pixel shader (default 64).\n"
+                   "  --vsync                 Present with v-sync.\n"
+                   "  --inject [path]         Load the injector (default VRSInjector.dll) before starting.\n"
+                   "  --csv path              Write the statistics of each frame to a CSV file.\n");
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options) {
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+            const bool hasValue = i + 1 < argc && argv[i + 1][0] != '-';
+            const auto value = [&]() -> std::string {
+                CHECK_MSG(hasValue, fmt::format("Missing value for {}", arg));
+                return argv[++i];
+            };
+            if (arg == "--resolution") {
+                Resolution resolution{};
+                CHECK_MSG(sscanf_s(value().c_str(), "%ux%u", &resolution.Width, &resolution.Height) == 2 &&
+                              resolution.Width && resolution.Height,
+                          "Invalid resolution");
+                options.Resolutions.push_back(resolution);
+            } else if (arg == "--resolution-period") {
+                options.ResolutionChangePeriod = std::stoul(value());
+            } else if (arg == "--frames") {
+                options.NumFrames = std::stoul(value());
+            } else if (arg == "--warmup") {
+                options.NumWarmupFrames = std::stoul(value());
+            } else if (arg == "--command-lists") {
+                options.NumCommandLists = std::max(static_cast<UINT>(std::stoul(value())), 1u);
+            } else if (arg == "--threads") {
+                options.NumThreads = std::max(static_cast<UINT>(std::stoul(value())), 1u);
+            } else if (arg == "--draws") {
+                options.NumDrawsPerCommandList = std::max(static_cast<UINT>(std::stoul(value())), 1u);
+            } else if (arg == "--iterations") {
+                options.ShaderIterations = std::stoul(value());
+            } else if (arg == "--vsync") {
+                options.VSync = true;
+            } else if (arg == "--inject") {
+                options.InjectorPath = hasValue ? value() : "VRSInjector.dll";
+            } else if (arg == "--csv") {
+                options.CsvPath = value();
+            } else {
+                return false;
+            }
+        }
+        if (options.Resolutions.empty()) {
+            options.Resolutions.push_back({1920, 1080});
+        }
+        return true;
+    }
+
+    double GetTimeMilliseconds() {
+        LARGE_INTEGER frequency, counter;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&counter);
+        return counter.QuadPart * 1000.0 / frequency.QuadPart;
+    }
+
+    // Run a task on multiple threads, once per frame.
+    class RecordingThreads {
+      public:
+        RecordingThreads(UINT NumThreads, std::function<void(UINT)> Task) : m_Task(std::move(Task)) {
+            for (UINT i = 0; i < NumThreads; i++) {
+                m_Threads.emplace_back([this, i] { Worker(i); });
+            }
+        }
+
+        ~RecordingThreads() {
+            {
+                std::unique_lock lock(m_Mutex);
+                m_Stop = true;
+            }
+            m_WakeUp.notify_all();
+            for (auto& thread : m_Threads) {
+                thread.join();
+            }
+        }
+
+        void Run() {
+            {
+                std::unique_lock lock(m_Mutex);
+                m_NumCompleted = 0;
+                m_Generation++;
+            }
+            m_WakeUp.notify_all();
+
+            std::unique_lock lock(m_Mutex);
+            m_Completed.wait(lock, [&] { return m_NumCompleted == m_Threads.size(); });
+        }
+
+      private:
+        void Worker(UINT ThreadIndex) {
+            uint64_t lastGeneration = 0;
+            std::unique_lock lock(m_Mutex);
+            while (true) {
+                m_WakeUp.wait(lock, [&] { return m_Stop || m_Generation != lastGeneration; });
+                if (m_Stop) {
+                    break;
+                }
+                lastGeneration = m_Generation;
+
+                lock.unlock();
+                m_Task(ThreadIndex);
+                lock.lock();
+
+                m_NumCompleted++;
+                m_Completed.notify_one();
+            }
+        }
+
+        const std::function<void(UINT)> m_Task;
+        std::mutex m_Mutex;
+        std::condition_variable m_WakeUp;
+        std::condition_variable m_Completed;
+        uint64_t m_Generation{0};
+        size_t m_NumCompleted{0};
+        bool m_Stop{false};
+
+        // Must be last, since the threads use the other members.
+        std::vector<std::thread> m_Threads;
+    };
+
+    LRESULT CALLBACK WindowProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+        switch (message) {
+        case WM_KEYDOWN:
+            if (wParam == VK_ESCAPE) {
+                PostQuitMessage(0);
+            }
+            return 0;
+        case WM_DESTROY:
+            PostQuitMessage(0);
+            return 0;
+        }
+        return DefWindowProc(hWnd, message, wParam, lParam);
+    }
+
+    // Render a synthetic scene made of full-screen draws with an expensive pixel shader, and measure each frame.
+    class Benchmark {
+      public:
+        Benchmark(const Options& Options) : m_Options(Options) {
+            CreateAppWindow();
+            CreateDevice();
+            CreateSwapchain(m_Options.Resolutions[0]);
+            CreatePipeline();
+            CreateFrameResources();
+
+            if (m_Options.NumThreads > 1) {
+                m_RecordingThreads = std::make_unique<RecordingThreads>(
+                    std::min(m_Options.NumThreads, m_Options.NumCommandLists), [this](UINT ThreadIndex) {
+                        const UINT numThreads = std::min(m_Options.NumThreads, m_Options.NumCommandLists);
+                        for (UINT i = ThreadIndex; i < m_Options.NumCommandLists; i += numThreads) {
+                            RecordCommandList(i);
+                        }
+                    });
+            }
+        }
+
+        ~Benchmark() {
+            m_RecordingThreads.reset();
+            if (m_Queue) {
+                WaitForGpu();
+            }
+            if (m_Window) {
+                DestroyWindow(m_Window);
+            }
+        }
+
+        std::vector<FrameStatistics> Run() {
+            const UINT totalFrames = m_Options.NumWarmupFrames + m_Options.NumFrames;
+            std::vector<FrameStatistics> statistics(totalFrames);
+
+            size_t resolutionIndex = 0;
+            double lastPresentTime = GetTimeMilliseconds();
+            for (m_FrameIndex = 0; m_FrameIndex < totalFrames; m_FrameIndex++) {
+                if (!PumpMessages()) {
+                    statistics.resize(m_FrameIndex);
+                    break;
+                }
+
+                if (m_Options.ResolutionChangePeriod && m_FrameIndex &&
+                    !(m_FrameIndex % m_Options.ResolutionChangePeriod)) {
+                    resolutionIndex = (resolutionIndex + 1) % m_Options.Resolutions.size();
+                    Resize(m_Options.Resolutions[resolutionIndex]);
+                    // The GPU is idle after resizing, the previous frames were measured already.
+                    lastPresentTime = GetTimeMilliseconds();
+                }
+
+                // Wait for the GPU to be done with this frame's resources, and collect the GPU time of the frame that
+                // used them.
+                FrameResources& frame = m_Frames[m_FrameIndex % NumFramesInFlight];
+                WaitForFence(frame.FenceValue);
+                if (frame.FrameIndex != UINT_MAX) {
+                    statistics[frame.FrameIndex].GpuTime = ReadGpuTime(frame);
+                    frame.FrameIndex = UINT_MAX;
+                }
+
+                const double cpuStartTime = GetTimeMilliseconds();
+
+                m_BackBufferIndex = m_Swapchain->GetCurrentBackBufferIndex();
+                if (m_RecordingThreads) {
+                    m_RecordingThreads->Run();
+                } else {
+                    for (UINT i = 0; i < m_Options.NumCommandLists; i++) {
+                        RecordCommandList(i);
+                    }
+                }
+
+                std::vector<ID3D12CommandList*> commandLists;
+                for (auto& commandList : frame.CommandLists) {
+                    commandLists.push_back(commandList.Get());
+                }
+                m_Queue->ExecuteCommandLists(static_cast<UINT>(commandLists.size()), commandLists.data());
+                CHECK_HRCMD(m_Swapchain->Present(m_Options.VSync ? 1 : 0,
+                                                 !m_Options.VSync && m_IsTearingSupported ? DXGI_PRESENT_ALLOW_TEARING
+                                                                                          : 0));
+                frame.FenceValue = ++m_FenceValue;
+                CHECK_HRCMD(m_Queue->Signal(m_Fence.Get(), frame.FenceValue));
+                frame.FrameIndex = m_FrameIndex;
+
+                const double presentTime = GetTimeMilliseconds();
+                FrameStatistics& frameStatistics = statistics[m_FrameIndex];
+                frameStatistics.Size = m_Resolution;
+                frameStatistics.CpuTime = presentTime - cpuStartTime;
+                frameStatistics.FrameTime = presentTime - lastPresentTime;
+                lastPresentTime = presentTime;
+
+                TraceLoggingWrite(Tracing::g_traceProvider,
+                                  "Frame",
+                                  TLArg(m_FrameIndex, "FrameIndex"),
+                                  TLArg(m_Resolution.Width, "Width"),
+                                  TLArg(m_Resolution.Height, "Height"),
+                                  TLArg(frameStatistics.CpuTime, "CpuTime"),
+                                  TLArg(frameStatistics.FrameTime, "FrameTime"));
+            }
+
+            // Collect the last frames.
+            WaitForGpu();
+            for (auto& frame : m_Frames) {
+                if (frame.FrameIndex != UINT_MAX && frame.FrameIndex < statistics.size()) {
+                    statistics[frame.FrameIndex].GpuTime = ReadGpuTime(frame);
+                }
+                frame.FrameIndex = UINT_MAX;
+            }
+
+            return statistics;
+        }
+
+      private:
+        struct FrameResources {
+            std::vector<ComPtr<ID3D12CommandAllocator>> Allocators;
+            std::vector<ComPtr<ID3D12GraphicsCommandList>> CommandLists;
+            uint64_t FenceValue{0};
+            // The frame measured with these resources, if any.
+            UINT FrameIndex{UINT_MAX};
+        };
+
+        void CreateAppWindow() {
+            WNDCLASSEX windowClass{};
+            windowClass.cbSize = sizeof(WNDCLASSEX);
+            windowClass.style = CS_HREDRAW | CS_VREDRAW;
+            windowClass.lpfnWndProc = WindowProc;
+            windowClass.hInstance = GetModuleHandle(nullptr);
+            windowClass.hCursor = LoadCursor(nullptr, IDC_ARROW);
+            windowClass.lpszClassName = L"VRSBenchmark";
+            RegisterClassEx(&windowClass);
+
+            m_Window = CreateWindow(windowClass.lpszClassName,
+                                    L"VRS Benchmark",
+                                    WS_OVERLAPPEDWINDOW,
+                                    CW_USEDEFAULT,
+                                    CW_USEDEFAULT,
+                                    CW_USEDEFAULT,
+                                    CW_USEDEFAULT,
+                                    nullptr,
+                                    nullptr,
+                                    windowClass.hInstance,
+                                    nullptr);
+            CHECK_MSG(m_Window, "Failed to create window");
+            ShowWindow(m_Window, SW_SHOW);
+        }
+
+        void ResizeAppWindow(const Resolution& Resolution) {
+            RECT rect{0, 0, static_cast<LONG>(Resolution.Width), static_cast<LONG>(Resolution.Height)};
+            AdjustWindowRect(&rect, WS_OVERLAPPEDWINDOW, FALSE);
+            SetWindowPos(m_Window,
+                         nullptr,
+                         0,
+                         0,
+                         rect.right - rect.left,
+                         rect.bottom - rect.top,
+                         SWP_NOMOVE | SWP_NOZORDER | SWP_NOACTIVATE);
+        }
+
+        void CreateDevice() {
+            CHECK_HRCMD(CreateDXGIFactory1(IID_PPV_ARGS(m_Factory.ReleaseAndGetAddressOf())));
+
+            ComPtr<IDXGIFactory5> factory5;
+            BOOL allowTearing = FALSE;
+            m_IsTearingSupported =
+                SUCCEEDED(m_Factory.As(&factory5)) &&
+                SUCCEEDED(factory5->CheckFeatureSupport(
+                    DXGI_FEATURE_PRESENT_ALLOW_TEARING, &allowTearing, sizeof(allowTearing))) &&
+                allowTearing;
+
+            CHECK_HRCMD(
+                D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_11_0, IID_PPV_ARGS(m_Device.ReleaseAndGetAddressOf())));
+
+            D3D12_COMMAND_QUEUE_DESC queueDesc{};
+            queueDesc.Type = D3D12_COMMAND_LIST_TYPE_DIRECT;
+            CHECK_HRCMD(m_Device->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(m_Queue.ReleaseAndGetAddressOf())));
+            CHECK_HRCMD(m_Queue->GetTimestampFrequency(&m_TimestampFrequency));
+
+            CHECK_HRCMD(
+                m_Device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(m_Fence.ReleaseAndGetAddressOf())));
+            m_FenceEvent.Attach(CreateEventEx(nullptr, L"Benchmark Fence", 0, EVENT_ALL_ACCESS));
+
+            D3D12_DESCRIPTOR_HEAP_DESC rtvHeapDesc{};
+            rtvHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_RTV;
+            rtvHeapDesc.NumDescriptors = NumBackBuffers + 1;
+            CHECK_HRCMD(
+                m_Device->CreateDescriptorHeap(&rtvHeapDesc, IID_PPV_ARGS(m_RTVHeap.ReleaseAndGetAddressOf())));
+            m_RTVDescriptorSize = m_Device->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_RTV);
+        }
+
+        UINT GetSwapchainFlags() const {
+            return m_IsTearingSupported ? DXGI_SWAP_CHAIN_FLAG_ALLOW_TEARING : 0;
+        }
+
+        void CreateSwapchain(const Resolution& Resolution) {
+            ResizeAppWindow(Resolution);
+
+            DXGI_SWAP_CHAIN_DESC1 swapchainDesc{};
+            swapchainDesc.Width = Resolution.Width;
+            swapchainDesc.Height = Resolution.Height;
+            swapchainDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+            swapchainDesc.SampleDesc.Count = 1;
+            swapchainDesc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+            swapchainDesc.BufferCount = NumBackBuffers;
+            swapchainDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
+            swapchainDesc.Flags = GetSwapchainFlags();
+
+            ComPtr<IDXGISwapChain1> swapchain;
+            CHECK_HRCMD(m_Factory->CreateSwapChainForHwnd(
+                m_Queue.Get(), m_Window, &swapchainDesc, nullptr, nullptr, swapchain.ReleaseAndGetAddressOf()));
+            CHECK_HRCMD(m_Factory->MakeWindowAssociation(m_Window, DXGI_MWA_NO_ALT_ENTER));
+            CHECK_HRCMD(swapchain.As(&m_Swapchain));
+
+            m_Resolution = Resolution;
+            CreateRenderTargetViews();
+        }
+
+        void Resize(const Resolution& Resolution) {
+            WaitForGpu();
+            for (auto& backBuffer : m_BackBuffers) {
+                backBuffer.Reset();
+            }
+            m_SceneColor.Reset();
+
+            ResizeAppWindow(Resolution);
+            CHECK_HRCMD(m_Swapchain->ResizeBuffers(
+                NumBackBuffers, Resolution.Width, Resolution.Height, DXGI_FORMAT_R8G8B8A8_UNORM, GetSwapchainFlags()));
+            m_Resolution = Resolution;
+            CreateRenderTargetViews();
+        }
+
+        // The scene is rendered offscreen then copied to the back buffer, like games do. The injector does not apply
+        // VRS to the passes rendering directly to the back buffer.
+        void CreateRenderTargetViews() {
+            for (UINT i = 0; i < NumBackBuffers; i++) {
+                CHECK_HRCMD(m_Swapchain->GetBuffer(i, IID_PPV_ARGS(m_BackBuffers[i].ReleaseAndGetAddressOf())));
+                m_Device->CreateRenderTargetView(m_BackBuffers[i].Get(), nullptr, GetRTV(i));
+            }
+
+            const D3D12_HEAP_PROPERTIES heapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+            const D3D12_RESOURCE_DESC sceneColorDesc =
+                CD3DX12_RESOURCE_DESC::Tex2D(DXGI_FORMAT_R8G8B8A8_UNORM,
+                                             m_Resolution.Width,
+                                             m_Resolution.Height,
+                                             1,
+                                             1,
+                                             1,
+                                             0,
+                                             D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET);
+            const D3D12_CLEAR_VALUE clearValue = CD3DX12_CLEAR_VALUE(DXGI_FORMAT_R8G8B8A8_UNORM, ClearColor);
+            CHECK_HRCMD(m_Device->CreateCommittedResource(&heapProperties,
+                                                          D3D12_HEAP_FLAG_NONE,
+                                                          &sceneColorDesc,
+                                                          D3D12_RESOURCE_STATE_RENDER_TARGET,
+                                                          &clearValue,
+                                                          IID_PPV_ARGS(m_SceneColor.ReleaseAndGetAddressOf())));
+            m_Device->CreateRenderTargetView(m_SceneColor.Get(), nullptr, GetRTV(SceneColorRTV));
+        }
+
+        D3D12_CPU_DESCRIPTOR_HANDLE GetRTV(UINT Index) const {
+            return CD3DX12_CPU_DESCRIPTOR_HANDLE(
+                m_RTVHeap->GetCPUDescriptorHandleForHeapStart(), Index, m_RTVDescriptorSize);
+        }
+
+        void CreatePipeline() {
+            D3D12_ROOT_PARAMETER rootParameters[1];
+            CD3DX12_ROOT_PARAMETER::InitAsConstants(rootParameters[0], 4, 0, 0, D3D12_SHADER_VISIBILITY_PIXEL);
+            D3D12_ROOT_SIGNATURE_DESC rootSignatureDesc{};
+            rootSignatureDesc.pParameters = rootParameters;
+            rootSignatureDesc.NumParameters = ARRAYSIZE(rootParameters);
+
+            ComPtr<ID3DBlob> rootSignatureBlob;
+            ComPtr<ID3DBlob> error;
+            CHECK_MSG(SUCCEEDED(D3D12SerializeRootSignature(&rootSignatureDesc,
+                                                            D3D_ROOT_SIGNATURE_VERSION_1,
+                                                            rootSignatureBlob.GetAddressOf(),
+                                                            error.GetAddressOf())),
+                      (char*)error->GetBufferPointer());
+            CHECK_HRCMD(m_Device->CreateRootSignature(0,
+                                                      rootSignatureBlob->GetBufferPointer(),
+                                                      rootSignatureBlob->GetBufferSize(),
+                                                      IID_PPV_ARGS(m_RootSignature.ReleaseAndGetAddressOf())));
+
+            D3D12_GRAPHICS_PIPELINE_STATE_DESC psoDesc{};
+            psoDesc.pRootSignature = m_RootSignature.Get();
+            psoDesc.VS = {g_SceneVS, sizeof(g_SceneVS)};
+            psoDesc.PS = {g_ScenePS, sizeof(g_ScenePS)};
+            psoDesc.RasterizerState = CD3DX12_RASTERIZER_DESC(D3D12_DEFAULT);
+            psoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+            psoDesc.BlendState = CD3DX12_BLEND_DESC(D3D12_DEFAULT);
+            psoDesc.DepthStencilState.DepthEnable = FALSE;
+            psoDesc.DepthStencilState.StencilEnable = FALSE;
+            psoDesc.SampleMask = UINT_MAX;
+            psoDesc.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE;
+            psoDesc.NumRenderTargets = 1;
+            psoDesc.RTVFormats[0] = DXGI_FORMAT_R8G8B8A8_UNORM;
+            psoDesc.SampleDesc.Count = 1;
+            CHECK_HRCMD(m_Device->CreateGraphicsPipelineState(&psoDesc,
+                                                              IID_PPV_ARGS(m_PipelineState.ReleaseAndGetAddressOf())));
+        }
+
+        void CreateFrameResources() {
+            for (auto& frame : m_Frames) {
+                for (UINT i = 0; i < m_Options.NumCommandLists; i++) {
+                    ComPtr<ID3D12CommandAllocator> allocator;
+                    CHECK_HRCMD(m_Device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT,
+                                                                 IID_PPV_ARGS(allocator.ReleaseAndGetAddressOf())));
+                    ComPtr<ID3D12GraphicsCommandList> commandList;
+                    CHECK_HRCMD(m_Device->CreateCommandList(0,
+                                                            D3D12_COMMAND_LIST_TYPE_DIRECT,
+                                                            allocator.Get(),
+                                                            nullptr,
+                                                            IID_PPV_ARGS(commandList.ReleaseAndGetAddressOf())));
+                    CHECK_HRCMD(commandList->Close());
+                    frame.Allocators.push_back(std::move(allocator));
+                    frame.CommandLists.push_back(std::move(commandList));
+                }
+            }
+
+            // A start and an end timestamp for each frame in flight.
+            D3D12_QUERY_HEAP_DESC queryHeapDesc{};
+            queryHeapDesc.Type = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+            queryHeapDesc.Count = 2 * NumFramesInFlight;
+            CHECK_HRCMD(m_Device->CreateQueryHeap(&queryHeapDesc, IID_PPV_ARGS(m_QueryHeap.ReleaseAndGetAddressOf())));
+
+            const D3D12_HEAP_PROPERTIES heapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK);
+            const D3D12_RESOURCE_DESC bufferDesc =
+                CD3DX12_RESOURCE_DESC::Buffer(queryHeapDesc.Count * sizeof(uint64_t));
+            CHECK_HRCMD(m_Device->CreateCommittedResource(&heapProperties,
+                                                          D3D12_HEAP_FLAG_NONE,
+                                                          &bufferDesc,
+                                                          D3D12_RESOURCE_STATE_COPY_DEST,
+                                                          nullptr,
+                                                          IID_PPV_ARGS(m_TimestampBuffer.ReleaseAndGetAddressOf())));
+        }
+
+        void RecordCommandList(UINT Index) {
+            const UINT slot = m_FrameIndex % NumFramesInFlight;
+            FrameResources& frame = m_Frames[slot];
+            ID3D12GraphicsCommandList* const commandList = frame.CommandLists[Index].Get();
+            ID3D12Resource* const backBuffer = m_BackBuffers[m_BackBufferIndex].Get();
+            const D3D12_CPU_DESCRIPTOR_HANDLE rtv = GetRTV(SceneColorRTV);
+
+            CHECK_HRCMD(frame.Allocators[Index]->Reset());
+            CHECK_HRCMD(commandList->Reset(frame.Allocators[Index].Get(), m_PipelineState.Get()));
+
+            if (Index == 0) {
+                commandList->EndQuery(m_QueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, 2 * slot);
+                commandList->ClearRenderTargetView(rtv, ClearColor, 0, nullptr);
+            }
+
+            // Full-screen viewport, like most games use for their main passes.
+            const D3D12_VIEWPORT viewport{
+                0.f, 0.f, static_cast<float>(m_Resolution.Width), static_cast<float>(m_Resolution.Height), 0.f, 1.f};
+            const D3D12_RECT scissor{
+                0, 0, static_cast<LONG>(m_Resolution.Width), static_cast<LONG>(m_Resolution.Height)};
+            commandList->SetGraphicsRootSignature(m_RootSignature.Get());
+            commandList->OMSetRenderTargets(1, &rtv, FALSE, nullptr);
+            commandList->RSSetViewports(1, &viewport);
+            commandList->RSSetScissorRects(1, &scissor);
+            commandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+            for (UINT i = 0; i < m_Options.NumDrawsPerCommandList; i++) {
+                struct {
+                    uint32_t Layer;
+                    uint32_t Iterations;
+                    float InvResolution[2];
+                } constants{Index * m_Options.NumDrawsPerCommandList + i,
+                            m_Options.ShaderIterations,
+                            {1.f / m_Resolution.Width, 1.f / m_Resolution.Height}};
+                commandList->SetGraphicsRoot32BitConstants(0, sizeof(constants) / 4, &constants, 0);
+                commandList->DrawInstanced(3, 1, 0, 0);
+            }
+
+            if (Index == m_Options.NumCommandLists - 1) {
+                const D3D12_RESOURCE_BARRIER toCopy[] = {
+                    CD3DX12_RESOURCE_BARRIER::Transition(
+                        m_SceneColor.Get(), D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_COPY_SOURCE),
+                    CD3DX12_RESOURCE_BARRIER::Transition(
+                        backBuffer, D3D12_RESOURCE_STATE_PRESENT, D3D12_RESOURCE_STATE_COPY_DEST)};
+                commandList->ResourceBarrier(ARRAYSIZE(toCopy), toCopy);
+                commandList->CopyResource(backBuffer, m_SceneColor.Get());
+                const D3D12_RESOURCE_BARRIER fromCopy[] = {
+                    CD3DX12_RESOURCE_BARRIER::Transition(
+                        m_SceneColor.Get(), D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_RENDER_TARGET),
+                    CD3DX12_RESOURCE_BARRIER::Transition(
+                        backBuffer, D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_PRESENT)};
+                commandList->ResourceBarrier(ARRAYSIZE(fromCopy), fromCopy);
+                commandList->EndQuery(m_QueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, 2 * slot + 1);
+                commandList->ResolveQueryData(m_QueryHeap.Get(),
+                                              D3D12_QUERY_TYPE_TIMESTAMP,
+                                              2 * slot,
+                                              2,
+                                              m_TimestampBuffer.Get(),
+                                              2 * slot * sizeof(uint64_t));
+            }
+
+            CHECK_HRCMD(commandList->Close());
+        }
+
+        double ReadGpuTime(const FrameResources& Frame) {
+            const size_t slot = &Frame - m_Frames;
+            const D3D12_RANGE readRange{2 * slot * sizeof(uint64_t), (2 * slot + 2) * sizeof(uint64_t)};
+            uint64_t* timestamps = nullptr;
+            CHECK_HRCMD(m_TimestampBuffer->Map(0, &readRange, reinterpret_cast<void**>(&timestamps)));
+            const uint64_t start = timestamps[2 * slot];
+            const uint64_t end = timestamps[2 * slot + 1];
+            const D3D12_RANGE noWrite{};
+            m_TimestampBuffer->Unmap(0, &noWrite);
+            return end > start ? (end - start) * 1000.0 / m_TimestampFrequency : -1.0;
+        }
+
+        void WaitForFence(uint64_t FenceValue) {
+            if (m_Fence->GetCompletedValue() < FenceValue) {
+                CHECK_HRCMD(m_Fence->SetEventOnCompletion(FenceValue, m_FenceEvent.Get()));
+                WaitForSingleObject(m_FenceEvent.Get(), INFINITE);
+            }
+        }
+
+        void WaitForGpu() {
+            CHECK_HRCMD(m_Queue->Signal(m_Fence.Get(), ++m_FenceValue));
+            WaitForFence(m_FenceValue);
+        }
+
+        bool PumpMessages() {
+            MSG msg;
+            while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+                if (msg.message == WM_QUIT) {
+                    return false;
+                }
+                TranslateMessage(&msg);
+                DispatchMessage(&msg);
+            }
+            return true;
+        }
+
+        const Options m_Options;
+
+        HWND m_Window{nullptr};
+        ComPtr<IDXGIFactory2> m_Factory;
+        bool m_IsTearingSupported{false};
+        ComPtr<ID3D12Device> m_Device;
+        ComPtr<ID3D12CommandQueue> m_Queue;
+        uint64_t m_TimestampFrequency{1};
+        ComPtr<ID3D12Fence> m_Fence;
+        uint64_t m_FenceValue{0};
+        Microsoft::WRL::Wrappers::Event m_FenceEvent;
+
+        ComPtr<IDXGISwapChain3> m_Swapchain;
+        Resolution m_Resolution{};
+        ComPtr<ID3D12DescriptorHeap> m_RTVHeap;
+        UINT m_RTVDescriptorSize{0};
+        ComPtr<ID3D12Resource> m_BackBuffers[NumBackBuffers];
+        ComPtr<ID3D12Resource> m_SceneColor;
+
+        ComPtr<ID3D12RootSignature> m_RootSignature;
+        ComPtr<ID3D12PipelineState> m_PipelineState;
+
+        FrameResources m_Frames[NumFramesInFlight];
+        ComPtr<ID3D12QueryHeap> m_QueryHeap;
+        ComPtr<ID3D12Resource> m_TimestampBuffer;
+        std::unique_ptr<RecordingThreads> m_RecordingThreads;
+
+        // The state of the frame being recorded, shared with the recording threads.
+        UINT m_FrameIndex{0};
+        UINT m_BackBufferIndex{0};
+    };
+
+    void PrintPercentiles(const char* Name, std::vector<double> Samples) {
+        Samples.erase(std::remove_if(Samples.begin(), Samples.end(), [](double sample) { return sample < 0.0; }),
+                      Samples.end());
+        if (Samples.empty()) {
+            fmt::print("{:<12} n/a\n", Name);
+            return;
+        }
+
+        const Statistics::Distribution distribution = Statistics::GetDistribution(std::move(Samples));
+        fmt::print("{:<12} avg {:7.3f}  p50 {:7.3f}  p90 {:7.3f}  p95 {:7.3f}  p99 {:7.3f}  max {:7.3f} (ms)\n",
+                   Name,
+                   distribution.Average,
+                   distribution.P50,
+                   distribution.P90,
+                   distribution.P95,
+                   distribution.P99,
+                   distribution.Max);
+    }
+
+    void Report(const Options& Options, const std::vector<FrameStatistics>& Statistics) {
+        if (!Options.CsvPath.empty()) {
+            FILE* file = nullptr;
+            CHECK_MSG(!fopen_s(&file, Options.CsvPath.c_str(), "w") && file, "Failed to open the CSV file");
+            fmt::print(file, "Frame,Width,Height,FrameTime,CpuTime,GpuTime\n");
+            for (size_t i = 0; i < Statistics.size(); i++) {
+                const FrameStatistics& frame = Statistics[i];
+                fmt::print(file,
+                           "{},{},{},{:.4f},{:.4f},{:.4f}\n",
+                           i,
+                           frame.Size.Width,
+                           frame.Size.Height,
+                           frame.FrameTime,
+                           frame.CpuTime,
+                           frame.GpuTime);
+            }
+            fclose(file);
+        }
+
+        // Report each resolution separately, excluding the warmup frames.
+        for (const Resolution& resolution : Options.Resolutions) {
+            std::vector<double> frameTimes, cpuTimes, gpuTimes;
+            for (size_t i = Options.NumWarmupFrames; i < Statistics.size(); i++) {
+                const FrameStatistics& frame = Statistics[i];
+                if (frame.Size.Width == resolution.Width && frame.Size.Height == resolution.Height) {
+                    frameTimes.push_back(frame.FrameTime);
+                    cpuTimes.push_back(frame.CpuTime);
+                    gpuTimes.push_back(frame.GpuTime);
+                }
+            }
+            if (frameTimes.empty()) {
+                continue;
+            }
+
+            fmt::print("{}x{} ({} frames)\n", resolution.Width, resolution.Height, frameTimes.size());
+            PrintPercentiles("Frame time", frameTimes);
+            PrintPercentiles("CPU time", cpuTimes);
+            PrintPercentiles("GPU time", gpuTimes);
+        }
+    }
+
+} // namespace
+
+int main(int argc, char** argv) {
+    TraceLoggingRegister(Tracing::g_traceProvider);
+
+    int result = 0;
+    try {
+        Options options;
+        if (!ParseOptions(argc, argv, options)) {
+            PrintUsage();
+            return 1;
+        }
+
+        if (!options.InjectorPath.empty()) {
+            // The injector hooks the objects created after it is loaded, so it must be loaded before our device.
+            CHECK_MSG(LoadLibraryA(options.InjectorPath.c_str()), "Failed to load the injector");
+        }
+        fmt::print("{} command lists, {} threads, {} draws per command list, {} iterations, injector {}\n",
+                   options.NumCommandLists,
+                   options.NumThreads,
+                   options.NumDrawsPerCommandList,
+                   options.ShaderIterations,
+                   options.InjectorPath.empty() ? "not loaded" : "loaded");
+
+        std::vector<FrameStatistics> statistics;
+        {
+            Benchmark benchmark(options);
+            statistics = benchmark.Run();
+        }
+        Report(options, statistics);
+    } catch (std::exception& exc) {
+        fmt::print(stderr, "{}\n", exc.what());
+        result = 1;
+    }
+
+    TraceLoggingUnregister(Tracing::g_traceProvider);
+    return result;
+}
@@ -0,0 +1,42 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+cbuffer Constants : register(b0)
+{
+    uint Layer;
+    uint Iterations;
+    float2 InvResolution;
+};
+
+// An arbitrarily expensive pattern, so that the cost of the frame is dominated by pixel shading.
+float4 main(float4 position : SV_Position) : SV_Target
+{
+    float2 uv = position.xy * InvResolution;
+    float2 p = uv * 8 + Layer;
+    float3 color = 0;
+    for (uint i = 0; i < Iterations; i++)
+    {
+        p = float2(sin(p.x * 1.3f + p.y), cos(p.y * 1.7f - p.x)) + uv;
+        color += abs(float3(p, p.x * p.y));
+    }
+    return float4(saturate(color / max(Iterations, 1)), 1);
+}
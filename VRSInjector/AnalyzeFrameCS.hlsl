@@ -0,0 +1,115 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Embedded, so that the root signature does not need to be serialized at runtime. The descriptor tables are volatile
+// like with a version 1.0 root signature.
+#define RootSignatureDesc \
+    "DescriptorTable(SRV(t0, flags = DESCRIPTORS_VOLATILE | DATA_VOLATILE))," \
+    "DescriptorTable(UAV(u0, flags = DESCRIPTORS_VOLATILE | DATA_VOLATILE))," \
+    "DescriptorTable(UAV(u1, flags = DESCRIPTORS_VOLATILE | DATA_VOLATILE))," \
+    "RootConstants(num32BitConstants = 4, b0)"
+
+Texture2D<float4> Frame : register(t0);
+RWTexture2D<uint> Bias : register(u0);
+RWTexture2D<float> History : register(u1);
+cbuffer Constants : register(b0)
+{
+    uint TileSize;
+    uint Width;
+    uint Height;
+    uint UseHistory;
+};
+
+// Gradients below these values (relative to the local brightness) allow coarsening by 4 or 2 pixels on an axis.
+static const float kVeryLowGradient = 0.01f;
+static const float kLowGradient = 0.04f;
+// Below this brightness, details are hard to perceive.
+static const float kDarkLuminance = 0.04f;
+// Above this change of brightness between two frames, the tile is likely to be blurred by motion.
+static const float kMotionThreshold = 0.25f;
+
+float Luminance(uint2 Position)
+{
+    return dot(Frame[min(Position, uint2(Width - 1, Height - 1))].rgb, float3(0.2126f, 0.7152f, 0.0722f));
+}
+
+uint Coarsen(uint Bias)
+{
+    return min(Bias + 1, 2);
+}
+
+// Each thread analyzes one tile, and outputs the coarsening (log2) for each axis: X in bits 2-3 and Y in bits 0-1, like
+// the D3D12_SHADING_RATE encoding.
+[RootSignature(RootSignatureDesc)]
+[numthreads(8, 8, 1)]
+void main(uint3 DTid : SV_DispatchThreadID)
+{
+    uint2 origin = DTid.xy * TileSize;
+    if (origin.x >= Width || origin.y >= Height)
+    {
+        return;
+    }
+
+    // Sample every other pixel of the tile.
+    float sum = 0, gradientX = 0, gradientY = 0;
+    uint count = 0;
+    for (uint y = 0; y < TileSize; y += 2)
+    {
+        for (uint x = 0; x < TileSize; x += 2)
+        {
+            uint2 position = origin + uint2(x, y);
+            float luminance = Luminance(position);
+            sum += luminance;
+            gradientX += abs(Luminance(position + uint2(1, 0)) - luminance);
+            gradientY += abs(Luminance(position + uint2(0, 1)) - luminance);
+            count++;
+        }
+    }
+    float mean = sum / count;
+
+    // Contrast is perceived relative to the local brightness.
+    float contrastScale = 1.f / max(mean, kDarkLuminance);
+    gradientX *= contrastScale / count;
+    gradientY *= contrastScale / count;
+
+    uint biasX = gradientX < kVeryLowGradient ? 2 : (gradientX < kLowGradient ? 1 : 0);
+    uint biasY = gradientY < kVeryLowGradient ? 2 : (gradientY < kLowGradient ? 1 : 0);
+
+    if (mean < kDarkLuminance)
+    {
+        biasX = Coarsen(biasX);
+        biasY = Coarsen(biasY);
+    }
+
+    if (UseHistory)
+    {
+        float previousMean = History[DTid.xy];
+        if (abs(mean - previousMean) > kMotionThreshold * max(max(mean, previousMean), kDarkLuminance))
+        {
+            biasX = Coarsen(biasX);
+            biasY = Coarsen(biasY);
+        }
+    }
+    History[DTid.xy] = mean;
+
+    Bias[DTid.xy] = (biasX << 2) | biasY;
+}
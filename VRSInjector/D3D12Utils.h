@@ -22,8 +22,60 @@
 
 #pragma once
 
+#include "Injector.h"
+
 namespace D3D12Utils {
 
+    // A heap of timestamp queries, resolved into a readback buffer. Reading a timestamp is only valid once the GPU has
+    // completed the command list resolving it.
+    class TimestampQueries {
+      public:
+        TimestampQueries(ID3D12Device* Device, UINT NumQueries, const std::wstring& DebugName = L"Unnamed") {
+            D3D12_QUERY_HEAP_DESC queryHeapDesc{};
+            queryHeapDesc.Type = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+            queryHeapDesc.Count = NumQueries;
+            CHECK_HRCMD(Device->CreateQueryHeap(&queryHeapDesc, IID_PPV_ARGS(m_QueryHeap.ReleaseAndGetAddressOf())));
+            m_QueryHeap->SetName((DebugName + L" Query Heap").c_str());
+
+            const D3D12_HEAP_PROPERTIES heapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK);
+            const D3D12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(NumQueries * sizeof(uint64_t));
+            CHECK_HRCMD(Device->CreateCommittedResource(&heapProperties,
+                                                        D3D12_HEAP_FLAG_NONE,
+                                                        &bufferDesc,
+                                                        D3D12_RESOURCE_STATE_COPY_DEST,
+                                                        nullptr,
+                                                        IID_PPV_ARGS(m_ReadbackBuffer.ReleaseAndGetAddressOf())));
+            m_ReadbackBuffer->SetName((DebugName + L" Readback Buffer").c_str());
+        }
+
+        void Write(ID3D12GraphicsCommandList* CommandList, UINT Index) const {
+            CommandList->EndQuery(m_QueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, Index);
+        }
+
+        void Resolve(ID3D12GraphicsCommandList* CommandList, UINT Index, UINT Count) const {
+            CommandList->ResolveQueryData(m_QueryHeap.Get(),
+                                          D3D12_QUERY_TYPE_TIMESTAMP,
+                                          Index,
+                                          Count,
+                                          m_ReadbackBuffer.Get(),
+                                          Index * sizeof(uint64_t));
+        }
+
+        uint64_t Read(UINT Index) const {
+            const D3D12_RANGE readRange{Index * sizeof(uint64_t), (Index + 1) * sizeof(uint64_t)};
+            uint64_t* data = nullptr;
+            CHECK_HRCMD(m_ReadbackBuffer->Map(0, &readRange, reinterpret_cast<void**>(&data)));
+            const uint64_t timestamp = data[Index];
+            const D3D12_RANGE noWrite{};
+            m_ReadbackBuffer->Unmap(0, &noWrite);
+            return timestamp;
+        }
+
+      private:
+        ComPtr<ID3D12QueryHeap> m_QueryHeap;
+        ComPtr<ID3D12Resource> m_ReadbackBuffer;
+    };
+
     class CommandList {
       public:
         ComPtr<ID3D12GraphicsCommandList> Commands;
@@ -31,17 +83,22 @@ namespace D3D12Utils {
       private:
         ComPtr<ID3D12CommandAllocator> Allocator;
         uint64_t CompletedFenceValue{0};
+        UINT TimestampSlot{UINT_MAX};
 
         friend class CommandContext;
     };
 
     class CommandContext {
       public:
-        CommandContext(ID3D12Device* Device, const std::wstring& DebugName = L"Unnamed")
-            : m_Device(Device), m_DebugName(DebugName) {
+        CommandContext(ID3D12Device* Device,
+                       const std::wstring& DebugName = L"Unnamed",
+                       D3D12_COMMAND_LIST_TYPE Type = D3D12_COMMAND_LIST_TYPE_DIRECT,
+                       D3D12_COMMAND_QUEUE_PRIORITY Priority = D3D12_COMMAND_QUEUE_PRIORITY_NORMAL)
+            : m_Device(Device), m_Type(Type), m_DebugName(DebugName) {
             // Create a command queue for our commands.
             D3D12_COMMAND_QUEUE_DESC commandQueueDesc{};
-            commandQueueDesc.Type = D3D12_COMMAND_LIST_TYPE_DIRECT;
+            commandQueueDesc.Type = m_Type;
+            commandQueueDesc.Priority = Priority;
             CHECK_HRCMD(
                 m_Device->CreateCommandQueue(&commandQueueDesc, IID_PPV_ARGS(m_CommandQueue.ReleaseAndGetAddressOf())));
             m_CommandQueue->SetName((DebugName + L" Command Queue").c_str());
@@ -51,12 +108,20 @@ namespace D3D12Utils {
             m_CompletionFence->SetName((DebugName + L" Completion Fence").c_str());
         }
 
+        // Submit our commands to an existing command queue, such as the application's queue.
+        CommandContext(ID3D12Device* Device,
+                       ID3D12CommandQueue* CommandQueue,
+                       const std::wstring& DebugName = L"Unnamed")
+            : m_Device(Device), m_Type(CommandQueue->GetDesc().Type), m_CommandQueue(CommandQueue),
+              m_DebugName(DebugName) {
+            CHECK_HRCMD(m_Device->CreateFence(
+                0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(m_CompletionFence.ReleaseAndGetAddressOf())));
+            m_CompletionFence->SetName((DebugName + L" Completion Fence").c_str());
+        }
+
         ~CommandContext() {
             if (m_CompletionFenceValue) {
-                wil::unique_handle handle;
-                *handle.put() = CreateEventEx(nullptr, L"Destruction Fence", 0, EVENT_ALL_ACCESS);
-                CHECK_HRCMD(m_CompletionFence->SetEventOnCompletion(m_CompletionFenceValue, handle.get()));
-                WaitForSingleObject(handle.get(), INFINITE);
+                WaitForCommandList(m_CompletionFenceValue);
             }
         }
 
@@ -76,13 +141,13 @@ namespace D3D12Utils {
             if (m_AvailableCommandList.empty()) {
                 // Allocate a new command list if needed.
                 CHECK_HRCMD(m_Device->CreateCommandAllocator(
-                    D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(commandList.Allocator.ReleaseAndGetAddressOf())));
+                    m_Type, IID_PPV_ARGS(commandList.Allocator.ReleaseAndGetAddressOf())));
                 CHECK_HRCMD(m_Device->CreateCommandList(0,
-                                                        D3D12_COMMAND_LIST_TYPE_DIRECT,
+                                                        m_Type,
                                                         commandList.Allocator.Get(),
                                                         nullptr,
                                                         IID_PPV_ARGS(commandList.Commands.ReleaseAndGetAddressOf())));
-                commandList.Commands->SetName(L"Shading Rate Creation Command List");
+                commandList.Commands->SetName((m_DebugName + L" Command List").c_str());
             } else {
                 commandList = m_AvailableCommandList.front();
                 m_AvailableCommandList.pop_front();
@@ -92,33 +157,121 @@ namespace D3D12Utils {
                 CHECK_HRCMD(commandList.Commands->Reset(commandList.Allocator.Get(), nullptr));
             }
 
+            commandList.TimestampSlot = UINT_MAX;
+            if (m_IsTimestampsEnabled && !m_AvailableTimestampSlots.empty()) {
+                commandList.TimestampSlot = m_AvailableTimestampSlots.front();
+                m_AvailableTimestampSlots.pop_front();
+                m_Timestamps->Write(commandList.Commands.Get(), 2 * commandList.TimestampSlot);
+            }
+
             return commandList;
         }
 
         uint64_t SubmitCommandList(CommandList CommandList) {
             std::unique_lock lock(m_CommandListPoolMutex);
 
+            if (CommandList.TimestampSlot != UINT_MAX) {
+                m_Timestamps->Write(CommandList.Commands.Get(), 2 * CommandList.TimestampSlot + 1);
+                m_Timestamps->Resolve(CommandList.Commands.Get(), 2 * CommandList.TimestampSlot, 2);
+            }
             CHECK_HRCMD(CommandList.Commands->Close());
-            // TODO: This call goes through the Detoured version, which causes unwanted tracing.
-            m_CommandQueue->ExecuteCommandLists(
-                1, reinterpret_cast<ID3D12CommandList**>(CommandList.Commands.GetAddressOf()));
+            Injector::ExecuteCommandListsUnhooked(
+                m_CommandQueue.Get(), 1, reinterpret_cast<ID3D12CommandList**>(CommandList.Commands.GetAddressOf()));
             CommandList.CompletedFenceValue = ++m_CompletionFenceValue;
             m_CommandQueue->Signal(m_CompletionFence.Get(), CommandList.CompletedFenceValue);
+            if (CommandList.TimestampSlot != UINT_MAX) {
+                m_TimedCommandLists.push_back({CommandList.TimestampSlot, CommandList.CompletedFenceValue});
+            }
             m_PendingCommandList.push_back(std::move(CommandList));
 
             return CommandList.CompletedFenceValue;
         }
 
+        // Signal the completion fence after the work submitted to the queue so far, such as the application's work.
+        uint64_t Signal() {
+            std::unique_lock lock(m_CommandListPoolMutex);
+
+            CHECK_HRCMD(m_CommandQueue->Signal(m_CompletionFence.Get(), ++m_CompletionFenceValue));
+            return m_CompletionFenceValue;
+        }
+
         bool IsCommandListCompleted(uint64_t CompletedFenceValue) {
             return m_CompletionFence->GetCompletedValue() >= CompletedFenceValue;
         }
 
+        // Block the calling thread until the GPU has completed the command list.
+        void WaitForCommandList(uint64_t CompletedFenceValue) {
+            if (IsCommandListCompleted(CompletedFenceValue)) {
+                return;
+            }
+
+            wil::unique_handle handle;
+            *handle.put() = CreateEventEx(nullptr, L"Completion Fence", 0, EVENT_ALL_ACCESS);
+            CHECK_HRCMD(m_CompletionFence->SetEventOnCompletion(CompletedFenceValue, handle.get()));
+            WaitForSingleObject(handle.get(), INFINITE);
+        }
+
+        // Make the GPU wait for another fence before executing the next command lists of this context.
+        void InsertWait(ID3D12Fence* Fence, uint64_t FenceValue) {
+            std::unique_lock lock(m_CommandListPoolMutex);
+
+            CHECK_HRCMD(m_CommandQueue->Wait(Fence, FenceValue));
+        }
+
+        // Measure the GPU duration of the command lists obtained from now on.
+        void EnableTimestamps(bool Enable) {
+            std::unique_lock lock(m_CommandListPoolMutex);
+
+            if (Enable && !m_Timestamps) {
+                m_Timestamps =
+                    std::make_unique<TimestampQueries>(m_Device.Get(), 2 * MaxTimedCommandLists, m_DebugName);
+                CHECK_HRCMD(m_CommandQueue->GetTimestampFrequency(&m_TimestampFrequency));
+                for (UINT i = 0; i < MaxTimedCommandLists; i++) {
+                    m_AvailableTimestampSlots.push_back(i);
+                }
+            }
+            m_IsTimestampsEnabled = Enable;
+        }
+
+        // Retrieve the total GPU time (in microseconds) of the measured command lists that completed since the previous
+        // call.
+        double CollectGpuTime(UINT& NumCommandLists) {
+            std::unique_lock lock(m_CommandListPoolMutex);
+
+            double gpuTime = 0.0;
+            NumCommandLists = 0;
+            while (!m_TimedCommandLists.empty() &&
+                   IsCommandListCompleted(m_TimedCommandLists.front().CompletedFenceValue)) {
+                const UINT slot = m_TimedCommandLists.front().Slot;
+                m_TimedCommandLists.pop_front();
+
+                const uint64_t start = m_Timestamps->Read(2 * slot);
+                const uint64_t end = m_Timestamps->Read(2 * slot + 1);
+                if (end > start) {
+                    gpuTime += (end - start) * 1e6 / m_TimestampFrequency;
+                }
+                NumCommandLists++;
+                m_AvailableTimestampSlots.push_back(slot);
+            }
+
+            return gpuTime;
+        }
+
         ID3D12Fence* GetCompletionFence() const {
             return m_CompletionFence.Get();
         }
 
+        D3D12_COMMAND_LIST_TYPE GetType() const {
+            return m_Type;
+        }
+
+        ID3D12CommandQueue* GetCommandQueue() const {
+            return m_CommandQueue.Get();
+        }
+
       private:
         ComPtr<ID3D12Device> m_Device;
+        const D3D12_COMMAND_LIST_TYPE m_Type;
         ComPtr<ID3D12CommandQueue> m_CommandQueue;
 
         std::mutex m_CommandListPoolMutex;
@@ -127,73 +280,513 @@ namespace D3D12Utils {
         ComPtr<ID3D12Fence> m_CompletionFence;
         uint64_t m_CompletionFenceValue{0};
 
+        static constexpr UINT MaxTimedCommandLists = 64;
+        std::unique_ptr<TimestampQueries> m_Timestamps;
+        uint64_t m_TimestampFrequency{1};
+        bool m_IsTimestampsEnabled{false};
+        std::deque<UINT> m_AvailableTimestampSlots;
+        struct TimedCommandList {
+            UINT Slot;
+            uint64_t CompletedFenceValue;
+        };
+        std::deque<TimedCommandList> m_TimedCommandLists;
+
         const std::wstring m_DebugName;
     };
 
+    // A persistently mapped upload buffer, sub-allocated as a ring. The allocations are tagged with the fence value of
+    // the command list that reads them, and their memory is reused once that command list completed. Not thread-safe.
+    class UploadRing {
+      public:
+        UploadRing(ID3D12Device* Device, UINT64 Size, const std::wstring& DebugName = L"Unnamed") : m_Size(Size) {
+            const D3D12_HEAP_PROPERTIES heapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD);
+            const D3D12_RESOURCE_DESC bufferDesc = CD3DX12_RESOURCE_DESC::Buffer(Size);
+            CHECK_HRCMD(Device->CreateCommittedResource(&heapProperties,
+                                                        D3D12_HEAP_FLAG_NONE,
+                                                        &bufferDesc,
+                                                        D3D12_RESOURCE_STATE_GENERIC_READ,
+                                                        nullptr,
+                                                        IID_PPV_ARGS(m_Buffer.ReleaseAndGetAddressOf())));
+            m_Buffer->SetName((DebugName + L" Upload Ring").c_str());
+
+            const D3D12_RANGE noRead{};
+            CHECK_HRCMD(m_Buffer->Map(0, &noRead, reinterpret_cast<void**>(&m_Data)));
+        }
+
+        ~UploadRing() {
+            m_Buffer->Unmap(0, nullptr);
+        }
+
+        // Fail when the ring is full until more command lists complete. Allocations never wrap around the end of the
+        // buffer.
+        bool Allocate(UINT64 Size, UINT64 Alignment, UINT64& Offset, uint8_t*& Data) {
+            UINT64 start = (m_Head + Alignment - 1) / Alignment * Alignment;
+            if (start % m_Size + Size > m_Size) {
+                start = (start / m_Size + 1) * m_Size;
+            }
+            if (start + Size - m_Tail > m_Size) {
+                return false;
+            }
+
+            m_Head = start + Size;
+            Offset = start % m_Size;
+            Data = m_Data + Offset;
+            return true;
+        }
+
+        // Tag the allocations made since the previous submission.
+        void Submit(uint64_t CompletedFenceValue) {
+            if (m_Head != m_SubmittedHead) {
+                m_Submissions.push_back({m_Head, CompletedFenceValue});
+                m_SubmittedHead = m_Head;
+            }
+        }
+
+        // Reclaim the memory of the command lists that completed.
+        void Retire(CommandContext& Context) {
+            while (!m_Submissions.empty() &&
+                   Context.IsCommandListCompleted(m_Submissions.front().CompletedFenceValue)) {
+                m_Tail = m_Submissions.front().End;
+                m_Submissions.pop_front();
+            }
+        }
+
+        // The command list to wait for in order to reclaim memory, or 0 if all the allocations are yet to be
+        // submitted.
+        uint64_t GetOldestFenceValue() const {
+            return m_Submissions.empty() ? 0 : m_Submissions.front().CompletedFenceValue;
+        }
+
+        ID3D12Resource* GetBuffer() const {
+            return m_Buffer.Get();
+        }
+
+      private:
+        const UINT64 m_Size;
+        ComPtr<ID3D12Resource> m_Buffer;
+        uint8_t* m_Data{nullptr};
+
+        // Positions are monotonic, the offset within the buffer is the position modulo the size.
+        UINT64 m_Head{0};
+        UINT64 m_Tail{0};
+        UINT64 m_SubmittedHead{0};
+        struct Submission {
+            UINT64 End;
+            uint64_t CompletedFenceValue;
+        };
+        std::deque<Submission> m_Submissions;
+    };
+
+    // A growable allocator of descriptors. Descriptors are allocated from pages of CPU-only descriptors, where the
+    // views are created. For shader-visible heap types, CommitDescriptor() then copies them into a single
+    // shader-visible heap: when the pages outgrow it, a larger heap replaces it and GetDescriptorHeap() changes.
+    // Allocating and returning descriptors is lock-free (one bitmap per page), only growing and committing take a lock.
     class DescriptorHeap {
       public:
         DescriptorHeap(ID3D12Device* Device,
                        D3D12_DESCRIPTOR_HEAP_TYPE HeapType,
                        UINT NumDescriptors = 128u,
                        const std::wstring& DebugName = L"Unnamed")
-            : m_Device(Device) {
-            // Create the descriptor heap.
+            : m_Device(Device), m_HeapType(HeapType),
+              m_IsShaderVisible(HeapType == D3D12_DESCRIPTOR_HEAP_TYPE_SAMPLER ||
+                                HeapType == D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV),
+              m_DescriptorSize(Device->GetDescriptorHandleIncrementSize(HeapType)), m_DebugName(DebugName) {
+            std::unique_lock lock(m_GrowMutex);
+
+            while (m_NumPages * PageSize < NumDescriptors) {
+                CHECK_MSG(AddPage(), "Failed to create descriptor heap");
+            }
+        }
+
+        // Fail when the heap cannot grow anymore. The caller must then do without the descriptor, since this may be
+        // called from within a call of the application.
+        bool AllocateDescriptor(D3D12_CPU_DESCRIPTOR_HANDLE& CpuHandle) {
+            while (true) {
+                const UINT numPages = m_NumPages.load(std::memory_order_acquire);
+                for (UINT i = 0; i < numPages; i++) {
+                    Page& page = *m_Pages[i];
+                    uint64_t used = page.Used.load(std::memory_order_relaxed);
+                    while (~used) {
+                        unsigned long slot;
+                        _BitScanForward64(&slot, ~used);
+                        if (page.Used.compare_exchange_weak(used, used | (1ull << slot), std::memory_order_acq_rel)) {
+                            CpuHandle = CD3DX12_CPU_DESCRIPTOR_HANDLE(page.CPUHandleStart, slot, m_DescriptorSize);
+                            return true;
+                        }
+                    }
+                }
+
+                // All pages are full, unless another thread just added one.
+                std::unique_lock lock(m_GrowMutex);
+                if (m_NumPages.load(std::memory_order_relaxed) == numPages && !AddPage()) {
+                    return false;
+                }
+            }
+        }
+
+        void ReturnDescriptor(const D3D12_CPU_DESCRIPTOR_HANDLE& CpuHandle) {
+            UINT slot;
+            Page& page = FindPage(CpuHandle, slot);
+            page.Used.fetch_and(~(1ull << slot), std::memory_order_release);
+        }
+
+        // Publish a view created at CpuHandle to the shader-visible heap.
+        void CommitDescriptor(const D3D12_CPU_DESCRIPTOR_HANDLE& CpuHandle) {
+            if (!m_IsShaderVisible) {
+                return;
+            }
+
+            std::unique_lock lock(m_GrowMutex);
+
+            m_Device->CopyDescriptorsSimple(1, GetShaderVisibleCPUDescriptor(CpuHandle), CpuHandle, m_HeapType);
+        }
+
+        // The handle is only valid with the current GetDescriptorHeap().
+        D3D12_GPU_DESCRIPTOR_HANDLE GetGPUDescriptor(const D3D12_CPU_DESCRIPTOR_HANDLE& CpuHandle) const {
+            UINT slot;
+            const UINT index = FindPageIndex(CpuHandle, slot) * PageSize + slot;
+            return CD3DX12_GPU_DESCRIPTOR_HANDLE(
+                m_ShaderVisibleHeap.load(std::memory_order_acquire)->GetGPUDescriptorHandleForHeapStart(),
+                index,
+                m_DescriptorSize);
+        }
+
+        ID3D12DescriptorHeap* GetDescriptorHeap() const {
+            return m_ShaderVisibleHeap.load(std::memory_order_acquire);
+        }
+
+        UINT GetNumAllocatedDescriptors() const {
+            const UINT numPages = m_NumPages.load(std::memory_order_acquire);
+            UINT numAllocated = 0;
+            for (UINT i = 0; i < numPages; i++) {
+                numAllocated += static_cast<UINT>(__popcnt64(m_Pages[i]->Used.load(std::memory_order_relaxed)));
+            }
+            return numAllocated;
+        }
+
+        UINT GetCapacity() const {
+            return m_NumPages.load(std::memory_order_acquire) * PageSize;
+        }
+
+      private:
+        static constexpr UINT PageSize = 64;
+        static constexpr UINT MaxPages = 1024;
+
+        struct alignas(64) Page {
+            ComPtr<ID3D12DescriptorHeap> Heap;
+            D3D12_CPU_DESCRIPTOR_HANDLE CPUHandleStart{};
+            // One bit per allocated descriptor.
+            std::atomic<uint64_t> Used{0};
+        };
+
+        // Must be called while holding m_GrowMutex. Fail when the heap reached its maximum size or out of memory.
+        bool AddPage() {
+            const UINT numPages = m_NumPages.load(std::memory_order_relaxed);
+            if (numPages >= MaxPages) {
+                return false;
+            }
+
+            auto page = std::make_unique<Page>();
             D3D12_DESCRIPTOR_HEAP_DESC descriptorHeapDesc{};
-            descriptorHeapDesc.Type = HeapType;
+            descriptorHeapDesc.Type = m_HeapType;
+            descriptorHeapDesc.NumDescriptors = PageSize;
+            if (FAILED(m_Device->CreateDescriptorHeap(&descriptorHeapDesc,
+                                                      IID_PPV_ARGS(page->Heap.ReleaseAndGetAddressOf())))) {
+                return false;
+            }
+            page->Heap->SetName((m_DebugName + L" Descriptor Page").c_str());
+            page->CPUHandleStart = page->Heap->GetCPUDescriptorHandleForHeapStart();
+
+            // The new page has no descriptor in use yet, so only the existing pages are carried over.
+            if (m_IsShaderVisible && m_ShaderVisibleCapacity < (numPages + 1) * PageSize &&
+                !GrowShaderVisibleHeap(std::max(m_ShaderVisibleCapacity * 2, (numPages + 1) * PageSize), numPages)) {
+                return false;
+            }
+            m_Pages[numPages] = std::move(page);
+
+            // Publish the page only once it is fully initialized.
+            m_NumPages.store(numPages + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Must be called while holding m_GrowMutex.
+        bool GrowShaderVisibleHeap(UINT NumDescriptors, UINT NumPagesToCopy) {
+            ComPtr<ID3D12DescriptorHeap> heap;
+            D3D12_DESCRIPTOR_HEAP_DESC descriptorHeapDesc{};
+            descriptorHeapDesc.Type = m_HeapType;
             descriptorHeapDesc.NumDescriptors = NumDescriptors;
-            if (HeapType == D3D12_DESCRIPTOR_HEAP_TYPE_SAMPLER || HeapType == D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV) {
-                descriptorHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
+            descriptorHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
+            if (FAILED(
+                    m_Device->CreateDescriptorHeap(&descriptorHeapDesc, IID_PPV_ARGS(heap.ReleaseAndGetAddressOf())))) {
+                return false;
+            }
+            heap->SetName((m_DebugName + L" Descriptor Heap").c_str());
+
+            // Carry over the descriptors in use. The ones allocated but not committed yet will be committed to the new
+            // heap.
+            const D3D12_CPU_DESCRIPTOR_HANDLE heapStart = heap->GetCPUDescriptorHandleForHeapStart();
+            for (UINT i = 0; i < NumPagesToCopy; i++) {
+                uint64_t used = m_Pages[i]->Used.load(std::memory_order_acquire);
+                while (used) {
+                    unsigned long slot;
+                    _BitScanForward64(&slot, used);
+                    used &= used - 1;
+                    m_Device->CopyDescriptorsSimple(
+                        1,
+                        CD3DX12_CPU_DESCRIPTOR_HANDLE(heapStart, i * PageSize + slot, m_DescriptorSize),
+                        CD3DX12_CPU_DESCRIPTOR_HANDLE(m_Pages[i]->CPUHandleStart, slot, m_DescriptorSize),
+                        m_HeapType);
+                }
             }
-            CHECK_HRCMD(
-                m_Device->CreateDescriptorHeap(&descriptorHeapDesc, IID_PPV_ARGS(m_Heap.ReleaseAndGetAddressOf())));
-            m_Heap->SetName((DebugName + L" Descriptor Heap").c_str());
 
-            // Retrieve the heap base.
-            m_CPUHandleStart = m_Heap->GetCPUDescriptorHandleForHeapStart();
-            m_GPUHandleStart = m_Heap->GetGPUDescriptorHandleForHeapStart();
-            m_DescriptorSize = m_Device->GetDescriptorHandleIncrementSize(HeapType);
+            // Command lists in flight may still reference the previous heap. It is at most half the size of the new
+            // one, so we keep it around rather than tracking its use.
+            if (m_ShaderVisibleHeapOwner) {
+                m_RetiredHeaps.push_back(std::move(m_ShaderVisibleHeapOwner));
+            }
+            m_ShaderVisibleHeapOwner = heap;
+            m_ShaderVisibleCapacity = NumDescriptors;
+            m_ShaderVisibleHeap.store(heap.Get(), std::memory_order_release);
+            return true;
+        }
 
-            // Populate the allocator.
-            for (UINT i = 0; i < descriptorHeapDesc.NumDescriptors; i++) {
-                m_AvailableDescriptor.push_back(i);
+        UINT FindPageIndex(const D3D12_CPU_DESCRIPTOR_HANDLE& CpuHandle, UINT& Slot) const {
+            const UINT numPages = m_NumPages.load(std::memory_order_acquire);
+            for (UINT i = 0; i < numPages; i++) {
+                const SIZE_T start = m_Pages[i]->CPUHandleStart.ptr;
+                if (CpuHandle.ptr >= start && CpuHandle.ptr < start + PageSize * m_DescriptorSize) {
+                    Slot = static_cast<UINT>((CpuHandle.ptr - start) / m_DescriptorSize);
+                    return i;
+                }
             }
+            CHECK_MSG(false, "Descriptor is not from this heap");
+            return 0;
         }
 
-        D3D12_CPU_DESCRIPTOR_HANDLE AllocateDescriptor() {
-            std::unique_lock lock(m_AvailableDescriptorMutex);
+        Page& FindPage(const D3D12_CPU_DESCRIPTOR_HANDLE& CpuHandle, UINT& Slot) const {
+            return *m_Pages[FindPageIndex(CpuHandle, Slot)];
+        }
+
+        // Must be called while holding m_GrowMutex.
+        D3D12_CPU_DESCRIPTOR_HANDLE GetShaderVisibleCPUDescriptor(const D3D12_CPU_DESCRIPTOR_HANDLE& CpuHandle) const {
+            UINT slot;
+            const UINT index = FindPageIndex(CpuHandle, slot) * PageSize + slot;
+            return CD3DX12_CPU_DESCRIPTOR_HANDLE(
+                m_ShaderVisibleHeapOwner->GetCPUDescriptorHandleForHeapStart(), index, m_DescriptorSize);
+        }
+
+        ComPtr<ID3D12Device> m_Device;
+        const D3D12_DESCRIPTOR_HEAP_TYPE m_HeapType;
+        const bool m_IsShaderVisible;
+        const UINT m_DescriptorSize;
+
+        std::unique_ptr<Page> m_Pages[MaxPages];
+        std::atomic<UINT> m_NumPages{0};
 
-            CHECK_MSG(!m_AvailableDescriptor.empty(), "Out of descriptors");
+        // The members below are protected by m_GrowMutex.
+        std::mutex m_GrowMutex;
+        ComPtr<ID3D12DescriptorHeap> m_ShaderVisibleHeapOwner;
+        UINT m_ShaderVisibleCapacity{0};
+        std::vector<ComPtr<ID3D12DescriptorHeap>> m_RetiredHeaps;
 
-            const UINT allocated = m_AvailableDescriptor.front();
-            m_AvailableDescriptor.pop_front();
-            return CD3DX12_CPU_DESCRIPTOR_HANDLE(m_CPUHandleStart, allocated, m_DescriptorSize);
+        // Read without holding the lock.
+        std::atomic<ID3D12DescriptorHeap*> m_ShaderVisibleHeap{nullptr};
+
+        const std::wstring m_DebugName;
+    };
+
+    // A pipeline library persisted to a file, so that our pipeline states are only compiled once per adapter and
+    // driver. Without support for pipeline libraries, the pipeline states are compiled every time.
+    class PipelineLibrary {
+      public:
+        PipelineLibrary(ID3D12Device* Device, const std::filesystem::path& Path) : m_Device(Device), m_Path(Path) {
+            ComPtr<ID3D12Device1> device1;
+            if (FAILED(m_Device->QueryInterface(IID_PPV_ARGS(device1.ReleaseAndGetAddressOf())))) {
+                return;
+            }
+
+            // The library references the serialized blob, which must outlive it.
+            std::ifstream file(m_Path, std::ios::binary);
+            if (file) {
+                m_Blob.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            }
+
+            HRESULT result = device1->CreatePipelineLibrary(
+                m_Blob.data(), m_Blob.size(), IID_PPV_ARGS(m_Library.ReleaseAndGetAddressOf()));
+            if (FAILED(result) && !m_Blob.empty()) {
+                // The file was written for another driver, or is corrupted. Start over.
+                m_Blob.clear();
+                result = device1->CreatePipelineLibrary(nullptr, 0, IID_PPV_ARGS(m_Library.ReleaseAndGetAddressOf()));
+            }
+            if (FAILED(result)) {
+                m_Library.Reset();
+            }
         }
 
-        void ReturnDescriptor(const D3D12_CPU_DESCRIPTOR_HANDLE& CpuHandle) {
-            std::unique_lock lock(m_AvailableDescriptorMutex);
+        ComPtr<ID3D12PipelineState> LoadComputePipeline(const wchar_t* Name,
+                                                        const D3D12_COMPUTE_PIPELINE_STATE_DESC& Desc) {
+            ComPtr<ID3D12PipelineState> pipelineState;
+            if (m_Library &&
+                SUCCEEDED(m_Library->LoadComputePipeline(
+                    Name, &Desc, IID_PPV_ARGS(pipelineState.ReleaseAndGetAddressOf())))) {
+                return pipelineState;
+            }
 
-            const SIZE_T offset = (CpuHandle.ptr - m_CPUHandleStart.ptr) / m_DescriptorSize;
-            m_AvailableDescriptor.push_back(static_cast<UINT>(offset));
+            CHECK_HRCMD(m_Device->CreateComputePipelineState(&Desc,
+                                                             IID_PPV_ARGS(pipelineState.ReleaseAndGetAddressOf())));
+            if (m_Library && SUCCEEDED(m_Library->StorePipeline(Name, pipelineState.Get()))) {
+                m_IsDirty = true;
+            }
+            return pipelineState;
         }
 
-        D3D12_GPU_DESCRIPTOR_HANDLE GetGPUDescriptor(const D3D12_CPU_DESCRIPTOR_HANDLE& CpuHandle) const {
-            const SIZE_T offset = (CpuHandle.ptr - m_CPUHandleStart.ptr) / m_DescriptorSize;
-            return CD3DX12_GPU_DESCRIPTOR_HANDLE(m_GPUHandleStart, static_cast<UINT>(offset), m_DescriptorSize);
+        // Write the library back to its file if new pipeline states were added. Failures are not fatal, the pipeline
+        // states will be compiled again next time.
+        void Save() {
+            if (!m_IsDirty) {
+                return;
+            }
+            m_IsDirty = false;
+
+            std::vector<char> blob(m_Library->GetSerializedSize());
+            if (FAILED(m_Library->Serialize(blob.data(), blob.size()))) {
+                return;
+            }
+
+            // Another process may be reading the file, so write a copy and replace the file at once.
+            std::error_code error;
+            std::filesystem::create_directories(m_Path.parent_path(), error);
+            std::filesystem::path temporaryPath = m_Path;
+            temporaryPath += L".tmp";
+            {
+                std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+                if (!file.write(blob.data(), blob.size())) {
+                    return;
+                }
+            }
+            std::filesystem::rename(temporaryPath, m_Path, error);
         }
 
-        ID3D12DescriptorHeap* GetDescriptorHeap() const {
-            return m_Heap.Get();
+      private:
+        ComPtr<ID3D12Device> m_Device;
+        const std::filesystem::path m_Path;
+        std::vector<char> m_Blob;
+        ComPtr<ID3D12PipelineLibrary> m_Library;
+        bool m_IsDirty{false};
+    };
+
+    // Where a resource lives within a PlacedResourceAllocator.
+    struct ResourcePlacement {
+        UINT64 Offset{0};
+        // Zero for a committed resource, when the heap had no room left for the resource.
+        UINT64 Size{0};
+        // Whether the memory was previously used by another resource, and needs an aliasing barrier before first use.
+        bool NeedsAliasingBarrier{false};
+    };
+
+    // Sub-allocate resources from a single heap, in order to avoid OS/driver memory allocations upon resource creation.
+    // Placements are powers of two, and the freed placements are reused for resources of the same size class.
+    class PlacedResourceAllocator {
+      public:
+        PlacedResourceAllocator(ID3D12Device* Device,
+                                UINT64 HeapSize = 16ull * 1024 * 1024,
+                                D3D12_HEAP_FLAGS HeapFlags = D3D12_HEAP_FLAG_ALLOW_ONLY_NON_RT_DS_TEXTURES,
+                                const std::wstring& DebugName = L"Unnamed")
+            : m_Device(Device), m_HeapSize(AlignTo(HeapSize, D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT)) {
+            // Reserve the memory upfront.
+            D3D12_HEAP_DESC heapDesc{};
+            heapDesc.SizeInBytes = m_HeapSize;
+            heapDesc.Properties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+            heapDesc.Alignment = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+            heapDesc.Flags = HeapFlags;
+            CHECK_HRCMD(m_Device->CreateHeap(&heapDesc, IID_PPV_ARGS(m_Heap.ReleaseAndGetAddressOf())));
+            m_Heap->SetName((DebugName + L" Heap").c_str());
+
+            for (UINT64 size = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT; size <= m_HeapSize; size *= 2) {
+                m_AvailablePlacements.emplace_back();
+            }
+        }
+
+        ResourcePlacement CreateResource(const D3D12_RESOURCE_DESC& ResourceDesc,
+                                         D3D12_RESOURCE_STATES InitialState,
+                                         ID3D12Resource** ppResource) {
+            const D3D12_RESOURCE_ALLOCATION_INFO allocationInfo =
+                m_Device->GetResourceAllocationInfo(0, 1, &ResourceDesc);
+
+            ResourcePlacement placement{};
+            size_t sizeClass = 0;
+            for (UINT64 size = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT; size <= m_HeapSize; size *= 2) {
+                if (size >= allocationInfo.SizeInBytes) {
+                    placement.Size = size;
+                    break;
+                }
+                sizeClass++;
+            }
+
+            if (placement.Size) {
+                std::unique_lock lock(m_AvailablePlacementsMutex);
+
+                if (!m_AvailablePlacements[sizeClass].empty()) {
+                    // Reuse a freed placement.
+                    placement.Offset = m_AvailablePlacements[sizeClass].back();
+                    placement.NeedsAliasingBarrier = true;
+                    m_AvailablePlacements[sizeClass].pop_back();
+                } else {
+                    // Grab fresh memory. Placements are naturally aligned since they are powers of two.
+                    const UINT64 offset = AlignTo(m_NextOffset, placement.Size);
+                    if (offset + placement.Size <= m_HeapSize) {
+                        placement.Offset = offset;
+                        m_NextOffset = offset + placement.Size;
+                    } else {
+                        placement.Size = 0;
+                    }
+                }
+            }
+
+            if (placement.Size) {
+                CHECK_HRCMD(m_Device->CreatePlacedResource(
+                    m_Heap.Get(), placement.Offset, &ResourceDesc, InitialState, nullptr, IID_PPV_ARGS(ppResource)));
+            } else {
+                // Fallback to a committed resource when the heap is full or the resource is too large.
+                const D3D12_HEAP_PROPERTIES defaultHeap = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+                CHECK_HRCMD(m_Device->CreateCommittedResource(&defaultHeap,
+                                                              D3D12_HEAP_FLAG_NONE,
+                                                              &ResourceDesc,
+                                                              InitialState,
+                                                              nullptr,
+                                                              IID_PPV_ARGS(ppResource)));
+            }
+
+            return placement;
+        }
+
+        // The resource must have been released and must no longer be in use by the GPU.
+        void ReturnResource(const ResourcePlacement& Placement) {
+            if (!Placement.Size) {
+                return;
+            }
+
+            std::unique_lock lock(m_AvailablePlacementsMutex);
+
+            size_t sizeClass = 0;
+            while ((D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT << sizeClass) < Placement.Size) {
+                sizeClass++;
+            }
+            m_AvailablePlacements[sizeClass].push_back(Placement.Offset);
         }
 
       private:
+        static UINT64 AlignTo(UINT64 Value, UINT64 Alignment) {
+            return (Value + Alignment - 1) & ~(Alignment - 1);
+        }
+
         ComPtr<ID3D12Device> m_Device;
-        ComPtr<ID3D12DescriptorHeap> m_Heap;
-        D3D12_CPU_DESCRIPTOR_HANDLE m_CPUHandleStart{};
-        D3D12_GPU_DESCRIPTOR_HANDLE m_GPUHandleStart{};
-        UINT m_DescriptorSize{0};
+        ComPtr<ID3D12Heap> m_Heap;
+        const UINT64 m_HeapSize;
 
-        std::mutex m_AvailableDescriptorMutex;
-        std::deque<UINT> m_AvailableDescriptor;
+        std::mutex m_AvailablePlacementsMutex;
+        UINT64 m_NextOffset{0};
+        std::vector<std::vector<UINT64>> m_AvailablePlacements;
     };
 
 } // namespace D3D12Utils
\ No newline at end of file
@@ -30,43 +30,233 @@ namespace {
 
     using namespace EyeGaze;
 
+    int64_t GetTimeMicroseconds() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // The filtered gaze at the time of a sample, in the time domain of the samples.
+    struct GazeEstimate {
+        int64_t Timestamp{0};
+        float X{0.f};
+        float Y{0.f};
+        float VelocityX{0.f};
+        float VelocityY{0.f};
+    };
+
+    // Extrapolate the gaze to a timestamp, in the time domain of the samples.
+    void PredictGaze(const GazeEstimate& Estimate, int64_t Timestamp, int64_t MaxPrediction, float& X, float& Y) {
+        const float horizon = std::clamp(Timestamp - Estimate.Timestamp, int64_t{0}, MaxPrediction) * 1e-6f;
+        X = Estimate.X + Estimate.VelocityX * horizon;
+        Y = Estimate.Y + Estimate.VelocityY * horizon;
+    }
+
+    // A sequence lock to publish the latest value from one writer thread to any number of readers, without any lock
+    // or system call on the reader side. The value is copied through atomic words, and the readers retry upon a
+    // concurrent write.
+    template <typename T>
+    class SeqLock {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+      public:
+        void Store(const T& Value) {
+            uint64_t words[kNumWords]{};
+            memcpy(words, &Value, sizeof(T));
+
+            const uint32_t sequence = m_Sequence.load(std::memory_order_relaxed);
+            m_Sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t i = 0; i < kNumWords; i++) {
+                m_Words[i].store(words[i], std::memory_order_relaxed);
+            }
+            m_Sequence.store(sequence + 2, std::memory_order_release);
+        }
+
+        T Load() const {
+            uint64_t words[kNumWords];
+            uint32_t sequenceBefore, sequenceAfter;
+            do {
+                sequenceBefore = m_Sequence.load(std::memory_order_acquire);
+                for (size_t i = 0; i < kNumWords; i++) {
+                    words[i] = m_Words[i].load(std::memory_order_relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                sequenceAfter = m_Sequence.load(std::memory_order_relaxed);
+            } while ((sequenceBefore & 1) || sequenceBefore != sequenceAfter);
+
+            T value;
+            memcpy(&value, words, sizeof(T));
+            return value;
+        }
+
+      private:
+        static constexpr size_t kNumWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+        std::atomic<uint32_t> m_Sequence{0};
+        std::atomic<uint64_t> m_Words[kNumWords]{};
+    };
+
+    // A constant-velocity (alpha-beta) filter of the gaze position, reset upon saccades.
+    class GazePredictor {
+      public:
+        GazePredictor(const GazePredictionOptions& Options) : m_Options(Options) {
+        }
+
+        void AddSample(int64_t Timestamp, float X, float Y) {
+            // Restart the filter after a gap in the samples, since the velocity is meaningless by now.
+            if (!m_HasState || Timestamp <= m_LastTimestamp || Timestamp - m_LastTimestamp > 100'000) {
+                Reset(Timestamp, X, Y);
+                return;
+            }
+
+            const float dt = (Timestamp - m_LastTimestamp) * 1e-6f;
+            const float measuredVelocityX = (X - m_LastX) / dt;
+            const float measuredVelocityY = (Y - m_LastY) / dt;
+            m_IsSaccade = std::sqrt(measuredVelocityX * measuredVelocityX + measuredVelocityY * measuredVelocityY) >
+                          m_Options.SaccadeVelocityThreshold;
+
+            if (m_IsSaccade) {
+                // Follow the eye without any smoothing, and do not extrapolate.
+                m_X = X;
+                m_Y = Y;
+                m_VelocityX = m_VelocityY = 0.f;
+            } else {
+                const float predictedX = m_X + m_VelocityX * dt;
+                const float predictedY = m_Y + m_VelocityY * dt;
+                const float residualX = X - predictedX;
+                const float residualY = Y - predictedY;
+                m_X = predictedX + m_Options.Alpha * residualX;
+                m_Y = predictedY + m_Options.Alpha * residualY;
+                m_VelocityX += m_Options.Beta * residualX / dt;
+                m_VelocityY += m_Options.Beta * residualY / dt;
+            }
+
+            m_LastTimestamp = Timestamp;
+            m_LastX = X;
+            m_LastY = Y;
+        }
+
+        GazeEstimate GetEstimate() const {
+            return {m_LastTimestamp, m_X, m_Y, m_VelocityX, m_VelocityY};
+        }
+
+        bool IsSaccade() const {
+            return m_IsSaccade;
+        }
+
+      private:
+        void Reset(int64_t Timestamp, float X, float Y) {
+            m_HasState = true;
+            m_IsSaccade = false;
+            m_X = m_LastX = X;
+            m_Y = m_LastY = Y;
+            m_VelocityX = m_VelocityY = 0.f;
+            m_LastTimestamp = Timestamp;
+        }
+
+        const GazePredictionOptions m_Options;
+
+        bool m_HasState{false};
+        bool m_IsSaccade{false};
+        int64_t m_LastTimestamp{0};
+        float m_LastX{0.f};
+        float m_LastY{0.f};
+        float m_X{0.f};
+        float m_Y{0.f};
+        float m_VelocityX{0.f};
+        float m_VelocityY{0.f};
+    };
+
     // Retrieve eye gaze tracking data from a Tobii commercial sensor, such as the Tobii Eye Tracker 5.
+    // The sensor is polled from a dedicated thread, and the latest gaze is published to the rendering threads.
     struct TobiiEyeGazeManager : IEyeGazeManager {
         struct GazeData {
-            std::chrono::time_point<std::chrono::steady_clock> Timepoint;
-            float GazeX;
-            float GazeY;
+            bool IsValid;
+            // The time the sample was received, in our time domain.
+            int64_t Timepoint;
+            // The offset from the time domain of the samples to our time domain.
+            int64_t ClockOffset;
+            GazeEstimate Estimate;
             float Distance;
         };
 
-        TobiiEyeGazeManager(const tobiiAPI& Api, HWND Hwnd) : m_Api(Api), m_Hwnd(Hwnd) {
+        TobiiEyeGazeManager(const tobiiAPI& Api, HWND Hwnd, const GazePredictionOptions& Options)
+            : m_Api(Api), m_Hwnd(Hwnd), m_Options(Options), m_Predictor(Options) {
             TraceLocalActivity(local);
             TraceLoggingWriteStart(local, "TobiiCreate");
 
-            m_Api.SetWindow(m_Hwnd);
-            const bool started = m_Api.Start(false /* custom_thread */);
-            m_Api.SubscribeToStream(TobiiSubscriptionUserPresence);
-            m_Api.SubscribeToStream(TobiiSubscriptionFoveatedGaze);
-            m_Api.SubscribeToStream(TobiiSubscriptionHeadTracking);
+            m_GazeData.Store({});
+            m_PollingThread = std::thread([this]() { PollingThread(); });
 
-            TraceLoggingWriteStop(local,
-                                  "TobiiCreate",
-                                  TLArg(m_Api.IsInitialised(), "Initialized"),
-                                  TLArg(started, "Started"),
-                                  TLArg(m_Api.IsConnected(), "Connected"),
-                                  TLArg(m_Api.IsReady(), "Ready"));
+            TraceLoggingWriteStop(local, "TobiiCreate");
         }
 
         ~TobiiEyeGazeManager() override {
             TraceLocalActivity(local);
             TraceLoggingWriteStart(local, "TobiiDestroy");
 
-            m_Api.Stop();
+            m_StopPolling = true;
+            m_PollingThread.join();
 
             TraceLoggingWriteStop(local, "TobiiDestroy");
         }
 
-        void Update() override {
+        bool GetGaze(float& X, float& Y, float& Distance) override {
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(local, "TobiiGetGaze");
+
+            const GazeData gazeData = m_GazeData.Load();
+            const int64_t now = GetTimeMicroseconds();
+
+            // Ignore the latched gaze data when it is too old.
+            if (gazeData.IsValid && now - gazeData.Timepoint < m_Options.GazeTimeoutMicroseconds) {
+                // Return the gaze predicted for when the frame will be displayed.
+                const int64_t displayTime = now - gazeData.ClockOffset + m_Options.PredictionLatencyMicroseconds;
+                PredictGaze(gazeData.Estimate, displayTime, m_Options.MaxPredictionMicroseconds, X, Y);
+                Distance = gazeData.Distance;
+                TraceLoggingWriteStop(local, "TobiiGetGaze", TLArg(X), TLArg(Y), TLArg(Distance));
+                return true;
+            }
+            TraceLoggingWriteStop(local, "TobiiGetGaze_NotAvailable");
+            return false;
+        }
+
+        HWND GetHwnd() const override {
+            return m_Hwnd;
+        }
+
+        void PollingThread() {
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(local, "TobiiPollingThread");
+
+            // The Tobii API is only used from this thread.
+            m_Api.SetWindow(m_Hwnd);
+            const bool started = m_Api.Start(true /* custom_thread */);
+            m_Api.SubscribeToStream(TobiiSubscriptionUserPresence);
+            m_Api.SubscribeToStream(TobiiSubscriptionFoveatedGaze);
+            m_Api.SubscribeToStream(TobiiSubscriptionHeadTracking);
+
+            TraceLoggingWriteTagged(local,
+                                    "TobiiPollingThread_Start",
+                                    TLArg(m_Api.IsInitialised(), "Initialized"),
+                                    TLArg(started, "Started"),
+                                    TLArg(m_Api.IsConnected(), "Connected"),
+                                    TLArg(m_Api.IsReady(), "Ready"));
+
+            while (!m_StopPolling) {
+                Poll();
+
+                // The sensor streams at a few hundred Hz at most.
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+
+            m_Api.Stop();
+
+            TraceLoggingWriteStop(local, "TobiiPollingThread");
+        }
+
+        void Poll() {
             TraceLocalActivity(local);
             TraceLoggingWriteStart(local, "TobiiUpdate");
 
@@ -91,70 +281,71 @@ namespace {
                 TraceLoggingWriteTagged(
                     local, "TobiiUpdate", TLArg(numHeadPoses, "NumHeadPoses"), TLArg(numGazePoints, "NumGazePoints"));
 
-                GazeData gazeData{};
-
                 if (numHeadPoses) {
                     const auto& mostRecent = headPoses[numHeadPoses - 1];
-                    gazeData.Distance = std::sqrt(mostRecent.Position.X * mostRecent.Position.X +
-                                                  mostRecent.Position.Y * mostRecent.Position.Y +
-                                                  mostRecent.Position.Z * mostRecent.Position.Z);
+                    m_Distance = std::sqrt(mostRecent.Position.X * mostRecent.Position.X +
+                                           mostRecent.Position.Y * mostRecent.Position.Y +
+                                           mostRecent.Position.Z * mostRecent.Position.Z);
                 }
 
-                // Update the cache if we have enough data.
+                // Publish a new estimate if we have enough data.
                 if (numGazePoints) {
-                    const auto& mostRecent = gazePoints[numGazePoints - 1];
-                    gazeData.GazeX = mostRecent.X;
-                    gazeData.GazeY = mostRecent.Y;
+                    // Feed all the samples to the predictor, not only the most recent one.
+                    for (int i = 0; i < numGazePoints; i++) {
+                        m_Predictor.AddSample(gazePoints[i].TimeStampMicroSeconds, gazePoints[i].X, gazePoints[i].Y);
+                    }
+
+                    // The sensor timestamps are not in our time domain. Estimate the offset between the two clocks,
+                    // using the sample delivered the fastest. The offset is allowed to drift slowly.
+                    const int64_t now = GetTimeMicroseconds();
+                    const int64_t clockOffset = now - gazePoints[numGazePoints - 1].TimeStampMicroSeconds;
+                    m_ClockOffset = m_ClockOffset ? std::min(*m_ClockOffset + 100, clockOffset) : clockOffset;
 
-                    gazeData.Timepoint = std::chrono::steady_clock::now();
+                    GazeData gazeData{};
+                    gazeData.IsValid = true;
+                    gazeData.Timepoint = now;
+                    gazeData.ClockOffset = *m_ClockOffset;
+                    gazeData.Estimate = m_Predictor.GetEstimate();
+                    gazeData.Distance = m_Distance;
+                    m_GazeData.Store(gazeData);
 
-                    m_GazeData = gazeData;
+                    TraceLoggingWriteTagged(local,
+                                            "TobiiUpdate_Sample",
+                                            TLArg(gazePoints[numGazePoints - 1].X, "GazeX"),
+                                            TLArg(gazePoints[numGazePoints - 1].Y, "GazeY"),
+                                            TLArg(m_Predictor.IsSaccade(), "IsSaccade"),
+                                            TLArg(*m_ClockOffset, "ClockOffset"));
                 }
             }
 
             TraceLoggingWriteStop(local, "TobiiUpdate");
         }
 
-        bool GetGaze(float& X, float& Y, float& Distance) override {
-            TraceLocalActivity(local);
-            TraceLoggingWriteStart(local, "TobiiGetGaze");
+        const tobiiAPI m_Api;
+        const HWND m_Hwnd;
+        const GazePredictionOptions m_Options;
 
-            // Invalidate the latched gaze data when it is too old.
-            if (m_GazeData && (std::chrono::steady_clock::now() - m_GazeData->Timepoint).count() >= 600'000'000) {
-                m_GazeData.reset();
-            }
+        SeqLock<GazeData> m_GazeData;
 
-            // Return the cached gaze data.
-            if (m_GazeData) {
-                X = m_GazeData->GazeX;
-                Y = m_GazeData->GazeY;
-                Distance = m_GazeData->Distance;
-                TraceLoggingWriteStop(local, "TobiiGetGaze", TLArg(X), TLArg(Y), TLArg(Distance));
-                return true;
-            }
-            TraceLoggingWriteStop(local, "TobiiGetGaze_NotAvailable");
-            return false;
-        }
+        // The members below are only accessed from the polling thread.
+        GazePredictor m_Predictor;
+        std::optional<int64_t> m_ClockOffset;
+        float m_Distance{0.f};
 
-        HWND GetHwnd() const override {
-            return m_Hwnd;
-        }
-
-        const tobiiAPI m_Api;
-        const HWND m_Hwnd;
-        std::optional<GazeData> m_GazeData;
+        std::thread m_PollingThread;
+        std::atomic<bool> m_StopPolling{false};
     };
 
 } // namespace
 
 namespace EyeGaze {
-    std::unique_ptr<IEyeGazeManager> CreateTobiiEyeGazeManager(HWND Hwnd) {
+    std::unique_ptr<IEyeGazeManager> CreateTobiiEyeGazeManager(HWND Hwnd, const GazePredictionOptions& Options) {
         tobiiAPI api{};
         if (!InitializeTobiiAPI(&api)) {
             TraceLoggingWrite(Tracing::g_traceProvider, "TobiiNotFound");
             return {};
         }
-        return std::make_unique<TobiiEyeGazeManager>(api, Hwnd);
+        return std::make_unique<TobiiEyeGazeManager>(api, Hwnd, Options);
     }
 
 } // namespace EyeGaze
@@ -24,15 +24,34 @@
 
 namespace EyeGaze {
 
+    struct GazePredictionOptions {
+        // The time between the capture of a gaze sample and the display of a frame rendered with it. The gaze is
+        // extrapolated over this interval.
+        int64_t PredictionLatencyMicroseconds{25'000};
+        // The longest interval we will extrapolate over, to bound the error when the sensor stops delivering samples.
+        int64_t MaxPredictionMicroseconds{50'000};
+        // The age of the last gaze sample past which the gaze is considered lost, and the center of the viewport is
+        // used instead.
+        int64_t GazeTimeoutMicroseconds{600'000};
+
+        // Gains of the alpha-beta filter for the position and the velocity.
+        float Alpha{0.5f};
+        float Beta{0.1f};
+
+        // Above this velocity (in normalized units per second), the eye is considered to be in a saccade. The landing
+        // point of a saccade cannot be extrapolated, so we follow the most recent sample instead.
+        float SaccadeVelocityThreshold{4.f};
+    };
+
     struct IEyeGazeManager {
         virtual ~IEyeGazeManager() = default;
 
-        virtual void Update() = 0;
+        // Return the gaze predicted for the time the next frame will be displayed.
         virtual bool GetGaze(float& X, float& Y, float& Distance) = 0;
 
         virtual HWND GetHwnd() const = 0;
     };
 
-    std::unique_ptr<IEyeGazeManager> CreateTobiiEyeGazeManager(HWND Hwnd);
+    std::unique_ptr<IEyeGazeManager> CreateTobiiEyeGazeManager(HWND Hwnd, const GazePredictionOptions& Options = {});
 
 } // namespace EyeGaze
@@ -20,32 +20,111 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+// The permutations, see the GenerateShadingRateMapCS_*.hlsl files. The profile shape and the use of the
+// content-adaptive bias are known when the device is created, so they are resolved at build time instead of branching
+// on the constants.
+#ifndef PROFILE_LOOKUP_TABLE
+#define PROFILE_LOOKUP_TABLE 0
+#endif
+#ifndef USE_BIAS
+#define USE_BIAS 1
+#endif
+
+// Embedded, so that the root signature does not need to be serialized at runtime. The descriptor tables are volatile
+// like with a version 1.0 root signature.
+#define RootSignatureDesc \
+    "DescriptorTable(UAV(u0, flags = DESCRIPTORS_VOLATILE | DATA_VOLATILE))," \
+    "RootConstants(num32BitConstants = 48, b0)," \
+    "DescriptorTable(SRV(t0, flags = DESCRIPTORS_VOLATILE | DATA_VOLATILE))," \
+    "DescriptorTable(SRV(t1, flags = DESCRIPTORS_VOLATILE | DATA_VOLATILE))"
+
 RWTexture2D<uint> Output : register(u0);
+StructuredBuffer<uint> LookupTable : register(t0);
+// The per-axis coarsening from the content of the previous frame, see AnalyzeFrameCS.
+Texture2D<uint> Bias : register(t1);
 cbuffer Constants : register(b0)
 {
-    float CenterX;
-    float CenterY;
-    float InnerRing;
-    float OuterRing;
-    uint Rate1x1;
-    uint RateMedium;
-    uint RateLow;
+    float HorizontalScale;
+    uint NumRings;
+    uint OuterRate;
+    uint LookupTableSize;
+    // Convert a relative distance into an index in the lookup table.
+    float LookupTableScale;
+    uint NumFoveae;
+    uint2 Padding;
+    float4 RingRadius[2];
+    uint4 RingRate[2];
+    // x, y: center of the fovea in tiles. z: convert a distance in tiles into a distance relative to the height of the
+    // viewport.
+    float4 Foveae[4];
+    // Convert a tile of the map into a tile of the bias texture.
+    float2 BiasScale;
+    uint UseBias;
+    // The coarsest rate supported on each axis (log2).
+    uint MaxAxisRate;
+    // The coarsening (log2) applied to all the tiles outside of the full rate region, see the frame time controller.
+    uint RateOffset;
+    uint3 Padding2;
 };
 
+[RootSignature(RootSignatureDesc)]
 [numthreads(8, 8, 1)]
 void main(uint3 DTid : SV_DispatchThreadID)
 {
-    float2 fromCenter = float2(DTid.x - CenterX, DTid.y - CenterY);
-    float distance = sqrt(fromCenter.x * fromCenter.x + fromCenter.y * fromCenter.y);
+    // Use the closest fovea. The distances are compared squared, and the square root is only needed to index the lookup
+    // table.
+    float distanceSquared = 1e30f;
+    for (uint j = 0; j < NumFoveae; j++)
+    {
+        float2 fromCenter = float2((DTid.x - Foveae[j].x) / HorizontalScale, DTid.y - Foveae[j].y) * Foveae[j].z;
+        distanceSquared = min(distanceSquared, dot(fromCenter, fromCenter));
+    }
 
-    uint rate = Rate1x1;
-    if (distance >= OuterRing)
+#if PROFILE_LOOKUP_TABLE
+    // Past the end of the table is the outer rate. Select rather than branch, the load is always in bounds.
+    uint index = (uint)min(sqrt(distanceSquared) * LookupTableScale, (float)LookupTableSize);
+    uint rate = index < LookupTableSize ? LookupTable[min(index, LookupTableSize - 1)] : OuterRate;
+#else
+    uint rate = OuterRate;
+    for (uint i = 0; i < NumRings; i++)
     {
-        rate = RateLow;
+        float radius = RingRadius[i / 4][i % 4];
+        if (distanceSquared < radius * radius)
+        {
+            rate = RingRate[i / 4][i % 4];
+            break;
+        }
     }
-    else if (distance >= InnerRing)
+#endif
+
+#if USE_BIAS
+    if (UseBias || RateOffset)
+#else
+    if (RateOffset)
+#endif
     {
-        rate = RateMedium;
+        uint x = rate >> 2;
+        uint y = rate & 3;
+        if (rate != 0)
+        {
+            x += RateOffset;
+            y += RateOffset;
+        }
+#if USE_BIAS
+        if (UseBias)
+        {
+            uint bias = Bias.Load(int3(DTid.xy * BiasScale, 0));
+            x += bias >> 2;
+            y += bias & 3;
+        }
+#endif
+        x = min(x, MaxAxisRate);
+        y = min(y, MaxAxisRate);
+
+        // There are no 1X4 and 4X1 rates.
+        x = max(x, y - min(y, 1));
+        y = max(y, x - min(x, 1));
+        rate = (x << 2) | y;
     }
 
     Output[DTid.xy] = rate;
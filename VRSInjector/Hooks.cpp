@@ -22,8 +22,8 @@
 
 #include "pch.h"
 
-#include "Check.h"
 #include "Injector.h"
+#include "Telemetry.h"
 #include "Tracing.h"
 
 #pragma comment(lib, "dxgi.lib")
@@ -31,67 +31,35 @@
 
 namespace {
 
-    // From DXSample framework.
-    void GetHardwareAdapter(IDXGIFactory1* pFactory, IDXGIAdapter1** ppAdapter, bool requestHighPerformanceAdapter) {
-        *ppAdapter = nullptr;
-
-        ComPtr<IDXGIAdapter1> adapter;
-
-        ComPtr<IDXGIFactory6> factory6;
-        if (SUCCEEDED(pFactory->QueryInterface(IID_PPV_ARGS(&factory6)))) {
-            for (UINT adapterIndex = 0; SUCCEEDED(factory6->EnumAdapterByGpuPreference(
-                     adapterIndex,
-                     requestHighPerformanceAdapter == true ? DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE
-                                                           : DXGI_GPU_PREFERENCE_UNSPECIFIED,
-                     IID_PPV_ARGS(&adapter)));
-                 ++adapterIndex) {
-                DXGI_ADAPTER_DESC1 desc;
-                adapter->GetDesc1(&desc);
-
-                if (desc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE) {
-                    // Don't select the Basic Render Driver adapter.
-                    // If you want a software adapter, pass in "/warp" on the command line.
-                    continue;
-                }
-
-                // Check to see whether the adapter supports Direct3D 12, but don't create the
-                // actual device yet.
-                if (SUCCEEDED(
-                        D3D12CreateDevice(adapter.Get(), D3D_FEATURE_LEVEL_11_0, _uuidof(ID3D12Device), nullptr))) {
-                    break;
-                }
-            }
-        }
+#define DECLARE_DETOUR_FUNCTION(ReturnType, Callconv, FunctionName, ...)                                               \
+    ReturnType(Callconv* original_##FunctionName)(##__VA_ARGS__) = nullptr;                                            \
+    ReturnType Callconv hooked_##FunctionName(##__VA_ARGS__)
 
-        if (adapter.Get() == nullptr) {
-            for (UINT adapterIndex = 0; SUCCEEDED(pFactory->EnumAdapters1(adapterIndex, &adapter)); ++adapterIndex) {
-                DXGI_ADAPTER_DESC1 desc;
-                adapter->GetDesc1(&desc);
+    // The objects are created by the application from any thread, and we hook their methods the first time we see them.
+    std::mutex g_HooksMutex;
 
-                if (desc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE) {
-                    // Don't select the Basic Render Driver adapter.
-                    // If you want a software adapter, pass in "/warp" on the command line.
-                    continue;
-                }
+    template <typename TFunction>
+    void DetourFunctionAttach(TFunction target, TFunction hooked, TFunction& original) {
+        std::unique_lock lock(g_HooksMutex);
 
-                // Check to see whether the adapter supports Direct3D 12, but don't create the
-                // actual device yet.
-                if (SUCCEEDED(
-                        D3D12CreateDevice(adapter.Get(), D3D_FEATURE_LEVEL_11_0, _uuidof(ID3D12Device), nullptr))) {
-                    break;
-                }
-            }
+        if (original) {
+            // Already hooked.
+            return;
         }
 
-        *ppAdapter = adapter.Detach();
-    }
+        DetourTransactionBegin();
+        DetourUpdateThread(GetCurrentThread());
 
-#define DECLARE_DETOUR_FUNCTION(ReturnType, Callconv, FunctionName, ...)                                               \
-    ReturnType(Callconv* original_##FunctionName)(##__VA_ARGS__) = nullptr;                                            \
-    ReturnType Callconv hooked_##FunctionName(##__VA_ARGS__)
+        original = target;
+        DetourAttach((PVOID*)&original, hooked);
+
+        DetourTransactionCommit();
+    }
 
     template <class T, typename TMethod>
     void DetourMethodAttach(T* instance, unsigned int methodOffset, TMethod hooked, TMethod& original) {
+        std::unique_lock lock(g_HooksMutex);
+
         if (original) {
             // Already hooked.
             return;
@@ -109,7 +77,20 @@ namespace {
         DetourTransactionCommit();
     }
 
+    // The injection manager reads the rules and the settings of the application, which cannot be done from DllMain()
+    // under the loader lock. It is created upon the first device or DXGI factory, before any of the methods that use
+    // it are hooked.
     std::unique_ptr<Injector::IInjectionManager> g_InjectionManager;
+    Injector::InjectionManagerFactory g_CreateInjectionManager = nullptr;
+    std::once_flag g_InjectionManagerCreated;
+
+    void CreateInjectionManagerOnce() {
+        std::call_once(g_InjectionManagerCreated, [] {
+            TraceLoggingWrite(Tracing::g_traceProvider, "CreateInjectionManager");
+            assert(g_CreateInjectionManager);
+            g_InjectionManager = g_CreateInjectionManager();
+        });
+    }
 
     DECLARE_DETOUR_FUNCTION(void,
                             STDMETHODCALLTYPE,
@@ -117,21 +98,22 @@ namespace {
                             ID3D12GraphicsCommandList* pCommandList,
                             UINT NumViewports,
                             const D3D12_VIEWPORT* pViewports) {
-        TraceLocalActivity(local);
-        TraceLoggingWriteStart(local,
-                               "ID3D12GraphicsCommandList_RSSetViewports",
-                               TLPArg(pCommandList, "CommandList"),
-                               TLArg(NumViewports, "NumViewports"));
-
-        if (IsTraceEnabled() && pViewports) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(local,
+                              "ID3D12GraphicsCommandList_RSSetViewports",
+                              TLPArg(pCommandList, "CommandList"),
+                              TLArg(NumViewports, "NumViewports"));
+        TraceCount(SetViewports);
+
+        if (IsTraceDetailEnabled() && pViewports) {
             for (UINT i = 0; i < NumViewports; i++) {
-                TraceLoggingWriteTagged(local,
-                                        "ID3D12GraphicsCommandList_RSSetViewports",
-                                        TLArg(i, "ViewportIndex"),
-                                        TLArg(pViewports[i].TopLeftX, "TopLeftX"),
-                                        TLArg(pViewports[i].TopLeftY, "TopLeftY"),
-                                        TLArg(pViewports[i].Width, "Width"),
-                                        TLArg(pViewports[i].Height, "Height"));
+                TraceDetailWriteTagged(local,
+                                       "ID3D12GraphicsCommandList_RSSetViewports",
+                                       TLArg(i, "ViewportIndex"),
+                                       TLArg(pViewports[i].TopLeftX, "TopLeftX"),
+                                       TLArg(pViewports[i].TopLeftY, "TopLeftY"),
+                                       TLArg(pViewports[i].Width, "Width"),
+                                       TLArg(pViewports[i].Height, "Height"));
             }
         }
 
@@ -139,10 +121,350 @@ namespace {
         original_ID3D12GraphicsCommandList_RSSetViewports(pCommandList, NumViewports, pViewports);
 
         // Invoke the hook after the state has been set on the command list.
-        assert(g_InjectionManager);
-        g_InjectionManager->OnSetViewports(pCommandList, NumViewports > 0 ? pViewports[0] : D3D12_VIEWPORT{});
+        {
+            TelemetryHookTimer(SetViewports);
+            assert(g_InjectionManager);
+            g_InjectionManager->OnSetViewports(pCommandList, NumViewports, pViewports);
+        }
+
+        TraceDetailWriteStop(local, "ID3D12GraphicsCommandList_RSSetViewports");
+    }
+
+    DECLARE_DETOUR_FUNCTION(void,
+                            STDMETHODCALLTYPE,
+                            ID3D12GraphicsCommandList_OMSetRenderTargets,
+                            ID3D12GraphicsCommandList* pCommandList,
+                            UINT NumRenderTargetDescriptors,
+                            const D3D12_CPU_DESCRIPTOR_HANDLE* pRenderTargetDescriptors,
+                            BOOL RTsSingleHandleToDescriptorRange,
+                            const D3D12_CPU_DESCRIPTOR_HANDLE* pDepthStencilDescriptor) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(local,
+                              "ID3D12GraphicsCommandList_OMSetRenderTargets",
+                              TLPArg(pCommandList, "CommandList"),
+                              TLArg(NumRenderTargetDescriptors, "NumRenderTargetDescriptors"));
+        TraceCount(SetRenderTargets);
+
+        assert(original_ID3D12GraphicsCommandList_OMSetRenderTargets);
+        original_ID3D12GraphicsCommandList_OMSetRenderTargets(pCommandList,
+                                                              NumRenderTargetDescriptors,
+                                                              pRenderTargetDescriptors,
+                                                              RTsSingleHandleToDescriptorRange,
+                                                              pDepthStencilDescriptor);
+
+        // Whether or not the descriptors are a range, the first one is the first render target.
+        const D3D12_CPU_DESCRIPTOR_HANDLE* const pRenderTarget =
+            NumRenderTargetDescriptors && pRenderTargetDescriptors ? &pRenderTargetDescriptors[0] : nullptr;
+        {
+            TelemetryHookTimer(SetRenderTargets);
+            assert(g_InjectionManager);
+            g_InjectionManager->OnSetRenderTarget(pCommandList, pRenderTarget);
+        }
+
+        TraceDetailWriteStop(local, "ID3D12GraphicsCommandList_OMSetRenderTargets");
+    }
+
+    DECLARE_DETOUR_FUNCTION(void,
+                            STDMETHODCALLTYPE,
+                            ID3D12GraphicsCommandList4_BeginRenderPass,
+                            ID3D12GraphicsCommandList4* pCommandList,
+                            UINT NumRenderTargets,
+                            const D3D12_RENDER_PASS_RENDER_TARGET_DESC* pRenderTargets,
+                            const D3D12_RENDER_PASS_DEPTH_STENCIL_DESC* pDepthStencil,
+                            D3D12_RENDER_PASS_FLAGS Flags) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(local,
+                              "ID3D12GraphicsCommandList4_BeginRenderPass",
+                              TLPArg(pCommandList, "CommandList"),
+                              TLArg(NumRenderTargets, "NumRenderTargets"));
+        TraceCount(SetRenderTargets);
+
+        assert(original_ID3D12GraphicsCommandList4_BeginRenderPass);
+        original_ID3D12GraphicsCommandList4_BeginRenderPass(
+            pCommandList, NumRenderTargets, pRenderTargets, pDepthStencil, Flags);
+
+        {
+            TelemetryHookTimer(BeginRenderPass);
+            assert(g_InjectionManager);
+            g_InjectionManager->OnSetRenderTarget(
+                pCommandList, NumRenderTargets && pRenderTargets ? &pRenderTargets[0].cpuDescriptor : nullptr);
+        }
+
+        TraceDetailWriteStop(local, "ID3D12GraphicsCommandList4_BeginRenderPass");
+    }
+
+    DECLARE_DETOUR_FUNCTION(void,
+                            STDMETHODCALLTYPE,
+                            ID3D12GraphicsCommandList_SetPipelineState,
+                            ID3D12GraphicsCommandList* pCommandList,
+                            ID3D12PipelineState* pPipelineState) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(local,
+                              "ID3D12GraphicsCommandList_SetPipelineState",
+                              TLPArg(pCommandList, "CommandList"),
+                              TLPArg(pPipelineState, "PipelineState"));
+        TraceCount(SetPipelineState);
+
+        assert(original_ID3D12GraphicsCommandList_SetPipelineState);
+        original_ID3D12GraphicsCommandList_SetPipelineState(pCommandList, pPipelineState);
+
+        {
+            TelemetryHookTimer(SetPipelineState);
+            assert(g_InjectionManager);
+            g_InjectionManager->OnSetPipelineState(pCommandList, pPipelineState);
+        }
+
+        TraceDetailWriteStop(local, "ID3D12GraphicsCommandList_SetPipelineState");
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            ID3D12GraphicsCommandList_Reset,
+                            ID3D12GraphicsCommandList* pCommandList,
+                            ID3D12CommandAllocator* pAllocator,
+                            ID3D12PipelineState* pInitialState) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(local, "ID3D12GraphicsCommandList_Reset", TLPArg(pCommandList, "CommandList"));
+        TraceCount(ResetCommandList);
+
+        assert(original_ID3D12GraphicsCommandList_Reset);
+        const HRESULT result = original_ID3D12GraphicsCommandList_Reset(pCommandList, pAllocator, pInitialState);
+
+        {
+            TelemetryHookTimer(ResetCommandList);
+            if (SUCCEEDED(result)) {
+                assert(g_InjectionManager);
+                g_InjectionManager->OnResetCommandList(pCommandList);
+                if (pInitialState) {
+                    g_InjectionManager->OnSetPipelineState(pCommandList, pInitialState);
+                }
+            }
+        }
+
+        TraceDetailWriteStop(local, "ID3D12GraphicsCommandList_Reset", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(void,
+                            STDMETHODCALLTYPE,
+                            ID3D12GraphicsCommandList_ClearState,
+                            ID3D12GraphicsCommandList* pCommandList,
+                            ID3D12PipelineState* pPipelineState) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(local, "ID3D12GraphicsCommandList_ClearState", TLPArg(pCommandList, "CommandList"));
+        TraceCount(ResetCommandList);
+
+        assert(original_ID3D12GraphicsCommandList_ClearState);
+        original_ID3D12GraphicsCommandList_ClearState(pCommandList, pPipelineState);
+
+        // ClearState() also resets the VRS state of the command list.
+        {
+            TelemetryHookTimer(ClearState);
+            assert(g_InjectionManager);
+            g_InjectionManager->OnResetCommandList(pCommandList);
+            if (pPipelineState) {
+                g_InjectionManager->OnSetPipelineState(pCommandList, pPipelineState);
+            }
+        }
 
-        TraceLoggingWriteStop(local, "ID3D12GraphicsCommandList_RSSetViewports");
+        TraceDetailWriteStop(local, "ID3D12GraphicsCommandList_ClearState");
+    }
+
+    // The application may request any interface of the pipeline state.
+    void OnCreatedPipelineState(const D3D12_SHADER_BYTECODE& PixelShader, void** ppPipelineState) {
+        ComPtr<ID3D12PipelineState> pipelineState;
+        if (ppPipelineState && *ppPipelineState &&
+            SUCCEEDED(static_cast<IUnknown*>(*ppPipelineState)
+                          ->QueryInterface(IID_PPV_ARGS(pipelineState.ReleaseAndGetAddressOf())))) {
+            assert(g_InjectionManager);
+            g_InjectionManager->OnCreatePipelineState(PixelShader, pipelineState.Get());
+        }
+    }
+
+    // The pixel shader of a pipeline state stream, or an empty bytecode if there is none.
+    D3D12_SHADER_BYTECODE GetPixelShader(const D3D12_PIPELINE_STATE_STREAM_DESC& Desc) {
+        struct PixelShaderParser : ID3DX12PipelineParserCallbacks {
+            void PSCb(const D3D12_SHADER_BYTECODE& Shader) override {
+                PixelShader = Shader;
+            }
+
+            D3D12_SHADER_BYTECODE PixelShader{};
+        } parser;
+        if (FAILED(D3DX12ParsePipelineStream(Desc, &parser))) {
+            return {};
+        }
+        return parser.PixelShader;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            ID3D12Device_CreateGraphicsPipelineState,
+                            ID3D12Device* pDevice,
+                            const D3D12_GRAPHICS_PIPELINE_STATE_DESC* pDesc,
+                            REFIID riid,
+                            void** ppPipelineState) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(local, "ID3D12Device_CreateGraphicsPipelineState", TLPArg(pDevice, "Device"));
+
+        assert(original_ID3D12Device_CreateGraphicsPipelineState);
+        const HRESULT result = original_ID3D12Device_CreateGraphicsPipelineState(pDevice, pDesc, riid, ppPipelineState);
+
+        {
+            TelemetryHookTimer(CreateGraphicsPipelineState);
+            if (SUCCEEDED(result) && pDesc) {
+                OnCreatedPipelineState(pDesc->PS, ppPipelineState);
+            }
+        }
+
+        TraceDetailWriteStop(local, "ID3D12Device_CreateGraphicsPipelineState", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            ID3D12Device2_CreatePipelineState,
+                            ID3D12Device2* pDevice,
+                            const D3D12_PIPELINE_STATE_STREAM_DESC* pDesc,
+                            REFIID riid,
+                            void** ppPipelineState) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(local, "ID3D12Device2_CreatePipelineState", TLPArg(pDevice, "Device"));
+
+        assert(original_ID3D12Device2_CreatePipelineState);
+        const HRESULT result = original_ID3D12Device2_CreatePipelineState(pDevice, pDesc, riid, ppPipelineState);
+
+        {
+            TelemetryHookTimer(CreatePipelineState);
+            if (SUCCEEDED(result) && pDesc) {
+                OnCreatedPipelineState(GetPixelShader(*pDesc), ppPipelineState);
+            }
+        }
+
+        TraceDetailWriteStop(local, "ID3D12Device2_CreatePipelineState", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            ID3D12PipelineLibrary_LoadGraphicsPipeline,
+                            ID3D12PipelineLibrary* pPipelineLibrary,
+                            LPCWSTR pName,
+                            const D3D12_GRAPHICS_PIPELINE_STATE_DESC* pDesc,
+                            REFIID riid,
+                            void** ppPipelineState) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(
+            local, "ID3D12PipelineLibrary_LoadGraphicsPipeline", TLPArg(pPipelineLibrary, "PipelineLibrary"));
+
+        assert(original_ID3D12PipelineLibrary_LoadGraphicsPipeline);
+        const HRESULT result =
+            original_ID3D12PipelineLibrary_LoadGraphicsPipeline(pPipelineLibrary, pName, pDesc, riid, ppPipelineState);
+
+        {
+            TelemetryHookTimer(LoadPipeline);
+            if (SUCCEEDED(result) && pDesc) {
+                OnCreatedPipelineState(pDesc->PS, ppPipelineState);
+            }
+        }
+
+        TraceDetailWriteStop(local, "ID3D12PipelineLibrary_LoadGraphicsPipeline", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            ID3D12PipelineLibrary1_LoadPipeline,
+                            ID3D12PipelineLibrary1* pPipelineLibrary,
+                            LPCWSTR pName,
+                            const D3D12_PIPELINE_STATE_STREAM_DESC* pDesc,
+                            REFIID riid,
+                            void** ppPipelineState) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(
+            local, "ID3D12PipelineLibrary1_LoadPipeline", TLPArg(pPipelineLibrary, "PipelineLibrary"));
+
+        assert(original_ID3D12PipelineLibrary1_LoadPipeline);
+        const HRESULT result =
+            original_ID3D12PipelineLibrary1_LoadPipeline(pPipelineLibrary, pName, pDesc, riid, ppPipelineState);
+
+        {
+            TelemetryHookTimer(LoadPipeline);
+            if (SUCCEEDED(result) && pDesc) {
+                OnCreatedPipelineState(GetPixelShader(*pDesc), ppPipelineState);
+            }
+        }
+
+        TraceDetailWriteStop(local, "ID3D12PipelineLibrary1_LoadPipeline", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            ID3D12Device1_CreatePipelineLibrary,
+                            ID3D12Device1* pDevice,
+                            const void* pLibraryBlob,
+                            SIZE_T BlobLength,
+                            REFIID riid,
+                            void** ppPipelineLibrary) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "ID3D12Device1_CreatePipelineLibrary", TLPArg(pDevice, "Device"));
+
+        assert(original_ID3D12Device1_CreatePipelineLibrary);
+        const HRESULT result =
+            original_ID3D12Device1_CreatePipelineLibrary(pDevice, pLibraryBlob, BlobLength, riid, ppPipelineLibrary);
+
+        // Hook to the pipeline states loaded from the library, which are never created with the device.
+        ComPtr<ID3D12PipelineLibrary> pipelineLibrary;
+        if (SUCCEEDED(result) && ppPipelineLibrary && *ppPipelineLibrary &&
+            SUCCEEDED(static_cast<IUnknown*>(*ppPipelineLibrary)
+                          ->QueryInterface(IID_PPV_ARGS(pipelineLibrary.ReleaseAndGetAddressOf())))) {
+            DetourMethodAttach(pipelineLibrary.Get(),
+                               9, // LoadGraphicsPipeline()
+                               hooked_ID3D12PipelineLibrary_LoadGraphicsPipeline,
+                               original_ID3D12PipelineLibrary_LoadGraphicsPipeline);
+            ComPtr<ID3D12PipelineLibrary1> pipelineLibrary1;
+            if (SUCCEEDED(pipelineLibrary.As(&pipelineLibrary1))) {
+                DetourMethodAttach(pipelineLibrary1.Get(),
+                                   13, // LoadPipeline()
+                                   hooked_ID3D12PipelineLibrary1_LoadPipeline,
+                                   original_ID3D12PipelineLibrary1_LoadPipeline);
+            }
+        }
+
+        TraceLoggingWriteStop(local, "ID3D12Device1_CreatePipelineLibrary", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(void,
+                            STDMETHODCALLTYPE,
+                            ID3D12Device_CreateRenderTargetView,
+                            ID3D12Device* pDevice,
+                            ID3D12Resource* pResource,
+                            const D3D12_RENDER_TARGET_VIEW_DESC* pDesc,
+                            D3D12_CPU_DESCRIPTOR_HANDLE DestDescriptor) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(local,
+                              "ID3D12Device_CreateRenderTargetView",
+                              TLPArg(pDevice, "Device"),
+                              TLPArg(pResource, "Resource"),
+                              TLArg(DestDescriptor.ptr, "Descriptor"));
+
+        assert(original_ID3D12Device_CreateRenderTargetView);
+        original_ID3D12Device_CreateRenderTargetView(pDevice, pResource, pDesc, DestDescriptor);
+
+        {
+            TelemetryHookTimer(CreateRenderTargetView);
+            assert(g_InjectionManager);
+            g_InjectionManager->OnCreateRenderTargetView(pResource, pDesc, DestDescriptor);
+        }
+
+        TraceDetailWriteStop(local, "ID3D12Device_CreateRenderTargetView");
     }
 
     DECLARE_DETOUR_FUNCTION(void,
@@ -151,28 +473,31 @@ namespace {
                             ID3D12CommandQueue* pCommandQueue,
                             UINT NumCommandLists,
                             ID3D12CommandList* const* ppCommandLists) {
-        TraceLocalActivity(local);
-        TraceLoggingWriteStart(local,
-                               "ID3D12CommandQueue_ExecuteCommandLists",
-                               TLPArg(pCommandQueue, "CommandQueue"),
-                               TLArg(NumCommandLists, "NumCommandLists"));
-
-        if (IsTraceEnabled() && ppCommandLists) {
+        TraceDetailActivity(local);
+        TraceDetailWriteStart(local,
+                              "ID3D12CommandQueue_ExecuteCommandLists",
+                              TLPArg(pCommandQueue, "CommandQueue"),
+                              TLArg(NumCommandLists, "NumCommandLists"));
+        TraceCount(ExecuteCommandLists);
+
+        if (IsTraceDetailEnabled() && ppCommandLists) {
             for (UINT i = 0; i < NumCommandLists; i++) {
-                TraceLoggingWriteTagged(
+                TraceDetailWriteTagged(
                     local, "ID3D12CommandQueue_ExecuteCommandLists", TLPArg(ppCommandLists[i], "pCommandList"));
             }
         }
 
         // Invoke the hook before the real execution, in order to inject Wait() commands if needed.
-        assert(g_InjectionManager);
-        std::vector<ID3D12CommandList*> commandLists(ppCommandLists, ppCommandLists + NumCommandLists);
-        g_InjectionManager->OnExecuteCommandLists(pCommandQueue, commandLists);
+        {
+            TelemetryHookTimer(ExecuteCommandLists);
+            assert(g_InjectionManager);
+            g_InjectionManager->OnExecuteCommandLists(pCommandQueue, NumCommandLists, ppCommandLists);
+        }
 
         assert(original_ID3D12CommandQueue_ExecuteCommandLists);
         original_ID3D12CommandQueue_ExecuteCommandLists(pCommandQueue, NumCommandLists, ppCommandLists);
 
-        TraceLoggingWriteStop(local, "ID3D12CommandQueue_ExecuteCommandLists");
+        TraceDetailWriteStop(local, "ID3D12CommandQueue_ExecuteCommandLists");
     }
 
     DECLARE_DETOUR_FUNCTION(
@@ -184,9 +509,16 @@ namespace {
                                TLArg(SyncInterval, "SyncInterval"),
                                TLArg(Flags, "Flags"));
 
+        // Close the counters of the frame that is ending.
+        Tracing::TraceFrameCounters();
+
         // Invoke the hook prior to presenting, in case we wish to enqueue more work before any v-sync.
-        assert(g_InjectionManager);
-        g_InjectionManager->OnFramePresent(pSwapChain);
+        {
+            TelemetryHookTimer(Present);
+            assert(g_InjectionManager);
+            g_InjectionManager->OnFramePresent(pSwapChain);
+        }
+        Telemetry::PublishFrame();
 
         assert(original_IDXGISwapChain_Present);
         const HRESULT result = original_IDXGISwapChain_Present(pSwapChain, SyncInterval, Flags);
@@ -196,77 +528,458 @@ namespace {
         return result;
     }
 
+    // The objects below are created rarely, so we hook the objects they create every time: the first of each kind
+    // patches the methods, and the next ones return immediately from DetourMethodAttach().
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            ID3D12Device_CreateCommandQueue,
+                            ID3D12Device* pDevice,
+                            const D3D12_COMMAND_QUEUE_DESC* pDesc,
+                            REFIID riid,
+                            void** ppCommandQueue) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "ID3D12Device_CreateCommandQueue", TLPArg(pDevice, "Device"));
+
+        assert(original_ID3D12Device_CreateCommandQueue);
+        const HRESULT result = original_ID3D12Device_CreateCommandQueue(pDevice, pDesc, riid, ppCommandQueue);
+
+        ComPtr<ID3D12CommandQueue> commandQueue;
+        if (SUCCEEDED(result) && ppCommandQueue && *ppCommandQueue &&
+            SUCCEEDED(static_cast<IUnknown*>(*ppCommandQueue)
+                          ->QueryInterface(IID_PPV_ARGS(commandQueue.ReleaseAndGetAddressOf())))) {
+            Injector::HookCommandQueue(commandQueue.Get());
+        }
+
+        TraceLoggingWriteStop(local, "ID3D12Device_CreateCommandQueue", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    void HookCreatedCommandList(D3D12_COMMAND_LIST_TYPE Type, void** ppCommandList) {
+        // We only inject into direct command lists.
+        ComPtr<ID3D12GraphicsCommandList> commandList;
+        if (Type == D3D12_COMMAND_LIST_TYPE_DIRECT && ppCommandList && *ppCommandList &&
+            SUCCEEDED(static_cast<IUnknown*>(*ppCommandList)
+                          ->QueryInterface(IID_PPV_ARGS(commandList.ReleaseAndGetAddressOf())))) {
+            Injector::HookCommandList(commandList.Get());
+        }
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            ID3D12Device_CreateCommandList,
+                            ID3D12Device* pDevice,
+                            UINT NodeMask,
+                            D3D12_COMMAND_LIST_TYPE Type,
+                            ID3D12CommandAllocator* pCommandAllocator,
+                            ID3D12PipelineState* pInitialState,
+                            REFIID riid,
+                            void** ppCommandList) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(
+            local, "ID3D12Device_CreateCommandList", TLPArg(pDevice, "Device"), TLArg((int)Type, "Type"));
+
+        assert(original_ID3D12Device_CreateCommandList);
+        const HRESULT result = original_ID3D12Device_CreateCommandList(
+            pDevice, NodeMask, Type, pCommandAllocator, pInitialState, riid, ppCommandList);
+
+        if (SUCCEEDED(result)) {
+            HookCreatedCommandList(Type, ppCommandList);
+        }
+
+        TraceLoggingWriteStop(local, "ID3D12Device_CreateCommandList", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            ID3D12Device4_CreateCommandList1,
+                            ID3D12Device4* pDevice,
+                            UINT NodeMask,
+                            D3D12_COMMAND_LIST_TYPE Type,
+                            D3D12_COMMAND_LIST_FLAGS Flags,
+                            REFIID riid,
+                            void** ppCommandList) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(
+            local, "ID3D12Device4_CreateCommandList1", TLPArg(pDevice, "Device"), TLArg((int)Type, "Type"));
+
+        assert(original_ID3D12Device4_CreateCommandList1);
+        const HRESULT result =
+            original_ID3D12Device4_CreateCommandList1(pDevice, NodeMask, Type, Flags, riid, ppCommandList);
+
+        if (SUCCEEDED(result)) {
+            HookCreatedCommandList(Type, ppCommandList);
+        }
+
+        TraceLoggingWriteStop(local, "ID3D12Device4_CreateCommandList1", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            WINAPI,
+                            D3D12CreateDevice,
+                            IUnknown* pAdapter,
+                            D3D_FEATURE_LEVEL MinimumFeatureLevel,
+                            REFIID riid,
+                            void** ppDevice) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "D3D12CreateDevice", TLPArg(pAdapter, "Adapter"));
+
+        assert(original_D3D12CreateDevice);
+        const HRESULT result = original_D3D12CreateDevice(pAdapter, MinimumFeatureLevel, riid, ppDevice);
+
+        // ppDevice is nullptr when the application only checks for support.
+        ComPtr<ID3D12Device> device;
+        if (SUCCEEDED(result) && ppDevice && *ppDevice &&
+            SUCCEEDED(
+                static_cast<IUnknown*>(*ppDevice)->QueryInterface(IID_PPV_ARGS(device.ReleaseAndGetAddressOf())))) {
+            Injector::HookDevice(device.Get());
+        }
+
+        TraceLoggingWriteStop(local, "D3D12CreateDevice", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    void HookCreatedSwapChain(IUnknown* pDevice, IDXGISwapChain* pSwapChain) {
+        // We only inject into Direct3D 12 swapchains, which are created from a command queue.
+        ComPtr<ID3D12CommandQueue> commandQueue;
+        if (pDevice && pSwapChain &&
+            SUCCEEDED(pDevice->QueryInterface(IID_PPV_ARGS(commandQueue.ReleaseAndGetAddressOf())))) {
+            Injector::HookSwapChain(pSwapChain);
+        }
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            IDXGIFactory_CreateSwapChain,
+                            IDXGIFactory* pFactory,
+                            IUnknown* pDevice,
+                            DXGI_SWAP_CHAIN_DESC* pDesc,
+                            IDXGISwapChain** ppSwapChain) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "IDXGIFactory_CreateSwapChain", TLPArg(pDevice, "Device"));
+
+        assert(original_IDXGIFactory_CreateSwapChain);
+        const HRESULT result = original_IDXGIFactory_CreateSwapChain(pFactory, pDevice, pDesc, ppSwapChain);
+
+        if (SUCCEEDED(result) && ppSwapChain) {
+            HookCreatedSwapChain(pDevice, *ppSwapChain);
+        }
+
+        TraceLoggingWriteStop(local, "IDXGIFactory_CreateSwapChain", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            IDXGIFactory2_CreateSwapChainForHwnd,
+                            IDXGIFactory2* pFactory,
+                            IUnknown* pDevice,
+                            HWND hWnd,
+                            const DXGI_SWAP_CHAIN_DESC1* pDesc,
+                            const DXGI_SWAP_CHAIN_FULLSCREEN_DESC* pFullscreenDesc,
+                            IDXGIOutput* pRestrictToOutput,
+                            IDXGISwapChain1** ppSwapChain) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "IDXGIFactory2_CreateSwapChainForHwnd", TLPArg(pDevice, "Device"));
+
+        assert(original_IDXGIFactory2_CreateSwapChainForHwnd);
+        const HRESULT result = original_IDXGIFactory2_CreateSwapChainForHwnd(
+            pFactory, pDevice, hWnd, pDesc, pFullscreenDesc, pRestrictToOutput, ppSwapChain);
+
+        if (SUCCEEDED(result) && ppSwapChain) {
+            HookCreatedSwapChain(pDevice, *ppSwapChain);
+        }
+
+        TraceLoggingWriteStop(local, "IDXGIFactory2_CreateSwapChainForHwnd", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            IDXGIFactory2_CreateSwapChainForCoreWindow,
+                            IDXGIFactory2* pFactory,
+                            IUnknown* pDevice,
+                            IUnknown* pWindow,
+                            const DXGI_SWAP_CHAIN_DESC1* pDesc,
+                            IDXGIOutput* pRestrictToOutput,
+                            IDXGISwapChain1** ppSwapChain) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "IDXGIFactory2_CreateSwapChainForCoreWindow", TLPArg(pDevice, "Device"));
+
+        assert(original_IDXGIFactory2_CreateSwapChainForCoreWindow);
+        const HRESULT result = original_IDXGIFactory2_CreateSwapChainForCoreWindow(
+            pFactory, pDevice, pWindow, pDesc, pRestrictToOutput, ppSwapChain);
+
+        if (SUCCEEDED(result) && ppSwapChain) {
+            HookCreatedSwapChain(pDevice, *ppSwapChain);
+        }
+
+        TraceLoggingWriteStop(local, "IDXGIFactory2_CreateSwapChainForCoreWindow", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT,
+                            STDMETHODCALLTYPE,
+                            IDXGIFactory2_CreateSwapChainForComposition,
+                            IDXGIFactory2* pFactory,
+                            IUnknown* pDevice,
+                            const DXGI_SWAP_CHAIN_DESC1* pDesc,
+                            IDXGIOutput* pRestrictToOutput,
+                            IDXGISwapChain1** ppSwapChain) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "IDXGIFactory2_CreateSwapChainForComposition", TLPArg(pDevice, "Device"));
+
+        assert(original_IDXGIFactory2_CreateSwapChainForComposition);
+        const HRESULT result = original_IDXGIFactory2_CreateSwapChainForComposition(
+            pFactory, pDevice, pDesc, pRestrictToOutput, ppSwapChain);
+
+        if (SUCCEEDED(result) && ppSwapChain) {
+            HookCreatedSwapChain(pDevice, *ppSwapChain);
+        }
+
+        TraceLoggingWriteStop(local, "IDXGIFactory2_CreateSwapChainForComposition", TLArg(result, "Result"));
+
+        return result;
+    }
+
+    void HookFactory(void** ppFactory) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "HookFactory");
+
+        CreateInjectionManagerOnce();
+
+        ComPtr<IDXGIFactory> factory;
+        if (ppFactory && *ppFactory &&
+            SUCCEEDED(
+                static_cast<IUnknown*>(*ppFactory)->QueryInterface(IID_PPV_ARGS(factory.ReleaseAndGetAddressOf())))) {
+            TraceLoggingWriteTagged(local, "HookFactory_Detour_CreateSwapChain", TLPArg(factory.Get(), "Factory"));
+            DetourMethodAttach(factory.Get(),
+                               10, // CreateSwapChain()
+                               hooked_IDXGIFactory_CreateSwapChain,
+                               original_IDXGIFactory_CreateSwapChain);
+
+            ComPtr<IDXGIFactory2> factory2;
+            if (SUCCEEDED(factory.As(&factory2))) {
+                DetourMethodAttach(factory2.Get(),
+                                   15, // CreateSwapChainForHwnd()
+                                   hooked_IDXGIFactory2_CreateSwapChainForHwnd,
+                                   original_IDXGIFactory2_CreateSwapChainForHwnd);
+                DetourMethodAttach(factory2.Get(),
+                                   16, // CreateSwapChainForCoreWindow()
+                                   hooked_IDXGIFactory2_CreateSwapChainForCoreWindow,
+                                   original_IDXGIFactory2_CreateSwapChainForCoreWindow);
+                DetourMethodAttach(factory2.Get(),
+                                   24, // CreateSwapChainForComposition()
+                                   hooked_IDXGIFactory2_CreateSwapChainForComposition,
+                                   original_IDXGIFactory2_CreateSwapChainForComposition);
+            }
+        }
+
+        TraceLoggingWriteStop(local, "HookFactory");
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT, WINAPI, CreateDXGIFactory, REFIID riid, void** ppFactory) {
+        assert(original_CreateDXGIFactory);
+        const HRESULT result = original_CreateDXGIFactory(riid, ppFactory);
+        if (SUCCEEDED(result)) {
+            HookFactory(ppFactory);
+        }
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT, WINAPI, CreateDXGIFactory1, REFIID riid, void** ppFactory) {
+        assert(original_CreateDXGIFactory1);
+        const HRESULT result = original_CreateDXGIFactory1(riid, ppFactory);
+        if (SUCCEEDED(result)) {
+            HookFactory(ppFactory);
+        }
+        return result;
+    }
+
+    DECLARE_DETOUR_FUNCTION(HRESULT, WINAPI, CreateDXGIFactory2, UINT Flags, REFIID riid, void** ppFactory) {
+        assert(original_CreateDXGIFactory2);
+        const HRESULT result = original_CreateDXGIFactory2(Flags, riid, ppFactory);
+        if (SUCCEEDED(result)) {
+            HookFactory(ppFactory);
+        }
+        return result;
+    }
+
 } // namespace
 
 namespace Injector {
 
-    void InstallHooks(std::unique_ptr<IInjectionManager> Manager) {
+    void InstallHooks(InjectionManagerFactory CreateManager) {
         TraceLocalActivity(local);
         TraceLoggingWriteStart(local, "InstallHooks");
 
-        g_InjectionManager = std::move(Manager);
+        g_CreateInjectionManager = CreateManager;
 
-        ComPtr<IDXGIFactory2> dxgiFactory;
-        CHECK_HRCMD(CreateDXGIFactory2(0, IID_PPV_ARGS(dxgiFactory.ReleaseAndGetAddressOf())));
+        // Hook to the creation of the device and the DXGI factories. We hook the methods of the objects that the
+        // application creates from them, rather than creating our own objects to find the methods up-front.
+        TraceLoggingWriteTagged(local, "InstallHooks_Detour_CreateDevice");
+        DetourFunctionAttach(&::D3D12CreateDevice, hooked_D3D12CreateDevice, original_D3D12CreateDevice);
 
-        ComPtr<IDXGIAdapter1> hardwareAdapter;
-        GetHardwareAdapter(dxgiFactory.Get(), &hardwareAdapter, true);
+        TraceLoggingWriteTagged(local, "InstallHooks_Detour_CreateFactory");
+        DetourFunctionAttach(&::CreateDXGIFactory, hooked_CreateDXGIFactory, original_CreateDXGIFactory);
+        DetourFunctionAttach(&::CreateDXGIFactory1, hooked_CreateDXGIFactory1, original_CreateDXGIFactory1);
+        DetourFunctionAttach(&::CreateDXGIFactory2, hooked_CreateDXGIFactory2, original_CreateDXGIFactory2);
 
-        // Hook to the command list's RSSetViewports(), where we will decide whether or not to inject VRS commands.
-        ComPtr<ID3D12Device> device;
-        CHECK_HRCMD(D3D12CreateDevice(
-            hardwareAdapter.Get(), D3D_FEATURE_LEVEL_12_0, IID_PPV_ARGS(device.ReleaseAndGetAddressOf())));
+        TraceLoggingWriteStop(local, "InstallHooks");
+    }
 
-        ComPtr<ID3D12CommandAllocator> commandAllocator;
-        CHECK_HRCMD(device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT,
-                                                   IID_PPV_ARGS(commandAllocator.ReleaseAndGetAddressOf())));
+    void HookDevice(ID3D12Device* pDevice) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "HookDevice", TLPArg(pDevice, "Device"));
+
+        CreateInjectionManagerOnce();
+
+        // Hook to the creation of the command lists and queues, in order to hook their methods below.
+        TraceLoggingWriteTagged(local, "HookDevice_Detour_CreateCommandList");
+        DetourMethodAttach(pDevice,
+                           12, // CreateCommandList()
+                           hooked_ID3D12Device_CreateCommandList,
+                           original_ID3D12Device_CreateCommandList);
+        ComPtr<ID3D12Device4> device4;
+        if (SUCCEEDED(pDevice->QueryInterface(IID_PPV_ARGS(device4.ReleaseAndGetAddressOf())))) {
+            DetourMethodAttach(device4.Get(),
+                               51, // CreateCommandList1()
+                               hooked_ID3D12Device4_CreateCommandList1,
+                               original_ID3D12Device4_CreateCommandList1);
+        }
+        TraceLoggingWriteTagged(local, "HookDevice_Detour_CreateCommandQueue");
+        DetourMethodAttach(pDevice,
+                           8, // CreateCommandQueue()
+                           hooked_ID3D12Device_CreateCommandQueue,
+                           original_ID3D12Device_CreateCommandQueue);
+
+        // Hook to the render target views creation, in order to know the render target of each pass.
+        TraceLoggingWriteTagged(local, "HookDevice_Detour_RenderTargets");
+        DetourMethodAttach(pDevice,
+                           20, // CreateRenderTargetView()
+                           hooked_ID3D12Device_CreateRenderTargetView,
+                           original_ID3D12Device_CreateRenderTargetView);
+
+        // Hook to the pipeline states creation, in order to apply a per-draw rate to some pipeline states.
+        TraceLoggingWriteTagged(local, "HookDevice_Detour_PipelineStates");
+        DetourMethodAttach(pDevice,
+                           10, // CreateGraphicsPipelineState()
+                           hooked_ID3D12Device_CreateGraphicsPipelineState,
+                           original_ID3D12Device_CreateGraphicsPipelineState);
+        ComPtr<ID3D12Device1> device1;
+        if (SUCCEEDED(pDevice->QueryInterface(IID_PPV_ARGS(device1.ReleaseAndGetAddressOf())))) {
+            DetourMethodAttach(device1.Get(),
+                               44, // CreatePipelineLibrary()
+                               hooked_ID3D12Device1_CreatePipelineLibrary,
+                               original_ID3D12Device1_CreatePipelineLibrary);
+        }
+        // The pipeline state streams (eg: with mesh shaders or depth bounds).
+        ComPtr<ID3D12Device2> device2;
+        if (SUCCEEDED(pDevice->QueryInterface(IID_PPV_ARGS(device2.ReleaseAndGetAddressOf())))) {
+            DetourMethodAttach(device2.Get(),
+                               47, // CreatePipelineState()
+                               hooked_ID3D12Device2_CreatePipelineState,
+                               original_ID3D12Device2_CreatePipelineState);
+        }
 
-        ComPtr<ID3D12GraphicsCommandList> commandList;
-        CHECK_HRCMD(device->CreateCommandList(0,
-                                              D3D12_COMMAND_LIST_TYPE_DIRECT,
-                                              commandAllocator.Get(),
-                                              nullptr,
-                                              IID_PPV_ARGS(commandList.ReleaseAndGetAddressOf())));
-
-        TraceLoggingWriteTagged(local, "InstallHooks_Detour_RSViewports", TLPArg(commandList.Get(), "CommandList"));
-        DetourMethodAttach(commandList.Get(),
+        TraceLoggingWriteStop(local, "HookDevice");
+    }
+
+    void HookCommandList(ID3D12GraphicsCommandList* pCommandList) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "HookCommandList", TLPArg(pCommandList, "CommandList"));
+
+        CreateInjectionManagerOnce();
+
+        // Hook to the command list's RSSetViewports(), where we will decide whether or not to inject VRS commands.
+        TraceLoggingWriteTagged(local, "HookCommandList_Detour_RSViewports");
+        DetourMethodAttach(pCommandList,
                            21, // RSSetViewports()
                            hooked_ID3D12GraphicsCommandList_RSSetViewports,
                            original_ID3D12GraphicsCommandList_RSSetViewports);
 
-        // Hook to the command queue's ExecuteCommandLists() in order to add synchronization between our command lists.
-        D3D12_COMMAND_QUEUE_DESC commandQueueDesc{};
-        commandQueueDesc.Type = D3D12_COMMAND_LIST_TYPE_DIRECT;
-        ComPtr<ID3D12CommandQueue> commandQueue;
-        CHECK_HRCMD(device->CreateCommandQueue(&commandQueueDesc, IID_PPV_ARGS(commandQueue.ReleaseAndGetAddressOf())));
+        // Hook to the command list's Reset() and ClearState(), where we invalidate our per-command list state.
+        TraceLoggingWriteTagged(local, "HookCommandList_Detour_Reset");
+        DetourMethodAttach(pCommandList,
+                           10, // Reset()
+                           hooked_ID3D12GraphicsCommandList_Reset,
+                           original_ID3D12GraphicsCommandList_Reset);
+        DetourMethodAttach(pCommandList,
+                           11, // ClearState()
+                           hooked_ID3D12GraphicsCommandList_ClearState,
+                           original_ID3D12GraphicsCommandList_ClearState);
+
+        // Hook to the render targets binding, in order to know the render target of each pass.
+        TraceLoggingWriteTagged(local, "HookCommandList_Detour_RenderTargets");
+        DetourMethodAttach(pCommandList,
+                           46, // OMSetRenderTargets()
+                           hooked_ID3D12GraphicsCommandList_OMSetRenderTargets,
+                           original_ID3D12GraphicsCommandList_OMSetRenderTargets);
+        ComPtr<ID3D12GraphicsCommandList4> commandList4;
+        if (SUCCEEDED(pCommandList->QueryInterface(IID_PPV_ARGS(commandList4.ReleaseAndGetAddressOf())))) {
+            DetourMethodAttach(commandList4.Get(),
+                               68, // BeginRenderPass()
+                               hooked_ID3D12GraphicsCommandList4_BeginRenderPass,
+                               original_ID3D12GraphicsCommandList4_BeginRenderPass);
+        }
 
-        TraceLoggingWriteTagged(
-            local, "InstallHooks_Detour_ExecuteCommandLists", TLPArg(commandQueue.Get(), "CommandQueue"));
-        DetourMethodAttach(commandQueue.Get(),
+        // Hook to the pipeline states binding, in order to apply a per-draw rate to some pipeline states.
+        TraceLoggingWriteTagged(local, "HookCommandList_Detour_PipelineStates");
+        DetourMethodAttach(pCommandList,
+                           25, // SetPipelineState()
+                           hooked_ID3D12GraphicsCommandList_SetPipelineState,
+                           original_ID3D12GraphicsCommandList_SetPipelineState);
+
+        TraceLoggingWriteStop(local, "HookCommandList");
+    }
+
+    void HookCommandQueue(ID3D12CommandQueue* pCommandQueue) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "HookCommandQueue", TLPArg(pCommandQueue, "CommandQueue"));
+
+        CreateInjectionManagerOnce();
+
+        // Hook to the command queue's ExecuteCommandLists() in order to add synchronization between our command lists.
+        DetourMethodAttach(pCommandQueue,
                            10, // ExecuteCommandLists()
                            hooked_ID3D12CommandQueue_ExecuteCommandLists,
                            original_ID3D12CommandQueue_ExecuteCommandLists);
 
+        TraceLoggingWriteStop(local, "HookCommandQueue");
+    }
+
+    void HookSwapChain(IDXGISwapChain* pSwapChain) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "HookSwapChain", TLPArg(pSwapChain, "SwapChain"));
+
+        CreateInjectionManagerOnce();
+
         // Hook to the swapchain presentation, where we will collect information on rendering.
-        DXGI_SWAP_CHAIN_DESC1 swapChainDesc{};
-        swapChainDesc.BufferCount = 2;
-        swapChainDesc.Width = 128;
-        swapChainDesc.Height = 128;
-        swapChainDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-        swapChainDesc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
-        swapChainDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
-        swapChainDesc.SampleDesc.Count = 1;
-        ComPtr<IDXGISwapChain1> dxgiSwapchain;
-        CHECK_HRCMD(dxgiFactory->CreateSwapChainForComposition(
-            commandQueue.Get(), &swapChainDesc, nullptr, dxgiSwapchain.ReleaseAndGetAddressOf()));
-
-        TraceLoggingWriteTagged(local, "InstallHooks_Detour_Preset", TLPArg(dxgiSwapchain.Get(), "DXGISwapchain"));
-        DetourMethodAttach(dxgiSwapchain.Get(),
+        DetourMethodAttach(pSwapChain,
                            8, // Present()
                            hooked_IDXGISwapChain_Present,
                            original_IDXGISwapChain_Present);
 
-        TraceLoggingWriteStop(local, "InstallHooks");
+        TraceLoggingWriteStop(local, "HookSwapChain");
+    }
+
+    void ExecuteCommandListsUnhooked(ID3D12CommandQueue* pCommandQueue,
+                                     UINT NumCommandLists,
+                                     ID3D12CommandList* const* ppCommandLists) {
+        if (original_ID3D12CommandQueue_ExecuteCommandLists) {
+            original_ID3D12CommandQueue_ExecuteCommandLists(pCommandQueue, NumCommandLists, ppCommandLists);
+        } else {
+            pCommandQueue->ExecuteCommandLists(NumCommandLists, ppCommandLists);
+        }
     }
 
 } // namespace Injector
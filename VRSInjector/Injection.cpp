@@ -25,6 +25,7 @@
 #include "Check.h"
 #include "EyeGaze.h"
 #include "Injector.h"
+#include "Settings.h"
 #include "Tracing.h"
 #include "VRS.h"
 
@@ -33,51 +34,622 @@ namespace {
     using namespace Injector;
     using namespace EyeGaze;
 
-    struct InjectionManager : IInjectionManager {
-        struct Resolution {
-            UINT Width{0};
-            UINT Height{0};
-        };
+    // {7E0B5C7A-2B8B-4E8D-9F3C-6A1D2E4B9C51}
+    constexpr GUID GUID_CommandListContext = {
+        0x7e0b5c7a, 0x2b8b, 0x4e8d, {0x9f, 0x3c, 0x6a, 0x1d, 0x2e, 0x4b, 0x9c, 0x51}};
+
+    // {5B1E8F0C-9D3A-4C62-B7E4-2F8A6D1C3E90}
+    constexpr GUID GUID_PipelineStateDrawRate = {
+        0x5b1e8f0c, 0x9d3a, 0x4c62, {0xb7, 0xe4, 0x2f, 0x8a, 0x6d, 0x1c, 0x3e, 0x90}};
+
+    struct Resolution {
+        UINT Width{0};
+        UINT Height{0};
+    };
+
+    // What we know of the render target of a pass, packed in 64 bits so that it can be read and written atomically.
+    // The special values below are for when no render target is bound, or when we do not know the render target (eg:
+    // its view was created before we installed our hooks).
+    constexpr uint64_t RenderTargetNone = 0;
+    constexpr uint64_t RenderTargetUnknown = ~0ull;
+
+    struct RenderTargetInfo {
+        UINT Width;
+        UINT Height;
+        UINT SampleCount;
+        DXGI_FORMAT Format;
+        // Whether the format and the sample count are suitable for VRS. Evaluated once when the view is created.
+        bool IsFormatEligible;
+        // Whether the view is of a back buffer of a swapchain. Evaluated when the view is bound.
+        bool IsBackBuffer;
+
+        static constexpr uint64_t kValid = 1ull << 63;
+        static constexpr uint64_t kFormatEligible = 1ull << 62;
+        static constexpr uint64_t kBackBuffer = 1ull << 61;
+
+        uint64_t Pack() const {
+            return kValid | (IsFormatEligible ? kFormatEligible : 0) | (IsBackBuffer ? kBackBuffer : 0) |
+                   (static_cast<uint64_t>(Format & 0xff) << 48) |
+                   (static_cast<uint64_t>(SampleCount & 0xff) << 40) | (static_cast<uint64_t>(Height & 0xfffff) << 20) |
+                   (Width & 0xfffff);
+        }
+
+        static RenderTargetInfo Unpack(uint64_t Value) {
+            RenderTargetInfo info{};
+            info.Width = static_cast<UINT>(Value & 0xfffff);
+            info.Height = static_cast<UINT>((Value >> 20) & 0xfffff);
+            info.SampleCount = static_cast<UINT>((Value >> 40) & 0xff);
+            info.Format = static_cast<DXGI_FORMAT>((Value >> 48) & 0xff);
+            info.IsFormatEligible = Value & kFormatEligible;
+            info.IsBackBuffer = Value & kBackBuffer;
+            return info;
+        }
+    };
+
+    // The color formats used for the scene, as opposed to integer targets (eg: IDs, visibility buffers) or one and two
+    // channel targets (eg: ambient occlusion, velocity, shadow moments).
+    bool IsSceneColorFormat(DXGI_FORMAT Format) {
+        switch (Format) {
+        case DXGI_FORMAT_R32G32B32A32_FLOAT:
+        case DXGI_FORMAT_R32G32B32_FLOAT:
+        case DXGI_FORMAT_R16G16B16A16_FLOAT:
+        case DXGI_FORMAT_R16G16B16A16_UNORM:
+        case DXGI_FORMAT_R10G10B10A2_UNORM:
+        case DXGI_FORMAT_R11G11B10_FLOAT:
+        case DXGI_FORMAT_R8G8B8A8_UNORM:
+        case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+        case DXGI_FORMAT_B8G8R8A8_UNORM:
+        case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+        case DXGI_FORMAT_B8G8R8X8_UNORM:
+        case DXGI_FORMAT_B8G8R8X8_UNORM_SRGB:
+            return true;
+        default:
+            return false;
+        }
+    }
 
-        struct RenderingContext {
-            std::unique_ptr<VRS::ICommandManager> CommandManager;
-            Resolution PresentResolution;
+    // Table of the render target views created by the application, keyed by their CPU descriptor. Lookups never block:
+    // slots are claimed with a compare-and-swap on their key and keys are never removed. When the application
+    // overwrites a descriptor, the value of its slot is replaced.
+    //
+    // The table knows the descriptors, not the resources: a view copied to another descriptor with CopyDescriptors()
+    // is unknown, and the pass is then classified from its viewports only. Descriptor heaps are recycled by the
+    // applications, so a slot whose descriptor has not been bound for a while may be claimed by a new descriptor.
+    class RenderTargetTable {
+      public:
+        void Insert(SIZE_T Descriptor, uint64_t Value, ID3D12Resource* Resource) {
+            const uint32_t frame = m_Frame.load(std::memory_order_relaxed);
+            const size_t start = Hash(Descriptor);
+            Slot* oldest = nullptr;
+            for (size_t i = 0; i < kMaxProbes; i++) {
+                Slot& slot = m_Slots[(start + i) & (kCapacity - 1)];
+                SIZE_T current = slot.Key.load(std::memory_order_acquire);
+                if (!current && slot.Key.compare_exchange_strong(current, Descriptor, std::memory_order_acq_rel)) {
+                    current = Descriptor;
+                }
+                if (current == Descriptor) {
+                    Store(slot, Value, Resource, frame);
+                    return;
+                }
+                if (!oldest || frame - slot.LastUsedFrame.load(std::memory_order_relaxed) >
+                                   frame - oldest->LastUsedFrame.load(std::memory_order_relaxed)) {
+                    oldest = &slot;
+                }
+            }
+
+            // Reclaim the slot of the descriptor that was bound the least recently, if it is stale. A reader that
+            // matched the previous descriptor just before may see the new value, which is harmless since the previous
+            // descriptor is no longer in use.
+            SIZE_T current = oldest->Key.load(std::memory_order_acquire);
+            if (frame - oldest->LastUsedFrame.load(std::memory_order_relaxed) >= kMaxAge) {
+                oldest->Value.store(RenderTargetUnknown, std::memory_order_release);
+                if (oldest->Key.compare_exchange_strong(current, Descriptor, std::memory_order_acq_rel)) {
+                    Store(*oldest, Value, Resource, frame);
+                    return;
+                }
+            }
+
+            // The table is full. This render target will be unknown.
+        }
+
+        uint64_t Find(SIZE_T Descriptor, ID3D12Resource*& Resource) {
+            Resource = nullptr;
+            const size_t start = Hash(Descriptor);
+            for (size_t i = 0; i < kMaxProbes; i++) {
+                Slot& slot = m_Slots[(start + i) & (kCapacity - 1)];
+                const SIZE_T current = slot.Key.load(std::memory_order_acquire);
+                if (current == Descriptor) {
+                    // Only write the shared cache line once per frame.
+                    const uint32_t frame = m_Frame.load(std::memory_order_relaxed);
+                    if (slot.LastUsedFrame.load(std::memory_order_relaxed) != frame) {
+                        slot.LastUsedFrame.store(frame, std::memory_order_relaxed);
+                    }
+                    Resource = slot.Resource.load(std::memory_order_acquire);
+                    return slot.Value.load(std::memory_order_acquire);
+                }
+                if (!current) {
+                    // Keys are never removed, so the probe sequence ends on the first empty slot.
+                    break;
+                }
+            }
+            return RenderTargetUnknown;
+        }
+
+        void NextFrame() {
+            m_Frame.fetch_add(1, std::memory_order_relaxed);
+        }
+
+      private:
+        static constexpr size_t kCapacity = 16384; // Must be a power of 2.
+        static constexpr size_t kMaxProbes = 32;
+        // In frames.
+        static constexpr uint32_t kMaxAge = 300;
+
+        struct Slot {
+            std::atomic<SIZE_T> Key{0};
+            // Until the value is written, a reader that found the key sees an unknown render target.
+            std::atomic<uint64_t> Value{RenderTargetUnknown};
+            // Only used to recognize the back buffers, never dereferenced.
+            std::atomic<ID3D12Resource*> Resource{nullptr};
+            std::atomic<uint32_t> LastUsedFrame{0};
         };
 
-        void OnSetViewports(ID3D12CommandList* pCommandList, const D3D12_VIEWPORT& Viewport) override {
-            TraceLocalActivity(local);
-            TraceLoggingWriteStart(local, "OnSetViewports", TLPArg(pCommandList, "CommandList"));
+        static void Store(Slot& Slot, uint64_t Value, ID3D12Resource* Resource, uint32_t Frame) {
+            Slot.LastUsedFrame.store(Frame, std::memory_order_relaxed);
+            Slot.Resource.store(Resource, std::memory_order_release);
+            Slot.Value.store(Value, std::memory_order_release);
+        }
 
-            ComPtr<ID3D12Device> device;
-            CHECK_HRCMD(pCommandList->GetDevice(IID_PPV_ARGS(device.ReleaseAndGetAddressOf())));
+        static size_t Hash(SIZE_T Key) {
+            // Fibonacci hashing, ignoring the low bits that are always 0 due to the descriptor size.
+            return static_cast<size_t>(((static_cast<uint64_t>(Key) >> 5) * 0x9E3779B97F4A7C15ull) >> 32);
+        }
+
+        std::atomic<uint32_t> m_Frame{0};
+        Slot m_Slots[kCapacity];
+    };
+
+    // Insert-only table of the pipeline states matching a rule, so that most calls to SetPipelineState() only cost a
+    // lookup. Pipeline states are never removed: when one is destroyed, another one may reuse its address, and the
+    // private data of the pipeline state remains the reference for the hits.
+    class PipelineStateTable {
+      public:
+        bool Insert(ID3D12PipelineState* PipelineState) {
+            const uintptr_t key = reinterpret_cast<uintptr_t>(PipelineState);
+            const size_t start = Hash(key);
+            for (size_t i = 0; i < kMaxProbes; i++) {
+                std::atomic<uintptr_t>& slot = m_Slots[(start + i) & (kCapacity - 1)];
+                uintptr_t current = slot.load(std::memory_order_acquire);
+                if (!current && slot.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+                    return true;
+                }
+                if (current == key) {
+                    return true;
+                }
+            }
+
+            // The table is full.
+            return false;
+        }
+
+        bool Contains(ID3D12PipelineState* PipelineState) const {
+            const uintptr_t key = reinterpret_cast<uintptr_t>(PipelineState);
+            const size_t start = Hash(key);
+            for (size_t i = 0; i < kMaxProbes; i++) {
+                const uintptr_t current = m_Slots[(start + i) & (kCapacity - 1)].load(std::memory_order_acquire);
+                if (current == key) {
+                    return true;
+                }
+                if (!current) {
+                    // Keys are never removed, so the probe sequence ends on the first empty slot.
+                    break;
+                }
+            }
+            return false;
+        }
+
+      private:
+        static constexpr size_t kCapacity = 4096; // Must be a power of 2.
+        static constexpr size_t kMaxProbes = 32;
+
+        static size_t Hash(uintptr_t Key) {
+            // Fibonacci hashing, ignoring the low bits that are always 0 due to alignment.
+            return static_cast<size_t>(((static_cast<uint64_t>(Key) >> 4) * 0x9E3779B97F4A7C15ull) >> 32);
+        }
+
+        std::atomic<uintptr_t> m_Slots[kCapacity]{};
+    };
+
+    // Identify a shader across runs of the application. DXBC and DXIL containers embed an MD5 digest of their
+    // contents, which we use when present. Otherwise we hash the bytecode ourselves.
+    std::string GetShaderHash(const D3D12_SHADER_BYTECODE& Shader) {
+        const uint8_t* const bytes = static_cast<const uint8_t*>(Shader.pShaderBytecode);
+        if (!bytes || !Shader.BytecodeLength) {
+            return {};
+        }
+
+        uint8_t digest[16]{};
+        if (Shader.BytecodeLength >= 20 && !memcmp(bytes, "DXBC", 4)) {
+            memcpy(digest, bytes + 4, sizeof(digest));
+        }
+        if (std::all_of(std::begin(digest), std::end(digest), [](uint8_t b) { return !b; })) {
+            // FNV-1a.
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for (size_t i = 0; i < Shader.BytecodeLength; i++) {
+                hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+            }
+            memcpy(digest, &hash, sizeof(hash));
+        }
+
+        std::string hash;
+        for (const uint8_t b : digest) {
+            hash += fmt::format("{:02x}", b);
+        }
+        return hash;
+    }
+
+    // The VRS command manager of a device, and the resolution of its swapchain. Shared with the command lists of the
+    // device, so that they never outlive it.
+    struct RenderingContext {
+        std::unique_ptr<VRS::ICommandManager> CommandManager;
+        // Protected by the contexts lock of the injection manager.
+        Resolution PresentResolution;
+    };
+
+    // State attached to each application command list, in order to avoid redundant work upon every RSSetViewports().
+    // A command list can only be recorded from one thread at a time, therefore this state does not need a lock.
+    struct CommandListContext : IUnknown {
+        std::shared_ptr<RenderingContext> Rendering;
+        // The version of the contexts of the injection manager when Rendering was looked up.
+        uint64_t RenderingVersion{0};
+        VRS::CommandListState State;
+
+        // The render target currently bound, see RenderTargetInfo.
+        uint64_t RenderTarget{RenderTargetUnknown};
+
+        // The last viewports we processed, and the conditions under which we processed them.
+        bool HasLastViewport{false};
+        UINT LastNumViewports{0};
+        D3D12_VIEWPORT LastViewports[VRS::MaxFoveae]{};
+        uint64_t LastGeneration{0};
+        bool LastEnabled{false};
+        uint64_t LastRenderTarget{RenderTargetUnknown};
+
+        void Reset() {
+            State.IsEnabled = false;
+            State.ShadingRateImage = nullptr;
+            State.DrawRate = State.RecordedDrawRate = D3D12_SHADING_RATE_1X1;
+            RenderTarget = RenderTargetNone;
+            HasLastViewport = false;
+        }
+
+        HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override {
+            if (!ppvObject) {
+                return E_POINTER;
+            }
+            if (riid == __uuidof(IUnknown)) {
+                AddRef();
+                *ppvObject = static_cast<IUnknown*>(this);
+                return S_OK;
+            }
+            *ppvObject = nullptr;
+            return E_NOINTERFACE;
+        }
+
+        ULONG STDMETHODCALLTYPE AddRef() override {
+            return ++m_RefCount;
+        }
+
+        ULONG STDMETHODCALLTYPE Release() override {
+            const ULONG refCount = --m_RefCount;
+            if (!refCount) {
+                delete this;
+            }
+            return refCount;
+        }
+
+      private:
+        virtual ~CommandListContext() = default;
+
+        std::atomic<ULONG> m_RefCount{1};
+    };
+
+    ComPtr<CommandListContext> GetCommandListContext(ID3D12CommandList* pCommandList) {
+        ComPtr<IUnknown> unknown;
+        UINT dataSize = sizeof(IUnknown*);
+        if (FAILED(pCommandList->GetPrivateData(
+                GUID_CommandListContext, &dataSize, reinterpret_cast<void*>(unknown.GetAddressOf()))) ||
+            !unknown) {
+            return {};
+        }
+
+        // We are the only ones using this GUID, so the interface is always our own object.
+        return static_cast<CommandListContext*>(unknown.Get());
+    }
+
+    ComPtr<CommandListContext> AttachCommandListContext(ID3D12CommandList* pCommandList) {
+        ComPtr<CommandListContext> commandListContext;
+        commandListContext.Attach(new CommandListContext);
+        ComPtr<ID3D12GraphicsCommandList5> vrsCommandList;
+        commandListContext->State.IsVrsCommandList =
+            SUCCEEDED(pCommandList->QueryInterface(IID_PPV_ARGS(vrsCommandList.ReleaseAndGetAddressOf())));
+        CHECK_HRCMD(pCommandList->SetPrivateDataInterface(GUID_CommandListContext, commandListContext.Get()));
+        return commandListContext;
+    }
+
+    struct InjectionManager : IInjectionManager {
+        InjectionManager() : m_SettingsManager(Settings::CreateSettingsManager()) {
+            ApplySettings(m_SettingsManager->GetSettings());
+        }
+
+        void OnSetViewports(ID3D12CommandList* pCommandList,
+                            UINT NumViewports,
+                            const D3D12_VIEWPORT* pViewports) override {
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(local, "OnSetViewports", TLPArg(pCommandList, "CommandList"));
+
+            // We only consider the viewports that can have their own fovea. The shading rate map does not cover the
+            // other ones, which are shaded at 1x1 beyond its bounds.
+            if (pViewports && NumViewports > VRS::MaxFoveae) {
+                TraceDetailWriteTagged(local, "OnSetViewports_TooManyViewports", TLArg(NumViewports, "NumViewports"));
+            }
+            NumViewports = pViewports ? std::min(NumViewports, static_cast<UINT>(VRS::MaxFoveae)) : 0;
+
+            ComPtr<CommandListContext> commandListContext = GetCommandListContext(pCommandList);
+
+            // Engines will set the same viewport many times within the same command list. If nothing has changed since
+            // the last time, the command list is already in the desired state.
+            if (commandListContext && commandListContext->Rendering &&
+                commandListContext->RenderingVersion == m_ContextsVersion.load(std::memory_order_acquire) &&
+                commandListContext->HasLastViewport && commandListContext->LastEnabled == m_Enabled &&
+                commandListContext->LastGeneration ==
+                    commandListContext->Rendering->CommandManager->GetCurrentGeneration() &&
+                commandListContext->LastRenderTarget == commandListContext->RenderTarget &&
+                commandListContext->LastNumViewports == NumViewports &&
+                (!NumViewports ||
+                 !memcmp(commandListContext->LastViewports, pViewports, NumViewports * sizeof(D3D12_VIEWPORT)))) {
+                TraceCount(SameViewport);
+                TraceDetailWriteStop(local, "OnSetViewports", TLArg(true, "SameViewport"));
+                return;
+            }
 
             std::shared_lock lock(m_ContextsMutex);
 
-            auto it = m_Contexts.find(device.Get());
-            if (it != m_Contexts.end()) {
-                VRS::ICommandManager* const commandManager = it->second.CommandManager.get();
-                const Resolution& presentResolution = it->second.PresentResolution;
-
-                if (IsViewportEligible(presentResolution, Viewport)) {
-                    // Update the eye gaze input as late as possible.
-                    if (m_EyeGazeManager && !m_GazeUpdatedThisFrame) {
-                        m_EyeGazeManager->Update();
-                        m_GazeUpdatedThisFrame = true;
-                    }
+            // Look up the rendering context again if the contexts changed (eg: a device was replaced).
+            const uint64_t contextsVersion = m_ContextsVersion.load(std::memory_order_acquire);
+            if (!commandListContext || !commandListContext->Rendering ||
+                commandListContext->RenderingVersion != contextsVersion) {
+                ComPtr<ID3D12Device> device;
+                CHECK_HRCMD(pCommandList->GetDevice(IID_PPV_ARGS(device.ReleaseAndGetAddressOf())));
 
-                    commandManager->Enable(pCommandList, Viewport, m_EyeGazeManager.get());
-                } else {
-                    commandManager->Disable(pCommandList);
+                auto it = m_Contexts.find(device.Get());
+                if (it == m_Contexts.end()) {
+                    // We have not seen this device present yet.
+                    TraceDetailWriteStop(local, "OnSetViewports", TLArg(false, "HasContext"));
+                    return;
                 }
+
+                if (!commandListContext) {
+                    commandListContext = AttachCommandListContext(pCommandList);
+                }
+                commandListContext->Rendering = it->second;
+                commandListContext->RenderingVersion = contextsVersion;
+            }
+
+            VRS::ICommandManager* const commandManager = commandListContext->Rendering->CommandManager.get();
+            commandListContext->LastGeneration = commandManager->GetCurrentGeneration();
+            commandListContext->LastEnabled = m_Enabled;
+            commandListContext->LastRenderTarget = commandListContext->RenderTarget;
+            commandListContext->LastNumViewports = NumViewports;
+            std::copy_n(pViewports, NumViewports, commandListContext->LastViewports);
+            commandListContext->HasLastViewport = true;
+
+            if (IsPassEligible(commandListContext->Rendering->PresentResolution,
+                               commandListContext->RenderTarget,
+                               NumViewports,
+                               pViewports)) {
+                commandManager->Enable(
+                    pCommandList, commandListContext->State, NumViewports, pViewports, m_EyeGazeManager.get());
+            } else {
+                commandManager->Disable(pCommandList, commandListContext->State);
             }
 
-            TraceLoggingWriteStop(local, "OnSetViewports");
+            TraceDetailWriteStop(local, "OnSetViewports");
+        }
+
+        void OnResetCommandList(ID3D12CommandList* pCommandList) override {
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(local, "OnResetCommandList", TLPArg(pCommandList, "CommandList"));
+
+            // The VRS state of the command list is back to its defaults.
+            ComPtr<CommandListContext> commandListContext = GetCommandListContext(pCommandList);
+            if (commandListContext) {
+                commandListContext->Reset();
+            }
+
+            TraceDetailWriteStop(local, "OnResetCommandList");
+        }
+
+        void OnCreateRenderTargetView(ID3D12Resource* pResource,
+                                      const D3D12_RENDER_TARGET_VIEW_DESC* pDesc,
+                                      D3D12_CPU_DESCRIPTOR_HANDLE DestDescriptor) override {
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(local, "OnCreateRenderTargetView", TLArg(DestDescriptor.ptr, "Descriptor"));
+
+            uint64_t renderTarget = RenderTargetNone;
+            if (pResource) {
+                const D3D12_RESOURCE_DESC resourceDesc = pResource->GetDesc();
+
+                RenderTargetInfo info{};
+                info.Format = pDesc && pDesc->Format != DXGI_FORMAT_UNKNOWN ? pDesc->Format : resourceDesc.Format;
+                info.SampleCount = resourceDesc.SampleDesc.Count;
+
+                // Only 2D views can use a shading rate image.
+                const D3D12_RTV_DIMENSION viewDimension = pDesc ? pDesc->ViewDimension
+                                                          : resourceDesc.SampleDesc.Count > 1
+                                                              ? D3D12_RTV_DIMENSION_TEXTURE2DMS
+                                                              : D3D12_RTV_DIMENSION_TEXTURE2D;
+                UINT mipSlice = 0;
+                bool is2D = false;
+                switch (viewDimension) {
+                case D3D12_RTV_DIMENSION_TEXTURE2D:
+                    mipSlice = pDesc ? pDesc->Texture2D.MipSlice : 0;
+                    is2D = true;
+                    break;
+                case D3D12_RTV_DIMENSION_TEXTURE2DARRAY:
+                    mipSlice = pDesc->Texture2DArray.MipSlice;
+                    is2D = true;
+                    break;
+                case D3D12_RTV_DIMENSION_TEXTURE2DMS:
+                case D3D12_RTV_DIMENSION_TEXTURE2DMSARRAY:
+                    is2D = true;
+                    break;
+                default:
+                    break;
+                }
+                info.Width = std::max(static_cast<UINT>(resourceDesc.Width >> mipSlice), 1u);
+                info.Height = std::max(resourceDesc.Height >> mipSlice, 1u);
+
+                // VRS Tier 2 supports MSAA, but beyond 4x most coarse rates are not available.
+                info.IsFormatEligible = is2D && IsSceneColorFormat(info.Format) && info.SampleCount <= 4;
+                renderTarget = info.Pack();
+
+                TraceDetailWriteTagged(local,
+                                       "OnCreateRenderTargetView",
+                                       TLArg(info.Width, "Width"),
+                                       TLArg(info.Height, "Height"),
+                                       TLArg((UINT)info.Format, "Format"),
+                                       TLArg(info.SampleCount, "SampleCount"),
+                                       TLArg(info.IsFormatEligible, "IsFormatEligible"));
+            }
+            m_RenderTargets.Insert(DestDescriptor.ptr, renderTarget, pResource);
+
+            TraceDetailWriteStop(local, "OnCreateRenderTargetView");
+        }
+
+        void OnSetRenderTarget(ID3D12CommandList* pCommandList,
+                               const D3D12_CPU_DESCRIPTOR_HANDLE* pRenderTarget) override {
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(local, "OnSetRenderTarget", TLPArg(pCommandList, "CommandList"));
+
+            uint64_t renderTarget = RenderTargetNone;
+            if (pRenderTarget) {
+                ID3D12Resource* resource;
+                renderTarget = m_RenderTargets.Find(pRenderTarget->ptr, resource);
+                if (renderTarget != RenderTargetUnknown && renderTarget != RenderTargetNone && IsBackBuffer(resource)) {
+                    renderTarget |= RenderTargetInfo::kBackBuffer;
+                }
+            }
+
+            ComPtr<CommandListContext> commandListContext = GetCommandListContext(pCommandList);
+            if (!commandListContext) {
+                commandListContext = AttachCommandListContext(pCommandList);
+            }
+            if (commandListContext->RenderTarget == renderTarget) {
+                TraceDetailWriteStop(local, "OnSetRenderTarget", TLArg(true, "SameRenderTarget"));
+                return;
+            }
+            commandListContext->RenderTarget = renderTarget;
+
+            // Engines may set the viewports before the render targets. Re-evaluate them for the new render target.
+            if (commandListContext->HasLastViewport) {
+                D3D12_VIEWPORT viewports[VRS::MaxFoveae];
+                const UINT numViewports = commandListContext->LastNumViewports;
+                std::copy_n(commandListContext->LastViewports, numViewports, viewports);
+                OnSetViewports(pCommandList, numViewports, viewports);
+            }
+
+            TraceDetailWriteStop(local, "OnSetRenderTarget");
+        }
+
+        void OnCreatePipelineState(const D3D12_SHADER_BYTECODE& PixelShader,
+                                   ID3D12PipelineState* pPipelineState) override {
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(local, "OnCreatePipelineState", TLPArg(pPipelineState, "PipelineState"));
+
+            // The pipeline states may be created from any thread, while the rules are reloaded.
+            const std::shared_ptr<const PipelineStateRules> rules = std::atomic_load(&m_PipelineStateRules);
+            if (!PixelShader.pShaderBytecode || (rules->empty() && !IsTraceDetailEnabled())) {
+                TraceDetailWriteStop(local, "OnCreatePipelineState");
+                return;
+            }
+
+            // The hash is traced so that the rules can be written from a capture of the application.
+            const std::string hash = GetShaderHash(PixelShader);
+            TraceDetailWriteTagged(local, "OnCreatePipelineState", TLArg(hash.c_str(), "PixelShaderHash"));
+
+            auto it = rules->find(hash);
+            if (it != rules->end()) {
+                const D3D12_SHADING_RATE rate = it->second;
+                CHECK_HRCMD(pPipelineState->SetPrivateData(GUID_PipelineStateDrawRate, sizeof(rate), &rate));
+                if (!m_RatedPipelineStates.Insert(pPipelineState)) {
+                    // Fall back to querying the private data of every pipeline state.
+                    m_IsRatedPipelineStatesFull = true;
+                }
+                m_HasRatedPipelineStates = true;
+                TraceDetailWriteTagged(local, "OnCreatePipelineState_Match", TLArg((UINT)rate, "Rate"));
+            }
+
+            TraceDetailWriteStop(local, "OnCreatePipelineState");
+        }
+
+        void OnSetPipelineState(ID3D12CommandList* pCommandList, ID3D12PipelineState* pPipelineState) override {
+            // Until a pipeline state matches a rule, every pipeline state draws at 1X1.
+            if (!m_HasRatedPipelineStates.load(std::memory_order_relaxed)) {
+                return;
+            }
+
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(local,
+                                  "OnSetPipelineState",
+                                  TLPArg(pCommandList, "CommandList"),
+                                  TLPArg(pPipelineState, "PipelineState"));
+
+            // Only the pipeline states that matched a rule have a private data.
+            D3D12_SHADING_RATE rate = D3D12_SHADING_RATE_1X1;
+            UINT dataSize = sizeof(rate);
+            if (!pPipelineState ||
+                (!m_IsRatedPipelineStatesFull.load(std::memory_order_relaxed) &&
+                 !m_RatedPipelineStates.Contains(pPipelineState)) ||
+                FAILED(pPipelineState->GetPrivateData(GUID_PipelineStateDrawRate, &dataSize, &rate))) {
+                rate = D3D12_SHADING_RATE_1X1;
+            }
+
+            ComPtr<CommandListContext> commandListContext = GetCommandListContext(pCommandList);
+            if (!commandListContext) {
+                if (rate == D3D12_SHADING_RATE_1X1) {
+                    TraceDetailWriteStop(local, "OnSetPipelineState", TLArg(true, "SameRate"));
+                    return;
+                }
+                commandListContext = AttachCommandListContext(pCommandList);
+            }
+            if (commandListContext->State.DrawRate == rate) {
+                TraceDetailWriteStop(local, "OnSetPipelineState", TLArg(true, "SameRate"));
+                return;
+            }
+
+            if (commandListContext->Rendering) {
+                commandListContext->Rendering->CommandManager->SetDrawRate(
+                    pCommandList, commandListContext->State, rate);
+            } else {
+                // The rate will be recorded when VRS is enabled on the command list.
+                commandListContext->State.DrawRate = rate;
+            }
+
+            TraceDetailWriteStop(local, "OnSetPipelineState", TLArg((UINT)rate, "Rate"));
         }
 
         void OnExecuteCommandLists(ID3D12CommandQueue* pCommandQueue,
-                                   const std::vector<ID3D12CommandList*>& CommandLists) override {
-            TraceLocalActivity(local);
-            TraceLoggingWriteStart(local, "OnExecuteCommandLists", TLPArg(pCommandQueue, "CommandQueue"));
+                                   UINT NumCommandLists,
+                                   ID3D12CommandList* const* ppCommandLists) override {
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(local, "OnExecuteCommandLists", TLPArg(pCommandQueue, "CommandQueue"));
+
+            // Most submissions do not need any synchronization. Skip the device lookup entirely for those.
+            if (!VRS::HasPendingDependencies() && !VRS::HasPendingFrameStart()) {
+                TraceDetailWriteStop(local, "OnExecuteCommandLists", TLArg(false, "HasPendingDependencies"));
+                return;
+            }
 
             ComPtr<ID3D12Device> device;
             CHECK_HRCMD(pCommandQueue->GetDevice(IID_PPV_ARGS(device.ReleaseAndGetAddressOf())));
@@ -86,18 +658,33 @@ namespace {
 
             auto it = m_Contexts.find(device.Get());
             if (it != m_Contexts.end()) {
-                VRS::ICommandManager* const commandManager = it->second.CommandManager.get();
+                VRS::ICommandManager* const commandManager = it->second->CommandManager.get();
 
-                commandManager->SyncQueue(pCommandQueue, CommandLists);
+                commandManager->SyncQueue(pCommandQueue, NumCommandLists, ppCommandLists);
             }
 
-            TraceLoggingWriteStop(local, "OnExecuteCommandLists");
+            TraceDetailWriteStop(local, "OnExecuteCommandLists");
         }
 
         void OnFramePresent(IDXGISwapChain* pSwapChain) override {
             TraceLocalActivity(local);
             TraceLoggingWriteStart(local, "OnFramePresent", TLPArg(pSwapChain, "SwapChain"));
 
+            // Apply the settings of the profile if it was edited, before anything uses them for the next frame.
+            if (std::shared_ptr<const Settings::TitleSettings> settings = m_SettingsManager->PollUpdatedSettings()) {
+                std::unique_lock lock(m_ContextsMutex);
+
+                ApplySettings(settings);
+                for (auto& [device, context] : m_Contexts) {
+                    context->CommandManager->UpdateOptions(m_Settings->CommandManager);
+                }
+                // The eye gaze manager is created again with the new options.
+                m_EyeGazeManager.reset();
+                TraceLoggingWriteTagged(local, "OnFramePresent_UpdateSettings", TLArg(m_Enabled.load(), "Enabled"));
+            }
+
+            m_RenderTargets.NextFrame();
+
             ComPtr<ID3D12Resource> buffer;
             const HRESULT result = pSwapChain->GetBuffer(0, IID_PPV_ARGS(buffer.ReleaseAndGetAddressOf()));
             if (SUCCEEDED(result)) {
@@ -108,6 +695,12 @@ namespace {
                 DXGI_SWAP_CHAIN_DESC swapChainDesc{};
                 CHECK_HRCMD(pSwapChain->GetDesc(&swapChainDesc));
 
+                // The buffers change when the swapchain is created or resized.
+                if (buffer.Get() != m_LastBackBuffer) {
+                    RecordBackBuffers(pSwapChain, swapChainDesc.BufferCount);
+                    m_LastBackBuffer = buffer.Get();
+                }
+
                 std::unique_lock lock(m_ContextsMutex);
 
                 auto it = m_Contexts.find(device.Get());
@@ -117,10 +710,10 @@ namespace {
                                             TLPArg(device.Get(), "Device"),
                                             TLArg(swapChainDesc.BufferDesc.Width, "Width"),
                                             TLArg(swapChainDesc.BufferDesc.Height, "Height"));
-                    it->second.PresentResolution = {swapChainDesc.BufferDesc.Width, swapChainDesc.BufferDesc.Height};
+                    it->second->PresentResolution = {swapChainDesc.BufferDesc.Width, swapChainDesc.BufferDesc.Height};
 
-                    VRS::ICommandManager* const commandManager = it->second.CommandManager.get();
-                    commandManager->Present();
+                    VRS::ICommandManager* const commandManager = it->second->CommandManager.get();
+                    commandManager->Present(pSwapChain, m_EyeGazeManager.get());
 
                 } else {
                     // First time we see this device, let's create a VRS command manager for it.
@@ -129,10 +722,11 @@ namespace {
                                             TLPArg(device.Get(), "Device"),
                                             TLArg(swapChainDesc.BufferDesc.Width, "Width"),
                                             TLArg(swapChainDesc.BufferDesc.Height, "Height"));
-                    RenderingContext newContext;
-                    newContext.CommandManager = VRS::CreateCommandManager(device.Get());
-                    newContext.PresentResolution = {swapChainDesc.BufferDesc.Width, swapChainDesc.BufferDesc.Height};
+                    auto newContext = std::make_shared<RenderingContext>();
+                    newContext->CommandManager = VRS::CreateCommandManager(device.Get(), m_Settings->CommandManager);
+                    newContext->PresentResolution = {swapChainDesc.BufferDesc.Width, swapChainDesc.BufferDesc.Height};
                     m_Contexts.insert_or_assign(device.Get(), std::move(newContext));
+                    m_ContextsVersion.fetch_add(1, std::memory_order_release);
                 }
 
                 // Try to attach an eye gaze manager.
@@ -146,10 +740,9 @@ namespace {
                     // bouncing the tracker from a window to another, eg: use the window with the largest dimension, or
                     // with the focus.
                     if (!m_EyeGazeManager || m_EyeGazeManager->GetHwnd() != hwnd) {
-                        m_EyeGazeManager = CreateTobiiEyeGazeManager(hwnd);
+                        m_EyeGazeManager = CreateTobiiEyeGazeManager(hwnd, m_Settings->GazePrediction);
                     }
                     m_EyeGazeManagerAging = 0;
-                    m_GazeUpdatedThisFrame = false;
                 }
 
             } else {
@@ -158,15 +751,23 @@ namespace {
                 TraceLoggingWriteTagged(local, "OnFramePresent_GetBuffer", TLArg(result, "Error"));
             }
 
-            // Age the eye gaze manager and garbage-collect it when it is not being used.
-            if (++m_EyeGazeManagerAging > 100) {
-                m_EyeGazeManager.reset();
+            // Age the eye gaze manager and garbage-collect it when it is not being used. Enable() may be using it from
+            // another thread.
+            {
+                std::unique_lock lock(m_ContextsMutex);
+
+                if (++m_EyeGazeManagerAging > m_Settings->EyeGazeMaxIdleFrames) {
+                    m_EyeGazeManager.reset();
+                }
             }
 
             {
                 static bool wasKeyPressed = false;
+                const std::vector<int>& toggleKeys = m_Settings->ToggleKeys;
                 const bool isKeyPressed =
-                    GetAsyncKeyState(VK_MENU) < 0 && GetAsyncKeyState('F') < 0 && GetAsyncKeyState('R') < 0;
+                    !toggleKeys.empty() && std::all_of(toggleKeys.begin(), toggleKeys.end(), [](int key) {
+                        return GetAsyncKeyState(key) < 0;
+                    });
                 if (isKeyPressed && !wasKeyPressed) {
                     m_Enabled = !m_Enabled;
                 }
@@ -176,6 +777,108 @@ namespace {
             TraceLoggingWriteStop(local, "OnFramePresent");
         }
 
+        // When we know the render target, we classify the pass based on its render target: it must use a scene color
+        // format, and be large enough to be a scene pass (which excludes shadow maps, reflection probes, and the
+        // other intermediate passes). The viewports must then cover a screen-shaped region of it, which may be smaller
+        // than the render target (eg: dynamic resolution).
+        bool IsPassEligible(const Resolution& PresentResolution,
+                            uint64_t RenderTarget,
+                            UINT NumViewports,
+                            const D3D12_VIEWPORT* pViewports) const {
+            if (RenderTarget == RenderTargetUnknown) {
+                return AreViewportsEligible(PresentResolution, NumViewports, pViewports);
+            }
+
+            // Depth-only passes do not benefit from VRS.
+            if (!m_Enabled || !NumViewports || RenderTarget == RenderTargetNone) {
+                return false;
+            }
+
+            // The passes rendering directly to the swapchain are the UI and the last post-processing passes.
+            const RenderTargetInfo renderTarget = RenderTargetInfo::Unpack(RenderTarget);
+            if (!renderTarget.IsFormatEligible || renderTarget.IsBackBuffer ||
+                !IsScreenSized(PresentResolution, renderTarget.Width, renderTarget.Height)) {
+                return false;
+            }
+
+            const D3D12_VIEWPORT bounds = GetViewportsBounds(NumViewports, pViewports);
+            if (!IsScreenSized(PresentResolution, bounds.Width, bounds.Height)) {
+                return false;
+            }
+
+            // Allow for some difference in aspect ratio, for render targets that are padded or cropped.
+            const double targetAspectRatio = static_cast<double>(PresentResolution.Height) / PresentResolution.Width;
+            const double viewportAspectRatio = static_cast<double>(bounds.Height) / bounds.Width;
+            return std::abs(viewportAspectRatio / targetAspectRatio - 1.0) < 0.2;
+        }
+
+        bool IsBackBuffer(ID3D12Resource* pResource) const {
+            return pResource && std::any_of(std::begin(m_BackBuffers), std::end(m_BackBuffers), [&](const auto& entry) {
+                       return entry.load(std::memory_order_relaxed) == pResource;
+                   });
+        }
+
+        // Called from Present() only.
+        void RecordBackBuffers(IDXGISwapChain* pSwapChain, UINT BufferCount) {
+            for (UINT i = 0; i < BufferCount; i++) {
+                ComPtr<ID3D12Resource> buffer;
+                if (FAILED(pSwapChain->GetBuffer(i, IID_PPV_ARGS(buffer.ReleaseAndGetAddressOf()))) ||
+                    IsBackBuffer(buffer.Get())) {
+                    continue;
+                }
+                // The oldest entries are of the buffers released by previous swapchains or resizes.
+                m_BackBuffers[m_NextBackBuffer].store(buffer.Get(), std::memory_order_relaxed);
+                m_NextBackBuffer = (m_NextBackBuffer + 1) % MaxBackBuffers;
+            }
+        }
+
+        bool IsScreenSized(const Resolution& PresentResolution, double Width, double Height) const {
+            // DLSS/FSR "Ultra Performance" might render at 33% of the final resolution.
+            const double minRenderScale = m_MinRenderScale.load(std::memory_order_relaxed);
+            return Width >= minRenderScale * PresentResolution.Width &&
+                   Height >= minRenderScale * PresentResolution.Height;
+        }
+
+        static D3D12_VIEWPORT GetViewportsBounds(UINT NumViewports, const D3D12_VIEWPORT* pViewports) {
+            float left = pViewports[0].TopLeftX, top = pViewports[0].TopLeftY;
+            float right = left + pViewports[0].Width, bottom = top + pViewports[0].Height;
+            for (UINT i = 1; i < NumViewports; i++) {
+                left = std::min(left, pViewports[i].TopLeftX);
+                top = std::min(top, pViewports[i].TopLeftY);
+                right = std::max(right, pViewports[i].TopLeftX + pViewports[i].Width);
+                bottom = std::max(bottom, pViewports[i].TopLeftY + pViewports[i].Height);
+            }
+
+            D3D12_VIEWPORT bounds{};
+            bounds.TopLeftX = left;
+            bounds.TopLeftY = top;
+            bounds.Width = right - left;
+            bounds.Height = bottom - top;
+            return bounds;
+        }
+
+        // Without a known render target, we fall back to comparing the viewports with the swapchain.
+        // Multiple viewports are eligible when they together cover an eligible area (eg: side-by-side stereo or
+        // split-screen), or when they are all eligible individually.
+        bool AreViewportsEligible(const Resolution& PresentResolution,
+                                  UINT NumViewports,
+                                  const D3D12_VIEWPORT* pViewports) const {
+            if (!NumViewports) {
+                return false;
+            }
+
+            if (NumViewports == 1) {
+                return IsViewportEligible(PresentResolution, pViewports[0]);
+            }
+
+            bool areAllEligible = true;
+            for (UINT i = 0; i < NumViewports; i++) {
+                areAllEligible = areAllEligible && IsViewportEligible(PresentResolution, pViewports[i]);
+            }
+            return areAllEligible ||
+                   IsViewportEligible(PresentResolution, GetViewportsBounds(NumViewports, pViewports));
+        }
+
         bool IsViewportEligible(const Resolution& PresentResolution, const D3D12_VIEWPORT& Viewport) const {
             if (!m_Enabled) {
                 return false;
@@ -189,19 +892,52 @@ namespace {
             const double viewportAspectRatio = static_cast<double>(Viewport.Height) / Viewport.Width;
             const double scaleOfTarget = static_cast<double>(Viewport.Width) / PresentResolution.Width;
 
+            // DLSS/FSR "Ultra Performance" might render at 33% of the final resolution.
             return std::abs(targetAspectRatio - viewportAspectRatio) < 0.0001 &&
-                   scaleOfTarget >= 0.32; // DLSS/FSR "Ultra Performance" might render at 33% of the final resolution.
+                   scaleOfTarget >= m_MinRenderScale.load(std::memory_order_relaxed);
+        }
+
+        // Must be called with m_ContextsMutex held, or from the constructor.
+        void ApplySettings(std::shared_ptr<const Settings::TitleSettings> NewSettings) {
+            // Only an edit of the Enabled value overrides the state toggled with the keys.
+            if (!m_Settings || m_Settings->Enabled != NewSettings->Enabled) {
+                m_Enabled = NewSettings->Enabled;
+            }
+            m_MinRenderScale = NewSettings->MinRenderScale;
+            m_Settings = std::move(NewSettings);
+            std::atomic_store(&m_PipelineStateRules,
+                              std::shared_ptr<const PipelineStateRules>(m_Settings, &m_Settings->PipelineStateRules));
         }
 
-        bool m_Enabled{true};
+        // Copied from the settings, since they are read outside of m_ContextsMutex.
+        std::atomic<bool> m_Enabled{true};
+        std::atomic<double> m_MinRenderScale{0.32};
+
+        RenderTargetTable m_RenderTargets;
+        PipelineStateTable m_RatedPipelineStates;
+        std::atomic<bool> m_IsRatedPipelineStatesFull{false};
+        std::atomic<bool> m_HasRatedPipelineStates{false};
+        // Shares the ownership of the settings, accessed with the atomic functions.
+        using PipelineStateRules = std::unordered_map<std::string, D3D12_SHADING_RATE>;
+        std::shared_ptr<const PipelineStateRules> m_PipelineStateRules;
+
+        // The back buffers of the swapchains, recorded at Present() and never dereferenced. The passes recorded before
+        // the first Present() are not recognized.
+        static constexpr size_t MaxBackBuffers = 16;
+        std::atomic<ID3D12Resource*> m_BackBuffers[MaxBackBuffers]{};
+        size_t m_NextBackBuffer{0};
+        ID3D12Resource* m_LastBackBuffer{nullptr};
 
         std::shared_mutex m_ContextsMutex;
-        std::unordered_map<ID3D12Device*, RenderingContext> m_Contexts;
+        std::unordered_map<ID3D12Device*, std::shared_ptr<RenderingContext>> m_Contexts;
+        // Incremented when m_Contexts changes, so that the command lists look up their context again.
+        std::atomic<uint64_t> m_ContextsVersion{0};
 
         // The members below are also protected by m_ContextsMutex.
+        const std::unique_ptr<Settings::ISettingsManager> m_SettingsManager;
+        std::shared_ptr<const Settings::TitleSettings> m_Settings;
         std::unique_ptr<IEyeGazeManager> m_EyeGazeManager;
         unsigned int m_EyeGazeManagerAging{0};
-        bool m_GazeUpdatedThisFrame{false};
     };
 
 } // namespace
@@ -27,13 +27,45 @@ namespace Injector {
     struct IInjectionManager {
         virtual ~IInjectionManager() = default;
 
-        virtual void OnSetViewports(ID3D12CommandList* pCommandList, const D3D12_VIEWPORT& Viewport) = 0;
+        virtual void OnSetViewports(ID3D12CommandList* pCommandList,
+                                    UINT NumViewports,
+                                    const D3D12_VIEWPORT* pViewports) = 0;
+        virtual void OnResetCommandList(ID3D12CommandList* pCommandList) = 0;
+        virtual void OnCreateRenderTargetView(ID3D12Resource* pResource,
+                                              const D3D12_RENDER_TARGET_VIEW_DESC* pDesc,
+                                              D3D12_CPU_DESCRIPTOR_HANDLE DestDescriptor) = 0;
+        // pRenderTarget is the first render target bound, or nullptr if there is none.
+        virtual void OnSetRenderTarget(ID3D12CommandList* pCommandList,
+                                       const D3D12_CPU_DESCRIPTOR_HANDLE* pRenderTarget) = 0;
+        // PixelShader is empty when the pipeline state has no pixel shader.
+        virtual void OnCreatePipelineState(const D3D12_SHADER_BYTECODE& PixelShader,
+                                           ID3D12PipelineState* pPipelineState) = 0;
+        // pPipelineState may be nullptr.
+        virtual void OnSetPipelineState(ID3D12CommandList* pCommandList, ID3D12PipelineState* pPipelineState) = 0;
         virtual void OnExecuteCommandLists(ID3D12CommandQueue* pCommandQueue,
-                                           const std::vector<ID3D12CommandList*>& CommandLists) = 0;
+                                           UINT NumCommandLists,
+                                           ID3D12CommandList* const* ppCommandLists) = 0;
         virtual void OnFramePresent(IDXGISwapChain* pSwapChain) = 0;
     };
 
     std::unique_ptr<IInjectionManager> CreateInjectionManager();
-    void InstallHooks(std::unique_ptr<IInjectionManager> Manager);
+    using InjectionManagerFactory = std::unique_ptr<IInjectionManager> (*)();
+
+    // Hooks the creation of the device and the DXGI factories. The methods of the objects are hooked from the first
+    // objects that the application creates. Safe to call from DllMain(): the injection manager is only created upon
+    // the first device or factory (or the first Hook*() call below).
+    void InstallHooks(InjectionManagerFactory CreateManager);
+
+    // Hook the methods of objects that were created before InstallHooks(). Detours patches the methods themselves, so
+    // hooking one object of each kind hooks all of them.
+    void HookDevice(ID3D12Device* pDevice);
+    void HookCommandList(ID3D12GraphicsCommandList* pCommandList);
+    void HookCommandQueue(ID3D12CommandQueue* pCommandQueue);
+    void HookSwapChain(IDXGISwapChain* pSwapChain);
+
+    // Submit our own command lists to a queue without going through the ExecuteCommandLists() hook.
+    void ExecuteCommandListsUnhooked(ID3D12CommandQueue* pCommandQueue,
+                                     UINT NumCommandLists,
+                                     ID3D12CommandList* const* ppCommandLists);
 
 } // namespace Injector
@@ -0,0 +1,487 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pch.h"
+
+#include "Settings.h"
+#include "Tracing.h"
+
+namespace {
+
+    using namespace Settings;
+
+    // The profiles are looked up in this folder next to the injector.
+    constexpr wchar_t ProfilesDirectoryName[] = L"Profiles";
+
+    std::string Trim(const std::string& Value) {
+        const size_t first = Value.find_first_not_of(" \t\r");
+        if (first == std::string::npos) {
+            return {};
+        }
+        const size_t last = Value.find_last_not_of(" \t\r");
+        return Value.substr(first, last - first + 1);
+    }
+
+    std::string ToLower(std::string Value) {
+        std::transform(Value.begin(), Value.end(), Value.begin(), [](char c) { return (char)tolower(c); });
+        return Value;
+    }
+
+    bool ParseBool(const std::string& Value, bool& Result) {
+        const std::string value = ToLower(Value);
+        if (value == "true" || value == "1" || value == "yes" || value == "on") {
+            Result = true;
+            return true;
+        }
+        if (value == "false" || value == "0" || value == "no" || value == "off") {
+            Result = false;
+            return true;
+        }
+        return false;
+    }
+
+    // Values outside of [Min, Max] are clamped. Negative values are rejected for the unsigned types, which the stream
+    // would otherwise wrap around.
+    template <typename T>
+    bool ParseNumber(const std::string& Value,
+                     T& Result,
+                     T Min = std::numeric_limits<T>::lowest(),
+                     T Max = std::numeric_limits<T>::max()) {
+        if constexpr (std::is_unsigned_v<T>) {
+            if (Value.find('-') != std::string::npos) {
+                return false;
+            }
+        }
+        std::istringstream stream(Value);
+        T value;
+        if (!(stream >> value) || !(stream >> std::ws).eof()) {
+            return false;
+        }
+        Result = std::clamp(value, Min, Max);
+        return true;
+    }
+
+    // A duration in milliseconds, stored in microseconds.
+    bool ParseMilliseconds(const std::string& Value, int64_t& Result) {
+        double milliseconds;
+        if (!ParseNumber(Value, milliseconds) || milliseconds < 0) {
+            return false;
+        }
+        Result = static_cast<int64_t>(milliseconds * 1000);
+        return true;
+    }
+
+    // A key name like "Alt", "F5" or "R".
+    std::optional<int> ParseKey(const std::string& Name) {
+        const std::string name = ToLower(Trim(Name));
+        if (name == "alt") {
+            return VK_MENU;
+        }
+        if (name == "ctrl" || name == "control") {
+            return VK_CONTROL;
+        }
+        if (name == "shift") {
+            return VK_SHIFT;
+        }
+        unsigned int functionKey;
+        if (name.size() > 1 && name[0] == 'f' && ParseNumber(name.substr(1), functionKey) && functionKey >= 1 &&
+            functionKey <= 24) {
+            return static_cast<int>(VK_F1 + functionKey - 1);
+        }
+        if (name.size() == 1 && isalnum(name[0])) {
+            return toupper(name[0]);
+        }
+        return {};
+    }
+
+    // Keys pressed together, like "Alt+F+R", or "none".
+    bool ParseKeys(const std::string& Value, std::vector<int>& Keys) {
+        std::vector<int> keys;
+        if (ToLower(Value) != "none") {
+            std::istringstream stream(Value);
+            std::string name;
+            while (std::getline(stream, name, '+')) {
+                const std::optional<int> key = ParseKey(name);
+                if (!key) {
+                    return false;
+                }
+                keys.push_back(*key);
+            }
+        }
+        Keys = std::move(keys);
+        return true;
+    }
+
+    // The ring scale of each upscaler tier, from Quality to Ultra Performance, like "1.15 1.25 1.4 1.8".
+    bool ParseUpscalerRingScales(const std::string& Value, float (&Scales)[VRS::UpscalerTierCount]) {
+        float scales[VRS::UpscalerTierCount];
+        std::istringstream stream(Value);
+        for (float& scale : scales) {
+            if (!(stream >> scale) || scale <= 0) {
+                return false;
+            }
+        }
+        if (!(stream >> std::ws).eof()) {
+            return false;
+        }
+        std::copy_n(scales, VRS::UpscalerTierCount, Scales);
+        return true;
+    }
+
+    // A comma-separated list of rings, each with its radius and rate, like "0.25 1X1, 0.8 2X2".
+    bool ParseRings(const std::string& Value, std::vector<VRS::FoveationRing>& Rings) {
+        std::vector<VRS::FoveationRing> rings;
+        std::istringstream stream(Value);
+        std::string ring;
+        while (std::getline(stream, ring, ',')) {
+            std::istringstream tokens(ring);
+            float radius;
+            std::string rateName;
+            if (!(tokens >> radius >> rateName) || radius <= 0) {
+                return false;
+            }
+            const std::optional<D3D12_SHADING_RATE> rate = ParseShadingRate(rateName);
+            if (!rate) {
+                return false;
+            }
+            rings.push_back({radius, *rate});
+        }
+        if (rings.size() > VRS::MaxFoveationRings) {
+            return false;
+        }
+        Rings = std::move(rings);
+        return true;
+    }
+
+    // The rates from the center outward, like "1X1 1X1 2X1 2X2 4X2", or "none".
+    bool ParseLookupTable(const std::string& Value, std::vector<D3D12_SHADING_RATE>& LookupTable) {
+        std::vector<D3D12_SHADING_RATE> lookupTable;
+        if (ToLower(Value) != "none") {
+            std::istringstream stream(Value);
+            std::string rateName;
+            while (stream >> rateName) {
+                const std::optional<D3D12_SHADING_RATE> rate = ParseShadingRate(rateName);
+                if (!rate) {
+                    return false;
+                }
+                lookupTable.push_back(*rate);
+            }
+            if (lookupTable.empty() || lookupTable.size() > VRS::MaxLookupTableSize) {
+                return false;
+            }
+        }
+        LookupTable = std::move(lookupTable);
+        return true;
+    }
+
+    bool ParseRate(const std::string& Value, D3D12_SHADING_RATE& Result) {
+        const std::optional<D3D12_SHADING_RATE> rate = ParseShadingRate(Value);
+        if (!rate) {
+            return false;
+        }
+        Result = *rate;
+        return true;
+    }
+
+    // The profile is an INI file, eg:
+    //   [Foveation]
+    //   Profile = balanced
+    //   OuterRate = 2X2
+    //   [PipelineStates]
+    //   0123456789abcdef0123456789abcdef = 2X2
+    // Lines starting with ';' or '#' are comments. The settings that are absent or invalid keep their default value.
+    TitleSettings ParseSettings(std::istream& Stream) {
+        TraceLocalActivity(local);
+        TraceLoggingWriteStart(local, "ParseSettings");
+
+        // Read all the values first, since the built-in profile must be applied before the individual settings
+        // overriding it, whatever their order in the file.
+        std::unordered_map<std::string, std::string> values;
+        std::string section;
+        std::string line;
+        while (std::getline(Stream, line)) {
+            line = Trim(line);
+            if (line.empty() || line[0] == ';' || line[0] == '#') {
+                continue;
+            }
+            if (line[0] == '[' && line.back() == ']') {
+                section = ToLower(Trim(line.substr(1, line.size() - 2)));
+                continue;
+            }
+            const size_t equal = line.find('=');
+            if (equal == std::string::npos) {
+                TraceLoggingWriteTagged(local, "ParseSettings_InvalidLine", TLArg(line.c_str(), "Line"));
+                continue;
+            }
+            values[section + "." + ToLower(Trim(line.substr(0, equal)))] = Trim(line.substr(equal + 1));
+        }
+
+        TitleSettings settings;
+        VRS::CommandManagerOptions& options = settings.CommandManager;
+        EyeGaze::GazePredictionOptions& gaze = settings.GazePrediction;
+        const std::pair<const char*, std::function<bool(const std::string&)>> parsers[] = {
+            {"foveation.profile",
+             [&](const std::string& value) {
+                 options.Profile = VRS::GetFoveationProfile(ToLower(value));
+                 return true;
+             }},
+            {"foveation.rings", [&](const std::string& value) { return ParseRings(value, options.Profile.Rings); }},
+            {"foveation.outerrate",
+             [&](const std::string& value) { return ParseRate(value, options.Profile.OuterRate); }},
+            {"foveation.horizontalscale",
+             [&](const std::string& value) { return ParseNumber(value, options.Profile.HorizontalScale, 0.1f, 10.f); }},
+            {"foveation.lookuptable",
+             [&](const std::string& value) { return ParseLookupTable(value, options.Profile.LookupTable); }},
+            {"foveation.lookuptablemaxdistance",
+             [&](const std::string& value) {
+                 return ParseNumber(value, options.Profile.LookupTableMaxDistance, 0.1f, 10.f);
+             }},
+
+            {"general.enabled", [&](const std::string& value) { return ParseBool(value, settings.Enabled); }},
+            {"general.togglekeys", [&](const std::string& value) { return ParseKeys(value, settings.ToggleKeys); }},
+            {"general.minrenderscale",
+             [&](const std::string& value) { return ParseNumber(value, settings.MinRenderScale, 0.1, 1.0); }},
+
+            {"shadingratemaps.numbuffers",
+             [&](const std::string& value) { return ParseNumber(value, options.NumShadingRateMapBuffers, 2u, 8u); }},
+            {"shadingratemaps.useasynccompute",
+             [&](const std::string& value) { return ParseBool(value, options.UseAsyncCompute); }},
+            {"shadingratemaps.usehighprioritycompute",
+             [&](const std::string& value) { return ParseBool(value, options.UseHighPriorityCompute); }},
+            {"shadingratemaps.usecpugeneration",
+             [&](const std::string& value) { return ParseBool(value, options.UseCpuGeneration); }},
+            {"shadingratemaps.pregenerateatpresent",
+             [&](const std::string& value) { return ParseBool(value, options.PregenerateAtPresent); }},
+            {"shadingratemaps.usecontentadaptiverates",
+             [&](const std::string& value) { return ParseBool(value, options.UseContentAdaptiveRates); }},
+            {"shadingratemaps.targetgpuframetime",
+             [&](const std::string& value) { return ParseNumber(value, options.TargetGpuFrameTime, 0.f, 1000.f); }},
+            {"shadingratemaps.gpuframetimehysteresis",
+             [&](const std::string& value) { return ParseNumber(value, options.GpuFrameTimeHysteresis, 0.f, 0.5f); }},
+            {"shadingratemaps.budget",
+             [&](const std::string& value) {
+                 double megabytes;
+                 if (!ParseNumber(value, megabytes) || megabytes < 0) {
+                     return false;
+                 }
+                 options.ShadingRateMapBudget = static_cast<UINT64>(megabytes * 1024 * 1024);
+                 return true;
+             }},
+            {"shadingratemaps.maxage",
+             [&](const std::string& value) { return ParseNumber(value, options.ShadingRateMapMaxAge, 1u, 10'000u); }},
+            {"shadingratemaps.sharingtolerance",
+             [&](const std::string& value) {
+                 return ParseNumber(value, options.ShadingRateMapSharingTolerance, 0u, 16u);
+             }},
+
+            {"upscaler.detectionframes",
+             [&](const std::string& value) { return ParseNumber(value, options.UpscalerDetectionFrames, 0u, 1000u); }},
+            {"upscaler.ringscale",
+             [&](const std::string& value) { return ParseUpscalerRingScales(value, options.UpscalerRingScale); }},
+
+            {"eyegaze.timeout",
+             [&](const std::string& value) { return ParseMilliseconds(value, gaze.GazeTimeoutMicroseconds); }},
+            {"eyegaze.predictionlatency",
+             [&](const std::string& value) {
+                 return ParseMilliseconds(value, gaze.PredictionLatencyMicroseconds);
+             }},
+            {"eyegaze.maxprediction",
+             [&](const std::string& value) { return ParseMilliseconds(value, gaze.MaxPredictionMicroseconds); }},
+            {"eyegaze.alpha", [&](const std::string& value) { return ParseNumber(value, gaze.Alpha, 0.f, 1.f); }},
+            {"eyegaze.beta", [&](const std::string& value) { return ParseNumber(value, gaze.Beta, 0.f, 1.f); }},
+            {"eyegaze.saccadevelocitythreshold",
+             [&](const std::string& value) { return ParseNumber(value, gaze.SaccadeVelocityThreshold, 0.f, 1000.f); }},
+            {"eyegaze.maxidleframes",
+             [&](const std::string& value) { return ParseNumber(value, settings.EyeGazeMaxIdleFrames, 1u, 100'000u); }},
+        };
+        for (const auto& [key, parser] : parsers) {
+            auto it = values.find(key);
+            if (it == values.end()) {
+                continue;
+            }
+            if (!parser(it->second)) {
+                TraceLoggingWriteTagged(local,
+                                        "ParseSettings_InvalidValue",
+                                        TLArg(key, "Key"),
+                                        TLArg(it->second.c_str(), "Value"));
+            }
+            values.erase(it);
+        }
+
+        // The keys of this section are the hashes of the pixel shaders.
+        const std::string pipelineStatesSection = "pipelinestates.";
+        for (auto it = values.begin(); it != values.end();) {
+            if (it->first.compare(0, pipelineStatesSection.size(), pipelineStatesSection)) {
+                it++;
+                continue;
+            }
+            D3D12_SHADING_RATE rate;
+            if (ParseRate(it->second, rate)) {
+                settings.PipelineStateRules[it->first.substr(pipelineStatesSection.size())] = rate;
+            } else {
+                TraceLoggingWriteTagged(local,
+                                        "ParseSettings_InvalidValue",
+                                        TLArg(it->first.c_str(), "Key"),
+                                        TLArg(it->second.c_str(), "Value"));
+            }
+            it = values.erase(it);
+        }
+
+        for (const auto& [key, value] : values) {
+            TraceLoggingWriteTagged(local, "ParseSettings_UnknownKey", TLArg(key.c_str(), "Key"));
+        }
+
+        TraceLoggingWriteStop(
+            local, "ParseSettings", TLArg(settings.PipelineStateRules.size(), "NumPipelineStateRules"));
+
+        return settings;
+    }
+
+    std::optional<std::string> ReadProfile(const std::filesystem::path& Path) {
+        std::ifstream file(Path, std::ios::binary);
+        if (!file) {
+            return {};
+        }
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    std::filesystem::path GetProfilePath() {
+        wchar_t executablePath[MAX_PATH]{};
+        GetModuleFileNameW(nullptr, executablePath, ARRAYSIZE(executablePath));
+
+        // The injector may not be next to the application's executable.
+        HMODULE injectorModule = nullptr;
+        wchar_t injectorPath[MAX_PATH]{};
+        if (GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                               reinterpret_cast<LPCWSTR>(&GetProfilePath),
+                               &injectorModule)) {
+            GetModuleFileNameW(injectorModule, injectorPath, ARRAYSIZE(injectorPath));
+        }
+
+        std::filesystem::path profilePath = std::filesystem::path(injectorPath).parent_path() /
+                                            ProfilesDirectoryName /
+                                            std::filesystem::path(executablePath).stem();
+        profilePath += L".ini";
+        return profilePath;
+    }
+
+    // The profile is read when the manager is created, then whenever its folder reports a change. The manager is not
+    // thread-safe, it is meant to be used from the presenting thread.
+    struct SettingsManager : ISettingsManager {
+        SettingsManager() : m_Path(GetProfilePath()) {
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(local, "SettingsCreate", TLArg(m_Path.c_str(), "Path"));
+
+            m_Contents = ReadProfile(m_Path).value_or("");
+            std::istringstream stream(m_Contents);
+            m_Settings = std::make_shared<const TitleSettings>(ParseSettings(stream));
+
+            // Create the folder if needed, so that a profile added later is picked up.
+            CreateDirectoryW(m_Path.parent_path().c_str(), nullptr);
+            Watch();
+
+            TraceLoggingWriteStop(local,
+                                  "SettingsCreate",
+                                  TLArg(!m_Contents.empty(), "HasProfile"),
+                                  TLArg(!!m_ChangeNotification, "IsWatched"));
+        }
+
+        std::shared_ptr<const TitleSettings> GetSettings() const override {
+            return m_Settings;
+        }
+
+        std::shared_ptr<const TitleSettings> PollUpdatedSettings() override {
+            if (!m_ChangeNotification) {
+                // The folder could not be watched (eg: it could not be created), retry once in a while. The profile
+                // may have been added meanwhile.
+                if (++m_PollsSinceWatchFailure < WatchRetryInterval || !Watch()) {
+                    return nullptr;
+                }
+            } else if (WaitForSingleObject(m_ChangeNotification.get(), 0) != WAIT_OBJECT_0) {
+                return nullptr;
+            } else {
+                FindNextChangeNotification(m_ChangeNotification.get());
+            }
+
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(local, "SettingsReload");
+
+            // Keep the current settings if the file was deleted, or if it did not change.
+            const std::optional<std::string> contents = ReadProfile(m_Path);
+            if (!contents || *contents == m_Contents) {
+                TraceLoggingWriteStop(local, "SettingsReload", TLArg(false, "Changed"));
+                return nullptr;
+            }
+            m_Contents = *contents;
+            std::istringstream stream(m_Contents);
+            m_Settings = std::make_shared<const TitleSettings>(ParseSettings(stream));
+
+            TraceLoggingWriteStop(local, "SettingsReload", TLArg(true, "Changed"));
+
+            return m_Settings;
+        }
+
+        bool Watch() {
+            // The notifications are for any file in the folder, we compare the contents of our file upon each of them.
+            m_ChangeNotification.reset(FindFirstChangeNotificationW(m_Path.parent_path().c_str(),
+                                                                    FALSE /* bWatchSubtree */,
+                                                                    FILE_NOTIFY_CHANGE_FILE_NAME |
+                                                                        FILE_NOTIFY_CHANGE_LAST_WRITE));
+            m_PollsSinceWatchFailure = 0;
+            return !!m_ChangeNotification;
+        }
+
+        // In frames.
+        static constexpr unsigned int WatchRetryInterval = 300;
+
+        const std::filesystem::path m_Path;
+        std::string m_Contents;
+        std::shared_ptr<const TitleSettings> m_Settings;
+        wil::unique_hfind_change m_ChangeNotification;
+        unsigned int m_PollsSinceWatchFailure{0};
+    };
+
+} // namespace
+
+namespace Settings {
+
+    std::unique_ptr<ISettingsManager> CreateSettingsManager() {
+        return std::make_unique<SettingsManager>();
+    }
+
+    std::optional<D3D12_SHADING_RATE> ParseShadingRate(const std::string& Rate) {
+        static const std::pair<const char*, D3D12_SHADING_RATE> rates[] = {{"1X1", D3D12_SHADING_RATE_1X1},
+                                                                           {"1X2", D3D12_SHADING_RATE_1X2},
+                                                                           {"2X1", D3D12_SHADING_RATE_2X1},
+                                                                           {"2X2", D3D12_SHADING_RATE_2X2},
+                                                                           {"2X4", D3D12_SHADING_RATE_2X4},
+                                                                           {"4X2", D3D12_SHADING_RATE_4X2},
+                                                                           {"4X4", D3D12_SHADING_RATE_4X4}};
+        for (const auto& [name, rate] : rates) {
+            if (!_stricmp(Rate.c_str(), name)) {
+                return rate;
+            }
+        }
+        return {};
+    }
+
+} // namespace Settings
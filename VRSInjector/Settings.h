@@ -0,0 +1,70 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "EyeGaze.h"
+#include "VRS.h"
+
+namespace Settings {
+
+    // The settings of a title, read from its profile file.
+    struct TitleSettings {
+        // Whether VRS is initially enabled.
+        bool Enabled{true};
+        // The virtual-key codes to press together to toggle VRS. Empty to disable the toggle.
+        std::vector<int> ToggleKeys{VK_MENU, 'F', 'R'};
+
+        // The smallest render target (or viewport), relative to the swapchain, considered for VRS. DLSS/FSR "Ultra
+        // Performance" might render at 33% of the final resolution.
+        double MinRenderScale{0.32};
+
+        // The number of frames presented without a window before the eye tracker is released.
+        unsigned int EyeGazeMaxIdleFrames{100};
+        EyeGaze::GazePredictionOptions GazePrediction;
+
+        VRS::CommandManagerOptions CommandManager;
+
+        // The per-draw rate of the pipeline states, by the hash of their pixel shader. A reload only applies to the
+        // pipeline states created after it.
+        std::unordered_map<std::string, D3D12_SHADING_RATE> PipelineStateRules;
+    };
+
+    struct ISettingsManager {
+        virtual ~ISettingsManager() = default;
+
+        // The settings loaded when the manager was created, or the latest ones returned by PollUpdatedSettings().
+        virtual std::shared_ptr<const TitleSettings> GetSettings() const = 0;
+
+        // Return the new settings if the profile file changed since the last call, or nullptr otherwise. The file is
+        // only read after a change notification, this is cheap to call upon every frame.
+        virtual std::shared_ptr<const TitleSettings> PollUpdatedSettings() = 0;
+    };
+
+    // The profile file is selected by the name of the application's executable: "Profiles\<name>.ini" next to the
+    // injector.
+    std::unique_ptr<ISettingsManager> CreateSettingsManager();
+
+    // Parse a rate like "2X2".
+    std::optional<D3D12_SHADING_RATE> ParseShadingRate(const std::string& Rate);
+
+} // namespace Settings
@@ -0,0 +1,62 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+namespace Statistics {
+
+    // The distribution of a series of samples, with nearest-rank percentiles.
+    struct Distribution {
+        size_t Count{0};
+        double Average{0.0};
+        double P50{0.0};
+        double P90{0.0};
+        double P95{0.0};
+        double P99{0.0};
+        double Max{0.0};
+    };
+
+    inline Distribution GetDistribution(std::vector<double> Samples) {
+        Distribution distribution{};
+        if (Samples.empty()) {
+            return distribution;
+        }
+
+        std::sort(Samples.begin(), Samples.end());
+        const auto percentile = [&](double p) {
+            return Samples[std::min(static_cast<size_t>(p * Samples.size()), Samples.size() - 1)];
+        };
+        double sum = 0.0;
+        for (const double sample : Samples) {
+            sum += sample;
+        }
+        distribution.Count = Samples.size();
+        distribution.Average = sum / Samples.size();
+        distribution.P50 = percentile(0.5);
+        distribution.P90 = percentile(0.9);
+        distribution.P95 = percentile(0.95);
+        distribution.P99 = percentile(0.99);
+        distribution.Max = Samples.back();
+        return distribution;
+    }
+
+} // namespace Statistics
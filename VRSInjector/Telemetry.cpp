@@ -0,0 +1,163 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pch.h"
+
+#include "Telemetry.h"
+#include "Tracing.h"
+
+namespace Telemetry {
+
+    namespace {
+
+        // The hook counters are incremented from all the threads recording command lists, so each thread uses its own
+        // shard, which it updates without atomic read-modify-writes. The threads beyond the first ones share the last
+        // shard. Unlike the trace counters, they are never reset.
+        constexpr size_t NumShards = 64;
+        constexpr size_t NumHooks = static_cast<size_t>(Hook::Count);
+        constexpr size_t NumCounters = static_cast<size_t>(Counter::Count);
+        constexpr size_t NumGauges = static_cast<size_t>(Gauge::Count);
+
+        struct alignas(64) Shard {
+            std::atomic<uint64_t> HookCalls[NumHooks]{};
+            std::atomic<uint64_t> HookTicks[NumHooks]{};
+        };
+
+        Shard g_Shards[NumShards];
+        std::atomic<size_t> g_NextShard{0};
+
+        // The counters are incremented from any thread, a few times per frame. The gauges are set upon Present().
+        std::atomic<uint64_t> g_Counters[NumCounters]{};
+        std::atomic<uint64_t> g_Gauges[NumGauges]{};
+
+        Shard& GetShard() {
+            thread_local Shard& shard = g_Shards[std::min(g_NextShard++, NumShards - 1)];
+            return shard;
+        }
+
+        void AddToShard(const Shard& Shard, std::atomic<uint64_t>& Value, uint64_t Amount) {
+            if (&Shard == &g_Shards[NumShards - 1]) {
+                Value.fetch_add(Amount, std::memory_order_relaxed);
+            } else {
+                Value.store(Value.load(std::memory_order_relaxed) + Amount, std::memory_order_relaxed);
+            }
+        }
+
+        struct SharedSection {
+            SharedSection() {
+                const std::wstring name = SharedTelemetryNamePrefix + std::to_wstring(GetCurrentProcessId());
+                m_Mapping.reset(CreateFileMappingW(
+                    INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(SharedTelemetry), name.c_str()));
+                if (m_Mapping) {
+                    m_View.reset(static_cast<SharedTelemetry*>(
+                        MapViewOfFile(m_Mapping.get(), FILE_MAP_WRITE, 0, 0, sizeof(SharedTelemetry))));
+                }
+                if (m_View) {
+                    // The section is zero-initialized.
+                    m_View->Size = sizeof(SharedTelemetry);
+                    m_View->Version.store(SharedTelemetryVersion, std::memory_order_release);
+                }
+
+                LARGE_INTEGER frequency;
+                QueryPerformanceFrequency(&frequency);
+                m_TicksPerSecond = frequency.QuadPart;
+
+                TraceLoggingWrite(Tracing::g_traceProvider,
+                                  "TelemetryCreate",
+                                  TLArg(name.c_str(), "Name"),
+                                  TLArg(!!m_View, "IsMapped"));
+            }
+
+            uint64_t ToMicroseconds(uint64_t Ticks) const {
+                // Split the conversion to avoid the overflow of Ticks * 1000000.
+                return (Ticks / m_TicksPerSecond) * 1'000'000 +
+                       (Ticks % m_TicksPerSecond) * 1'000'000 / m_TicksPerSecond;
+            }
+
+            wil::unique_handle m_Mapping;
+            wil::unique_mapview_ptr<SharedTelemetry> m_View;
+            uint64_t m_TicksPerSecond{1};
+        };
+
+    } // namespace
+
+    bool CountHookCall(Hook Hook) {
+        thread_local uint32_t numCalls[NumHooks]{};
+        Shard& shard = GetShard();
+        AddToShard(shard, shard.HookCalls[static_cast<size_t>(Hook)], 1);
+        return !(numCalls[static_cast<size_t>(Hook)]++ % HookTimingInterval);
+    }
+
+    void AddHookTime(Hook Hook, int64_t Ticks) {
+        // The timed call stands for the calls until the next one.
+        Shard& shard = GetShard();
+        AddToShard(shard, shard.HookTicks[static_cast<size_t>(Hook)], Ticks * HookTimingInterval);
+    }
+
+    void AddToCounter(Counter Counter, uint64_t Value) {
+        g_Counters[static_cast<size_t>(Counter)].fetch_add(Value, std::memory_order_relaxed);
+    }
+
+    void SetGauge(Gauge Gauge, uint64_t Value) {
+        g_Gauges[static_cast<size_t>(Gauge)].store(Value, std::memory_order_relaxed);
+    }
+
+    void PublishFrame() {
+#if VRSINJECTOR_TELEMETRY
+        static SharedSection section;
+        SharedTelemetry* const shared = section.m_View.get();
+        if (!shared) {
+            return;
+        }
+
+        const auto counter = [](Counter Counter) {
+            return g_Counters[static_cast<size_t>(Counter)].load(std::memory_order_relaxed);
+        };
+        const auto gauge = [](Gauge Gauge) {
+            return g_Gauges[static_cast<size_t>(Gauge)].load(std::memory_order_relaxed);
+        };
+
+        shared->NumShadingRateMapsGenerated.store(counter(Counter::ShadingRateMapsGenerated),
+                                                  std::memory_order_relaxed);
+        shared->NumShadingRateMapsReused.store(counter(Counter::ShadingRateMapsReused), std::memory_order_relaxed);
+        shared->NumQueueWaits.store(counter(Counter::QueueWaits), std::memory_order_relaxed);
+
+        for (size_t i = 0; i < NumHooks; i++) {
+            uint64_t numCalls = 0, ticks = 0;
+            for (const Shard& shard : g_Shards) {
+                numCalls += shard.HookCalls[i].load(std::memory_order_relaxed);
+                ticks += shard.HookTicks[i].load(std::memory_order_relaxed);
+            }
+            shared->Hooks[i].NumCalls.store(numCalls, std::memory_order_relaxed);
+            shared->Hooks[i].CpuTimeMicroseconds.store(section.ToMicroseconds(ticks), std::memory_order_relaxed);
+        }
+
+        shared->NumCachedResolutions.store(gauge(Gauge::CachedResolutions), std::memory_order_relaxed);
+        shared->NumDescriptorsInUse.store(gauge(Gauge::DescriptorsInUse), std::memory_order_relaxed);
+        shared->DescriptorCapacity.store(gauge(Gauge::DescriptorCapacity), std::memory_order_relaxed);
+        shared->IsGazeAvailable.store(gauge(Gauge::IsGazeAvailable), std::memory_order_relaxed);
+
+        shared->NumFrames.fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+
+} // namespace Telemetry
@@ -0,0 +1,156 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+// The telemetry is published in a shared memory section, for monitoring tools to read continuously without an ETW
+// session. It is compiled in unless VRSINJECTOR_TELEMETRY is defined to 0.
+#ifndef VRSINJECTOR_TELEMETRY
+#define VRSINJECTOR_TELEMETRY 1
+#endif
+
+#if VRSINJECTOR_TELEMETRY
+// Count a call to a hook, and sample its CPU time until the end of the enclosing scope.
+#define TelemetryHookTimer(hook) const Telemetry::HookTimer telemetryHookTimer(Telemetry::Hook::hook)
+#define TelemetryAdd(counter, value) Telemetry::AddToCounter(Telemetry::Counter::counter, value)
+#define TelemetrySetGauge(gauge, value) Telemetry::SetGauge(Telemetry::Gauge::gauge, value)
+#else
+#define TelemetryHookTimer(hook)
+#define TelemetryAdd(counter, value)                                                                                   \
+    do {                                                                                                               \
+    } while (0)
+#define TelemetrySetGauge(gauge, value)                                                                                \
+    do {                                                                                                               \
+    } while (0)
+#endif
+
+namespace Telemetry {
+
+    // The name of the section is followed by the ID of the process, eg: "Local\VRSInjector.Telemetry.1234".
+    constexpr wchar_t SharedTelemetryNamePrefix[] = L"Local\\VRSInjector.Telemetry.";
+    constexpr uint32_t SharedTelemetryVersion = 1;
+
+    // The hooks timed with TelemetryHookTimer(). The values index SharedTelemetry::Hooks, new hooks are only appended.
+    enum class Hook {
+        SetViewports = 0,
+        SetRenderTargets,
+        BeginRenderPass,
+        SetPipelineState,
+        ResetCommandList,
+        ClearState,
+        CreateGraphicsPipelineState,
+        CreateRenderTargetView,
+        ExecuteCommandLists,
+        Present,
+        CreatePipelineState,
+        LoadPipeline,
+
+        Count
+    };
+
+    enum class Counter {
+        ShadingRateMapsGenerated = 0,
+        // The updates skipped because the previous map of the resolution was still correct.
+        ShadingRateMapsReused,
+        // The Wait() commands inserted in the application's queues.
+        QueueWaits,
+
+        Count
+    };
+
+    // The values sampled upon Present(). With multiple devices, they are the ones of the device presenting last.
+    enum class Gauge {
+        CachedResolutions = 0,
+        DescriptorsInUse,
+        DescriptorCapacity,
+        IsGazeAvailable,
+
+        Count
+    };
+
+    constexpr size_t MaxSharedHooks = 32;
+    static_assert(static_cast<size_t>(Hook::Count) <= MaxSharedHooks);
+
+    // One call in HookTimingInterval (on each thread) is timed, the other ones are only counted.
+    constexpr uint32_t HookTimingInterval = 64;
+
+    struct SharedHookTelemetry {
+        std::atomic<uint64_t> NumCalls;
+        // The time spent in the injector, excluding the original method. Estimated from the timed calls.
+        std::atomic<uint64_t> CpuTimeMicroseconds;
+    };
+
+    // The layout of the shared memory section. It is updated once per Present() with relaxed stores, so a reader may
+    // see the values of two consecutive frames mixed. Fields are only appended, and Version is incremented when the
+    // meaning of an existing field changes. The counters are cumulative since the injector was loaded.
+    struct SharedTelemetry {
+        // 0 until the section is initialized.
+        std::atomic<uint32_t> Version;
+        uint32_t Size;
+
+        std::atomic<uint64_t> NumFrames;
+
+        std::atomic<uint64_t> NumShadingRateMapsGenerated;
+        std::atomic<uint64_t> NumShadingRateMapsReused;
+        std::atomic<uint64_t> NumQueueWaits;
+
+        SharedHookTelemetry Hooks[MaxSharedHooks];
+
+        std::atomic<uint64_t> NumCachedResolutions;
+        std::atomic<uint64_t> NumDescriptorsInUse;
+        std::atomic<uint64_t> DescriptorCapacity;
+        std::atomic<uint64_t> IsGazeAvailable;
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && sizeof(std::atomic<uint64_t>) == sizeof(uint64_t));
+
+    // Return whether the call must be timed.
+    bool CountHookCall(Hook Hook);
+    void AddHookTime(Hook Hook, int64_t Ticks);
+    void AddToCounter(Counter Counter, uint64_t Value);
+    void SetGauge(Gauge Gauge, uint64_t Value);
+
+    // Copy the counters to the shared memory section, creating it upon the first call.
+    void PublishFrame();
+
+    class HookTimer {
+      public:
+        HookTimer(Hook Hook) : m_Hook(Hook), m_IsTimed(CountHookCall(Hook)) {
+            if (m_IsTimed) {
+                QueryPerformanceCounter(&m_Start);
+            }
+        }
+
+        ~HookTimer() {
+            if (m_IsTimed) {
+                LARGE_INTEGER now;
+                QueryPerformanceCounter(&now);
+                AddHookTime(m_Hook, now.QuadPart - m_Start.QuadPart);
+            }
+        }
+
+      private:
+        const Hook m_Hook;
+        const bool m_IsTimed;
+        LARGE_INTEGER m_Start;
+    };
+
+} // namespace Telemetry
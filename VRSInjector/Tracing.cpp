@@ -0,0 +1,89 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pch.h"
+
+#include "Tracing.h"
+
+// The provider is defined outside of dllmain.cpp, so that the injector sources can be linked into other executables.
+namespace Tracing {
+
+    // {cbf3adcd-42b1-4c38-830b-95980af201f6}
+    TRACELOGGING_DEFINE_PROVIDER(g_traceProvider,
+                                 "VRSInjector",
+                                 (0xcbf3adcd, 0x42b1, 0x4e38, 0x93, 0x0b, 0x95, 0x98, 0x0a, 0xf2, 0x01, 0xf6));
+
+    namespace {
+
+        // The counters are incremented from all the threads recording command lists. Each thread uses its own shard
+        // (on its own cache line) so that they do not contend with each other.
+        constexpr size_t NumCounterShards = 16;
+        constexpr size_t NumCounters = static_cast<size_t>(Counter::Count);
+
+        struct alignas(64) CounterShard {
+            std::atomic<uint64_t> Values[NumCounters]{};
+        };
+
+        CounterShard g_CounterShards[NumCounterShards];
+        std::atomic<size_t> g_NextCounterShard{0};
+
+        CounterShard& GetCounterShard() {
+            thread_local CounterShard& shard = g_CounterShards[g_NextCounterShard++ % NumCounterShards];
+            return shard;
+        }
+
+        uint64_t CollectCounter(Counter Counter) {
+            uint64_t value = 0;
+            for (auto& shard : g_CounterShards) {
+                value += shard.Values[static_cast<size_t>(Counter)].exchange(0, std::memory_order_relaxed);
+            }
+            return value;
+        }
+
+    } // namespace
+
+    void IncrementCounter(Counter Counter) {
+        GetCounterShard().Values[static_cast<size_t>(Counter)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void TraceFrameCounters() {
+#if VRSINJECTOR_TRACING_LEVEL > VRSINJECTOR_TRACING_OFF
+        if (!IsTraceSummaryEnabled()) {
+            return;
+        }
+
+        TraceLoggingWrite(g_traceProvider,
+                          "FrameCounters",
+                          TraceLoggingKeyword(KeywordSummary),
+                          TLArg(CollectCounter(Counter::SetViewports), "NumSetViewports"),
+                          TLArg(CollectCounter(Counter::SetRenderTargets), "NumSetRenderTargets"),
+                          TLArg(CollectCounter(Counter::SetPipelineState), "NumSetPipelineState"),
+                          TLArg(CollectCounter(Counter::ResetCommandList), "NumResetCommandList"),
+                          TLArg(CollectCounter(Counter::ExecuteCommandLists), "NumExecuteCommandLists"),
+                          TLArg(CollectCounter(Counter::VRSEnable), "NumVRSEnable"),
+                          TLArg(CollectCounter(Counter::VRSDisable), "NumVRSDisable"),
+                          TLArg(CollectCounter(Counter::SameViewport), "NumSameViewport"),
+                          TLArg(CollectCounter(Counter::QueueWait), "NumQueueWait"));
+#endif
+    }
+
+} // namespace Tracing
@@ -22,7 +22,75 @@
 
 #pragma once
 
+// Tracing tiers, selected at compile time with VRSINJECTOR_TRACING_LEVEL:
+// - VRSINJECTOR_TRACING_OFF: the provider is never registered, and the hot path does not trace anything.
+// - VRSINJECTOR_TRACING_SUMMARY: the per-frame events, and per-frame counters of the calls on the hot path.
+// - VRSINJECTOR_TRACING_DETAIL: also the per-call events of the hot path.
+// At runtime, the per-frame counters and the per-call events are only recorded when a session enables the
+// KeywordSummary or KeywordDetail keyword respectively. Otherwise, each hot path macro costs a single branch.
+#define VRSINJECTOR_TRACING_OFF 0
+#define VRSINJECTOR_TRACING_SUMMARY 1
+#define VRSINJECTOR_TRACING_DETAIL 2
+
+#ifndef VRSINJECTOR_TRACING_LEVEL
+#define VRSINJECTOR_TRACING_LEVEL VRSINJECTOR_TRACING_DETAIL
+#endif
+
+#if VRSINJECTOR_TRACING_LEVEL > VRSINJECTOR_TRACING_OFF
 #define IsTraceEnabled() TraceLoggingProviderEnabled(Tracing::g_traceProvider, 0, 0)
+#define IsTraceSummaryEnabled() TraceLoggingProviderEnabled(Tracing::g_traceProvider, 0, Tracing::KeywordSummary)
+#define TraceCount(counter)                                                                                            \
+    do {                                                                                                               \
+        if (IsTraceSummaryEnabled()) {                                                                                 \
+            Tracing::IncrementCounter(Tracing::Counter::counter);                                                      \
+        }                                                                                                              \
+    } while (0)
+#else
+#define IsTraceEnabled() false
+#define IsTraceSummaryEnabled() false
+#define TraceCount(counter)                                                                                            \
+    do {                                                                                                               \
+    } while (0)
+#endif
+
+#if VRSINJECTOR_TRACING_LEVEL >= VRSINJECTOR_TRACING_DETAIL
+#define IsTraceDetailEnabled() TraceLoggingProviderEnabled(Tracing::g_traceProvider, 0, Tracing::KeywordDetail)
+// The activity is only started when the provider is enabled, in order to avoid creating an activity ID.
+#define TraceDetailActivity(activity)                                                                                  \
+    TraceLoggingActivity<Tracing::g_traceProvider, Tracing::KeywordDetail> activity;                                   \
+    const bool activity##IsEnabled = IsTraceDetailEnabled();
+#define TraceDetailWriteStart(activity, ...)                                                                           \
+    do {                                                                                                               \
+        if (activity##IsEnabled) {                                                                                     \
+            TraceLoggingWriteStart(activity, __VA_ARGS__);                                                             \
+        }                                                                                                              \
+    } while (0)
+#define TraceDetailWriteTagged(activity, ...)                                                                          \
+    do {                                                                                                               \
+        if (activity##IsEnabled) {                                                                                     \
+            TraceLoggingWriteTagged(activity, __VA_ARGS__);                                                            \
+        }                                                                                                              \
+    } while (0)
+#define TraceDetailWriteStop(activity, ...)                                                                            \
+    do {                                                                                                               \
+        if (activity##IsEnabled) {                                                                                     \
+            TraceLoggingWriteStop(activity, __VA_ARGS__);                                                              \
+        }                                                                                                              \
+    } while (0)
+#else
+#define IsTraceDetailEnabled() false
+#define TraceDetailActivity(activity)
+#define TraceDetailWriteStart(activity, ...)                                                                           \
+    do {                                                                                                               \
+    } while (0)
+#define TraceDetailWriteTagged(activity, ...)                                                                          \
+    do {                                                                                                               \
+    } while (0)
+#define TraceDetailWriteStop(activity, ...)                                                                            \
+    do {                                                                                                               \
+    } while (0)
+#endif
+
 #define TraceLocalActivity(activity) TraceLoggingActivity<Tracing::g_traceProvider> activity;
 #define TLArg(var, ...) TraceLoggingValue(var, ##__VA_ARGS__)
 #define TLPArg(var, ...) TraceLoggingPointer(var, ##__VA_ARGS__)
@@ -32,4 +100,28 @@ namespace Tracing {
     // {cbf3adcd-42b1-4c38-830b-95980af201f6}
     TRACELOGGING_DECLARE_PROVIDER(g_traceProvider);
 
+    // Events without a keyword are enabled with the provider.
+    constexpr uint64_t KeywordSummary = 0x1;
+    constexpr uint64_t KeywordDetail = 0x2;
+
+    // Calls on the hot path, counted for each frame.
+    enum class Counter {
+        SetViewports = 0,
+        SetRenderTargets,
+        SetPipelineState,
+        ResetCommandList,
+        ExecuteCommandLists,
+        VRSEnable,
+        VRSDisable,
+        SameViewport,
+        QueueWait,
+
+        Count
+    };
+
+    void IncrementCounter(Counter Counter);
+
+    // Emit the counters since the previous frame, and reset them.
+    void TraceFrameCounters();
+
 } // namespace Tracing
@@ -25,10 +25,15 @@
 #include "Check.h"
 #include "D3D12Utils.h"
 #include "EyeGaze.h"
+#include "Telemetry.h"
 #include "Tracing.h"
 #include "VRS.h"
 
-#include <GenerateShadingRateMapCS.h>
+#include <AnalyzeFrameCS.h>
+#include <GenerateShadingRateMapCS_LookupTable.h>
+#include <GenerateShadingRateMapCS_LookupTableBias.h>
+#include <GenerateShadingRateMapCS_Rings.h>
+#include <GenerateShadingRateMapCS_RingsBias.h>
 
 namespace {
 
@@ -37,58 +42,575 @@ namespace {
 
 #define Align(value, pad_to) (((value) + (pad_to)-1) & ~((pad_to)-1))
 
+    // Number of command list dependencies across all command managers.
+    std::atomic<uint32_t> g_NumPendingDependencies{0};
+
+    // Number of command managers waiting for the first submission of a frame to the presenting queue.
+    std::atomic<uint32_t> g_NumPendingFrameStarts{0};
+
     // We will use Root Constants to pass these values to the shader.
     struct GenerateShadingRateMapConstants {
-        float CenterX;
-        float CenterY;
-        float InnerRing;
-        float OuterRing;
-        uint32_t Rate1x1;
-        uint32_t RateMedium;
-        uint32_t RateLow;
+        float HorizontalScale;
+        uint32_t NumRings;
+        uint32_t OuterRate;
+        uint32_t LookupTableSize;
+        float LookupTableScale;
+        uint32_t NumFoveae;
+        uint32_t Padding[2];
+        float RingRadius[MaxFoveationRings];
+        uint32_t RingRate[MaxFoveationRings];
+        // Center (in tiles) and distance scale of each fovea.
+        struct {
+            float CenterX;
+            float CenterY;
+            float DistanceScale;
+            float Padding;
+        } Foveae[MaxFoveae];
+        // Convert a tile of the shading rate map into a tile of the content-adaptive bias texture.
+        float BiasScaleX;
+        float BiasScaleY;
+        uint32_t UseBias;
+        uint32_t MaxAxisRate;
+        uint32_t RateOffset;
+        uint32_t Padding2[3];
     };
     static_assert(!(sizeof(GenerateShadingRateMapConstants) % 4), "Constants size must be a multiple of 4 bytes");
     static_assert(sizeof(GenerateShadingRateMapConstants) / 4 < 64, "Maximum of 64 constants");
+    static_assert(sizeof(GenerateShadingRateMapConstants) / 4 == 48, "Must match the root signature of the shader");
+
+    struct ShaderPermutation {
+        const wchar_t* Name;
+        D3D12_SHADER_BYTECODE Bytecode;
+    };
+
+    // The permutations of GenerateShadingRateMapCS, indexed by [UseLookupTable][UseBias].
+    const ShaderPermutation GenerateShadingRateMapPermutations[2][2] = {
+        {{L"GenerateShadingRateMapCS_Rings",
+          {g_GenerateShadingRateMapCS_Rings, sizeof(g_GenerateShadingRateMapCS_Rings)}},
+         {L"GenerateShadingRateMapCS_RingsBias",
+          {g_GenerateShadingRateMapCS_RingsBias, sizeof(g_GenerateShadingRateMapCS_RingsBias)}}},
+        {{L"GenerateShadingRateMapCS_LookupTable",
+          {g_GenerateShadingRateMapCS_LookupTable, sizeof(g_GenerateShadingRateMapCS_LookupTable)}},
+         {L"GenerateShadingRateMapCS_LookupTableBias",
+          {g_GenerateShadingRateMapCS_LookupTableBias, sizeof(g_GenerateShadingRateMapCS_LookupTableBias)}}},
+    };
+
+    // A pipeline library is only valid for one adapter and driver, and our shaders change between builds. Name the file
+    // after all of them.
+    std::filesystem::path GetPipelineLibraryPath(IDXGIAdapter* Adapter) {
+        DXGI_ADAPTER_DESC desc{};
+        LARGE_INTEGER driverVersion{};
+        if (Adapter) {
+            Adapter->GetDesc(&desc);
+            Adapter->CheckInterfaceSupport(__uuidof(IDXGIDevice), &driverVersion);
+        }
+
+        // FNV-1a.
+        uint32_t shadersHash = 2166136261u;
+        const auto hashShader = [&](const D3D12_SHADER_BYTECODE& Shader) {
+            for (size_t i = 0; i < Shader.BytecodeLength; i++) {
+                shadersHash = (shadersHash ^ static_cast<const uint8_t*>(Shader.pShaderBytecode)[i]) * 16777619u;
+            }
+        };
+        hashShader({g_AnalyzeFrameCS, sizeof(g_AnalyzeFrameCS)});
+        for (const auto& permutations : GenerateShadingRateMapPermutations) {
+            for (const ShaderPermutation& permutation : permutations) {
+                hashShader(permutation.Bytecode);
+            }
+        }
+
+        std::error_code error;
+        return std::filesystem::temp_directory_path(error) / "VRSInjector" /
+               fmt::format("PipelineLibrary-{:04x}-{:04x}-{:016x}-{:08x}.bin",
+                           desc.VendorId,
+                           desc.DeviceId,
+                           static_cast<uint64_t>(driverVersion.QuadPart),
+                           shadersHash);
+    }
+
+    struct AnalyzeFrameConstants {
+        uint32_t TileSize;
+        uint32_t Width;
+        uint32_t Height;
+        uint32_t UseHistory;
+    };
+    static_assert(!(sizeof(AnalyzeFrameConstants) % 4), "Constants size must be a multiple of 4 bytes");
+    static_assert(sizeof(AnalyzeFrameConstants) / 4 == 4, "Must match the root signature of the shader");
+
+    // Without support for the additional shading rates, only up to 2 pixels per axis are supported.
+    D3D12_SHADING_RATE ClampShadingRate(D3D12_SHADING_RATE Rate, bool AdditionalShadingRatesSupported) {
+        if (AdditionalShadingRatesSupported) {
+            return Rate;
+        }
+
+        const UINT x = std::min((static_cast<UINT>(Rate) >> 2) & 3, 1u);
+        const UINT y = std::min(static_cast<UINT>(Rate) & 3, 1u);
+        return static_cast<D3D12_SHADING_RATE>((x << 2) | y);
+    }
+
+    bool IsAvx2Supported() {
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
+        }
+
+        // The OS must also save the AVX registers.
+        __cpuid(info, 1);
+        const bool isOsxsaveSupported = info[2] & (1 << 27);
+        const bool isAvxSupported = info[2] & (1 << 28);
+        if (!isOsxsaveSupported || !isAvxSupported || (_xgetbv(0) & 6) != 6) {
+            return false;
+        }
+
+        __cpuidex(info, 7, 0);
+        return info[1] & (1 << 5);
+    }
+
+    // The CPU equivalent of GenerateShadingRateMapCS, without the content-adaptive bias. The computations follow the
+    // shader step by step, so that both produce the same maps.
+    uint8_t GenerateShadingRate(const GenerateShadingRateMapConstants& Constants,
+                                const D3D12_SHADING_RATE* LookupTable,
+                                UINT X,
+                                UINT Y) {
+        float distance = 1e30f;
+        for (uint32_t j = 0; j < Constants.NumFoveae; j++) {
+            const float fromCenterX = (X - Constants.Foveae[j].CenterX) / Constants.HorizontalScale;
+            const float fromCenterY = Y - Constants.Foveae[j].CenterY;
+            distance = std::min(distance,
+                                std::sqrt(fromCenterX * fromCenterX + fromCenterY * fromCenterY) *
+                                    Constants.Foveae[j].DistanceScale);
+        }
+
+        uint32_t rate = Constants.OuterRate;
+        if (Constants.LookupTableSize) {
+            const uint32_t index = static_cast<uint32_t>(
+                std::min(distance * Constants.LookupTableScale, static_cast<float>(Constants.LookupTableSize)));
+            if (index < Constants.LookupTableSize) {
+                rate = LookupTable[index];
+            }
+        } else {
+            for (uint32_t i = 0; i < Constants.NumRings; i++) {
+                if (distance < Constants.RingRadius[i]) {
+                    rate = Constants.RingRate[i];
+                    break;
+                }
+            }
+        }
+
+        if (Constants.RateOffset) {
+            uint32_t x = rate >> 2;
+            uint32_t y = rate & 3;
+            if (rate != 0) {
+                x += Constants.RateOffset;
+                y += Constants.RateOffset;
+            }
+            x = std::min(x, Constants.MaxAxisRate);
+            y = std::min(y, Constants.MaxAxisRate);
+
+            // There are no 1X4 and 4X1 rates.
+            x = std::max(x, y - std::min(y, 1u));
+            y = std::max(y, x - std::min(x, 1u));
+            rate = (x << 2) | y;
+        }
+
+        return static_cast<uint8_t>(rate);
+    }
+
+    // Same as GenerateShadingRate(), for 8 consecutive tiles of a row.
+    void GenerateShadingRates8Avx2(const GenerateShadingRateMapConstants& Constants,
+                                   const D3D12_SHADING_RATE* LookupTable,
+                                   UINT X,
+                                   UINT Y,
+                                   uint8_t* Rates) {
+        const __m256 x = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(X)),
+                                       _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f));
+        __m256 distance = _mm256_set1_ps(1e30f);
+        for (uint32_t j = 0; j < Constants.NumFoveae; j++) {
+            const __m256 fromCenterX = _mm256_div_ps(_mm256_sub_ps(x, _mm256_set1_ps(Constants.Foveae[j].CenterX)),
+                                                     _mm256_set1_ps(Constants.HorizontalScale));
+            const float fromCenterY = Y - Constants.Foveae[j].CenterY;
+            const __m256 squared = _mm256_add_ps(_mm256_mul_ps(fromCenterX, fromCenterX),
+                                                 _mm256_set1_ps(fromCenterY * fromCenterY));
+            distance = _mm256_min_ps(
+                distance, _mm256_mul_ps(_mm256_sqrt_ps(squared), _mm256_set1_ps(Constants.Foveae[j].DistanceScale)));
+        }
+
+        __m256i rate = _mm256_set1_epi32(Constants.OuterRate);
+        if (Constants.LookupTableSize) {
+            const __m256 size = _mm256_set1_ps(static_cast<float>(Constants.LookupTableSize));
+            const __m256i index = _mm256_cvttps_epi32(
+                _mm256_min_ps(_mm256_mul_ps(distance, _mm256_set1_ps(Constants.LookupTableScale)), size));
+            const __m256i isInTable = _mm256_cmpgt_epi32(_mm256_set1_epi32(Constants.LookupTableSize), index);
+            rate = _mm256_mask_i32gather_epi32(rate, reinterpret_cast<const int*>(LookupTable), index, isInTable, 4);
+        } else {
+            // Walk the rings outward-in, so that the innermost ring containing the tile wins.
+            for (uint32_t i = Constants.NumRings; i > 0; i--) {
+                const __m256 isInRing =
+                    _mm256_cmp_ps(distance, _mm256_set1_ps(Constants.RingRadius[i - 1]), _CMP_LT_OQ);
+                rate = _mm256_blendv_epi8(
+                    rate, _mm256_set1_epi32(Constants.RingRate[i - 1]), _mm256_castps_si256(isInRing));
+            }
+        }
+
+        if (Constants.RateOffset) {
+            const __m256i one = _mm256_set1_epi32(1);
+            const __m256i maxAxisRate = _mm256_set1_epi32(Constants.MaxAxisRate);
+            const __m256i offset = _mm256_andnot_si256(_mm256_cmpeq_epi32(rate, _mm256_setzero_si256()),
+                                                       _mm256_set1_epi32(Constants.RateOffset));
+            __m256i rateX = _mm256_add_epi32(_mm256_srli_epi32(rate, 2), offset);
+            __m256i rateY = _mm256_add_epi32(_mm256_and_si256(rate, _mm256_set1_epi32(3)), offset);
+            rateX = _mm256_min_epu32(rateX, maxAxisRate);
+            rateY = _mm256_min_epu32(rateY, maxAxisRate);
+            rateX = _mm256_max_epu32(rateX, _mm256_sub_epi32(rateY, _mm256_min_epu32(rateY, one)));
+            rateY = _mm256_max_epu32(rateY, _mm256_sub_epi32(rateX, _mm256_min_epu32(rateX, one)));
+            rate = _mm256_or_si256(_mm256_slli_epi32(rateX, 2), rateY);
+        }
+
+        // The rates fit in a byte.
+        const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(rate), _mm256_extracti128_si256(rate, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(Rates), _mm_packus_epi16(words, words));
+    }
+
+    void GenerateShadingRateMapRow(const GenerateShadingRateMapConstants& Constants,
+                                   const D3D12_SHADING_RATE* LookupTable,
+                                   UINT Y,
+                                   UINT Width,
+                                   bool UseAvx2,
+                                   uint8_t* Row) {
+        UINT x = 0;
+        if (UseAvx2) {
+            for (; x + 8 <= Width; x += 8) {
+                GenerateShadingRates8Avx2(Constants, LookupTable, x, Y, Row + x);
+            }
+        }
+        for (; x < Width; x++) {
+            Row[x] = GenerateShadingRate(Constants, LookupTable, x, Y);
+        }
+    }
+
+    // We set all combiners to MAX, so that the coarsest wins (per-drawcall, per-primitive, VRS surface).
+    const D3D12_SHADING_RATE_COMBINER ShadingRateCombiners[D3D12_RS_SET_SHADING_RATE_COMBINER_COUNT] = {
+        D3D12_SHADING_RATE_COMBINER_MAX, D3D12_SHADING_RATE_COMBINER_MAX};
+
+    // A viewport within a shading rate map, in tiles.
+    struct TiledViewport {
+        UINT Left;
+        UINT Top;
+        UINT Width;
+        UINT Height;
+
+        bool operator==(const TiledViewport& other) const {
+            return Left == other.Left && Top == other.Top && Width == other.Width && Height == other.Height;
+        }
+    };
 
-    struct TiledResolution {
+    // The size of a shading rate map and the viewports it covers, with one fovea per viewport.
+    struct ShadingRateMapLayout {
         UINT Width;
         UINT Height;
+        UINT NumViewports;
+        TiledViewport Viewports[MaxFoveae];
+
+        bool operator==(const ShadingRateMapLayout& other) const {
+            if (Width != other.Width || Height != other.Height || NumViewports != other.NumViewports) {
+                return false;
+            }
+            for (UINT i = 0; i < NumViewports; i++) {
+                if (!(Viewports[i] == other.Viewports[i])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        size_t operator()(const ShadingRateMapLayout& key) const {
+            size_t hash = std::hash<UINT>{}(key.Width);
+            const auto combine = [&hash](UINT value) {
+                hash ^= std::hash<UINT>{}(value) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+            };
+            combine(key.Height);
+            for (UINT i = 0; i < key.NumViewports; i++) {
+                combine(key.Viewports[i].Left);
+                combine(key.Viewports[i].Top);
+                combine(key.Viewports[i].Width);
+                combine(key.Viewports[i].Height);
+            }
+            return hash;
+        }
+    };
+
+    ComPtr<ID3D12GraphicsCommandList5> GetVrsCommandList(ID3D12CommandList* pCommandList) {
+        ComPtr<ID3D12GraphicsCommandList5> vrsCommandList;
+        CHECK_HRCMD(pCommandList->QueryInterface(IID_PPV_ARGS(vrsCommandList.ReleaseAndGetAddressOf())));
+        return vrsCommandList;
+    }
+
+    // Classify the scale of the upscaler input to the presented resolution. Dynamic resolution may render anywhere in
+    // between the tiers, so we pick the closest one below.
+    UpscalerTier GetUpscalerTier(float RenderScale) {
+        if (RenderScale >= 0.62f) {
+            return UpscalerTier::Quality;
+        } else if (RenderScale >= 0.54f) {
+            return UpscalerTier::Balanced;
+        } else if (RenderScale >= 0.42f) {
+            return UpscalerTier::Performance;
+        }
+        return UpscalerTier::UltraPerformance;
+    }
+
+    // Open-addressed table of the fence values that command lists must wait for before their execution.
+    // Recording threads and submitting threads never block each other: slots are claimed with a compare-and-swap on
+    // their key, and the low bit of the key is used as a busy flag while the values of the slot are being accessed,
+    // which only lasts a few instructions. Keys never go back to empty, instead the slots whose dependency was retired
+    // or has expired are reused for new command lists. A command list only ever lives within the first kMaxProbes
+    // slots of its probe sequence, so that lookups stay short once all the slots have been used.
+    class CommandListDependencyTable {
+      public:
+        // Record the dependency of a command list. Returns false if the table is full.
+        bool Insert(ID3D12CommandList* CommandList,
+                    uint64_t FenceValue,
+                    uint64_t Epoch,
+                    uint64_t MinEpoch,
+                    bool& AddedDependency) {
+            const uintptr_t key = reinterpret_cast<uintptr_t>(CommandList);
+            AddedDependency = false;
+
+            // Update the existing slot for this command list if there is one.
+            if (Slot* slot = Find(key)) {
+                if (Lock(*slot, key)) {
+                    // An expired dependency is still accounted for in the pending count.
+                    AddedDependency = !slot->FenceValue;
+                    slot->FenceValue = FenceValue;
+                    slot->Epoch = Epoch;
+                    Unlock(*slot, key);
+                    return true;
+                }
+            }
+
+            // Otherwise claim an empty slot, or one that is no longer in use.
+            const size_t start = Hash(key);
+            for (size_t i = 0; i < kMaxProbes; i++) {
+                Slot& slot = m_Slots[(start + i) & (kCapacity - 1)];
+                uintptr_t current = slot.Key.load(std::memory_order_acquire);
+                while (true) {
+                    if (current & kBusy) {
+                        YieldProcessor();
+                        current = slot.Key.load(std::memory_order_acquire);
+                        continue;
+                    }
+                    if (!slot.Key.compare_exchange_weak(current, current | kBusy, std::memory_order_acquire)) {
+                        continue;
+                    }
+
+                    // We now own the slot.
+                    const bool isFree = !current || !slot.FenceValue || slot.Epoch < MinEpoch;
+                    if (!isFree) {
+                        Unlock(slot, current);
+                        break;
+                    }
+                    // An expired dependency is being replaced, and we must remove it from the pending count.
+                    const bool wasPending = current && slot.FenceValue;
+                    slot.FenceValue = FenceValue;
+                    slot.Epoch = Epoch;
+                    Unlock(slot, key);
+                    AddedDependency = !wasPending;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // Remove the dependency of a command list, and return the fence value to wait for (0 if none).
+        uint64_t Retire(ID3D12CommandList* CommandList, uint64_t MinEpoch, bool& RemovedDependency) {
+            const uintptr_t key = reinterpret_cast<uintptr_t>(CommandList);
+            RemovedDependency = false;
+
+            Slot* slot = Find(key);
+            if (!slot || !Lock(*slot, key)) {
+                return 0;
+            }
+
+            const uint64_t fenceValue = slot->FenceValue;
+            const uint64_t epoch = slot->Epoch;
+            slot->FenceValue = 0;
+            Unlock(*slot, key);
+
+            RemovedDependency = fenceValue != 0;
+            return epoch >= MinEpoch ? fenceValue : 0;
+        }
+
+        // Remove the expired dependencies (an application may have started then abandoned a command list), and return
+        // how many were removed.
+        UINT Expire(uint64_t MinEpoch) {
+            UINT numExpired = 0;
+            for (Slot& slot : m_Slots) {
+                const uintptr_t key = slot.Key.load(std::memory_order_relaxed) & ~kBusy;
+                if (!key || !Lock(slot, key)) {
+                    continue;
+                }
+                if (slot.FenceValue && slot.Epoch < MinEpoch) {
+                    slot.FenceValue = 0;
+                    numExpired++;
+                }
+                Unlock(slot, key);
+            }
+            return numExpired;
+        }
+
+      private:
+        static constexpr size_t kCapacity = 4096; // Must be a power of 2.
+        static constexpr size_t kMaxProbes = 32;
+        static constexpr uintptr_t kBusy = 1;
+
+        struct alignas(32) Slot {
+            std::atomic<uintptr_t> Key{0};
+            // The members below are protected by the busy bit of the key.
+            uint64_t FenceValue{0};
+            uint64_t Epoch{0};
+        };
 
-        bool operator==(const TiledResolution& other) const {
-            return (Width == other.Width && Height == other.Height);
+        static size_t Hash(uintptr_t Key) {
+            // Fibonacci hashing, ignoring the low bits that are always 0 due to alignment.
+            return static_cast<size_t>(((static_cast<uint64_t>(Key) >> 4) * 0x9E3779B97F4A7C15ull) >> 32);
         }
 
-        size_t operator()(const TiledResolution& key) const {
-            auto hash1 = std::hash<UINT>{}(key.Width);
-            auto hash2 = std::hash<UINT>{}(key.Height);
+        Slot* Find(uintptr_t Key) {
+            const size_t start = Hash(Key);
+            for (size_t i = 0; i < kMaxProbes; i++) {
+                Slot& slot = m_Slots[(start + i) & (kCapacity - 1)];
+                const uintptr_t current = slot.Key.load(std::memory_order_acquire) & ~kBusy;
+                if (current == Key) {
+                    return &slot;
+                }
+                if (!current) {
+                    // Keys are never removed, so the probe sequence ends on the first empty slot.
+                    break;
+                }
+            }
+            return nullptr;
+        }
 
-            if (hash1 != hash2) {
-                return hash1 ^ hash2;
+        // Returns false if the slot was reassigned to another command list.
+        static bool Lock(Slot& Slot, uintptr_t Key) {
+            uintptr_t expected = Key;
+            while (!Slot.Key.compare_exchange_weak(expected, Key | kBusy, std::memory_order_acquire)) {
+                if ((expected & ~kBusy) != Key) {
+                    return false;
+                }
+                expected = Key;
+                YieldProcessor();
             }
+            return true;
+        }
 
-            // If hash1 == hash2, their XOR is zero.
-            return hash1;
+        static void Unlock(Slot& Slot, uintptr_t Key) {
+            Slot.Key.store(Key, std::memory_order_release);
         }
+
+        Slot m_Slots[kCapacity];
     };
 
     struct CommandManager : ICommandManager {
+        // The inputs used to generate a shading rate map, quantized to the shading rate map tiles.
+        struct ShadingRateMapParameters {
+            // The center of the fovea of each viewport.
+            float CenterX[MaxFoveae]{};
+            float CenterY[MaxFoveae]{};
+            float ScaleFactor{0.f};
+            UINT RateOffset{0};
+            // The analysis of the application's frame used for the content-adaptive bias (0 for none).
+            uint64_t BiasGeneration{0};
+            // The foveation profile, which changes when the options are updated.
+            uint64_t ProfileVersion{0};
+            // The level of the frame time controller, which changes the scale factor and the rate offset.
+            uint64_t ControllerVersion{0};
+            // The scale of the rings when the layout is the upscaler input, which changes the scale factor.
+            float RingScale{1.f};
+
+            bool operator==(const ShadingRateMapParameters& other) const {
+                return !memcmp(CenterX, other.CenterX, sizeof(CenterX)) &&
+                       !memcmp(CenterY, other.CenterY, sizeof(CenterY)) && ScaleFactor == other.ScaleFactor &&
+                       RateOffset == other.RateOffset && BiasGeneration == other.BiasGeneration &&
+                       ProfileVersion == other.ProfileVersion && ControllerVersion == other.ControllerVersion &&
+                       RingScale == other.RingScale;
+            }
+        };
+
         struct ShadingRateMap {
             uint64_t Generation{0};
-            unsigned int Age{0};
             ComPtr<ID3D12Resource> ShadingRateTexture;
-            D3D12_CPU_DESCRIPTOR_HANDLE UAV;
-            D3D12_GPU_DESCRIPTOR_HANDLE UAVDescriptor;
+            D3D12_CPU_DESCRIPTOR_HANDLE UAV{};
             uint64_t CompletedFenceValue{0};
+            uint64_t LastUsedGeneration{0};
+            bool IsFreshTexture{true};
+            ResourcePlacement Placement;
+            ShadingRateMapParameters Parameters;
         };
 
-        struct CommandListDependency {
-            uint64_t FenceValue;
-            unsigned int Age{0};
+        // The successive generations of the shading rate map for a given layout are written to a ring of textures.
+        struct ShadingRateMapRing {
+            std::vector<ShadingRateMap> Buffers;
+            size_t Newest{0};
+            uint64_t Generation{0};
+            // Atomic since it may be reset while holding a shared lock.
+            std::atomic<unsigned int> Age{0};
+        };
+        using ShadingRateMapCache = std::unordered_map<ShadingRateMapLayout, ShadingRateMapRing, ShadingRateMapLayout>;
+
+        // The textures of the content-adaptive bias, for one resolution of the presented image.
+        struct BiasResources {
+            // The bias is double-buffered, so that the analysis of a frame never waits for the generation of the
+            // shading rate maps reading the bias of the previous frame.
+            struct {
+                ComPtr<ID3D12Resource> Texture;
+                D3D12_CPU_DESCRIPTOR_HANDLE SRV{};
+                D3D12_CPU_DESCRIPTOR_HANDLE UAV{};
+                // The latest generation of the shading rate maps reading the buffer.
+                uint64_t LastReadFenceValue{0};
+            } Bias[2];
+
+            // The history is only accessed by the analysis, on the presenting queue.
+            ComPtr<ID3D12Resource> History;
+            D3D12_CPU_DESCRIPTOR_HANDLE HistoryUAV{};
+
+            // When the back buffers cannot be used as shader resources, the analysis reads a copy of them.
+            ComPtr<ID3D12Resource> FrameCopy;
+            D3D12_CPU_DESCRIPTOR_HANDLE FrameCopySRV{};
+
+            D3D12_RESOURCE_DESC FrameDesc{};
+            uint64_t LastAnalysisFenceValue{0};
+        };
+
+        // Shading rate map updates recorded into a single command list, and submitted with a single fence signal.
+        struct ShadingRateMapBatch {
+            std::optional<CommandList> Commands;
+            std::vector<ShadingRateMap*> UpdatedShadingRateMaps;
+            // The state currently bound to the command list.
+            bool IsComputeBound{false};
+            ID3D12DescriptorHeap* DescriptorHeap{nullptr};
         };
 
-        CommandManager(ID3D12Device* Device) : m_Device(Device) {
+        CommandManager(ID3D12Device* Device, const CommandManagerOptions& Options)
+            : m_Device(Device), m_NumShadingRateMapBuffers(std::max(Options.NumShadingRateMapBuffers, 2u)),
+              m_PregenerateAtPresent(Options.PregenerateAtPresent),
+              m_UseContentAdaptiveRates(Options.UseContentAdaptiveRates),
+              m_UseCpuGeneration(Options.UseCpuGeneration && !Options.UseContentAdaptiveRates),
+              m_Profile(Options.Profile),
+              m_TargetGpuFrameTime(Options.TargetGpuFrameTime),
+              m_GpuFrameTimeHysteresis(std::clamp(Options.GpuFrameTimeHysteresis, 0.f, 0.5f)),
+              m_ShadingRateMapBudget(Options.ShadingRateMapBudget),
+              m_ShadingRateMapMaxAge(Options.ShadingRateMapMaxAge),
+              m_ShadingRateMapSharingTolerance(std::min(Options.ShadingRateMapSharingTolerance, 16u)),
+              m_UpscalerDetectionFrames(Options.UpscalerDetectionFrames) {
+            std::copy_n(Options.UpscalerRingScale, UpscalerTierCount, m_UpscalerRingScale);
+
             TraceLocalActivity(local);
-            TraceLoggingWriteStart(local, "VRSCreate", TLPArg(Device, "Device"));
+            TraceLoggingWriteStart(local,
+                                   "VRSCreate",
+                                   TLPArg(Device, "Device"),
+                                   TLArg(m_NumShadingRateMapBuffers, "NumShadingRateMapBuffers"));
 
             // Check for support on this device.
             D3D12_FEATURE_DATA_D3D12_OPTIONS6 options{};
@@ -103,344 +625,2133 @@ namespace {
             }
             m_VRSTileSize = options.ShadingRateImageTileSize;
 
+            // Watch the video memory budget, in order to release our unused maps first under memory pressure.
+            ComPtr<IDXGIFactory4> dxgiFactory;
+            if (SUCCEEDED(CreateDXGIFactory1(IID_PPV_ARGS(dxgiFactory.ReleaseAndGetAddressOf()))) &&
+                SUCCEEDED(dxgiFactory->EnumAdapterByLuid(m_Device->GetAdapterLuid(),
+                                                         IID_PPV_ARGS(m_Adapter.ReleaseAndGetAddressOf())))) {
+                *m_VideoMemoryBudgetEvent.put() = CreateEventEx(nullptr, L"Video Memory Budget", 0, EVENT_ALL_ACCESS);
+                if (FAILED(m_Adapter->RegisterVideoMemoryBudgetChangeNotificationEvent(
+                        m_VideoMemoryBudgetEvent.get(), &m_VideoMemoryBudgetCookie))) {
+                    m_VideoMemoryBudgetCookie = 0;
+                }
+                UpdateVideoMemoryPressure(true /* forceQuery */);
+            }
+
+            m_MaxAxisRate = options.AdditionalShadingRatesSupported ? 2u : 1u;
+            m_AdditionalShadingRatesSupported = options.AdditionalShadingRatesSupported;
+            NormalizeProfile(m_Profile);
+            TraceLoggingWriteTagged(local,
+                                    "VRSCreate_Profile",
+                                    TLArg(m_Profile.Rings.size(), "NumRings"),
+                                    TLArg((UINT)m_Profile.OuterRate, "OuterRate"),
+                                    TLArg(m_Profile.HorizontalScale, "HorizontalScale"),
+                                    TLArg(m_Profile.LookupTable.size(), "LookupTableSize"),
+                                    TLArg(!!options.AdditionalShadingRatesSupported, "AdditionalRates"));
+
             // Create a command context where we will perform the generation of the shading rate textures.
-            m_Context = std::make_unique<CommandContext>(m_Device.Get(), L"Shading Rate Map Creation");
-
-            // Create resources for the GenerateShadingRateMap compute shader.
-            D3D12_ROOT_SIGNATURE_DESC rootSignatureDesc{};
-            D3D12_DESCRIPTOR_RANGE uavRange;
-            CD3DX12_DESCRIPTOR_RANGE::Init(uavRange, D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 0);
-            D3D12_ROOT_PARAMETER rootParameters[2];
-            CD3DX12_ROOT_PARAMETER::InitAsDescriptorTable(rootParameters[0], 1, &uavRange);
-            CD3DX12_ROOT_PARAMETER::InitAsConstants(rootParameters[1], sizeof(GenerateShadingRateMapConstants) / 4, 0);
-            rootSignatureDesc.pParameters = rootParameters;
-            rootSignatureDesc.NumParameters = ARRAYSIZE(rootParameters);
-
-            ComPtr<ID3DBlob> rootSignatureBlob;
-            ComPtr<ID3DBlob> error;
-            CHECK_MSG(SUCCEEDED(D3D12SerializeRootSignature(&rootSignatureDesc,
-                                                            D3D_ROOT_SIGNATURE_VERSION_1,
-                                                            rootSignatureBlob.GetAddressOf(),
-                                                            error.GetAddressOf())),
-                      (char*)error->GetBufferPointer());
-
-            CHECK_HRCMD(m_Device->CreateRootSignature(0,
-                                                      rootSignatureBlob->GetBufferPointer(),
-                                                      rootSignatureBlob->GetBufferSize(),
-                                                      IID_PPV_ARGS(m_GenerateRootSignature.ReleaseAndGetAddressOf())));
-            m_GenerateRootSignature->SetName(L"GenerateShadingRateMapCS Root Signature");
-
-            D3D12_COMPUTE_PIPELINE_STATE_DESC computeDesc{};
-            computeDesc.CS.pShaderBytecode = g_GenerateShadingRateMapCS;
-            computeDesc.CS.BytecodeLength = ARRAYSIZE(g_GenerateShadingRateMapCS);
-            computeDesc.pRootSignature = m_GenerateRootSignature.Get();
-            CHECK_HRCMD(m_Device->CreateComputePipelineState(&computeDesc,
-                                                             IID_PPV_ARGS(m_GeneratePSO.ReleaseAndGetAddressOf())));
-            m_GeneratePSO->SetName(L"GenerateShadingRateMapCS PSO");
+            m_Context = std::make_unique<CommandContext>(
+                m_Device.Get(),
+                L"Shading Rate Map Creation",
+                Options.UseAsyncCompute ? D3D12_COMMAND_LIST_TYPE_COMPUTE : D3D12_COMMAND_LIST_TYPE_DIRECT,
+                Options.UseAsyncCompute && Options.UseHighPriorityCompute ? D3D12_COMMAND_QUEUE_PRIORITY_HIGH
+                                                                          : D3D12_COMMAND_QUEUE_PRIORITY_NORMAL);
+            // The SHADING_RATE_SOURCE state cannot be used on a compute queue. Instead we create the textures with
+            // simultaneous access, so that they implicitly promote from the COMMON state to UNORDERED_ACCESS on our
+            // queue and to SHADING_RATE_SOURCE on the application's queue, and decay back to COMMON after each
+            // ExecuteCommandLists(). The cross-queue ordering is handled by the Wait() inserted in SyncQueue().
+            m_UseImplicitTransitions = m_Context->GetType() != D3D12_COMMAND_LIST_TYPE_DIRECT;
+
+            if (m_UseCpuGeneration) {
+                // The maps are generated on the CPU, then copied from the upload ring. Leave room for two of the
+                // largest maps.
+                const UINT64 maxTiles = D3D12_REQ_TEXTURE2D_U_OR_V_DIMENSION / m_VRSTileSize;
+                const UINT64 maxShadingRateMapSize =
+                    Align(maxTiles, static_cast<UINT64>(D3D12_TEXTURE_DATA_PITCH_ALIGNMENT)) * maxTiles;
+                m_UploadRing = std::make_unique<UploadRing>(
+                    m_Device.Get(), std::max(4ull * 1024 * 1024, 2 * maxShadingRateMapSize), L"Shading Rate Map");
+                m_IsAvx2Supported = IsAvx2Supported();
+                TraceLoggingWriteTagged(local, "VRSCreate_CpuGeneration", TLArg(m_IsAvx2Supported, "IsAvx2Supported"));
+            } else {
+                // Our pipeline states are compiled once, then loaded from the pipeline library.
+                const std::filesystem::path pipelineLibraryPath = GetPipelineLibraryPath(m_Adapter.Get());
+                TraceLoggingWriteTagged(
+                    local, "VRSCreate_PipelineLibrary", TLArg(pipelineLibraryPath.c_str(), "PipelineLibraryPath"));
+                m_PipelineLibrary = std::make_unique<PipelineLibrary>(m_Device.Get(), pipelineLibraryPath);
+
+                // Create resources for the GenerateShadingRateMap compute shader. Use the permutation specialized for
+                // the shape of the profile and for the content-adaptive bias. The root signature is embedded in the
+                // shader.
+                const ShaderPermutation& permutation =
+                    GenerateShadingRateMapPermutations[!m_Profile.LookupTable.empty()][m_UseContentAdaptiveRates];
+                TraceLoggingWriteTagged(local, "VRSCreate_GenerateShader", TLArg(permutation.Name, "Permutation"));
+                CHECK_HRCMD(
+                    m_Device->CreateRootSignature(0,
+                                                  permutation.Bytecode.pShaderBytecode,
+                                                  permutation.Bytecode.BytecodeLength,
+                                                  IID_PPV_ARGS(m_GenerateRootSignature.ReleaseAndGetAddressOf())));
+                m_GenerateRootSignature->SetName(L"GenerateShadingRateMapCS Root Signature");
+
+                D3D12_COMPUTE_PIPELINE_STATE_DESC computeDesc{};
+                computeDesc.CS = permutation.Bytecode;
+                computeDesc.pRootSignature = m_GenerateRootSignature.Get();
+                m_GeneratePSO = m_PipelineLibrary->LoadComputePipeline(permutation.Name, computeDesc);
+                m_GeneratePSO->SetName(L"GenerateShadingRateMapCS PSO");
+            }
+
+            // Reserve the memory for our shading rate textures, so that creating them on the application's thread does
+            // not require any memory allocation.
+            m_ShadingRateTextureAllocator =
+                std::make_unique<PlacedResourceAllocator>(m_Device.Get(),
+                                                          16ull * 1024 * 1024,
+                                                          D3D12_HEAP_FLAG_ALLOW_ONLY_NON_RT_DS_TEXTURES,
+                                                          L"Shading Rate Map");
 
             // Create a descriptor heap for the UAVs for our shading rate textures.
             m_HeapForUAVs = std::make_unique<DescriptorHeap>(
                 m_Device.Get(), D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, 128u, L"Shading Rate Map UAV");
 
+            // Create the lookup table of the profile. It is small and written once, so it is read directly from the
+            // upload heap. Without a lookup table, we still need a valid (null) descriptor.
+            D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc{};
+            srvDesc.ViewDimension = D3D12_SRV_DIMENSION_BUFFER;
+            srvDesc.Format = DXGI_FORMAT_UNKNOWN;
+            srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+            srvDesc.Buffer.StructureByteStride = sizeof(uint32_t);
+            srvDesc.Buffer.NumElements = std::max(static_cast<UINT>(m_Profile.LookupTable.size()), 1u);
+            if (!m_Profile.LookupTable.empty()) {
+                const D3D12_HEAP_PROPERTIES uploadHeap = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD);
+                const D3D12_RESOURCE_DESC bufferDesc =
+                    CD3DX12_RESOURCE_DESC::Buffer(m_Profile.LookupTable.size() * sizeof(uint32_t));
+                CHECK_HRCMD(m_Device->CreateCommittedResource(&uploadHeap,
+                                                              D3D12_HEAP_FLAG_NONE,
+                                                              &bufferDesc,
+                                                              D3D12_RESOURCE_STATE_GENERIC_READ,
+                                                              nullptr,
+                                                              IID_PPV_ARGS(m_LookupTable.ReleaseAndGetAddressOf())));
+                m_LookupTable->SetName(L"Foveation Profile Lookup Table");
+
+                uint32_t* data = nullptr;
+                const D3D12_RANGE noRead{};
+                CHECK_HRCMD(m_LookupTable->Map(0, &noRead, reinterpret_cast<void**>(&data)));
+                for (size_t i = 0; i < m_Profile.LookupTable.size(); i++) {
+                    data[i] = m_Profile.LookupTable[i];
+                }
+                m_LookupTable->Unmap(0, nullptr);
+            }
+            CHECK_MSG(m_HeapForUAVs->AllocateDescriptor(m_LookupTableSRV), "Out of descriptors");
+            m_Device->CreateShaderResourceView(m_LookupTable.Get(), &srvDesc, m_LookupTableSRV);
+            m_HeapForUAVs->CommitDescriptor(m_LookupTableSRV);
+
+            // Until the first frame is analyzed, the content-adaptive bias uses a null descriptor.
+            CHECK_MSG(m_HeapForUAVs->AllocateDescriptor(m_NullBiasSRV), "Out of descriptors");
+            {
+                D3D12_SHADER_RESOURCE_VIEW_DESC biasSrvDesc{};
+                biasSrvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+                biasSrvDesc.Format = DXGI_FORMAT_R8_UINT;
+                biasSrvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+                biasSrvDesc.Texture2D.MipLevels = 1;
+                m_Device->CreateShaderResourceView(nullptr, &biasSrvDesc, m_NullBiasSRV);
+                m_HeapForUAVs->CommitDescriptor(m_NullBiasSRV);
+            }
+
+            if (m_UseContentAdaptiveRates) {
+                // Create resources for the AnalyzeFrame compute shader. The root signature is embedded in the shader.
+                const D3D12_SHADER_BYTECODE analyzeShader{g_AnalyzeFrameCS, sizeof(g_AnalyzeFrameCS)};
+                CHECK_HRCMD(
+                    m_Device->CreateRootSignature(0,
+                                                  analyzeShader.pShaderBytecode,
+                                                  analyzeShader.BytecodeLength,
+                                                  IID_PPV_ARGS(m_AnalyzeRootSignature.ReleaseAndGetAddressOf())));
+                m_AnalyzeRootSignature->SetName(L"AnalyzeFrameCS Root Signature");
+
+                D3D12_COMPUTE_PIPELINE_STATE_DESC analyzeComputeDesc{};
+                analyzeComputeDesc.CS = analyzeShader;
+                analyzeComputeDesc.pRootSignature = m_AnalyzeRootSignature.Get();
+                // The content-adaptive rates are not available with the CPU generation, so the library exists.
+                assert(m_PipelineLibrary);
+                m_AnalyzePSO = m_PipelineLibrary->LoadComputePipeline(L"AnalyzeFrameCS", analyzeComputeDesc);
+                m_AnalyzePSO->SetName(L"AnalyzeFrameCS PSO");
+
+                for (auto& frameSRV : m_FrameSRVs) {
+                    CHECK_MSG(m_HeapForUAVs->AllocateDescriptor(frameSRV.SRV), "Out of descriptors");
+                }
+            }
+
+            if (m_TargetGpuFrameTime > 0.f) {
+                // An end timestamp for each frame. The start is sampled from the clock of the presenting queue.
+                m_FrameTimestamps =
+                    std::make_unique<TimestampQueries>(m_Device.Get(), ARRAYSIZE(m_FrameTimings), L"Frame Time");
+            }
+
+            if (m_PipelineLibrary) {
+                m_PipelineLibrary->Save();
+            }
+
             TraceLoggingWriteStop(local, "VRSCreate");
         }
 
+        ~CommandManager() override {
+            if (m_IsFrameStartPending.load()) {
+                g_NumPendingFrameStarts--;
+            }
+            g_NumPendingDependencies -= m_NumPendingDependencies.load();
+            if (m_VideoMemoryBudgetCookie) {
+                m_Adapter->UnregisterVideoMemoryBudgetChangeNotification(m_VideoMemoryBudgetCookie);
+            }
+        }
+
         void Enable(ID3D12CommandList* pCommandList,
-                    const D3D12_VIEWPORT& Viewport,
+                    CommandListState& State,
+                    UINT NumViewports,
+                    const D3D12_VIEWPORT* pViewports,
                     EyeGaze::IEyeGazeManager* eyeGazeManager = nullptr) override {
-            TraceLocalActivity(local);
-            TraceLoggingWriteStart(local, "VRSEnable", TLPArg(pCommandList, "CommandList"));
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(local, "VRSEnable", TLPArg(pCommandList, "CommandList"));
+            TraceCount(VRSEnable);
+
+            if (m_Device && State.IsVrsCommandList && NumViewports) {
+                // The shading rate map is in render target space: it must cover all the viewports.
+                ShadingRateMapLayout shadingRateMapLayout{};
+                shadingRateMapLayout.NumViewports = std::min(NumViewports, static_cast<UINT>(MaxFoveae));
+                for (UINT i = 0; i < shadingRateMapLayout.NumViewports; i++) {
+                    const float left = std::max(pViewports[i].TopLeftX, 0.f);
+                    const float top = std::max(pViewports[i].TopLeftY, 0.f);
+                    TiledViewport& viewport = shadingRateMapLayout.Viewports[i];
+                    viewport.Left = static_cast<UINT>(left) / m_VRSTileSize;
+                    viewport.Top = static_cast<UINT>(top) / m_VRSTileSize;
+                    viewport.Width =
+                        Align(static_cast<UINT>(left + pViewports[i].Width + DBL_EPSILON), m_VRSTileSize) /
+                            m_VRSTileSize -
+                        viewport.Left;
+                    viewport.Height =
+                        Align(static_cast<UINT>(top + pViewports[i].Height + DBL_EPSILON), m_VRSTileSize) /
+                            m_VRSTileSize -
+                        viewport.Top;
+                    shadingRateMapLayout.Width = std::max(shadingRateMapLayout.Width, viewport.Left + viewport.Width);
+                    shadingRateMapLayout.Height =
+                        std::max(shadingRateMapLayout.Height, viewport.Top + viewport.Height);
+                }
+                TraceDetailWriteTagged(local,
+                                       "VRSEnable",
+                                       TLArg(shadingRateMapLayout.Width, "TiledWidth"),
+                                       TLArg(shadingRateMapLayout.Height, "TiledHeight"),
+                                       TLArg(shadingRateMapLayout.NumViewports, "NumViewports"));
 
-            if (m_Device) {
-                const TiledResolution shadingRateMapResolution{
-                    Align(static_cast<UINT>(Viewport.Width + DBL_EPSILON), m_VRSTileSize) / m_VRSTileSize,
-                    Align(static_cast<UINT>(Viewport.Height + DBL_EPSILON), m_VRSTileSize) / m_VRSTileSize};
-                TraceLoggingWriteTagged(local,
-                                        "VRSEnable",
-                                        TLArg(shadingRateMapResolution.Width, "TiledWidth"),
-                                        TLArg(shadingRateMapResolution.Height, "TiledHeight"));
-
-                float gazeX = 0.5f, gazeY = 0.5f, distance = 600.f /* mm */;
-                const bool wasUsingEyeGaze = m_UsingEyeGaze;
-                m_UsingEyeGaze = eyeGazeManager && eyeGazeManager->GetGaze(gazeX, gazeY, distance);
-                // When eye gaze becomes unavailable, we revert to fixed foveation, and we need to perform one last
-                // update of the shading rate map with the default values above.
-                const bool isEyeGazeAvailable = m_UsingEyeGaze || wasUsingEyeGaze;
-                const float scaleFactor = std::clamp(distance / 600.f, 0.1f, 1.5f);
-
-                bool skipDependency = false;
                 ShadingRateMap shadingRateMap{};
-                {
-                    std::unique_lock lock(m_ShadingRateMapsMutex);
+                bool isReady = false;
+                if (m_PregenerateAtPresent) {
+                    // Common case: the map was already generated and selected for this generation, only bind it.
+                    std::shared_lock lock(m_ShadingRateMapsMutex);
 
-                    auto it = m_ShadingRateMaps.find(shadingRateMapResolution);
+                    auto it = FindShadingRateMapRing(shadingRateMapLayout);
                     if (it != m_ShadingRateMaps.end()) {
-                        if (isEyeGazeAvailable) {
-                            ShadingRateMap& updatableShadingRateMap = it->second;
-
-                            if (updatableShadingRateMap.Generation != m_CurrentGeneration) {
-                                UpdateShadingRateMap(
-                                    shadingRateMapResolution, updatableShadingRateMap, gazeX, gazeY, scaleFactor);
+                        ShadingRateMapRing& ring = it->second;
+                        if ((!AreShadingRateMapsDynamic() && !IsShadingRateMapRingStale(it->first, ring)) ||
+                            ring.Generation == m_CurrentGeneration) {
+                            const ShadingRateMap& selectedShadingRateMap = SelectShadingRateMap(ring);
+                            if (selectedShadingRateMap.LastUsedGeneration == m_CurrentGeneration) {
+                                ring.Age = 0;
+                                shadingRateMap = selectedShadingRateMap;
+                                isReady = true;
                             }
                         }
+                    }
+                }
 
-                        it->second.Age = 0;
-                        shadingRateMap = it->second;
+                if (!isReady) {
+                    std::unique_lock lock(m_ShadingRateMapsMutex);
+
+                    if (!m_PregenerateAtPresent) {
+                        SampleGaze(eyeGazeManager);
+                    }
 
-                        // No need to create a dependency on the GPU.
-                        skipDependency = m_Context->IsCommandListCompleted(shadingRateMap.CompletedFenceValue);
+                    auto it = FindShadingRateMapRing(shadingRateMapLayout);
+                    if (it == m_ShadingRateMaps.end()) {
+                        it = ShareShadingRateMapRing(shadingRateMapLayout);
+                    }
+                    if (it != m_ShadingRateMaps.end()) {
+                        ShadingRateMapRing& ring = it->second;
 
-                        TraceLoggingWriteTagged(local, "VRSEnable_Reuse", TLArg(!skipDependency, "NeedDependency"));
+                        // With pre-generation, we only get here for the resolutions that were not used recently.
+                        if ((AreShadingRateMapsDynamic() || IsShadingRateMapRingStale(it->first, ring)) &&
+                            ring.Generation != m_CurrentGeneration) {
+                            UpdateShadingRateMaps(&it->first);
+                        }
 
+                        ring.Age = 0;
+                        ShadingRateMap& selectedShadingRateMap = SelectShadingRateMap(ring);
+                        selectedShadingRateMap.LastUsedGeneration = m_CurrentGeneration;
+                        shadingRateMap = selectedShadingRateMap;
                     } else {
                         // Request the shading rate map to be generated.
-                        shadingRateMap = RequestShadingRateMap(shadingRateMapResolution, gazeX, gazeY, scaleFactor);
+                        shadingRateMap = RequestShadingRateMap(shadingRateMapLayout);
+                    }
+                }
+
+                // We ran out of descriptors, so VRS remains disabled for this pass.
+                if (!shadingRateMap.ShadingRateTexture) {
+                    TraceDetailWriteTagged(local, "VRSEnable_NoShadingRateMap");
+                    if (State.IsEnabled) {
+                        Disable(pCommandList, State);
                     }
+                    TraceDetailWriteStop(local, "VRSEnable");
+                    return;
+                }
 
-                    ComPtr<ID3D12GraphicsCommandList5> vrsCommandList;
-                    CHECK_HRCMD(pCommandList->QueryInterface(vrsCommandList.GetAddressOf()));
+                // No need to create a dependency on the GPU.
+                const bool skipDependency = m_Context->IsCommandListCompleted(shadingRateMap.CompletedFenceValue);
+                TraceDetailWriteTagged(
+                    local, "VRSEnable_Bind", TLArg(isReady, "IsReady"), TLArg(!skipDependency, "NeedDependency"));
 
+                // Only record the commands if the command list is not already set up with this map.
+                const D3D12_SHADING_RATE drawRate = ClampShadingRate(State.DrawRate, m_AdditionalShadingRatesSupported);
+                if (!State.IsEnabled || State.ShadingRateImage != shadingRateMap.ShadingRateTexture.Get()) {
+                    const ComPtr<ID3D12GraphicsCommandList5> vrsCommandList = GetVrsCommandList(pCommandList);
                     // RSSetShadingRate() function sets both the combiners and the per-drawcall shading rate.
-                    // We set to 1X1 for all sources and all combiners to MAX, so that the coarsest wins
-                    // (per-drawcall, per-primitive, VRS surface).
-                    static const D3D12_SHADING_RATE_COMBINER combiners[D3D12_RS_SET_SHADING_RATE_COMBINER_COUNT] = {
-                        D3D12_SHADING_RATE_COMBINER_MAX, D3D12_SHADING_RATE_COMBINER_MAX};
-                    vrsCommandList->RSSetShadingRate(D3D12_SHADING_RATE_1X1, combiners);
+                    vrsCommandList->RSSetShadingRate(drawRate, ShadingRateCombiners);
                     vrsCommandList->RSSetShadingRateImage(shadingRateMap.ShadingRateTexture.Get());
+                    State.IsEnabled = true;
+                    State.ShadingRateImage = shadingRateMap.ShadingRateTexture.Get();
+                    State.RecordedDrawRate = drawRate;
+                } else if (State.RecordedDrawRate != drawRate) {
+                    GetVrsCommandList(pCommandList)->RSSetShadingRate(drawRate, ShadingRateCombiners);
+                    State.RecordedDrawRate = drawRate;
+                } else {
+                    TraceDetailWriteTagged(local, "VRSEnable_AlreadyBound");
                 }
 
                 if (!skipDependency) {
-                    std::unique_lock lock(m_CommandListDependenciesMutex);
-
                     // Add a dependency for command list submission.
-                    CommandListDependency dependency{};
-                    dependency.FenceValue = shadingRateMap.CompletedFenceValue;
-                    m_CommandListDependencies.insert_or_assign(pCommandList, std::move(dependency));
+                    bool addedDependency;
+                    if (m_CommandListDependencies.Insert(pCommandList,
+                                                         shadingRateMap.CompletedFenceValue,
+                                                         m_CurrentGeneration,
+                                                         GetMinDependencyEpoch(),
+                                                         addedDependency)) {
+                        if (addedDependency) {
+                            m_NumPendingDependencies++;
+                            g_NumPendingDependencies++;
+                        }
+                    } else {
+                        // We cannot track the dependency of this command list, so every submission waits for the
+                        // shading rate map until it is completed.
+                        TraceDetailWriteTagged(local, "VRSEnable_DependencyTableFull");
+                        AddOverflowDependency(shadingRateMap.CompletedFenceValue);
+                    }
                 }
             } else {
-                TraceLoggingWriteTagged(local, "VRSEnable_NotSupported");
+                TraceDetailWriteTagged(local, "VRSEnable_NotSupported");
             }
 
-            TraceLoggingWriteStop(local, "VRSEnable");
+            TraceDetailWriteStop(local, "VRSEnable");
         }
 
-        void Disable(ID3D12CommandList* pCommandList) override {
-            TraceLocalActivity(local);
-            TraceLoggingWriteStart(local, "VRSDisable", TLPArg(pCommandList, "CommandList"));
+        void Disable(ID3D12CommandList* pCommandList, CommandListState& State) override {
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(local, "VRSDisable", TLPArg(pCommandList, "CommandList"));
+            TraceCount(VRSDisable);
+
+            if (m_Device && State.IsVrsCommandList) {
+                // A command list starts with VRS disabled, there is nothing to do unless we enabled it.
+                if (State.IsEnabled) {
+                    const ComPtr<ID3D12GraphicsCommandList5> vrsCommandList = GetVrsCommandList(pCommandList);
+                    vrsCommandList->RSSetShadingRate(D3D12_SHADING_RATE_1X1, nullptr);
+                    vrsCommandList->RSSetShadingRateImage(nullptr);
+                    State.IsEnabled = false;
+                    State.ShadingRateImage = nullptr;
+                    State.RecordedDrawRate = D3D12_SHADING_RATE_1X1;
+                }
+            } else {
+                TraceDetailWriteTagged(local, "VRSDisable_NotSupported");
+            }
 
-            if (m_Device) {
-                ComPtr<ID3D12GraphicsCommandList5> vrsCommandList;
-                CHECK_HRCMD(pCommandList->QueryInterface(vrsCommandList.GetAddressOf()));
+            TraceDetailWriteStop(local, "VRSDisable");
+        }
 
-                vrsCommandList->RSSetShadingRate(D3D12_SHADING_RATE_1X1, nullptr);
-                vrsCommandList->RSSetShadingRateImage(nullptr);
-            } else {
-                TraceLoggingWriteTagged(local, "VRSDisable_NotSupported");
+        void SetDrawRate(ID3D12CommandList* pCommandList, CommandListState& State, D3D12_SHADING_RATE Rate) override {
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(
+                local, "VRSSetDrawRate", TLPArg(pCommandList, "CommandList"), TLArg((UINT)Rate, "Rate"));
+
+            State.DrawRate = Rate;
+
+            // Otherwise, the rate is recorded upon the next Enable().
+            if (m_Device && State.IsVrsCommandList && State.IsEnabled) {
+                const D3D12_SHADING_RATE drawRate = ClampShadingRate(Rate, m_AdditionalShadingRatesSupported);
+                if (State.RecordedDrawRate != drawRate) {
+                    GetVrsCommandList(pCommandList)->RSSetShadingRate(drawRate, ShadingRateCombiners);
+                    State.RecordedDrawRate = drawRate;
+                }
             }
 
-            TraceLoggingWriteStop(local, "VRSDisable");
+            TraceDetailWriteStop(local, "VRSSetDrawRate");
         }
 
         void SyncQueue(ID3D12CommandQueue* pCommandQueue,
-                       const std::vector<ID3D12CommandList*>& CommandLists) override {
-            TraceLocalActivity(local);
-            TraceLoggingWriteStart(local, "SyncQueue", TLPArg(pCommandQueue, "CommandQueue"));
+                       UINT NumCommandLists,
+                       ID3D12CommandList* const* ppCommandLists) override {
+            TraceDetailActivity(local);
+            TraceDetailWriteStart(local, "SyncQueue", TLPArg(pCommandQueue, "CommandQueue"));
 
-            std::unique_lock lock(m_CommandListDependenciesMutex);
+            if (m_IsFrameStartPending.load() && pCommandQueue == m_PresentQueue.load()) {
+                RecordFrameStart(pCommandQueue);
+            }
+            if (pCommandQueue != m_LastSyncQueue.load(std::memory_order_relaxed)) {
+                RegisterRenderQueue(pCommandQueue);
+            }
+
+            if (!m_NumPendingDependencies.load()) {
+                TraceDetailWriteStop(local, "SyncQueue", TLPArg(pCommandQueue, "CommandQueue"));
+                return;
+            }
 
-            for (const auto& commandList : CommandLists) {
-                auto it = m_CommandListDependencies.find(commandList);
-                if (it != m_CommandListDependencies.end()) {
-                    const CommandListDependency& dependency = it->second;
+            // Our fence values are monotonic, so we only need to wait for the largest one.
+            uint64_t fenceValueToWait = 0;
+            const uint64_t minEpoch = GetMinDependencyEpoch();
+            for (UINT i = 0; i < NumCommandLists; i++) {
+                bool removedDependency;
+                const uint64_t fenceValue =
+                    m_CommandListDependencies.Retire(ppCommandLists[i], minEpoch, removedDependency);
+                if (removedDependency) {
+                    TraceDetailWriteTagged(local,
+                                           "SyncQueue_Dependency",
+                                           TLPArg(ppCommandLists[i], "CommandList"),
+                                           TLArg(fenceValue, "FenceValue"));
+                    fenceValueToWait = std::max(fenceValueToWait, fenceValue);
+                    m_NumPendingDependencies--;
+                    g_NumPendingDependencies--;
+                }
+            }
 
-                    // Insert a wait to ensure the shading rate map is ready for use.
-                    TraceLoggingWriteTagged(local,
-                                            "SyncQueue_Wait",
-                                            TLPArg(commandList, "CommandList"),
-                                            TLArg(dependency.FenceValue, "FenceValue"));
-                    pCommandQueue->Wait(m_Context->GetCompletionFence(), dependency.FenceValue);
+            const uint64_t overflowFenceValue = m_OverflowFenceValue.load();
+            if (overflowFenceValue && !ReleaseOverflowDependency(overflowFenceValue)) {
+                fenceValueToWait = std::max(fenceValueToWait, overflowFenceValue);
+            }
 
-                    // Retire the dependency.
-                    m_CommandListDependencies.erase(it);
+            // Insert a wait to ensure the shading rate maps are ready for use.
+            if (fenceValueToWait && !m_Context->IsCommandListCompleted(fenceValueToWait)) {
+                TraceDetailWriteTagged(local, "SyncQueue_Wait", TLArg(fenceValueToWait, "FenceValue"));
+                TraceCount(QueueWait);
+                if (!m_IsMeasuringOverhead || !WaitWithTimestamps(pCommandQueue, fenceValueToWait)) {
+                    pCommandQueue->Wait(m_Context->GetCompletionFence(), fenceValueToWait);
                 }
+                m_NumQueueWaits++;
             }
 
-            TraceLoggingWriteStop(local, "SyncQueue", TLPArg(pCommandQueue, "CommandQueue"));
+            TraceDetailWriteStop(local, "SyncQueue", TLPArg(pCommandQueue, "CommandQueue"));
         }
 
-        void Present() override {
+        void Present(IDXGISwapChain* pSwapChain, EyeGaze::IEyeGazeManager* eyeGazeManager = nullptr) override {
             TraceLocalActivity(local);
             TraceLoggingWriteStart(local, "VRSPresent");
 
+            if (!m_Device) {
+                TraceLoggingWriteStop(local, "VRSPresent", TLArg(false, "Supported"));
+                return;
+            }
+
             {
                 std::unique_lock lock(m_ShadingRateMapsMutex);
 
-                TraceLoggingWriteTagged(
-                    local, "VRSPresent_Cleanup_ShadingRateMaps", TLArg(m_ShadingRateMaps.size(), "NumShadingRateMaps"));
-                for (auto it = m_ShadingRateMaps.begin(); it != m_ShadingRateMaps.end();) {
-                    // Age the unused masks and garbage-collect them.
-                    if (++it->second.Age > 100) {
-                        TraceLoggingWriteTagged(local,
-                                                "VRSPresent_Cleanup_ShadingRateMaps",
-                                                TLArg(it->first.Width, "TiledWidth"),
-                                                TLArg(it->first.Height, "TiledHeight"));
-                        it = m_ShadingRateMaps.erase(it);
-                    } else {
-                        it++;
+                // Only measure the GPU overhead while someone is listening to the detailed events, since the
+                // timestamps are not free.
+                const bool isMeasuringOverhead = IsTraceDetailEnabled();
+                if (isMeasuringOverhead != m_IsMeasuringOverhead) {
+                    m_Context->EnableTimestamps(isMeasuringOverhead);
+                    if (m_PresentQueueContext) {
+                        m_PresentQueueContext->EnableTimestamps(isMeasuringOverhead);
                     }
+                    m_IsMeasuringOverhead = isMeasuringOverhead;
                 }
-            }
-            {
-                std::unique_lock lock(m_CommandListDependenciesMutex);
 
-                TraceLoggingWriteTagged(local,
-                                        "VRSPresent_Cleanup_CommandListDependencies",
-                                        TLArg(m_CommandListDependencies.size(), "NumCommandListDependencies"));
-                for (auto it = m_CommandListDependencies.begin(); it != m_CommandListDependencies.end();) {
-                    // Age the unused command list dependencies and garbage-collect them.
-                    // An application may have started then abandoned a command list.
-                    if (++it->second.Age > 100) {
-                        TraceLoggingWriteTagged(local,
-                                                "VRSPresent_Cleanup_CommandListDependencies",
-                                                TLPArg(it->first, "CommandList"),
-                                                TLArg(it->second.FenceValue, "FenceValue"));
-                        it = m_CommandListDependencies.erase(it);
-                    } else {
-                        it++;
+                // Mark the end of the frame on the application's queues, so that we know when the GPU is done with it.
+                const bool hasPresentQueue = pSwapChain && UpdatePresentQueueContext(pSwapChain);
+                if (hasPresentQueue) {
+                    FrameFence frameFence{m_CurrentGeneration, m_PresentQueueContext->Signal()};
+                    std::unique_lock queuesLock(m_RenderQueuesMutex);
+                    for (RenderQueue& renderQueue : m_RenderQueues) {
+                        if (renderQueue.Queue.Get() != m_PresentQueueContext->GetCommandQueue()) {
+                            CHECK_HRCMD(renderQueue.Queue->Signal(renderQueue.Fence.Get(), ++renderQueue.FenceValue));
+                        }
+                        frameFence.RenderQueueFenceValues.push_back(renderQueue.FenceValue);
+                    }
+                    m_FrameFences.push_back(std::move(frameFence));
+                }
+                m_HasFrameFences = hasPresentQueue;
+                UpdateCompletedGenerations();
+
+                if (pSwapChain) {
+                    DXGI_SWAP_CHAIN_DESC swapChainDesc{};
+                    if (SUCCEEDED(pSwapChain->GetDesc(&swapChainDesc))) {
+                        m_PresentWidth = swapChainDesc.BufferDesc.Width;
+                        m_PresentHeight = swapChainDesc.BufferDesc.Height;
                     }
                 }
-            }
 
-            m_CurrentGeneration++;
+                // Before the maps are aged, while we still know which resolutions were used during the frame.
+                DetectUpscalerInput();
 
-            TraceLoggingWriteStop(local, "VRSPresent", TLArg(m_CurrentGeneration, "CurrentGeneration"));
-        }
+                ReleaseRetiredShadingRateMaps();
+                if (hasPresentQueue) {
+                    ReleaseRetiredBiasResources();
+                }
+                UpdateVideoMemoryPressure(false /* forceQuery */);
+                CleanupShadingRateMaps();
+                TelemetrySetGauge(CachedResolutions, m_ShadingRateMaps.size());
+                TelemetrySetGauge(DescriptorsInUse, m_HeapForUAVs->GetNumAllocatedDescriptors());
+                TelemetrySetGauge(DescriptorCapacity, m_HeapForUAVs->GetCapacity());
+
+                if (hasPresentQueue && m_UseContentAdaptiveRates) {
+                    AnalyzeFrame(pSwapChain);
+                }
+                if (hasPresentQueue && m_FrameTimestamps) {
+                    EndFrameTiming();
+                }
+                TraceGpuOverhead();
 
-        ShadingRateMap
-        RequestShadingRateMap(const TiledResolution& Resolution, float CenterX, float CenterY, float ScaleFactor) {
-            TraceLocalActivity(local);
-            TraceLoggingWriteStart(local,
-                                   "VRSCreateShadingRateMap",
-                                   TLArg(Resolution.Width, "TiledWidth"),
-                                   TLArg(Resolution.Height, "TiledHeight"));
+                // The generation only changes while holding the lock, so that Enable() observes a consistent state.
+                m_CurrentGeneration++;
 
-            const int rowPitch = Align(Resolution.Width, D3D12_TEXTURE_DATA_PITCH_ALIGNMENT);
+                if (hasPresentQueue && m_FrameTimestamps) {
+                    BeginFrameTiming();
+                }
 
-            ShadingRateMap newShadingRateMap;
+                if (m_PregenerateAtPresent) {
+                    // Sample the gaze once, and prepare the maps for the next frame, before the application starts
+                    // recording it.
+                    SampleGaze(eyeGazeManager);
+                    if (AreShadingRateMapsDynamic() ||
+                        std::any_of(m_ShadingRateMaps.begin(), m_ShadingRateMaps.end(), [&](const auto& entry) {
+                            return IsShadingRateMapRingStale(entry.first, entry.second);
+                        })) {
+                        UpdateShadingRateMaps(nullptr);
+                    }
 
-            // Create the resources for the texture.
-            const D3D12_HEAP_PROPERTIES defaultHeap = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
-            const D3D12_RESOURCE_DESC textureDesc =
-                CD3DX12_RESOURCE_DESC::Tex2D(DXGI_FORMAT_R8_UINT,
-                                             Resolution.Width,
-                                             Resolution.Height,
-                                             1 /* arraySize */,
-                                             1 /* mipLevels */,
-                                             1 /* sampleCount */,
-                                             0 /* sampleQuality */,
-                                             D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-            CHECK_HRCMD(m_Device->CreateCommittedResource(
-                &defaultHeap,
-                D3D12_HEAP_FLAG_NONE,
-                &textureDesc,
-                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-                nullptr,
-                IID_PPV_ARGS(newShadingRateMap.ShadingRateTexture.ReleaseAndGetAddressOf())));
-            newShadingRateMap.ShadingRateTexture->SetName(L"Shading Rate Texture");
-
-            newShadingRateMap.UAV = m_HeapForUAVs->AllocateDescriptor();
-            newShadingRateMap.UAVDescriptor = m_HeapForUAVs->GetGPUDescriptor(newShadingRateMap.UAV);
+                    // Select the map to use for the next frame in advance, so that Enable() does not need to.
+                    for (auto& [layout, ring] : m_ShadingRateMaps) {
+                        if (ring.Age <= 1) {
+                            SelectShadingRateMap(ring).LastUsedGeneration = m_CurrentGeneration;
+                        }
+                    }
+                }
+            }
+            // A dependency recorded more than 100 generations ago is considered expired. We remove it from the pending
+            // count, so that SyncQueue() can be skipped again.
+            if (m_NumPendingDependencies.load()) {
+                const UINT numExpired = m_CommandListDependencies.Expire(GetMinDependencyEpoch());
+                if (numExpired) {
+                    m_NumPendingDependencies -= numExpired;
+                    g_NumPendingDependencies -= numExpired;
+                }
+                if (const uint64_t overflowFenceValue = m_OverflowFenceValue.load()) {
+                    ReleaseOverflowDependency(overflowFenceValue);
+                }
+            }
+            TraceLoggingWriteTagged(local,
+                                    "VRSPresent_CommandListDependencies",
+                                    TLArg(m_NumPendingDependencies.load(), "NumCommandListDependencies"));
 
-            D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc{};
-            uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
-            uavDesc.Format = DXGI_FORMAT_R8_UINT;
-            m_Device->CreateUnorderedAccessView(
-                newShadingRateMap.ShadingRateTexture.Get(), nullptr, &uavDesc, newShadingRateMap.UAV);
+            TraceLoggingWriteStop(local, "VRSPresent", TLArg(m_CurrentGeneration.load(), "CurrentGeneration"));
+        }
 
-            UpdateShadingRateMap(
-                Resolution, newShadingRateMap, CenterX, CenterY, ScaleFactor, true /* IsFreshTexture */);
+        // Record a dependency that did not fit in the table. It counts as one pending dependency until the shading rate
+        // map is completed, so that SyncQueue() is not skipped.
+        void AddOverflowDependency(uint64_t FenceValue) {
+            uint64_t overflowFenceValue = m_OverflowFenceValue.load();
+            while (overflowFenceValue < FenceValue &&
+                   !m_OverflowFenceValue.compare_exchange_weak(overflowFenceValue, FenceValue)) {
+            }
+            if (!overflowFenceValue) {
+                m_NumPendingDependencies++;
+                g_NumPendingDependencies++;
+            }
+        }
 
-            m_ShadingRateMaps.insert_or_assign(Resolution, newShadingRateMap);
+        // Release the overflow dependency once the shading rate map is completed.
+        bool ReleaseOverflowDependency(uint64_t FenceValue) {
+            if (!m_Context->IsCommandListCompleted(FenceValue)) {
+                return false;
+            }
+            if (m_OverflowFenceValue.compare_exchange_strong(FenceValue, 0)) {
+                m_NumPendingDependencies--;
+                g_NumPendingDependencies--;
+            }
+            return true;
+        }
 
-            TraceLoggingWriteStop(
-                local, "VRSCreateShadingRateMap", TLArg(newShadingRateMap.CompletedFenceValue, "CompletedFenceValue"));
+        // Age the unused maps, and evict the least-recently used ones when they are too old or when the cache is over
+        // budget. Must be called with the lock held.
+        void CleanupShadingRateMaps() {
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(
+                local, "VRSPresent_Cleanup_ShadingRateMaps", TLArg(m_ShadingRateMaps.size(), "NumShadingRateMaps"));
 
-            return newShadingRateMap;
-        }
+            UINT64 totalSize = 0;
+            for (auto& [layout, ring] : m_ShadingRateMaps) {
+                ring.Age++;
+                totalSize += GetShadingRateMapRingSize(layout, ring);
+            }
 
-        void UpdateShadingRateMap(const TiledResolution& Resolution,
-                                  ShadingRateMap& ShadingRateMap,
-                                  float CenterX,
-                                  float CenterY,
-                                  float ScaleFactor,
-                                  bool IsFreshTexture = false) {
-            // Prepare a command list.
-            CommandList commandList = m_Context->GetCommandList();
-            ID3D12DescriptorHeap* heaps[] = {m_HeapForUAVs->GetDescriptorHeap()};
-            commandList.Commands->SetDescriptorHeaps(ARRAYSIZE(heaps), heaps);
+            // Under memory pressure, we release every map that is not in use, before the application has to.
+            const UINT64 budget = m_IsUnderMemoryPressure ? 0 : m_ShadingRateMapBudget;
+            while (true) {
+                // The application may still record command lists with the maps used in the last few frames.
+                auto leastRecentlyUsed = m_ShadingRateMaps.end();
+                for (auto it = m_ShadingRateMaps.begin(); it != m_ShadingRateMaps.end(); it++) {
+                    if (it->second.Age >= m_NumShadingRateMapBuffers &&
+                        (leastRecentlyUsed == m_ShadingRateMaps.end() ||
+                         it->second.Age > leastRecentlyUsed->second.Age)) {
+                        leastRecentlyUsed = it;
+                    }
+                }
+                if (leastRecentlyUsed == m_ShadingRateMaps.end() ||
+                    (leastRecentlyUsed->second.Age <= m_ShadingRateMapMaxAge && totalSize <= budget)) {
+                    break;
+                }
 
-            if (!IsFreshTexture) {
-                // Transition to UAV state for the compute shader.
-                const D3D12_RESOURCE_BARRIER barrier =
-                    CD3DX12_RESOURCE_BARRIER::Transition(ShadingRateMap.ShadingRateTexture.Get(),
-                                                         D3D12_RESOURCE_STATE_SHADING_RATE_SOURCE,
-                                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
-                commandList.Commands->ResourceBarrier(1, &barrier);
+                TraceLoggingWriteTagged(local,
+                                        "VRSPresent_Cleanup_ShadingRateMaps",
+                                        TLArg(leastRecentlyUsed->first.Width, "TiledWidth"),
+                                        TLArg(leastRecentlyUsed->first.Height, "TiledHeight"),
+                                        TLArg(leastRecentlyUsed->second.Age.load(), "Age"),
+                                        TLArg(totalSize, "TotalSize"));
+                totalSize -= GetShadingRateMapRingSize(leastRecentlyUsed->first, leastRecentlyUsed->second);
+                for (ShadingRateMap& shadingRateMap : leastRecentlyUsed->second.Buffers) {
+                    if (shadingRateMap.ShadingRateTexture) {
+                        m_RetiredShadingRateMaps.push_back({std::move(shadingRateMap.ShadingRateTexture),
+                                                            shadingRateMap.Placement,
+                                                            shadingRateMap.UAV,
+                                                            m_CurrentGeneration});
+                    }
+                }
+                for (auto it = m_SharedLayouts.begin(); it != m_SharedLayouts.end();) {
+                    it = it->second == leastRecentlyUsed->first ? m_SharedLayouts.erase(it) : std::next(it);
+                }
+                if (m_ShadingRateMapSharingTolerance) {
+                    auto [first, last] = m_SharingBuckets.equal_range(GetSharingBucket(leastRecentlyUsed->first));
+                    auto bucketEntry = std::find_if(
+                        first, last, [&](const auto& entry) { return entry.second == leastRecentlyUsed->first; });
+                    if (bucketEntry != last) {
+                        m_SharingBuckets.erase(bucketEntry);
+                    }
+                }
+                m_ShadingRateMaps.erase(leastRecentlyUsed);
             }
 
-            // Dispatch the compute shader to generate the map.
-            GenerateShadingRateMapConstants constants{};
-            constants.CenterX = CenterX * Resolution.Width;
-            constants.CenterY = CenterY * Resolution.Height;
-            // TODO: Customize these.
-            constants.InnerRing = 0.25f * Resolution.Height;
-            constants.OuterRing = 0.8f * Resolution.Height;
-            constants.Rate1x1 = D3D12_SHADING_RATE_1X1;
-            constants.RateMedium = D3D12_SHADING_RATE_2X2;
-            constants.RateLow = D3D12_SHADING_RATE_4X4;
-            commandList.Commands->SetComputeRootSignature(m_GenerateRootSignature.Get());
-            commandList.Commands->SetPipelineState(m_GeneratePSO.Get());
-            commandList.Commands->SetComputeRootDescriptorTable(0, ShadingRateMap.UAVDescriptor);
-            commandList.Commands->SetComputeRoot32BitConstants(
-                1, sizeof(GenerateShadingRateMapConstants) / 4, &constants, 0);
-            commandList.Commands->Dispatch(Align(Resolution.Width, 8) / 8, Align(Resolution.Height, 8) / 8, 1);
-
-            // Transition to the correct state for use with VRS.
-            const D3D12_RESOURCE_BARRIER barrier =
-                CD3DX12_RESOURCE_BARRIER::Transition(ShadingRateMap.ShadingRateTexture.Get(),
-                                                     D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-                                                     D3D12_RESOURCE_STATE_SHADING_RATE_SOURCE);
-            commandList.Commands->ResourceBarrier(1, &barrier);
-
-            ShadingRateMap.CompletedFenceValue = m_Context->SubmitCommandList(commandList);
-            ShadingRateMap.Generation = m_CurrentGeneration;
+            TraceLoggingWriteStop(local,
+                                  "VRSPresent_Cleanup_ShadingRateMaps",
+                                  TLArg(totalSize, "TotalSize"),
+                                  TLArg(m_RetiredShadingRateMaps.size(), "NumRetired"));
         }
 
-        ComPtr<ID3D12Device> m_Device;
-        UINT m_VRSTileSize{0};
+        // The memory used by the textures of a ring. Must be called with the lock held.
+        static UINT64 GetShadingRateMapRingSize(const ShadingRateMapLayout& Layout, const ShadingRateMapRing& Ring) {
+            UINT64 size = 0;
+            for (const ShadingRateMap& shadingRateMap : Ring.Buffers) {
+                if (shadingRateMap.ShadingRateTexture) {
+                    // Committed resources have no placement, estimate their size.
+                    size += shadingRateMap.Placement.Size
+                                ? shadingRateMap.Placement.Size
+                                : Align(static_cast<UINT64>(Layout.Width) * Layout.Height,
+                                        static_cast<UINT64>(D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT));
+                }
+            }
+            return size;
+        }
 
-        std::unique_ptr<CommandContext> m_Context;
-        std::unique_ptr<DescriptorHeap> m_HeapForUAVs;
+        // Release the textures that the GPU is done with. Must be called with the lock held.
+        void ReleaseRetiredShadingRateMaps() {
+            while (!m_RetiredShadingRateMaps.empty()) {
+                RetiredShadingRateMap& retired = m_RetiredShadingRateMaps.front();
+                if (!IsGenerationCompleted(retired.Generation)) {
+                    break;
+                }
 
-        ComPtr<ID3D12RootSignature> m_GenerateRootSignature;
-        ComPtr<ID3D12PipelineState> m_GeneratePSO;
+                retired.ShadingRateTexture.Reset();
+                m_ShadingRateTextureAllocator->ReturnResource(retired.Placement);
+                m_HeapForUAVs->ReturnDescriptor(retired.UAV);
+                m_RetiredShadingRateMaps.pop_front();
+            }
+        }
+
+        // Must be called with the lock held.
+        void UpdateVideoMemoryPressure(bool forceQuery) {
+            if (!m_Adapter) {
+                return;
+            }
+
+            // Query the usage upon budget changes, and on every frame while under pressure to detect the recovery.
+            if (!forceQuery && !m_IsUnderMemoryPressure &&
+                WaitForSingleObject(m_VideoMemoryBudgetEvent.get(), 0) != WAIT_OBJECT_0) {
+                return;
+            }
+
+            DXGI_QUERY_VIDEO_MEMORY_INFO info{};
+            if (FAILED(m_Adapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &info))) {
+                return;
+            }
+
+            const bool isUnderMemoryPressure = info.CurrentUsage > info.Budget;
+            if (isUnderMemoryPressure != m_IsUnderMemoryPressure) {
+                TraceLoggingWrite(g_traceProvider,
+                                  "VRSVideoMemoryPressure",
+                                  TLArg(isUnderMemoryPressure, "IsUnderMemoryPressure"),
+                                  TLArg(info.CurrentUsage, "CurrentUsage"),
+                                  TLArg(info.Budget, "Budget"));
+                m_IsUnderMemoryPressure = isUnderMemoryPressure;
+            }
+        }
+
+        uint64_t GetCurrentGeneration() const override {
+            return m_CurrentGeneration;
+        }
+
+        void UpdateOptions(const CommandManagerOptions& Options) override {
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(local, "VRSUpdateOptions");
+
+            if (!m_Device) {
+                TraceLoggingWriteStop(local, "VRSUpdateOptions", TLArg(false, "Enabled"));
+                return;
+            }
+
+            std::unique_lock lock(m_ShadingRateMapsMutex);
+
+            // The lookup table is uploaded at creation and selects the shader permutation, so we keep it. A new table
+            // only applies to the devices created after the change.
+            FoveationProfile profile = Options.Profile;
+            NormalizeProfile(profile);
+            if (profile.LookupTable != m_Profile.LookupTable) {
+                TraceLoggingWriteTagged(local,
+                                        "VRSUpdateOptions_LookupTableIgnored",
+                                        TLArg(profile.LookupTable.size(), "LookupTableSize"),
+                                        TLArg(m_Profile.LookupTable.size(), "CurrentLookupTableSize"));
+                profile.LookupTable = m_Profile.LookupTable;
+            }
+            m_Profile = std::move(profile);
+
+            // The maps are regenerated upon their next use (or at the next Present() with pre-generation).
+            m_ProfileVersion++;
+
+            std::copy_n(Options.UpscalerRingScale, UpscalerTierCount, m_UpscalerRingScale);
+            m_ShadingRateMapBudget = Options.ShadingRateMapBudget;
+            m_ShadingRateMapMaxAge = Options.ShadingRateMapMaxAge;
+
+            TraceLoggingWriteStop(local,
+                                  "VRSUpdateOptions",
+                                  TLArg(true, "Enabled"),
+                                  TLArg(m_Profile.Rings.size(), "NumRings"),
+                                  TLArg((UINT)m_Profile.OuterRate, "OuterRate"),
+                                  TLArg(m_Profile.HorizontalScale, "HorizontalScale"),
+                                  TLArg(m_ShadingRateMapBudget, "ShadingRateMapBudget"),
+                                  TLArg(m_ShadingRateMapMaxAge, "ShadingRateMapMaxAge"));
+        }
+
+        // Make a profile usable with this device and with our shader.
+        void NormalizeProfile(FoveationProfile& Profile) const {
+            std::sort(Profile.Rings.begin(), Profile.Rings.end(), [](const auto& a, const auto& b) {
+                return a.Radius < b.Radius;
+            });
+            if (Profile.Rings.size() > MaxFoveationRings) {
+                Profile.Rings.resize(MaxFoveationRings);
+            }
+            for (auto& ring : Profile.Rings) {
+                ring.Rate = ClampShadingRate(ring.Rate, m_AdditionalShadingRatesSupported);
+            }
+            for (auto& rate : Profile.LookupTable) {
+                rate = ClampShadingRate(rate, m_AdditionalShadingRatesSupported);
+            }
+            Profile.OuterRate = ClampShadingRate(Profile.OuterRate, m_AdditionalShadingRatesSupported);
+            Profile.HorizontalScale = std::max(Profile.HorizontalScale, 0.1f);
+        }
+
+        // Return a map without a texture when we ran out of descriptors.
+        ShadingRateMap
+        RequestShadingRateMap(const ShadingRateMapLayout& Layout) {
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(local,
+                                   "VRSCreateShadingRateMap",
+                                   TLArg(Layout.Width, "TiledWidth"),
+                                   TLArg(Layout.Height, "TiledHeight"));
+
+            // Only the first buffer of the ring is created now, the other ones are created upon the first update.
+            ShadingRateMap firstShadingRateMap;
+            if (!CreateShadingRateMap(Layout, firstShadingRateMap)) {
+                TraceLoggingWriteStop(local, "VRSCreateShadingRateMap", TLArg(false, "Created"));
+                return {};
+            }
+
+            auto [it, isNew] = m_ShadingRateMaps.try_emplace(Layout);
+            if (isNew && m_ShadingRateMapSharingTolerance) {
+                m_SharingBuckets.emplace(GetSharingBucket(Layout), Layout);
+            }
+            ShadingRateMapRing& newShadingRateMapRing = it->second;
+            newShadingRateMapRing.Buffers.resize(m_NumShadingRateMapBuffers);
+            newShadingRateMapRing.Generation = m_CurrentGeneration;
+            ShadingRateMap& newShadingRateMap = newShadingRateMapRing.Buffers[0];
+            newShadingRateMap = std::move(firstShadingRateMap);
+
+            ShadingRateMapBatch batch;
+            RecordShadingRateMapUpdate(
+                batch, Layout, newShadingRateMap, GetShadingRateMapParameters(Layout, nullptr));
+            SubmitShadingRateMapBatch(batch);
+            newShadingRateMap.LastUsedGeneration = m_CurrentGeneration;
+
+            TraceLoggingWriteStop(
+                local, "VRSCreateShadingRateMap", TLArg(newShadingRateMap.CompletedFenceValue, "CompletedFenceValue"));
+
+            return it->second.Buffers[0];
+        }
+
+        // Return false when we ran out of descriptors, which leaves the map without a texture.
+        bool CreateShadingRateMap(const ShadingRateMapLayout& Layout, ShadingRateMap& NewShadingRateMap) {
+            if (!m_HeapForUAVs->AllocateDescriptor(NewShadingRateMap.UAV)) {
+                TraceLoggingWrite(g_traceProvider,
+                                  "VRSCreateShadingRateMap_OutOfDescriptors",
+                                  TLArg(Layout.Width, "TiledWidth"),
+                                  TLArg(Layout.Height, "TiledHeight"));
+                return false;
+            }
+
+            // Create the resources for the texture.
+            const D3D12_RESOURCE_DESC textureDesc = CD3DX12_RESOURCE_DESC::Tex2D(
+                DXGI_FORMAT_R8_UINT,
+                Layout.Width,
+                Layout.Height,
+                1 /* arraySize */,
+                1 /* mipLevels */,
+                1 /* sampleCount */,
+                0 /* sampleQuality */,
+                D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS | (m_UseImplicitTransitions
+                                                                  ? D3D12_RESOURCE_FLAG_ALLOW_SIMULTANEOUS_ACCESS
+                                                                  : D3D12_RESOURCE_FLAG_NONE));
+            NewShadingRateMap.Placement = m_ShadingRateTextureAllocator->CreateResource(
+                textureDesc,
+                m_UseImplicitTransitions ? D3D12_RESOURCE_STATE_COMMON : D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                NewShadingRateMap.ShadingRateTexture.ReleaseAndGetAddressOf());
+            NewShadingRateMap.ShadingRateTexture->SetName(L"Shading Rate Texture");
+            NewShadingRateMap.IsFreshTexture = true;
+
+            D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc{};
+            uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+            uavDesc.Format = DXGI_FORMAT_R8_UINT;
+            m_Device->CreateUnorderedAccessView(
+                NewShadingRateMap.ShadingRateTexture.Get(), nullptr, &uavDesc, NewShadingRateMap.UAV);
+            m_HeapForUAVs->CommitDescriptor(NewShadingRateMap.UAV);
+            return true;
+        }
+
+        // Whether a buffer of the ring can be overwritten without disturbing the frames still in flight.
+        bool IsShadingRateMapRetired(const ShadingRateMap& ShadingRateMap) const {
+            return !ShadingRateMap.ShadingRateTexture || IsGenerationCompleted(ShadingRateMap.LastUsedGeneration);
+        }
+
+        // Whether the GPU is done with the frames of a generation. Without a fence on the presenting queue, we assume
+        // that the application queues at most (NumShadingRateMapBuffers - 1) frames ahead. Must be called with the lock
+        // held.
+        bool IsGenerationCompleted(uint64_t Generation) const {
+            if (Generation >= m_CurrentGeneration) {
+                return false;
+            }
+            if (m_HasFrameFences) {
+                return Generation < m_NumCompletedGenerations;
+            }
+            return Generation + (m_NumShadingRateMapBuffers - 1) <= m_CurrentGeneration;
+        }
+
+        // Must be called with the lock held.
+        void UpdateCompletedGenerations() {
+            std::unique_lock queuesLock(m_RenderQueuesMutex);
+
+            while (!m_FrameFences.empty()) {
+                const FrameFence& frameFence = m_FrameFences.front();
+                if (!m_PresentQueueContext->IsCommandListCompleted(frameFence.FenceValue)) {
+                    break;
+                }
+                bool isCompleted = true;
+                for (size_t i = 0; i < frameFence.RenderQueueFenceValues.size() && isCompleted; i++) {
+                    isCompleted = m_RenderQueues[i].Fence->GetCompletedValue() >= frameFence.RenderQueueFenceValues[i];
+                }
+                if (!isCompleted) {
+                    break;
+                }
+                m_NumCompletedGenerations = frameFence.Generation + 1;
+                m_FrameFences.pop_front();
+            }
+        }
+
+        // Remember a queue submitting the application's command lists, so that the maps are only retired once the
+        // frames completed on that queue as well. Invoked from SyncQueue(), which sees the queues of the command lists
+        // waiting for the maps.
+        void RegisterRenderQueue(ID3D12CommandQueue* pCommandQueue) {
+            std::unique_lock queuesLock(m_RenderQueuesMutex);
+
+            m_LastSyncQueue = pCommandQueue;
+            if (std::any_of(m_RenderQueues.begin(), m_RenderQueues.end(), [&](const RenderQueue& renderQueue) {
+                    return renderQueue.Queue.Get() == pCommandQueue;
+                })) {
+                return;
+            }
+            if (m_RenderQueues.size() >= MaxRenderQueues ||
+                pCommandQueue->GetDesc().Type != D3D12_COMMAND_LIST_TYPE_DIRECT) {
+                TraceLoggingWrite(g_traceProvider,
+                                  "VRSRegisterRenderQueue",
+                                  TLPArg(pCommandQueue, "CommandQueue"),
+                                  TLArg(false, "Registered"));
+                return;
+            }
+
+            RenderQueue renderQueue;
+            renderQueue.Queue = pCommandQueue;
+            CHECK_HRCMD(m_Device->CreateFence(
+                0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(renderQueue.Fence.ReleaseAndGetAddressOf())));
+            renderQueue.Fence->SetName(L"Render Queue Fence");
+            m_RenderQueues.push_back(std::move(renderQueue));
+            TraceLoggingWrite(g_traceProvider,
+                              "VRSRegisterRenderQueue",
+                              TLPArg(pCommandQueue, "CommandQueue"),
+                              TLArg(true, "Registered"));
+        }
+
+        // Use the newest generation of the map if it is ready. Otherwise, keep using the previous generation rather
+        // than making the application's queue wait for the newest one.
+        ShadingRateMap& SelectShadingRateMap(ShadingRateMapRing& Ring) {
+            ShadingRateMap& newest = Ring.Buffers[Ring.Newest];
+            if (m_Context->IsCommandListCompleted(newest.CompletedFenceValue)) {
+                return newest;
+            }
+
+            const size_t previousIndex = (Ring.Newest + Ring.Buffers.size() - 1) % Ring.Buffers.size();
+            ShadingRateMap& previous = Ring.Buffers[previousIndex];
+            if (previous.ShadingRateTexture && previous.Generation < newest.Generation &&
+                m_Context->IsCommandListCompleted(previous.CompletedFenceValue)) {
+                return previous;
+            }
+
+            return newest;
+        }
+
+        // Start a new generation for all the resolutions in use, and record all the updates into a single batch.
+        // The requested layout is updated regardless of its age. It may be null.
+        void UpdateShadingRateMaps(const ShadingRateMapLayout* RequestedLayout) {
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(local, "VRSUpdateShadingRateMaps", TLArg(m_CurrentGeneration.load(), "Generation"));
+
+            ShadingRateMapBatch batch;
+            size_t numUnchangedShadingRateMaps = 0;
+            for (auto& [layout, ring] : m_ShadingRateMaps) {
+                // Only update the resolutions used recently. The other ones will be updated upon their next use.
+                if (ring.Generation == m_CurrentGeneration ||
+                    (ring.Age > 1 && !(RequestedLayout && layout == *RequestedLayout))) {
+                    continue;
+                }
+                ring.Generation = m_CurrentGeneration;
+
+                // Skip the update when the gaze did not move enough to change any tile of the map.
+                const ShadingRateMap& newestShadingRateMap = ring.Buffers[ring.Newest];
+                const ShadingRateMapParameters parameters =
+                    GetShadingRateMapParameters(layout, &newestShadingRateMap.Parameters);
+                if (parameters == newestShadingRateMap.Parameters) {
+                    numUnchangedShadingRateMaps++;
+                    continue;
+                }
+
+                // Write the new generation to the next buffer in the ring, but only once the GPU is done with it.
+                // Otherwise, keep using the current generation.
+                const size_t next = (ring.Newest + 1) % ring.Buffers.size();
+                ShadingRateMap& updatableShadingRateMap = ring.Buffers[next];
+                if (!IsShadingRateMapRetired(updatableShadingRateMap)) {
+                    TraceLoggingWriteTagged(local,
+                                            "VRSUpdateShadingRateMaps_BufferInUse",
+                                            TLArg(layout.Width, "TiledWidth"),
+                                            TLArg(layout.Height, "TiledHeight"),
+                                            TLArg(updatableShadingRateMap.LastUsedGeneration, "LastUsedGeneration"));
+                    continue;
+                }
+
+                // Without a descriptor, keep using the current generation.
+                if (!updatableShadingRateMap.ShadingRateTexture &&
+                    !CreateShadingRateMap(layout, updatableShadingRateMap)) {
+                    continue;
+                }
+                RecordShadingRateMapUpdate(batch, layout, updatableShadingRateMap, parameters);
+                ring.Newest = next;
+            }
+            SubmitShadingRateMapBatch(batch);
+            TelemetryAdd(ShadingRateMapsReused, numUnchangedShadingRateMaps);
+
+            TraceLoggingWriteStop(local,
+                                  "VRSUpdateShadingRateMaps",
+                                  TLArg(batch.UpdatedShadingRateMaps.size(), "NumUpdatedShadingRateMaps"),
+                                  TLArg(numUnchangedShadingRateMaps, "NumUnchangedShadingRateMaps"));
+        }
+
+        // Quantize the current gaze to the shading rate map tiles. The gaze must move by at least one tile (ie:
+        // m_VRSTileSize pixels) away from the previous center before the center is moved, which avoids regenerating the
+        // maps (and making the application wait for them) upon small movements of a fixating eye.
+        ShadingRateMapParameters GetShadingRateMapParameters(const ShadingRateMapLayout& Layout,
+                                                             const ShadingRateMapParameters* Previous) const {
+            const float kDeadZone = 1.f; // In tiles.
+            const float kScaleFactorStep = 0.05f;
+
+            // The frame time controller scales the rings like the distance of the viewer to the screen does.
+            const float ringScale = GetUpscalerRingScale(Layout);
+            const float scaleFactor = m_Gaze.ScaleFactor * GetControllerScaleFactor() * ringScale;
+
+            ShadingRateMapParameters parameters{};
+            parameters.ScaleFactor = std::max(std::round(scaleFactor / kScaleFactorStep), 1.f) * kScaleFactorStep;
+            parameters.RateOffset = GetControllerRateOffset();
+            // A new analysis of the application's frame always requires an update.
+            parameters.BiasGeneration = m_BiasGeneration;
+            parameters.ProfileVersion = m_ProfileVersion;
+            parameters.ControllerVersion = m_FrameTimeController.Version;
+            parameters.RingScale = ringScale;
+
+            // The gaze is relative to each viewport (eg: each eye for side-by-side stereo).
+            bool isInDeadZone = Previous && parameters.ScaleFactor == Previous->ScaleFactor;
+            float centerX[MaxFoveae], centerY[MaxFoveae];
+            for (UINT i = 0; i < Layout.NumViewports; i++) {
+                centerX[i] = Layout.Viewports[i].Left + m_Gaze.X * Layout.Viewports[i].Width;
+                centerY[i] = Layout.Viewports[i].Top + m_Gaze.Y * Layout.Viewports[i].Height;
+                isInDeadZone = isInDeadZone && std::abs(centerX[i] - Previous->CenterX[i]) < kDeadZone &&
+                               std::abs(centerY[i] - Previous->CenterY[i]) < kDeadZone;
+            }
+            for (UINT i = 0; i < Layout.NumViewports; i++) {
+                parameters.CenterX[i] = isInDeadZone ? Previous->CenterX[i] : std::round(centerX[i]);
+                parameters.CenterY[i] = isInDeadZone ? Previous->CenterY[i] : std::round(centerY[i]);
+            }
+            return parameters;
+        }
+
+        GenerateShadingRateMapConstants GetGenerateShadingRateMapConstants(
+            const ShadingRateMapLayout& Layout, const ShadingRateMapParameters& Parameters) const {
+            GenerateShadingRateMapConstants constants{};
+            constants.NumFoveae = Layout.NumViewports;
+            for (UINT i = 0; i < Layout.NumViewports; i++) {
+                constants.Foveae[i].CenterX = Parameters.CenterX[i];
+                constants.Foveae[i].CenterY = Parameters.CenterY[i];
+                // The fovea grows with the distance of the viewer to the screen.
+                constants.Foveae[i].DistanceScale = 1.f / (Layout.Viewports[i].Height * Parameters.ScaleFactor);
+            }
+            constants.HorizontalScale = m_Profile.HorizontalScale;
+            constants.NumRings = static_cast<uint32_t>(m_Profile.Rings.size());
+            for (size_t i = 0; i < m_Profile.Rings.size(); i++) {
+                constants.RingRadius[i] = m_Profile.Rings[i].Radius;
+                constants.RingRate[i] = m_Profile.Rings[i].Rate;
+            }
+            constants.OuterRate = m_Profile.OuterRate;
+            constants.LookupTableSize = static_cast<uint32_t>(m_Profile.LookupTable.size());
+            constants.LookupTableScale =
+                m_Profile.LookupTable.size() / std::max(m_Profile.LookupTableMaxDistance, 0.01f);
+            constants.UseBias = !!Parameters.BiasGeneration;
+            if (constants.UseBias) {
+                // The bias is in the space of the presented image, while the map is in render target space (they may
+                // differ with upscaling).
+                constants.BiasScaleX = static_cast<float>(m_BiasWidth) / Layout.Width;
+                constants.BiasScaleY = static_cast<float>(m_BiasHeight) / Layout.Height;
+            }
+            constants.MaxAxisRate = m_MaxAxisRate;
+            constants.RateOffset = Parameters.RateOffset;
+            return constants;
+        }
+
+        void RecordShadingRateMapUpdate(ShadingRateMapBatch& Batch,
+                                        const ShadingRateMapLayout& Layout,
+                                        ShadingRateMap& ShadingRateMap,
+                                        const ShadingRateMapParameters& Parameters) {
+            if (!Batch.Commands) {
+                // Prepare a command list.
+                Batch.Commands = m_Context->GetCommandList();
+            }
+
+            if (ShadingRateMap.IsFreshTexture && ShadingRateMap.Placement.NeedsAliasingBarrier) {
+                // The memory was previously used by another texture.
+                const D3D12_RESOURCE_BARRIER barrier =
+                    CD3DX12_RESOURCE_BARRIER::Aliasing(nullptr, ShadingRateMap.ShadingRateTexture.Get());
+                Batch.Commands->Commands->ResourceBarrier(1, &barrier);
+            }
+
+            const GenerateShadingRateMapConstants constants = GetGenerateShadingRateMapConstants(Layout, Parameters);
+            if (m_UploadRing) {
+                RecordShadingRateMapUpload(Batch, Layout, ShadingRateMap, constants);
+            } else {
+                RecordShadingRateMapDispatch(Batch, Layout, ShadingRateMap, constants);
+            }
+
+            ShadingRateMap.Parameters = Parameters;
+            Batch.UpdatedShadingRateMaps.push_back(&ShadingRateMap);
+        }
+
+        // Generate the map with the GenerateShadingRateMap compute shader.
+        void RecordShadingRateMapDispatch(ShadingRateMapBatch& Batch,
+                                          const ShadingRateMapLayout& Layout,
+                                          ShadingRateMap& ShadingRateMap,
+                                          const GenerateShadingRateMapConstants& Constants) {
+            ID3D12GraphicsCommandList* const commandList = Batch.Commands->Commands.Get();
+            if (!Batch.IsComputeBound) {
+                commandList->SetComputeRootSignature(m_GenerateRootSignature.Get());
+                commandList->SetPipelineState(m_GeneratePSO.Get());
+                Batch.IsComputeBound = true;
+            }
+            if (Batch.DescriptorHeap != m_HeapForUAVs->GetDescriptorHeap()) {
+                // The heap grows when creating new maps, possibly in the middle of a batch.
+                Batch.DescriptorHeap = m_HeapForUAVs->GetDescriptorHeap();
+                ID3D12DescriptorHeap* heaps[] = {Batch.DescriptorHeap};
+                commandList->SetDescriptorHeaps(ARRAYSIZE(heaps), heaps);
+                commandList->SetComputeRootDescriptorTable(2, m_HeapForUAVs->GetGPUDescriptor(m_LookupTableSRV));
+                commandList->SetComputeRootDescriptorTable(
+                    3,
+                    m_HeapForUAVs->GetGPUDescriptor(m_BiasResources ? m_BiasResources->Bias[m_NewestBias].SRV
+                                                                    : m_NullBiasSRV));
+            }
+
+            if (!m_UseImplicitTransitions && !ShadingRateMap.IsFreshTexture) {
+                // Transition to UAV state for the compute shader.
+                const D3D12_RESOURCE_BARRIER barrier =
+                    CD3DX12_RESOURCE_BARRIER::Transition(ShadingRateMap.ShadingRateTexture.Get(),
+                                                         D3D12_RESOURCE_STATE_SHADING_RATE_SOURCE,
+                                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+                commandList->ResourceBarrier(1, &barrier);
+            }
+
+            // Dispatch the compute shader to generate the map.
+            commandList->SetComputeRootDescriptorTable(0, m_HeapForUAVs->GetGPUDescriptor(ShadingRateMap.UAV));
+            commandList->SetComputeRoot32BitConstants(1, sizeof(GenerateShadingRateMapConstants) / 4, &Constants, 0);
+            commandList->Dispatch(Align(Layout.Width, 8) / 8, Align(Layout.Height, 8) / 8, 1);
+
+            if (!m_UseImplicitTransitions) {
+                // Transition to the correct state for use with VRS.
+                const D3D12_RESOURCE_BARRIER barrier =
+                    CD3DX12_RESOURCE_BARRIER::Transition(ShadingRateMap.ShadingRateTexture.Get(),
+                                                         D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                                         D3D12_RESOURCE_STATE_SHADING_RATE_SOURCE);
+                commandList->ResourceBarrier(1, &barrier);
+            }
+        }
+
+        // Generate the map on the CPU into the upload ring, and copy it into the texture.
+        void RecordShadingRateMapUpload(ShadingRateMapBatch& Batch,
+                                        const ShadingRateMapLayout& Layout,
+                                        ShadingRateMap& ShadingRateMap,
+                                        const GenerateShadingRateMapConstants& Constants) {
+            const UINT rowPitch = Align(Layout.Width, static_cast<UINT>(D3D12_TEXTURE_DATA_PITCH_ALIGNMENT));
+            const UINT64 size = static_cast<UINT64>(rowPitch) * Layout.Height;
+
+            UINT64 offset;
+            uint8_t* data;
+            m_UploadRing->Retire(*m_Context);
+            while (!m_UploadRing->Allocate(size, D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT, offset, data)) {
+                const uint64_t oldestFenceValue = m_UploadRing->GetOldestFenceValue();
+                if (!oldestFenceValue) {
+                    // The ring is full with the uploads of this batch: submit them to make room.
+                    TraceLoggingWrite(g_traceProvider, "VRSUploadRing_SubmitEarly");
+                    SubmitShadingRateMapBatch(Batch);
+                    Batch.Commands = m_Context->GetCommandList();
+                    continue;
+                }
+                TraceLoggingWrite(g_traceProvider, "VRSUploadRing_Wait", TLArg(oldestFenceValue, "FenceValue"));
+                m_Context->WaitForCommandList(oldestFenceValue);
+                m_UploadRing->Retire(*m_Context);
+            }
+
+            for (UINT y = 0; y < Layout.Height; y++) {
+                GenerateShadingRateMapRow(
+                    Constants, m_Profile.LookupTable.data(), y, Layout.Width, m_IsAvx2Supported, data + y * rowPitch);
+            }
+
+            ID3D12GraphicsCommandList* const commandList = Batch.Commands->Commands.Get();
+            if (!m_UseImplicitTransitions) {
+                // A fresh texture is created in the UAV state.
+                const D3D12_RESOURCE_BARRIER barrier = CD3DX12_RESOURCE_BARRIER::Transition(
+                    ShadingRateMap.ShadingRateTexture.Get(),
+                    ShadingRateMap.IsFreshTexture ? D3D12_RESOURCE_STATE_UNORDERED_ACCESS
+                                                  : D3D12_RESOURCE_STATE_SHADING_RATE_SOURCE,
+                    D3D12_RESOURCE_STATE_COPY_DEST);
+                commandList->ResourceBarrier(1, &barrier);
+            }
+
+            D3D12_PLACED_SUBRESOURCE_FOOTPRINT footprint{};
+            footprint.Offset = offset;
+            footprint.Footprint =
+                CD3DX12_SUBRESOURCE_FOOTPRINT(DXGI_FORMAT_R8_UINT, Layout.Width, Layout.Height, 1, rowPitch);
+            const CD3DX12_TEXTURE_COPY_LOCATION source(m_UploadRing->GetBuffer(), footprint);
+            const CD3DX12_TEXTURE_COPY_LOCATION destination(ShadingRateMap.ShadingRateTexture.Get(), 0);
+            commandList->CopyTextureRegion(&destination, 0, 0, 0, &source, nullptr);
+
+            if (!m_UseImplicitTransitions) {
+                // Transition to the correct state for use with VRS.
+                const D3D12_RESOURCE_BARRIER barrier =
+                    CD3DX12_RESOURCE_BARRIER::Transition(ShadingRateMap.ShadingRateTexture.Get(),
+                                                         D3D12_RESOURCE_STATE_COPY_DEST,
+                                                         D3D12_RESOURCE_STATE_SHADING_RATE_SOURCE);
+                commandList->ResourceBarrier(1, &barrier);
+            }
+        }
+
+        // Create the textures of the content-adaptive bias for the given back buffer. Return null when we ran out of
+        // descriptors. Must be called with the lock held.
+        std::unique_ptr<BiasResources> CreateBiasResources(const D3D12_RESOURCE_DESC& FrameDesc,
+                                                           UINT BiasWidth,
+                                                           UINT BiasHeight) {
+            auto resources = std::make_unique<BiasResources>();
+            resources->FrameDesc = FrameDesc;
+
+            // Swapchains created without DXGI_USAGE_SHADER_INPUT deny the shader resource views of their buffers.
+            const bool needFrameCopy = !!(FrameDesc.Flags & D3D12_RESOURCE_FLAG_DENY_SHADER_RESOURCE);
+
+            // Reserve the descriptors before creating any texture.
+            bool isAllocated = m_HeapForUAVs->AllocateDescriptor(resources->HistoryUAV);
+            for (auto& bias : resources->Bias) {
+                isAllocated = isAllocated && m_HeapForUAVs->AllocateDescriptor(bias.SRV) &&
+                              m_HeapForUAVs->AllocateDescriptor(bias.UAV);
+            }
+            if (isAllocated && needFrameCopy) {
+                isAllocated = m_HeapForUAVs->AllocateDescriptor(resources->FrameCopySRV);
+            }
+            if (!isAllocated) {
+                ReturnBiasDescriptors(*resources);
+                return nullptr;
+            }
+
+            // With simultaneous access, the textures implicitly promote to the states needed on both queues.
+            const D3D12_HEAP_PROPERTIES heapProperties = CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT);
+            D3D12_RESOURCE_DESC textureDesc = CD3DX12_RESOURCE_DESC::Tex2D(
+                DXGI_FORMAT_R8_UINT,
+                BiasWidth,
+                BiasHeight,
+                1 /* arraySize */,
+                1 /* mipLevels */,
+                1 /* sampleCount */,
+                0 /* sampleQuality */,
+                D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS | D3D12_RESOURCE_FLAG_ALLOW_SIMULTANEOUS_ACCESS);
+
+            D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc{};
+            srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+            srvDesc.Format = DXGI_FORMAT_R8_UINT;
+            srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+            srvDesc.Texture2D.MipLevels = 1;
+            D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc{};
+            uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+            uavDesc.Format = DXGI_FORMAT_R8_UINT;
+            for (auto& bias : resources->Bias) {
+                CHECK_HRCMD(m_Device->CreateCommittedResource(&heapProperties,
+                                                              D3D12_HEAP_FLAG_NONE,
+                                                              &textureDesc,
+                                                              D3D12_RESOURCE_STATE_COMMON,
+                                                              nullptr,
+                                                              IID_PPV_ARGS(bias.Texture.ReleaseAndGetAddressOf())));
+                bias.Texture->SetName(L"Content-Adaptive Bias Texture");
+                m_Device->CreateShaderResourceView(bias.Texture.Get(), &srvDesc, bias.SRV);
+                m_Device->CreateUnorderedAccessView(bias.Texture.Get(), nullptr, &uavDesc, bias.UAV);
+                m_HeapForUAVs->CommitDescriptor(bias.SRV);
+                m_HeapForUAVs->CommitDescriptor(bias.UAV);
+            }
+
+            textureDesc.Format = DXGI_FORMAT_R32_FLOAT;
+            textureDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+            CHECK_HRCMD(
+                m_Device->CreateCommittedResource(&heapProperties,
+                                                  D3D12_HEAP_FLAG_NONE,
+                                                  &textureDesc,
+                                                  D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+                                                  nullptr,
+                                                  IID_PPV_ARGS(resources->History.ReleaseAndGetAddressOf())));
+            resources->History->SetName(L"Content-Adaptive History Texture");
+            uavDesc.Format = DXGI_FORMAT_R32_FLOAT;
+            m_Device->CreateUnorderedAccessView(resources->History.Get(), nullptr, &uavDesc, resources->HistoryUAV);
+            m_HeapForUAVs->CommitDescriptor(resources->HistoryUAV);
+
+            if (needFrameCopy) {
+                const D3D12_RESOURCE_DESC copyDesc = CD3DX12_RESOURCE_DESC::Tex2D(
+                    FrameDesc.Format, FrameDesc.Width, FrameDesc.Height, 1 /* arraySize */, 1 /* mipLevels */);
+                CHECK_HRCMD(
+                    m_Device->CreateCommittedResource(&heapProperties,
+                                                      D3D12_HEAP_FLAG_NONE,
+                                                      &copyDesc,
+                                                      D3D12_RESOURCE_STATE_COPY_DEST,
+                                                      nullptr,
+                                                      IID_PPV_ARGS(resources->FrameCopy.ReleaseAndGetAddressOf())));
+                resources->FrameCopy->SetName(L"Content-Adaptive Frame Copy");
+                srvDesc.Format = FrameDesc.Format;
+                m_Device->CreateShaderResourceView(resources->FrameCopy.Get(), &srvDesc, resources->FrameCopySRV);
+                m_HeapForUAVs->CommitDescriptor(resources->FrameCopySRV);
+            }
+
+            return resources;
+        }
+
+        // Release the textures of the content-adaptive bias that neither queue is using anymore. Must be called with
+        // the lock held.
+        void ReleaseRetiredBiasResources() {
+            while (!m_RetiredBiasResources.empty()) {
+                BiasResources& retired = *m_RetiredBiasResources.front();
+                if (!m_PresentQueueContext->IsCommandListCompleted(retired.LastAnalysisFenceValue) ||
+                    !m_Context->IsCommandListCompleted(
+                        std::max(retired.Bias[0].LastReadFenceValue, retired.Bias[1].LastReadFenceValue))) {
+                    break;
+                }
+
+                ReturnBiasDescriptors(retired);
+                m_RetiredBiasResources.pop_front();
+            }
+        }
+
+        // Return the descriptors of the content-adaptive bias, skipping the ones that were never allocated.
+        void ReturnBiasDescriptors(const BiasResources& Resources) {
+            for (const D3D12_CPU_DESCRIPTOR_HANDLE& descriptor : {Resources.Bias[0].SRV,
+                                                                  Resources.Bias[0].UAV,
+                                                                  Resources.Bias[1].SRV,
+                                                                  Resources.Bias[1].UAV,
+                                                                  Resources.HistoryUAV,
+                                                                  Resources.FrameCopySRV}) {
+                if (descriptor.ptr) {
+                    m_HeapForUAVs->ReturnDescriptor(descriptor);
+                }
+            }
+        }
+
+        // With D3D12, the device of a swapchain is the command queue used for presentation. We submit the work that
+        // must follow the application's rendering (or measure it) to that queue. Must be called with the lock held.
+        bool UpdatePresentQueueContext(IDXGISwapChain* pSwapChain) {
+            ComPtr<ID3D12CommandQueue> commandQueue;
+            if (FAILED(pSwapChain->GetDevice(IID_PPV_ARGS(commandQueue.ReleaseAndGetAddressOf()))) ||
+                commandQueue->GetDesc().Type != D3D12_COMMAND_LIST_TYPE_DIRECT) {
+                return false;
+            }
+
+            if (!m_PresentQueueContext || m_PresentQueueContext->GetCommandQueue() != commandQueue.Get()) {
+                TraceLocalActivity(local);
+                TraceLoggingWriteStart(
+                    local, "VRSCreatePresentQueueContext", TLPArg(commandQueue.Get(), "CommandQueue"));
+
+                // Destroying the previous context waits for all its work to complete. The frames may still be in flight
+                // on the other queues.
+                m_PresentQueueContext.reset();
+                for (FrameFence& frameFence : m_FrameFences) {
+                    frameFence.FenceValue = 0;
+                }
+                m_PresentQueueContext =
+                    std::make_unique<CommandContext>(m_Device.Get(), commandQueue.Get(), L"Present Queue");
+                m_PresentQueueContext->EnableTimestamps(m_IsMeasuringOverhead);
+                m_PresentQueue = commandQueue.Get();
+                CHECK_HRCMD(commandQueue->GetTimestampFrequency(&m_PresentQueueTimestampFrequency));
+
+                m_BiasFenceValue = 0;
+                m_IsBiasFenceWaited = true;
+                for (auto& retired : m_RetiredBiasResources) {
+                    retired->LastAnalysisFenceValue = 0;
+                }
+                for (auto& frameSRV : m_FrameSRVs) {
+                    frameSRV.CompletedFenceValue = 0;
+                }
+                for (auto& frameTiming : m_FrameTimings) {
+                    frameTiming = {};
+                }
+                m_LastFrameEndTimestamp = 0;
+                {
+                    std::unique_lock waitLock(m_QueueWaitTimestampsMutex);
+                    m_PendingQueueWaits.clear();
+                    m_AvailableQueueWaitSlots.clear();
+                }
+
+                TraceLoggingWriteStop(local, "VRSCreatePresentQueueContext");
+            }
+
+            return true;
+        }
+
+        // Analyze the frame about to be presented, and produce the content-adaptive bias for the next generation of
+        // the shading rate maps. Must be called with the lock held.
+        void AnalyzeFrame(IDXGISwapChain* pSwapChain) {
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(local, "VRSAnalyzeFrame", TLPArg(pSwapChain, "SwapChain"));
+
+            ComPtr<IDXGISwapChain3> dxgiSwapchain3;
+            ComPtr<ID3D12Resource> backBuffer;
+            if (FAILED(pSwapChain->QueryInterface(dxgiSwapchain3.ReleaseAndGetAddressOf())) ||
+                FAILED(dxgiSwapchain3->GetBuffer(dxgiSwapchain3->GetCurrentBackBufferIndex(),
+                                                 IID_PPV_ARGS(backBuffer.ReleaseAndGetAddressOf())))) {
+                TraceLoggingWriteStop(local, "VRSAnalyzeFrame", TLArg(false, "Analyzed"));
+                return;
+            }
+
+            // One tile of the bias per tile of the presented image.
+            const D3D12_RESOURCE_DESC backBufferDesc = backBuffer->GetDesc();
+            const UINT biasWidth = Align(static_cast<UINT>(backBufferDesc.Width), m_VRSTileSize) / m_VRSTileSize;
+            const UINT biasHeight = Align(backBufferDesc.Height, m_VRSTileSize) / m_VRSTileSize;
+            const bool isFrameCopied = !!(backBufferDesc.Flags & D3D12_RESOURCE_FLAG_DENY_SHADER_RESOURCE);
+
+            // The view of the back buffer. We skip the analysis of this frame rather than waiting for a view to be
+            // available, or for the generation of the shading rate maps to release the bias. The previous bias remains
+            // in use until then.
+            auto& frameSRV = m_FrameSRVs[m_NextFrameSRV];
+            if (!isFrameCopied && !m_PresentQueueContext->IsCommandListCompleted(frameSRV.CompletedFenceValue)) {
+                TraceLoggingWriteStop(local, "VRSAnalyzeFrame", TLArg(false, "Analyzed"));
+                return;
+            }
+            const size_t nextBias = m_NewestBias ^ 1;
+            const bool isResized = !m_BiasResources || m_BiasResources->FrameDesc.Width != backBufferDesc.Width ||
+                                   m_BiasResources->FrameDesc.Height != backBufferDesc.Height ||
+                                   m_BiasResources->FrameDesc.Format != backBufferDesc.Format ||
+                                   m_BiasResources->FrameDesc.Flags != backBufferDesc.Flags;
+            if (!isResized &&
+                !m_Context->IsCommandListCompleted(m_BiasResources->Bias[nextBias].LastReadFenceValue)) {
+                TraceLoggingWriteStop(local, "VRSAnalyzeFrame", TLArg(false, "Analyzed"));
+                return;
+            }
+
+            if (isResized) {
+                TraceLoggingWriteTagged(local,
+                                        "VRSAnalyzeFrame_CreateBias",
+                                        TLArg(biasWidth, "TiledWidth"),
+                                        TLArg(biasHeight, "TiledHeight"),
+                                        TLArg(isFrameCopied, "IsFrameCopied"));
+
+                // The previous textures are released once neither the analysis nor the generation of the shading rate
+                // maps is using them.
+                if (m_BiasResources) {
+                    m_BiasResources->LastAnalysisFenceValue = m_BiasFenceValue;
+                    m_RetiredBiasResources.push_back(std::move(m_BiasResources));
+                }
+                m_BiasResources = CreateBiasResources(backBufferDesc, biasWidth, biasHeight);
+                if (!m_BiasResources) {
+                    // The shading rate maps use the null bias until the analysis can resume.
+                    TraceLoggingWriteTagged(local, "VRSAnalyzeFrame_OutOfDescriptors");
+                    TraceLoggingWriteStop(local, "VRSAnalyzeFrame", TLArg(false, "Analyzed"));
+                    return;
+                }
+                m_BiasWidth = biasWidth;
+                m_BiasHeight = biasHeight;
+                m_IsHistoryValid = false;
+            }
+            BiasResources& resources = *m_BiasResources;
+
+            D3D12_CPU_DESCRIPTOR_HANDLE frameView = resources.FrameCopySRV;
+            if (!isFrameCopied) {
+                m_NextFrameSRV = (m_NextFrameSRV + 1) % ARRAYSIZE(m_FrameSRVs);
+                D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc{};
+                srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+                srvDesc.Format = backBufferDesc.Format;
+                srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+                srvDesc.Texture2D.MipLevels = 1;
+                m_Device->CreateShaderResourceView(backBuffer.Get(), &srvDesc, frameSRV.SRV);
+                m_HeapForUAVs->CommitDescriptor(frameSRV.SRV);
+                frameView = frameSRV.SRV;
+            }
+
+            CommandList commandList = m_PresentQueueContext->GetCommandList();
+            ID3D12GraphicsCommandList* const commands = commandList.Commands.Get();
+            ID3D12DescriptorHeap* heaps[] = {m_HeapForUAVs->GetDescriptorHeap()};
+            commands->SetDescriptorHeaps(ARRAYSIZE(heaps), heaps);
+            commands->SetComputeRootSignature(m_AnalyzeRootSignature.Get());
+            commands->SetPipelineState(m_AnalyzePSO.Get());
+
+            if (isFrameCopied) {
+                {
+                    const D3D12_RESOURCE_BARRIER barrier = CD3DX12_RESOURCE_BARRIER::Transition(
+                        backBuffer.Get(), D3D12_RESOURCE_STATE_PRESENT, D3D12_RESOURCE_STATE_COPY_SOURCE);
+                    commands->ResourceBarrier(1, &barrier);
+                }
+                commands->CopyResource(resources.FrameCopy.Get(), backBuffer.Get());
+                {
+                    const D3D12_RESOURCE_BARRIER barriers[] = {
+                        CD3DX12_RESOURCE_BARRIER::Transition(
+                            backBuffer.Get(), D3D12_RESOURCE_STATE_COPY_SOURCE, D3D12_RESOURCE_STATE_PRESENT),
+                        CD3DX12_RESOURCE_BARRIER::Transition(resources.FrameCopy.Get(),
+                                                             D3D12_RESOURCE_STATE_COPY_DEST,
+                                                             D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE)};
+                    commands->ResourceBarrier(ARRAYSIZE(barriers), barriers);
+                }
+            } else {
+                const D3D12_RESOURCE_BARRIER barrier = CD3DX12_RESOURCE_BARRIER::Transition(
+                    backBuffer.Get(), D3D12_RESOURCE_STATE_PRESENT, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+                commands->ResourceBarrier(1, &barrier);
+            }
+
+            AnalyzeFrameConstants constants{};
+            constants.TileSize = m_VRSTileSize;
+            constants.Width = static_cast<uint32_t>(backBufferDesc.Width);
+            constants.Height = backBufferDesc.Height;
+            constants.UseHistory = m_IsHistoryValid;
+            commands->SetComputeRootDescriptorTable(0, m_HeapForUAVs->GetGPUDescriptor(frameView));
+            commands->SetComputeRootDescriptorTable(1, m_HeapForUAVs->GetGPUDescriptor(resources.Bias[nextBias].UAV));
+            commands->SetComputeRootDescriptorTable(2, m_HeapForUAVs->GetGPUDescriptor(resources.HistoryUAV));
+            commands->SetComputeRoot32BitConstants(3, sizeof(AnalyzeFrameConstants) / 4, &constants, 0);
+            commands->Dispatch(Align(m_BiasWidth, 8) / 8, Align(m_BiasHeight, 8) / 8, 1);
+
+            {
+                const D3D12_RESOURCE_BARRIER barrier =
+                    isFrameCopied ? CD3DX12_RESOURCE_BARRIER::Transition(resources.FrameCopy.Get(),
+                                                                         D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE,
+                                                                         D3D12_RESOURCE_STATE_COPY_DEST)
+                                  : CD3DX12_RESOURCE_BARRIER::Transition(backBuffer.Get(),
+                                                                         D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE,
+                                                                         D3D12_RESOURCE_STATE_PRESENT);
+                commands->ResourceBarrier(1, &barrier);
+            }
+
+            m_BiasFenceValue = m_PresentQueueContext->SubmitCommandList(std::move(commandList));
+            if (!isFrameCopied) {
+                frameSRV.CompletedFenceValue = m_BiasFenceValue;
+            }
+            m_NewestBias = nextBias;
+            m_BiasGeneration++;
+            m_IsBiasFenceWaited = false;
+            m_IsHistoryValid = true;
+
+            TraceLoggingWriteStop(local,
+                                  "VRSAnalyzeFrame",
+                                  TLArg(true, "Analyzed"),
+                                  TLArg(m_BiasFenceValue, "BiasFenceValue"));
+        }
+
+        // Sample the timestamp counter of the presenting queue upon the first submission of the application for the
+        // frame. This is our estimate of the start of the frame on the GPU, unless the queue is still busy with the
+        // previous frame.
+        void RecordFrameStart(ID3D12CommandQueue* pCommandQueue) {
+            std::shared_lock lock(m_ShadingRateMapsMutex);
+
+            if (pCommandQueue != m_PresentQueue.load() || !m_IsFrameStartPending.exchange(false)) {
+                return;
+            }
+            g_NumPendingFrameStarts--;
+
+            const UINT slot = static_cast<UINT>(m_CurrentGeneration % ARRAYSIZE(m_FrameTimings));
+            FrameTiming& frameTiming = m_FrameTimings[slot];
+            uint64_t cpuTimestamp;
+            if (frameTiming.Generation == m_CurrentGeneration && !frameTiming.IsPending &&
+                SUCCEEDED(pCommandQueue->GetClockCalibration(&frameTiming.StartTimestamp, &cpuTimestamp))) {
+                frameTiming.HasStart = true;
+            }
+        }
+
+        // Must be called with the lock held, after the generation is incremented.
+        void BeginFrameTiming() {
+            FrameTiming& frameTiming = m_FrameTimings[m_CurrentGeneration % ARRAYSIZE(m_FrameTimings)];
+            if (frameTiming.IsPending) {
+                // The GPU is too far behind, do not measure this frame.
+                return;
+            }
+            frameTiming.Generation = m_CurrentGeneration;
+            frameTiming.HasStart = false;
+
+            // The next submission to the presenting queue samples the start of the frame.
+            if (!m_IsFrameStartPending.exchange(true)) {
+                g_NumPendingFrameStarts++;
+            }
+        }
+
+        // Write the end timestamp of the frame being presented, and feed the frames completed by the GPU since the
+        // previous Present() to the controller. Must be called with the lock held.
+        void EndFrameTiming() {
+            const UINT slot = static_cast<UINT>(m_CurrentGeneration % ARRAYSIZE(m_FrameTimings));
+            FrameTiming& frameTiming = m_FrameTimings[slot];
+            if (frameTiming.Generation == m_CurrentGeneration && frameTiming.HasStart && !frameTiming.IsPending) {
+                CommandList commandList = m_PresentQueueContext->GetCommandList();
+                m_FrameTimestamps->Write(commandList.Commands.Get(), slot);
+                m_FrameTimestamps->Resolve(commandList.Commands.Get(), slot, 1);
+                frameTiming.CompletedFenceValue = m_PresentQueueContext->SubmitCommandList(std::move(commandList));
+                frameTiming.IsPending = true;
+            }
+
+            // The frames complete in order on the presenting queue.
+            UINT completedSlots[ARRAYSIZE(m_FrameTimings)];
+            UINT numCompletedSlots = 0;
+            for (UINT i = 0; i < ARRAYSIZE(m_FrameTimings); i++) {
+                if (m_FrameTimings[i].IsPending &&
+                    m_PresentQueueContext->IsCommandListCompleted(m_FrameTimings[i].CompletedFenceValue)) {
+                    completedSlots[numCompletedSlots++] = i;
+                }
+            }
+            std::sort(completedSlots, completedSlots + numCompletedSlots, [&](UINT a, UINT b) {
+                return m_FrameTimings[a].Generation < m_FrameTimings[b].Generation;
+            });
+
+            for (UINT i = 0; i < numCompletedSlots; i++) {
+                FrameTiming& completedFrameTiming = m_FrameTimings[completedSlots[i]];
+                completedFrameTiming.IsPending = false;
+
+                // The GPU cannot start the frame before it is done with the previous one. This excludes the time
+                // spent on the previous frame, and the idle time between the frames, but not the idle time within the
+                // frame while the queue waits for the next submission.
+                const uint64_t end = m_FrameTimestamps->Read(completedSlots[i]);
+                const uint64_t start = std::max(completedFrameTiming.StartTimestamp, m_LastFrameEndTimestamp);
+                m_LastFrameEndTimestamp = end;
+                if (end <= start) {
+                    continue;
+                }
+                const double frameTime = (end - start) * 1000.0 / m_PresentQueueTimestampFrequency;
+                TraceLoggingWriteTagged(local,
+                                        "VRSPresent_GpuFrameTime",
+                                        TLArg(completedFrameTiming.Generation, "Generation"),
+                                        TLArg(frameTime, "FrameTime"));
+
+                // Ignore the frames rendered before the previous adjustment took effect.
+                if (completedFrameTiming.Generation > m_FrameTimeController.LastChangeGeneration) {
+                    UpdateFrameTimeController(frameTime);
+                }
+            }
+        }
+
+        // Tighten the foveation when the GPU frame time is above the target, relax it when there is headroom. Each
+        // level shrinks the rings by 5%. Beyond the smallest rings, all the tiles but the full rate ones are made one
+        // step coarser.
+        void UpdateFrameTimeController(double FrameTime) {
+            const double kSmoothing = 0.3;
+
+            auto& controller = m_FrameTimeController;
+            controller.AverageFrameTime =
+                controller.AverageFrameTime > 0.0
+                    ? controller.AverageFrameTime + kSmoothing * (FrameTime - controller.AverageFrameTime)
+                    : FrameTime;
+
+            int level = controller.Level;
+            if (controller.AverageFrameTime > m_TargetGpuFrameTime * (1.0 + m_GpuFrameTimeHysteresis)) {
+                level = std::min(level + 1, kMaxControllerLevel + 1);
+            } else if (controller.AverageFrameTime < m_TargetGpuFrameTime * (1.0 - m_GpuFrameTimeHysteresis)) {
+                level = std::max(level - 1, kMinControllerLevel);
+            }
+            if (level == controller.Level) {
+                return;
+            }
+
+            TraceLoggingWriteTagged(local,
+                                    "VRSPresent_FrameTimeController",
+                                    TLArg(controller.AverageFrameTime, "AverageFrameTime"),
+                                    TLArg(level, "Level"));
+            controller.Level = level;
+            controller.LastChangeGeneration = m_CurrentGeneration;
+            // The maps are regenerated like upon a change of the profile.
+            controller.Version++;
+            // Start over the average with the frames using the new level.
+            controller.AverageFrameTime = 0.0;
+        }
+
+        float GetControllerScaleFactor() const {
+            return 1.f - 0.05f * std::min(m_FrameTimeController.Level, kMaxControllerLevel);
+        }
+
+        UINT GetControllerRateOffset() const {
+            return m_FrameTimeController.Level > kMaxControllerLevel ? 1u : 0u;
+        }
 
-        std::mutex m_ShadingRateMapsMutex;
-        std::unordered_map<TiledResolution, ShadingRateMap, TiledResolution> m_ShadingRateMaps;
-        uint64_t m_CurrentGeneration{0};
+        // Bracket the Wait() on the presenting queue with timestamps, to measure how long it stalls the application's
+        // queue. Returns false if the Wait() was not inserted.
+        bool WaitWithTimestamps(ID3D12CommandQueue* pCommandQueue, uint64_t FenceValue) {
+            std::shared_lock lock(m_ShadingRateMapsMutex);
 
-        bool m_UsingEyeGaze{false};
+            if (pCommandQueue != m_PresentQueue.load() || !m_PresentQueueContext) {
+                return false;
+            }
+
+            std::unique_lock waitLock(m_QueueWaitTimestampsMutex);
+
+            if (!m_QueueWaitTimestamps) {
+                m_QueueWaitTimestamps =
+                    std::make_unique<TimestampQueries>(m_Device.Get(), 2 * MaxMeasuredQueueWaits, L"Queue Wait");
+            }
+            if (m_PendingQueueWaits.empty() && m_AvailableQueueWaitSlots.empty()) {
+                for (UINT i = 0; i < MaxMeasuredQueueWaits; i++) {
+                    m_AvailableQueueWaitSlots.push_back(i);
+                }
+            }
+            if (m_AvailableQueueWaitSlots.empty()) {
+                return false;
+            }
+            const UINT slot = m_AvailableQueueWaitSlots.front();
+            m_AvailableQueueWaitSlots.pop_front();
+
+            CommandList beforeWait = m_PresentQueueContext->GetCommandList();
+            m_QueueWaitTimestamps->Write(beforeWait.Commands.Get(), 2 * slot);
+            m_PresentQueueContext->SubmitCommandList(std::move(beforeWait));
+
+            m_PresentQueueContext->InsertWait(m_Context->GetCompletionFence(), FenceValue);
+
+            CommandList afterWait = m_PresentQueueContext->GetCommandList();
+            m_QueueWaitTimestamps->Write(afterWait.Commands.Get(), 2 * slot + 1);
+            m_QueueWaitTimestamps->Resolve(afterWait.Commands.Get(), 2 * slot, 2);
+            m_PendingQueueWaits.push_back({slot, m_PresentQueueContext->SubmitCommandList(std::move(afterWait))});
+
+            return true;
+        }
+
+        // Emit the GPU cost of the injector for the work completed since the previous Present(). Must be called with
+        // the lock held.
+        void TraceGpuOverhead() {
+            UINT numShadingRateMapCommandLists = 0;
+            const double shadingRateMapGpuTime = m_Context->CollectGpuTime(numShadingRateMapCommandLists);
+            UINT numPresentQueueCommandLists = 0;
+            const double presentQueueGpuTime =
+                m_PresentQueueContext ? m_PresentQueueContext->CollectGpuTime(numPresentQueueCommandLists) : 0.0;
+
+            double queueWaitTime = 0.0;
+            UINT numMeasuredQueueWaits = 0;
+            {
+                std::unique_lock waitLock(m_QueueWaitTimestampsMutex);
+
+                while (!m_PendingQueueWaits.empty() &&
+                       m_PresentQueueContext->IsCommandListCompleted(m_PendingQueueWaits.front().CompletedFenceValue)) {
+                    const UINT slot = m_PendingQueueWaits.front().Slot;
+                    m_PendingQueueWaits.pop_front();
+
+                    const uint64_t start = m_QueueWaitTimestamps->Read(2 * slot);
+                    const uint64_t end = m_QueueWaitTimestamps->Read(2 * slot + 1);
+                    if (end > start) {
+                        queueWaitTime += (end - start) * 1e6 / m_PresentQueueTimestampFrequency;
+                    }
+                    numMeasuredQueueWaits++;
+                    m_AvailableQueueWaitSlots.push_back(slot);
+                }
+            }
+
+            const UINT numQueueWaits = m_NumQueueWaits.exchange(0);
+            const UINT numShadingRateMapsGenerated = m_NumShadingRateMapsGenerated.exchange(0);
+            TelemetryAdd(QueueWaits, numQueueWaits);
+            TelemetryAdd(ShadingRateMapsGenerated, numShadingRateMapsGenerated);
+            if (!m_IsMeasuringOverhead) {
+                return;
+            }
 
-        std::mutex m_CommandListDependenciesMutex;
-        std::unordered_map<ID3D12CommandList*, CommandListDependency> m_CommandListDependencies;
+            // The GPU times are in microseconds, and lag behind by a few frames.
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(local, "VRSGpuOverhead");
+            TraceLoggingWriteStop(local,
+                                  "VRSGpuOverhead",
+                                  TLArg(m_CurrentGeneration.load(), "Generation"),
+                                  TLArg(shadingRateMapGpuTime, "ShadingRateMapGpuTime"),
+                                  TLArg(numShadingRateMapCommandLists, "NumShadingRateMapCommandLists"),
+                                  TLArg(presentQueueGpuTime, "PresentQueueGpuTime"),
+                                  TLArg(numPresentQueueCommandLists, "NumPresentQueueCommandLists"),
+                                  TLArg(queueWaitTime, "QueueWaitTime"),
+                                  TLArg(numMeasuredQueueWaits, "NumMeasuredQueueWaits"),
+                                  TLArg(numQueueWaits, "NumQueueWaits"),
+                                  TLArg(numShadingRateMapsGenerated, "NumShadingRateMapsGenerated"));
+        }
+
+        // Must be called with the lock held.
+        void SampleGaze(EyeGaze::IEyeGazeManager* eyeGazeManager) {
+            float gazeX = 0.5f, gazeY = 0.5f, distance = 600.f /* mm */;
+            const bool wasUsingEyeGaze = m_Gaze.IsUsingEyeGaze;
+            m_Gaze.IsUsingEyeGaze = eyeGazeManager && eyeGazeManager->GetGaze(gazeX, gazeY, distance);
+            // When eye gaze becomes unavailable, we revert to fixed foveation, and we need to perform one last
+            // update of the shading rate map with the default values above.
+            m_Gaze.IsAvailable = m_Gaze.IsUsingEyeGaze || wasUsingEyeGaze;
+            m_Gaze.X = gazeX;
+            m_Gaze.Y = gazeY;
+            m_Gaze.ScaleFactor = std::clamp(distance / 600.f, 0.1f, 1.5f);
+            TelemetrySetGauge(IsGazeAvailable, m_Gaze.IsUsingEyeGaze);
+        }
+
+        // Whether the shading rate maps must be updated with every generation.
+        bool AreShadingRateMapsDynamic() const {
+            return m_Gaze.IsAvailable || m_BiasGeneration;
+        }
+
+        // Whether the newest map of a ring was generated with a previous foveation profile, or before the layout
+        // became (or stopped being) the upscaler input. Must be called with the lock held.
+        bool IsShadingRateMapRingStale(const ShadingRateMapLayout& Layout, const ShadingRateMapRing& Ring) const {
+            const ShadingRateMapParameters& parameters = Ring.Buffers[Ring.Newest].Parameters;
+            return parameters.ProfileVersion != m_ProfileVersion ||
+                   parameters.ControllerVersion != m_FrameTimeController.Version ||
+                   parameters.RingScale != GetUpscalerRingScale(Layout);
+        }
+
+        // Find the maps of a layout, or the maps of another layout that it shares. Must be called with the lock held.
+        ShadingRateMapCache::iterator FindShadingRateMapRing(const ShadingRateMapLayout& Layout) {
+            auto it = m_ShadingRateMaps.find(Layout);
+            if (it == m_ShadingRateMaps.end() && !m_SharedLayouts.empty()) {
+                auto shared = m_SharedLayouts.find(Layout);
+                if (shared != m_SharedLayouts.end()) {
+                    it = m_ShadingRateMaps.find(shared->second);
+                }
+            }
+            return it;
+        }
+
+        // Share the maps of a similar layout rather than creating new ones for a layout. The fovea moves by at most
+        // the tolerance, and the tiles beyond a smaller map are shaded at 1x1. Only the buckets next to the one of the
+        // layout are searched. Must be called with the exclusive lock held.
+        ShadingRateMapCache::iterator ShareShadingRateMapRing(const ShadingRateMapLayout& Layout) {
+            auto it = m_ShadingRateMaps.end();
+            if (!m_ShadingRateMapSharingTolerance) {
+                return it;
+            }
+
+            const UINT column = Layout.Width / GetSharingBucketSize();
+            const UINT row = Layout.Height / GetSharingBucketSize();
+            for (UINT x = column ? column - 1 : 0; x <= column + 1 && it == m_ShadingRateMaps.end(); x++) {
+                for (UINT y = row ? row - 1 : 0; y <= row + 1 && it == m_ShadingRateMaps.end(); y++) {
+                    auto [first, last] = m_SharingBuckets.equal_range(GetSharingBucket(x, y));
+                    auto similar = std::find_if(
+                        first, last, [&](const auto& entry) { return AreLayoutsSimilar(entry.second, Layout); });
+                    if (similar != last) {
+                        it = m_ShadingRateMaps.find(similar->second);
+                    }
+                }
+            }
+            if (it != m_ShadingRateMaps.end()) {
+                TraceLoggingWrite(g_traceProvider,
+                                  "VRSShareShadingRateMap",
+                                  TLArg(Layout.Width, "TiledWidth"),
+                                  TLArg(Layout.Height, "TiledHeight"),
+                                  TLArg(it->first.Width, "SharedTiledWidth"),
+                                  TLArg(it->first.Height, "SharedTiledHeight"));
+                m_SharedLayouts.emplace(Layout, it->first);
+            }
+            return it;
+        }
+
+        // The similar layouts differ by at most the tolerance, so they fall in neighboring buckets of their width and
+        // height.
+        UINT GetSharingBucketSize() const {
+            return m_ShadingRateMapSharingTolerance + 1;
+        }
+
+        static uint64_t GetSharingBucket(UINT Column, UINT Row) {
+            return (static_cast<uint64_t>(Column) << 32) | Row;
+        }
+
+        uint64_t GetSharingBucket(const ShadingRateMapLayout& Layout) const {
+            return GetSharingBucket(Layout.Width / GetSharingBucketSize(), Layout.Height / GetSharingBucketSize());
+        }
+
+        bool AreLayoutsSimilar(const ShadingRateMapLayout& a, const ShadingRateMapLayout& b) const {
+            const auto isClose = [&](UINT x, UINT y) {
+                return (x > y ? x - y : y - x) <= m_ShadingRateMapSharingTolerance;
+            };
+            if (!m_ShadingRateMapSharingTolerance || a.NumViewports != b.NumViewports || !isClose(a.Width, b.Width) ||
+                !isClose(a.Height, b.Height)) {
+                return false;
+            }
+            for (UINT i = 0; i < a.NumViewports; i++) {
+                if (!isClose(a.Viewports[i].Left, b.Viewports[i].Left) ||
+                    !isClose(a.Viewports[i].Top, b.Viewports[i].Top) ||
+                    !isClose(a.Viewports[i].Width, b.Viewports[i].Width) ||
+                    !isClose(a.Viewports[i].Height, b.Viewports[i].Height)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // The input of an upscaler is the largest resolution rendered below the presented resolution. Post-processing
+        // and UI passes at the presented resolution are not candidates. The candidate must be held for several frames,
+        // so that dynamic resolution or a transient target is not mistaken for it. Must be called with the lock held,
+        // before the maps are aged.
+        void DetectUpscalerInput() {
+            if (!m_UpscalerDetectionFrames || !m_PresentWidth || !m_PresentHeight) {
+                return;
+            }
+
+            const ShadingRateMapLayout* candidate = nullptr;
+            for (const auto& [layout, ring] : m_ShadingRateMaps) {
+                // Only the maps used during this frame.
+                if (ring.Age) {
+                    continue;
+                }
+                const float renderScale = static_cast<float>(layout.Width * m_VRSTileSize) / m_PresentWidth;
+                if (renderScale >= 0.9f) {
+                    continue;
+                }
+                if (!candidate || layout.Width * layout.Height > candidate->Width * candidate->Height) {
+                    candidate = &layout;
+                }
+            }
+
+            const UINT candidateWidth = candidate ? candidate->Width : 0;
+            const UINT candidateHeight = candidate ? candidate->Height : 0;
+            if (candidateWidth != m_Upscaler.CandidateWidth || candidateHeight != m_Upscaler.CandidateHeight) {
+                m_Upscaler.CandidateWidth = candidateWidth;
+                m_Upscaler.CandidateHeight = candidateHeight;
+                m_Upscaler.NumFrames = 0;
+            }
+            m_Upscaler.NumFrames = std::min(m_Upscaler.NumFrames + 1, m_UpscalerDetectionFrames);
+            if (m_Upscaler.NumFrames < m_UpscalerDetectionFrames ||
+                (candidateWidth == m_Upscaler.Width && candidateHeight == m_Upscaler.Height)) {
+                return;
+            }
+
+            m_Upscaler.Width = candidateWidth;
+            m_Upscaler.Height = candidateHeight;
+            const float renderScale = static_cast<float>(candidateWidth * m_VRSTileSize) / m_PresentWidth;
+            m_Upscaler.Tier = GetUpscalerTier(renderScale);
+
+            // Only the rings of the previous and the new upscaler input become stale.
+            TraceLoggingWrite(g_traceProvider,
+                              "VRSPresent_DetectUpscaler",
+                              TLArg(!!candidate, "HasUpscaler"),
+                              TLArg(candidateWidth, "TiledWidth"),
+                              TLArg(candidateHeight, "TiledHeight"),
+                              TLArg(renderScale, "RenderScale"),
+                              TLArg(candidate ? static_cast<int>(m_Upscaler.Tier) : -1, "Tier"));
+        }
+
+        // The rings are larger in the maps of the upscaler input.
+        float GetUpscalerRingScale(const ShadingRateMapLayout& Layout) const {
+            if (!m_Upscaler.Width || Layout.Width != m_Upscaler.Width || Layout.Height != m_Upscaler.Height) {
+                return 1.f;
+            }
+            return m_UpscalerRingScale[static_cast<size_t>(m_Upscaler.Tier)];
+        }
+
+        uint64_t GetMinDependencyEpoch() const {
+            const uint64_t currentGeneration = m_CurrentGeneration;
+            return currentGeneration > 100 ? currentGeneration - 100 : 0;
+        }
+
+        void SubmitShadingRateMapBatch(ShadingRateMapBatch& Batch) {
+            if (!Batch.Commands) {
+                return;
+            }
+
+            // Make sure the analysis of the application's frame is complete before using its bias. This delays the
+            // new maps until the application's queue reaches its latest Present(). In the meantime, Enable() keeps
+            // selecting the previous generation of the maps.
+            if (!m_IsBiasFenceWaited) {
+                if (!m_PresentQueueContext->IsCommandListCompleted(m_BiasFenceValue)) {
+                    m_Context->InsertWait(m_PresentQueueContext->GetCompletionFence(), m_BiasFenceValue);
+                }
+                m_IsBiasFenceWaited = true;
+            }
+
+            const uint64_t completedFenceValue = m_Context->SubmitCommandList(std::move(*Batch.Commands));
+            m_LastShadingRateMapFenceValue = completedFenceValue;
+            if (m_BiasResources) {
+                m_BiasResources->Bias[m_NewestBias].LastReadFenceValue = completedFenceValue;
+            }
+            if (m_UploadRing) {
+                m_UploadRing->Submit(completedFenceValue);
+            }
+            m_NumShadingRateMapsGenerated += static_cast<UINT>(Batch.UpdatedShadingRateMaps.size());
+            for (ShadingRateMap* shadingRateMap : Batch.UpdatedShadingRateMaps) {
+                shadingRateMap->CompletedFenceValue = completedFenceValue;
+                shadingRateMap->Generation = m_CurrentGeneration;
+                shadingRateMap->IsFreshTexture = false;
+            }
+            Batch.Commands.reset();
+            Batch.UpdatedShadingRateMaps.clear();
+            Batch.IsComputeBound = false;
+            Batch.DescriptorHeap = nullptr;
+        }
+
+        ComPtr<ID3D12Device> m_Device;
+        const UINT m_NumShadingRateMapBuffers;
+        UINT m_VRSTileSize{0};
+
+        std::unique_ptr<CommandContext> m_Context;
+        bool m_UseImplicitTransitions{false};
+        std::unique_ptr<PlacedResourceAllocator> m_ShadingRateTextureAllocator;
+        std::unique_ptr<DescriptorHeap> m_HeapForUAVs;
+
+        ComPtr<ID3D12Resource> m_LookupTable;
+        D3D12_CPU_DESCRIPTOR_HANDLE m_LookupTableSRV{};
+
+        // Declared before the pipeline states loaded from it, so that it outlives them.
+        std::unique_ptr<PipelineLibrary> m_PipelineLibrary;
+        ComPtr<ID3D12RootSignature> m_GenerateRootSignature;
+        ComPtr<ID3D12PipelineState> m_GeneratePSO;
+        UINT m_MaxAxisRate{1};
+        bool m_AdditionalShadingRatesSupported{false};
+        uint64_t m_LastShadingRateMapFenceValue{0};
+
+        const bool m_PregenerateAtPresent;
+        const bool m_UseContentAdaptiveRates;
+        const bool m_UseCpuGeneration;
+        std::unique_ptr<UploadRing> m_UploadRing;
+        bool m_IsAvx2Supported{false};
+        // The profile may be replaced while holding the lock below, which increments its version.
+        FoveationProfile m_Profile;
+        uint64_t m_ProfileVersion{0};
+
+        // The shading rate maps and the gaze are protected by this lock.
+        std::shared_mutex m_ShadingRateMapsMutex;
+        ShadingRateMapCache m_ShadingRateMaps;
+
+        // Evicted shading rate maps, waiting for the GPU to complete the frames that may use them.
+        struct RetiredShadingRateMap {
+            ComPtr<ID3D12Resource> ShadingRateTexture;
+            ResourcePlacement Placement;
+            D3D12_CPU_DESCRIPTOR_HANDLE UAV;
+            // The generation during which the maps were evicted.
+            uint64_t Generation;
+        };
+        std::deque<RetiredShadingRateMap> m_RetiredShadingRateMaps;
+        UINT64 m_ShadingRateMapBudget;
+        UINT m_ShadingRateMapMaxAge;
+
+        // The layouts using the maps of a similar layout, which are removed with the maps.
+        const UINT m_ShadingRateMapSharingTolerance;
+        std::unordered_map<ShadingRateMapLayout, ShadingRateMapLayout, ShadingRateMapLayout> m_SharedLayouts;
+        // The layouts of the cached maps, by the bucket of their width and height.
+        std::unordered_multimap<uint64_t, ShadingRateMapLayout> m_SharingBuckets;
+
+        // The upscaler input is protected by the shading rate maps lock.
+        const UINT m_UpscalerDetectionFrames;
+        float m_UpscalerRingScale[UpscalerTierCount];
+        UINT m_PresentWidth{0};
+        UINT m_PresentHeight{0};
+        struct {
+            // The resolution (in tiles) that was the candidate for the last frames, 0 for none.
+            UINT CandidateWidth{0};
+            UINT CandidateHeight{0};
+            UINT NumFrames{0};
+            // The detected upscaler input, 0 for none.
+            UINT Width{0};
+            UINT Height{0};
+            UpscalerTier Tier{UpscalerTier::Quality};
+        } m_Upscaler;
+
+        // The video memory budget notifications.
+        ComPtr<IDXGIAdapter3> m_Adapter;
+        wil::unique_handle m_VideoMemoryBudgetEvent;
+        DWORD m_VideoMemoryBudgetCookie{0};
+        bool m_IsUnderMemoryPressure{false};
+        std::atomic<uint64_t> m_CurrentGeneration{0};
+
+        // The fence values signaled on the presenting queue at the end of each generation, until the GPU completes
+        // them. Protected by the shading rate maps lock.
+        struct FrameFence {
+            uint64_t Generation;
+            // 0 once the presenting queue changed.
+            uint64_t FenceValue;
+            // The fence values signaled at the same time on the queues in m_RenderQueues.
+            std::vector<uint64_t> RenderQueueFenceValues;
+        };
+        std::deque<FrameFence> m_FrameFences;
+        uint64_t m_NumCompletedGenerations{0};
+        bool m_HasFrameFences{false};
+
+        // The other queues rendering with the maps. Queues are never removed, so that their index in the frame fences
+        // remains valid.
+        static constexpr size_t MaxRenderQueues = 8;
+        struct RenderQueue {
+            ComPtr<ID3D12CommandQueue> Queue;
+            ComPtr<ID3D12Fence> Fence;
+            uint64_t FenceValue{0};
+        };
+        std::mutex m_RenderQueuesMutex;
+        std::vector<RenderQueue> m_RenderQueues;
+        std::atomic<ID3D12CommandQueue*> m_LastSyncQueue{nullptr};
+
+        struct {
+            float X{0.5f};
+            float Y{0.5f};
+            float ScaleFactor{1.f};
+            bool IsUsingEyeGaze{false};
+            // Whether the maps must be updated with the gaze.
+            bool IsAvailable{false};
+        } m_Gaze;
+
+        CommandListDependencyTable m_CommandListDependencies;
+        std::atomic<uint32_t> m_NumPendingDependencies{0};
+        // The largest fence value of the dependencies that did not fit in the table, waited for by every submission.
+        std::atomic<uint64_t> m_OverflowFenceValue{0};
+
+        // The context submitting to the application's presenting queue, protected by the shading rate maps lock.
+        std::unique_ptr<CommandContext> m_PresentQueueContext;
+        std::atomic<ID3D12CommandQueue*> m_PresentQueue{nullptr};
+        uint64_t m_PresentQueueTimestampFrequency{1};
+
+        // The content-adaptive bias is protected by the shading rate maps lock.
+        ComPtr<ID3D12RootSignature> m_AnalyzeRootSignature;
+        ComPtr<ID3D12PipelineState> m_AnalyzePSO;
+        D3D12_CPU_DESCRIPTOR_HANDLE m_NullBiasSRV{};
+        std::unique_ptr<BiasResources> m_BiasResources;
+        std::deque<std::unique_ptr<BiasResources>> m_RetiredBiasResources;
+        // The buffer of the bias written by the latest analysis, and read by the generation.
+        size_t m_NewestBias{0};
+        UINT m_BiasWidth{0};
+        UINT m_BiasHeight{0};
+        bool m_IsHistoryValid{false};
+        uint64_t m_BiasGeneration{0};
+        uint64_t m_BiasFenceValue{0};
+        bool m_IsBiasFenceWaited{true};
+
+        // The views of the back buffers, reused once the analysis reading them has completed.
+        struct {
+            D3D12_CPU_DESCRIPTOR_HANDLE SRV;
+            uint64_t CompletedFenceValue{0};
+        } m_FrameSRVs[4];
+        size_t m_NextFrameSRV{0};
+
+        // The GPU frame time controller is protected by the shading rate maps lock.
+        static constexpr int kMinControllerLevel = -10;
+        static constexpr int kMaxControllerLevel = 10;
+        const float m_TargetGpuFrameTime;
+        const float m_GpuFrameTimeHysteresis;
+        std::unique_ptr<TimestampQueries> m_FrameTimestamps;
+        struct FrameTiming {
+            uint64_t Generation{0};
+            bool HasStart{false};
+            // The timestamp counter of the presenting queue upon the first submission of the frame.
+            uint64_t StartTimestamp{0};
+            // Whether the timestamps are resolved and waiting to be read.
+            bool IsPending{false};
+            uint64_t CompletedFenceValue{0};
+        };
+        FrameTiming m_FrameTimings[8];
+        uint64_t m_LastFrameEndTimestamp{0};
+        std::atomic<bool> m_IsFrameStartPending{false};
+        struct {
+            // 0 for the profile as-is, negative for larger rings, positive for smaller rings.
+            int Level{0};
+            double AverageFrameTime{0.0};
+            uint64_t LastChangeGeneration{0};
+            uint64_t Version{0};
+        } m_FrameTimeController;
+
+        // The measurement of the GPU overhead, when detailed tracing is enabled.
+        std::atomic<bool> m_IsMeasuringOverhead{false};
+        std::atomic<UINT> m_NumQueueWaits{0};
+        std::atomic<UINT> m_NumShadingRateMapsGenerated{0};
+        static constexpr UINT MaxMeasuredQueueWaits = 16;
+        std::mutex m_QueueWaitTimestampsMutex;
+        std::unique_ptr<TimestampQueries> m_QueueWaitTimestamps;
+        std::deque<UINT> m_AvailableQueueWaitSlots;
+        struct MeasuredQueueWait {
+            UINT Slot;
+            uint64_t CompletedFenceValue;
+        };
+        std::deque<MeasuredQueueWait> m_PendingQueueWaits;
     };
 
 } // namespace
 
 namespace VRS {
 
-    std::unique_ptr<ICommandManager> CreateCommandManager(ID3D12Device* Device) {
-        return std::make_unique<CommandManager>(Device);
+    std::unique_ptr<ICommandManager> CreateCommandManager(ID3D12Device* Device, const CommandManagerOptions& Options) {
+        return std::make_unique<CommandManager>(Device, Options);
+    }
+
+    FoveationProfile GetFoveationProfile(const std::string& Name) {
+        FoveationProfile profile;
+        if (Name == "quality") {
+            profile.Rings = {{0.3f, D3D12_SHADING_RATE_1X1}, {0.7f, D3D12_SHADING_RATE_2X1}};
+            profile.OuterRate = D3D12_SHADING_RATE_2X2;
+            profile.HorizontalScale = 1.3f;
+        } else if (Name == "balanced") {
+            profile.Rings = {{0.25f, D3D12_SHADING_RATE_1X1},
+                             {0.5f, D3D12_SHADING_RATE_2X1},
+                             {0.8f, D3D12_SHADING_RATE_2X2}};
+            profile.OuterRate = D3D12_SHADING_RATE_4X4;
+            profile.HorizontalScale = 1.3f;
+        } else if (Name == "performance") {
+            profile.Rings = {{0.15f, D3D12_SHADING_RATE_1X1},
+                             {0.35f, D3D12_SHADING_RATE_2X2},
+                             {0.6f, D3D12_SHADING_RATE_4X2}};
+            profile.OuterRate = D3D12_SHADING_RATE_4X4;
+            profile.HorizontalScale = 1.5f;
+        }
+        return profile;
+    }
+
+    bool HasPendingDependencies() {
+        return g_NumPendingDependencies.load() != 0;
+    }
+
+    bool HasPendingFrameStart() {
+        return g_NumPendingFrameStarts.load() != 0;
     }
 
 } // namespace VRS
@@ -26,20 +26,159 @@
 
 namespace VRS {
 
+    // The maximum number of rings in a foveation profile.
+    constexpr size_t MaxFoveationRings = 8;
+
+    // The maximum number of entries in the lookup table of a foveation profile.
+    constexpr size_t MaxLookupTableSize = 64;
+
+    // The maximum number of viewports, each with its own fovea, covered by one shading rate map.
+    constexpr size_t MaxFoveae = 4;
+
+    struct FoveationRing {
+        // The outer radius of the ring, relative to the height of the viewport.
+        float Radius;
+        D3D12_SHADING_RATE Rate;
+    };
+
+    // Describe the shading rate for each tile based on its distance to the center of the fovea.
+    struct FoveationProfile {
+        // From the innermost ring to the outermost ring.
+        std::vector<FoveationRing> Rings{{0.25f, D3D12_SHADING_RATE_1X1}, {0.8f, D3D12_SHADING_RATE_2X2}};
+        // The rate beyond the outermost ring.
+        D3D12_SHADING_RATE OuterRate{D3D12_SHADING_RATE_4X4};
+
+        // How much wider than tall the rings are. The horizontal field of view is wider than the vertical one.
+        float HorizontalScale{1.f};
+
+        // When not empty, the rates are looked up by distance in this table instead of using the rings. The entries are
+        // evenly spaced from the center to LookupTableMaxDistance (relative to the height of the viewport).
+        std::vector<D3D12_SHADING_RATE> LookupTable;
+        float LookupTableMaxDistance{1.f};
+    };
+
+    // Retrieve one of the built-in profiles: "default", "quality", "balanced" or "performance".
+    FoveationProfile GetFoveationProfile(const std::string& Name);
+
+    // The quality modes of the upscalers (eg: DLSS, FSR), by the scale of their input to the presented resolution.
+    enum class UpscalerTier {
+        Quality,          // ~67%
+        Balanced,         // ~58%
+        Performance,      // 50%
+        UltraPerformance, // ~33%
+    };
+    constexpr size_t UpscalerTierCount = 4;
+
+    struct CommandManagerOptions {
+        // Number of shading rate maps kept per resolution. Each new generation of a map is written to a different
+        // buffer, so that we never overwrite a texture that frames previously submitted by the application may still
+        // be reading: a buffer is only overwritten once the presenting queue, and the other queues that waited for
+        // the maps, completed the frames that used it. When the application queues more than
+        // (NumShadingRateMapBuffers - 1) frames ahead, the maps are updated less often.
+        UINT NumShadingRateMapBuffers{3};
+
+        // Generate the shading rate maps on a compute queue, so that the generation may overlap with the application's
+        // graphics work.
+        bool UseAsyncCompute{true};
+        bool UseHighPriorityCompute{false};
+
+        // Generate the shading rate maps on the CPU (with AVX2 when available) and upload them with a copy, instead of
+        // dispatching a compute shader. The maps are tiny, and this avoids the compute pipeline state entirely. Not
+        // available with the content-adaptive rates, whose bias is produced on the GPU.
+        bool UseCpuGeneration{false};
+
+        // Sample the gaze and generate the shading rate maps for the next frame upon Present(), rather than upon the
+        // first use of each map during the frame. This keeps the work off the application's recording threads.
+        bool PregenerateAtPresent{true};
+
+        // Analyze each presented frame, and coarsen the shading rate of the flat, dark or fast-changing tiles in the
+        // shading rate maps of the next frame.
+        bool UseContentAdaptiveRates{false};
+
+        // Steer the foveation toward this GPU frame time (in milliseconds), measured on the presenting queue from the
+        // first submission of a frame to its Present(). The rings shrink (then the rates coarsen) while above the
+        // target, and grow while below. 0 to disable.
+        float TargetGpuFrameTime{0.f};
+        // How far from the target (relative to the target) the frame time may be before the foveation is adjusted.
+        float GpuFrameTimeHysteresis{0.05f};
+
+        // The memory (in bytes) that the cached shading rate maps may use before the least recently used ones are
+        // released. Under video memory pressure, all the maps not in use are released.
+        UINT64 ShadingRateMapBudget{8ull * 1024 * 1024};
+        // The number of frames a shading rate map may go unused before it is released.
+        UINT ShadingRateMapMaxAge{100};
+        // Resolutions whose viewports differ by at most this many tiles share the same shading rate maps (eg: render
+        // targets padded or cropped by a few pixels, transient post-processing targets). 0 to disable, at most 16.
+        UINT ShadingRateMapSharingTolerance{2};
+
+        // The input of an upscaler is detected as the largest resolution rendered below the presented resolution,
+        // once it is held for this many frames. 0 to disable.
+        UINT UpscalerDetectionFrames{30};
+        // How much larger the rings are in the shading rate maps of the upscaler input, for each tier. The input is
+        // already rendered at a fraction of the presented resolution, and the upscaler reconstructs the periphery from
+        // it.
+        float UpscalerRingScale[UpscalerTierCount]{1.15f, 1.25f, 1.4f, 1.8f};
+
+        FoveationProfile Profile;
+    };
+
+    // The VRS commands last recorded into a command list, used to skip redundant commands.
+    // The state must be reset when the command list is reset.
+    struct CommandListState {
+        // Whether the command list supports VRS. The state is owned by the command list itself, so it cannot hold a
+        // reference on it: the ID3D12GraphicsCommandList5 interface is queried whenever commands are recorded.
+        bool IsVrsCommandList{false};
+        bool IsEnabled{false};
+        ID3D12Resource* ShadingRateImage{nullptr};
+
+        // The per-draw rate requested for the current pipeline state, and the one last recorded.
+        D3D12_SHADING_RATE DrawRate{D3D12_SHADING_RATE_1X1};
+        D3D12_SHADING_RATE RecordedDrawRate{D3D12_SHADING_RATE_1X1};
+    };
+
     struct ICommandManager {
         virtual ~ICommandManager() = default;
 
+        // Bind a shading rate map covering all the viewports, with a fovea in each viewport. The gaze is applied
+        // relative to each viewport (eg: each eye for side-by-side stereo, or each player for split-screen), so every
+        // viewport gets its fovea at the same relative position. Only the first MaxFoveae viewports are covered. The
+        // maps are cached per layout, which includes the offsets of the viewports within the render target.
         virtual void Enable(ID3D12CommandList* pCommandList,
-                            const D3D12_VIEWPORT& Viewport,
+                            CommandListState& State,
+                            UINT NumViewports,
+                            const D3D12_VIEWPORT* pViewports,
                             EyeGaze::IEyeGazeManager* eyeGazeManager = nullptr) = 0;
-        virtual void Disable(ID3D12CommandList* pCommandList) = 0;
+        virtual void Disable(ID3D12CommandList* pCommandList, CommandListState& State) = 0;
+
+        // Set the per-draw rate, combined with the shading rate map so that the coarsest wins. The rate only applies
+        // while a shading rate map is bound.
+        virtual void SetDrawRate(ID3D12CommandList* pCommandList, CommandListState& State, D3D12_SHADING_RATE Rate) = 0;
 
         virtual void SyncQueue(ID3D12CommandQueue* pCommandQueue,
-                               const std::vector<ID3D12CommandList*>& CommandLists) = 0;
+                               UINT NumCommandLists,
+                               ID3D12CommandList* const* ppCommandLists) = 0;
+
+        // Start a new generation. The swapchain is used for the content-adaptive shading rates, and may be null.
+        virtual void Present(IDXGISwapChain* pSwapChain, EyeGaze::IEyeGazeManager* eyeGazeManager = nullptr) = 0;
 
-        virtual void Present() = 0;
+        // The generation is incremented upon every Present().
+        virtual uint64_t GetCurrentGeneration() const = 0;
+
+        // Apply new options. The shading rate maps are regenerated with the new foveation profile upon their next use.
+        // Only the profile, the upscaler ring scales, the budget and the age of the shading rate maps can change, the
+        // other options are only read at creation.
+        virtual void UpdateOptions(const CommandManagerOptions& Options) = 0;
     };
 
-    std::unique_ptr<ICommandManager> CreateCommandManager(ID3D12Device* Device);
+    std::unique_ptr<ICommandManager> CreateCommandManager(ID3D12Device* Device,
+                                                          const CommandManagerOptions& Options = {});
+
+    // Whether any command manager has command lists waiting for a shading rate map. This is a cheap check meant to
+    // skip SyncQueue() entirely in the common case.
+    bool HasPendingDependencies();
+
+    // Whether any command manager is waiting for the first submission of a frame to its presenting queue, in order to
+    // measure the GPU frame time. Like HasPendingDependencies(), SyncQueue() may be skipped otherwise.
+    bool HasPendingFrameStart();
 
 } // namespace VRS
@@ -25,29 +25,6 @@
 #include "Injector.h"
 #include "Tracing.h"
 
-namespace Tracing {
-
-    // {cbf3adcd-42b1-4c38-830b-95980af201f6}
-    TRACELOGGING_DEFINE_PROVIDER(g_traceProvider,
-                                 "VRSInjector",
-                                 (0xcbf3adcd, 0x42b1, 0x4e38, 0x93, 0x0b, 0x95, 0x98, 0x0a, 0xf2, 0x01, 0xf6));
-} // namespace Tracing
-
-namespace {
-
-    std::future<void> g_deferredHook;
-
-    void DeferredHooking() {
-#ifdef _DEBUG
-        // Adding a small delay, seems to avoid PIX crashing.
-        using namespace std::chrono_literals;
-        std::this_thread::sleep_for(1s);
-#endif
-        Injector::InstallHooks(std::move(Injector::CreateInjectionManager()));
-    }
-
-} // namespace
-
 // Detours require at least one exported symbol.
 void __declspec(dllexport) dummy() {
 }
@@ -56,10 +33,14 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
     switch (ul_reason_for_call) {
     case DLL_PROCESS_ATTACH:
         DetourRestoreAfterWith();
+#if VRSINJECTOR_TRACING_LEVEL > VRSINJECTOR_TRACING_OFF
         TraceLoggingRegister(Tracing::g_traceProvider);
         TraceLoggingWrite(Tracing::g_traceProvider, "Hello");
-        // We cannot create certain COM/D3D objects from DllMain - defer it to later.
-        g_deferredHook = std::async(std::launch::async, [] { DeferredHooking(); });
+#endif
+        // We only hook the exports here, which is safe to do from DllMain. The injection manager (which loads the
+        // rules and the settings) is created, and the methods of the D3D/DXGI objects are hooked, when the application
+        // creates them.
+        Injector::InstallHooks(&Injector::CreateInjectionManager);
         break;
 
     case DLL_THREAD_ATTACH:
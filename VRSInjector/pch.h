@@ -22,20 +22,31 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <future>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <shared_mutex>
+#include <sstream>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <windows.h>
 #include <unknwn.h>
 #include <wrl.h>
+#include <intrin.h>
 
 using Microsoft::WRL::ComPtr;
 
@@ -0,0 +1,436 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// This executable links the injector sources directly, in order to measure the CPU cost of the detours without any
+// game in the way. pch.h, Check.h and the other headers below are the injector's own.
+#include "pch.h"
+
+#include "Check.h"
+#include "Injector.h"
+#include "Statistics.h"
+#include "Tracing.h"
+
+namespace {
+
+    constexpr UINT PresentWidth = 1920;
+    constexpr UINT PresentHeight = 1080;
+
+    // Record this many calls into a command list before resetting it, to keep the command allocator from growing.
+    constexpr UINT NumCallsPerCommandList = 1024;
+
+    // Number of command lists submitted between two waits on the GPU.
+    constexpr UINT NumSubmitCommandLists = 16;
+
+    struct Options {
+        UINT MaxThreads{std::max(std::thread::hardware_concurrency(), 1u)};
+        UINT NumSamples{20000};
+        // Calls that are too short for the timer resolution (eg: RSSetViewports()) are timed in batches.
+        UINT BatchSize{32};
+        std::string CsvPath;
+    };
+
+    void PrintUsage() {
+        fmt::print("Usage: VRSMicrobenchmark [options]\n"
+                   "  --threads N   Maximum number of threads calling each method (default: number of CPUs).\n"
+                   "  --samples N   Number of samples per thread (default 20000).\n"
+                   "  --batch N     Number of RSSetViewports() calls per sample (default 32).\n"
+                   "  --csv path    Write the results to a CSV file.\n");
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options) {
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                return false;
+            }
+            const std::string value = argv[++i];
+            if (arg == "--threads") {
+                options.MaxThreads = std::max(static_cast<UINT>(std::stoul(value)), 1u);
+            } else if (arg == "--samples") {
+                options.NumSamples = std::max(static_cast<UINT>(std::stoul(value)), 1u);
+            } else if (arg == "--batch") {
+                options.BatchSize = std::max(static_cast<UINT>(std::stoul(value)), 1u);
+            } else if (arg == "--csv") {
+                options.CsvPath = value;
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int64_t GetTicks() {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        return counter.QuadPart;
+    }
+
+    double TicksToNanoseconds(int64_t Ticks) {
+        static const double ticksPerNanosecond = [] {
+            LARGE_INTEGER frequency;
+            QueryPerformanceFrequency(&frequency);
+            return frequency.QuadPart / 1e9;
+        }();
+        return Ticks / ticksPerNanosecond;
+    }
+
+    // The objects used by one benchmark thread. Each thread has its own, like each thread of an engine records its own
+    // command lists.
+    struct ThreadResources {
+        ComPtr<ID3D12CommandAllocator> Allocator;
+        ComPtr<ID3D12GraphicsCommandList> CommandList;
+        UINT NumRecordedCalls{0};
+
+        ComPtr<ID3D12CommandQueue> Queue;
+        ComPtr<ID3D12CommandAllocator> SubmitAllocator;
+        ComPtr<ID3D12GraphicsCommandList> SubmitCommandLists[NumSubmitCommandLists];
+        ComPtr<ID3D12Fence> Fence;
+        uint64_t FenceValue{0};
+        Microsoft::WRL::Wrappers::Event FenceEvent;
+
+        ComPtr<IDXGISwapChain1> Swapchain;
+
+        void WaitForGpu() {
+            CHECK_HRCMD(Queue->Signal(Fence.Get(), ++FenceValue));
+            if (Fence->GetCompletedValue() < FenceValue) {
+                CHECK_HRCMD(Fence->SetEventOnCompletion(FenceValue, FenceEvent.Get()));
+                WaitForSingleObject(FenceEvent.Get(), INFINITE);
+            }
+        }
+
+        void ResetCommandList() {
+            CHECK_HRCMD(CommandList->Close());
+            CHECK_HRCMD(Allocator->Reset());
+            CHECK_HRCMD(CommandList->Reset(Allocator.Get(), nullptr));
+            NumRecordedCalls = 0;
+        }
+    };
+
+    // A method under test. Run() takes one sample and returns the number of calls it made.
+    struct Workload {
+        const char* Name;
+        bool IsBatched;
+        std::function<UINT(ThreadResources&, UINT)> Run;
+    };
+
+    struct Result {
+        const char* Method;
+        bool IsHooked;
+        UINT NumThreads;
+        Statistics::Distribution PerCall;
+        double CallsPerSecond;
+    };
+
+    // An engine sets the same viewport many times within a pass, and switches between passes rendered at different
+    // resolutions. Only the full resolution viewports are eligible for VRS.
+    const D3D12_VIEWPORT ViewportPattern[] = {
+        {0.f, 0.f, 1024.f, 1024.f, 0.f, 1.f}, // Shadow map.
+        {0.f, 0.f, 1024.f, 1024.f, 0.f, 1.f},
+        {0.f, 0.f, PresentWidth, PresentHeight, 0.f, 1.f}, // Main pass.
+        {0.f, 0.f, PresentWidth, PresentHeight, 0.f, 1.f},
+        {0.f, 0.f, PresentWidth, PresentHeight, 0.f, 1.f},
+        {0.f, 0.f, PresentWidth, PresentHeight, 0.f, 1.f},
+        {0.f, 0.f, PresentWidth, PresentHeight, 0.f, 1.f},
+        {0.f, 0.f, PresentWidth, PresentHeight, 0.f, 1.f},
+        {0.f, 0.f, PresentWidth / 2, PresentHeight / 2, 0.f, 1.f}, // Post-processing.
+        {0.f, 0.f, PresentWidth, PresentHeight, 0.f, 1.f},         // UI.
+    };
+
+    const Workload Workloads[] = {
+        {"RSSetViewports",
+         true,
+         [](ThreadResources& resources, UINT batchSize) {
+             if (resources.NumRecordedCalls + batchSize > NumCallsPerCommandList) {
+                 resources.ResetCommandList();
+             }
+             ID3D12GraphicsCommandList* const commandList = resources.CommandList.Get();
+             const UINT first = resources.NumRecordedCalls;
+             for (UINT i = 0; i < batchSize; i++) {
+                 commandList->RSSetViewports(1, &ViewportPattern[(first + i) % ARRAYSIZE(ViewportPattern)]);
+             }
+             resources.NumRecordedCalls += batchSize;
+             return batchSize;
+         }},
+        {"ExecuteCommandLists",
+         false,
+         [](ThreadResources& resources, UINT) {
+             ID3D12CommandList* const commandList =
+                 resources.SubmitCommandLists[resources.NumRecordedCalls % NumSubmitCommandLists].Get();
+             resources.Queue->ExecuteCommandLists(1, &commandList);
+             return 1u;
+         }},
+        {"Present",
+         false,
+         [](ThreadResources& resources, UINT) {
+             // Do not measure the frame latency throttling.
+             const HRESULT result = resources.Swapchain->Present(0, DXGI_PRESENT_DO_NOT_WAIT);
+             CHECK_MSG(SUCCEEDED(result) || result == DXGI_ERROR_WAS_STILL_DRAWING, "Present() failed");
+             return 1u;
+         }},
+    };
+
+    class Microbenchmark {
+      public:
+        Microbenchmark(const Options& Options) : m_Options(Options) {
+            CHECK_HRCMD(CreateDXGIFactory2(0, IID_PPV_ARGS(m_Factory.ReleaseAndGetAddressOf())));
+            CHECK_HRCMD(
+                D3D12CreateDevice(nullptr, D3D_FEATURE_LEVEL_12_0, IID_PPV_ARGS(m_Device.ReleaseAndGetAddressOf())));
+
+            for (UINT i = 0; i < m_Options.MaxThreads; i++) {
+                m_Threads.push_back(CreateThreadResources());
+            }
+        }
+
+        std::vector<Result> Run(bool IsHooked) {
+            if (IsHooked) {
+                // The injector only starts injecting once it has seen the device present.
+                for (auto& resources : m_Threads) {
+                    CHECK_HRCMD(resources->Swapchain->Present(0, 0));
+                    resources->WaitForGpu();
+                }
+            }
+
+            std::vector<Result> results;
+            for (const Workload& workload : Workloads) {
+                for (UINT numThreads = 1; numThreads <= m_Options.MaxThreads;
+                     numThreads = numThreads < m_Options.MaxThreads ? std::min(numThreads * 2, m_Options.MaxThreads)
+                                                                    : numThreads + 1) {
+                    results.push_back(Measure(workload, IsHooked, numThreads));
+                }
+            }
+            return results;
+        }
+
+        // Our objects are created before the hooks are installed, so they must be hooked explicitly.
+        void Hook() {
+            Injector::HookDevice(m_Device.Get());
+            Injector::HookCommandList(m_Threads[0]->CommandList.Get());
+            Injector::HookCommandQueue(m_Threads[0]->Queue.Get());
+            Injector::HookSwapChain(m_Threads[0]->Swapchain.Get());
+        }
+
+      private:
+        std::unique_ptr<ThreadResources> CreateThreadResources() {
+            auto resources = std::make_unique<ThreadResources>();
+
+            CHECK_HRCMD(m_Device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT,
+                                                         IID_PPV_ARGS(resources->Allocator.ReleaseAndGetAddressOf())));
+            CHECK_HRCMD(m_Device->CreateCommandList(0,
+                                                    D3D12_COMMAND_LIST_TYPE_DIRECT,
+                                                    resources->Allocator.Get(),
+                                                    nullptr,
+                                                    IID_PPV_ARGS(resources->CommandList.ReleaseAndGetAddressOf())));
+
+            D3D12_COMMAND_QUEUE_DESC queueDesc{};
+            queueDesc.Type = D3D12_COMMAND_LIST_TYPE_DIRECT;
+            CHECK_HRCMD(
+                m_Device->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(resources->Queue.ReleaseAndGetAddressOf())));
+            CHECK_HRCMD(m_Device->CreateCommandAllocator(
+                D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(resources->SubmitAllocator.ReleaseAndGetAddressOf())));
+            for (auto& commandList : resources->SubmitCommandLists) {
+                CHECK_HRCMD(m_Device->CreateCommandList(0,
+                                                        D3D12_COMMAND_LIST_TYPE_DIRECT,
+                                                        resources->SubmitAllocator.Get(),
+                                                        nullptr,
+                                                        IID_PPV_ARGS(commandList.ReleaseAndGetAddressOf())));
+                CHECK_HRCMD(commandList->Close());
+            }
+            CHECK_HRCMD(m_Device->CreateFence(
+                0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(resources->Fence.ReleaseAndGetAddressOf())));
+            resources->FenceEvent.Attach(CreateEventEx(nullptr, L"Microbenchmark Fence", 0, EVENT_ALL_ACCESS));
+
+            // A composition swapchain does not need a window.
+            DXGI_SWAP_CHAIN_DESC1 swapchainDesc{};
+            swapchainDesc.BufferCount = 2;
+            swapchainDesc.Width = PresentWidth;
+            swapchainDesc.Height = PresentHeight;
+            swapchainDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+            swapchainDesc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+            swapchainDesc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
+            swapchainDesc.SampleDesc.Count = 1;
+            CHECK_HRCMD(m_Factory->CreateSwapChainForComposition(
+                resources->Queue.Get(), &swapchainDesc, nullptr, resources->Swapchain.ReleaseAndGetAddressOf()));
+
+            return resources;
+        }
+
+        Result Measure(const Workload& Workload, bool IsHooked, UINT NumThreads) {
+            TraceLocalActivity(local);
+            TraceLoggingWriteStart(local,
+                                   "Microbenchmark_Measure",
+                                   TLArg(Workload.Name, "Method"),
+                                   TLArg(IsHooked, "IsHooked"),
+                                   TLArg(NumThreads, "NumThreads"));
+
+            const UINT batchSize = Workload.IsBatched ? m_Options.BatchSize : 1;
+            std::vector<std::vector<double>> samples(NumThreads);
+            std::vector<UINT> numCalls(NumThreads);
+            std::atomic<UINT> numReadyThreads{0};
+            std::atomic<bool> start{false};
+
+            std::vector<std::thread> threads;
+            for (UINT i = 0; i < NumThreads; i++) {
+                threads.emplace_back([&, i] {
+                    ThreadResources& resources = *m_Threads[i];
+                    std::vector<double>& threadSamples = samples[i];
+                    threadSamples.reserve(m_Options.NumSamples);
+
+                    numReadyThreads++;
+                    while (!start) {
+                        std::this_thread::yield();
+                    }
+
+                    for (UINT j = 0; j < m_Options.NumSamples; j++) {
+                        const int64_t startTime = GetTicks();
+                        const UINT calls = Workload.Run(resources, batchSize);
+                        const int64_t endTime = GetTicks();
+                        threadSamples.push_back(TicksToNanoseconds(endTime - startTime) / calls);
+                        numCalls[i] += calls;
+
+                        // Keep the GPU queue from growing indefinitely. This is not measured.
+                        if (batchSize == 1 && !(++resources.NumRecordedCalls % NumSubmitCommandLists)) {
+                            resources.WaitForGpu();
+                        }
+                    }
+                    resources.WaitForGpu();
+                });
+            }
+
+            while (numReadyThreads != NumThreads) {
+                std::this_thread::yield();
+            }
+            const int64_t startTime = GetTicks();
+            start = true;
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            const double elapsed = TicksToNanoseconds(GetTicks() - startTime);
+
+            std::vector<double> allSamples;
+            UINT totalCalls = 0;
+            for (UINT i = 0; i < NumThreads; i++) {
+                allSamples.insert(allSamples.end(), samples[i].begin(), samples[i].end());
+                totalCalls += numCalls[i];
+            }
+
+            Result result{Workload.Name, IsHooked, NumThreads, Statistics::GetDistribution(std::move(allSamples)), 0.0};
+            result.CallsPerSecond = totalCalls * 1e9 / elapsed;
+
+            TraceLoggingWriteStop(local,
+                                  "Microbenchmark_Measure",
+                                  TLArg(result.PerCall.Average, "Average"),
+                                  TLArg(result.PerCall.P50, "P50"),
+                                  TLArg(result.PerCall.P90, "P90"),
+                                  TLArg(result.PerCall.P99, "P99"),
+                                  TLArg(result.PerCall.Max, "Max"),
+                                  TLArg(result.CallsPerSecond, "CallsPerSecond"));
+
+            return result;
+        }
+
+        const Options m_Options;
+
+        ComPtr<IDXGIFactory2> m_Factory;
+        ComPtr<ID3D12Device> m_Device;
+        std::vector<std::unique_ptr<ThreadResources>> m_Threads;
+    };
+
+    void Report(const Options& Options, const std::vector<Result>& Original, const std::vector<Result>& Hooked) {
+        fmt::print("{:<20} {:>7} | {:>29} | {:>29} | {:>9} | {:>19}\n",
+                   "Method",
+                   "Threads",
+                   "Original p50/p90/p99 (ns)",
+                   "Hooked p50/p90/p99 (ns)",
+                   "Overhead",
+                   "Mcalls/s (orig/hook)");
+        for (size_t i = 0; i < Original.size() && i < Hooked.size(); i++) {
+            const Result& original = Original[i];
+            const Result& hooked = Hooked[i];
+            fmt::print("{:<20} {:>7} | {:>9.1f} {:>9.1f} {:>9.1f} | {:>9.1f} {:>9.1f} {:>9.1f} | {:>9.1f} | "
+                       "{:>9.3f} {:>9.3f}\n",
+                       original.Method,
+                       original.NumThreads,
+                       original.PerCall.P50,
+                       original.PerCall.P90,
+                       original.PerCall.P99,
+                       hooked.PerCall.P50,
+                       hooked.PerCall.P90,
+                       hooked.PerCall.P99,
+                       hooked.PerCall.P50 - original.PerCall.P50,
+                       original.CallsPerSecond / 1e6,
+                       hooked.CallsPerSecond / 1e6);
+        }
+
+        if (!Options.CsvPath.empty()) {
+            FILE* file = nullptr;
+            CHECK_MSG(!fopen_s(&file, Options.CsvPath.c_str(), "w") && file, "Failed to open the CSV file");
+            fmt::print(file, "Method,Hooked,Threads,Average,P50,P90,P99,Max,CallsPerSecond\n");
+            for (const auto* results : {&Original, &Hooked}) {
+                for (const Result& result : *results) {
+                    fmt::print(file,
+                               "{},{},{},{:.2f},{:.2f},{:.2f},{:.2f},{:.2f},{:.0f}\n",
+                               result.Method,
+                               result.IsHooked ? 1 : 0,
+                               result.NumThreads,
+                               result.PerCall.Average,
+                               result.PerCall.P50,
+                               result.PerCall.P90,
+                               result.PerCall.P99,
+                               result.PerCall.Max,
+                               result.CallsPerSecond);
+                }
+            }
+            fclose(file);
+        }
+    }
+
+} // namespace
+
+int main(int argc, char** argv) {
+    TraceLoggingRegister(Tracing::g_traceProvider);
+
+    int result = 0;
+    try {
+        Options options;
+        if (!ParseOptions(argc, argv, options)) {
+            PrintUsage();
+            return 1;
+        }
+
+        Microbenchmark microbenchmark(options);
+
+        // Detours patches the methods in place, so the same objects call the originals before this point, and the
+        // detours after.
+        const std::vector<Result> original = microbenchmark.Run(false);
+        Injector::InstallHooks(&Injector::CreateInjectionManager);
+        microbenchmark.Hook();
+        const std::vector<Result> hooked = microbenchmark.Run(true);
+
+        Report(options, original, hooked);
+    } catch (std::exception& exc) {
+        fmt::print(stderr, "{}\n", exc.what());
+        result = 1;
+    }
+
+    TraceLoggingUnregister(Tracing::g_traceProvider);
+    return result;
+}
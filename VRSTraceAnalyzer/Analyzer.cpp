@@ -0,0 +1,387 @@
+// MIT License
+//
+// Copyright(c) 2024 Matthieu Bucchianeri
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this softwareand associated documentation files(the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and /or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions :
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "pch.h"
+
+#include "Check.h"
+#include "Statistics.h"
+#include "Tracing.h"
+
+namespace Tracing {
+
+    // {f33d14aa-1080-4f6d-a804-4b6e7cc20cac}
+    TRACELOGGING_DEFINE_PROVIDER(g_traceProvider,
+                                 "VRSTraceAnalyzer",
+                                 (0xf33d14aa, 0x1080, 0x4f6d, 0xa8, 0x04, 0x4b, 0x6e, 0x7c, 0xc2, 0x0c, 0xac));
+
+} // namespace Tracing
+
+namespace {
+
+    // Must match the provider in VRSInjector/Tracing.cpp.
+    constexpr GUID VRSInjectorProviderGuid = {
+        0xcbf3adcd, 0x42b1, 0x4e38, {0x93, 0x0b, 0x95, 0x98, 0x0a, 0xf2, 0x01, 0xf6}};
+
+    struct Options {
+        std::string EtlPath;
+        // Only analyze the events of this process (0 for all).
+        DWORD ProcessId{0};
+        std::string CsvPath;
+        std::string JsonPath;
+    };
+
+    void PrintUsage() {
+        fmt::print("Usage: VRSTraceAnalyzer <trace.etl> [options]\n"
+                   "  --pid N                 Only analyze the events of this process.\n"
+                   "  --csv path              Write the metrics to a CSV file.\n"
+                   "  --json path             Write the metrics to a JSON file.\n");
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options) {
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+            const bool hasValue = i + 1 < argc && argv[i + 1][0] != '-';
+            const auto value = [&]() -> std::string {
+                CHECK_MSG(hasValue, fmt::format("Missing value for {}", arg));
+                return argv[++i];
+            };
+            if (arg == "--pid") {
+                options.ProcessId = std::stoul(value());
+            } else if (arg == "--csv") {
+                options.CsvPath = value();
+            } else if (arg == "--json") {
+                options.JsonPath = value();
+            } else if (arg[0] != '-' && options.EtlPath.empty()) {
+                options.EtlPath = arg;
+            } else {
+                return false;
+            }
+        }
+        return !options.EtlPath.empty();
+    }
+
+    std::string ToUtf8(const wchar_t* String) {
+        const int size = WideCharToMultiByte(CP_UTF8, 0, String, -1, nullptr, 0, nullptr, nullptr);
+        if (size <= 1) {
+            return {};
+        }
+        std::string result(size - 1, '\0');
+        WideCharToMultiByte(CP_UTF8, 0, String, -1, result.data(), size, nullptr, nullptr);
+        return result;
+    }
+
+    // Read an integer (or boolean) field of an event.
+    std::optional<uint64_t> GetIntegerProperty(PEVENT_RECORD Record, const wchar_t* Name) {
+        PROPERTY_DATA_DESCRIPTOR descriptor{};
+        descriptor.PropertyName = reinterpret_cast<ULONGLONG>(Name);
+        descriptor.ArrayIndex = ULONG_MAX;
+        ULONG size = 0;
+        if (TdhGetPropertySize(Record, 0, nullptr, 1, &descriptor, &size) != ERROR_SUCCESS || !size ||
+            size > sizeof(uint64_t)) {
+            return {};
+        }
+        uint64_t value = 0;
+        if (TdhGetProperty(Record, 0, nullptr, 1, &descriptor, size, reinterpret_cast<PBYTE>(&value)) !=
+            ERROR_SUCCESS) {
+            return {};
+        }
+        return value;
+    }
+
+    class TraceAnalyzer {
+      public:
+        void Analyze(const Options& Options) {
+            m_ProcessId = Options.ProcessId;
+
+            std::wstring path = std::filesystem::path(Options.EtlPath).wstring();
+            EVENT_TRACE_LOGFILEW logFile{};
+            logFile.LogFileName = path.data();
+            logFile.ProcessTraceMode = PROCESS_TRACE_MODE_EVENT_RECORD;
+            logFile.EventRecordCallback = &TraceAnalyzer::OnEventRecord;
+            logFile.Context = this;
+
+            TRACEHANDLE trace = OpenTraceW(&logFile);
+            CHECK_MSG(trace != INVALID_PROCESSTRACE_HANDLE, fmt::format("Failed to open {}", Options.EtlPath));
+            const ULONG result = ProcessTrace(&trace, 1, nullptr, nullptr);
+            CloseTrace(trace);
+            CHECK_MSG(result == ERROR_SUCCESS, fmt::format("Failed to process the trace: {}", result));
+        }
+
+        void Report(const Options& Options) const {
+            std::vector<std::pair<std::string, Statistics::Distribution>> distributions;
+            distributions.push_back({"FrameInterval", Statistics::GetDistribution(m_FrameIntervals)});
+            distributions.push_back({"GazeStaleness", Statistics::GetDistribution(m_GazeStaleness)});
+            for (const auto& [name, durations] : m_ActivityDurations) {
+                distributions.push_back({name, Statistics::GetDistribution(durations)});
+            }
+
+            const uint64_t numQueueWaits = std::max({m_NumQueueWaitEvents, m_NumQueueWaitsCounted, m_NumQueueWaitsGpu});
+            // The cache rates are the maps bound without waiting for a generation, and the updates skipped because the
+            // map was unchanged.
+            const std::pair<const char*, double> rates[] = {
+                {"Frames", static_cast<double>(m_NumFrames)},
+                {"ShadingRateMapBindReadyRate", Ratio(m_NumReadyBinds, m_NumBinds)},
+                {"ShadingRateMapUnchangedRate",
+                 Ratio(m_NumUnchangedShadingRateMaps, m_NumUnchangedShadingRateMaps + m_NumUpdatedShadingRateMaps)},
+                {"ShadingRateMapsCreated", static_cast<double>(m_NumCreatedShadingRateMaps)},
+                {"QueueWaits", static_cast<double>(numQueueWaits)},
+                {"QueueWaitsPerFrame", Ratio(numQueueWaits, m_NumFrames)},
+                {"GazeUnavailableRate", Ratio(m_NumGazeUnavailable, m_NumGazeQueries)},
+            };
+
+            fmt::print("{} events in {} frames\n", m_NumEvents, m_NumFrames);
+            for (const auto& [name, value] : rates) {
+                fmt::print("{:<40} {:.4f}\n", name, value);
+            }
+            fmt::print(
+                "\n{:<60} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9} (ms)\n", "", "count", "avg", "p50", "p90", "p99", "max");
+            for (const auto& [name, statistics] : distributions) {
+                fmt::print("{:<60} {:>9} {:9.4f} {:9.4f} {:9.4f} {:9.4f} {:9.4f}\n",
+                           name,
+                           statistics.Count,
+                           statistics.Average,
+                           statistics.P50,
+                           statistics.P90,
+                           statistics.P99,
+                           statistics.Max);
+            }
+
+            if (!Options.CsvPath.empty()) {
+                FILE* file = nullptr;
+                CHECK_MSG(!fopen_s(&file, Options.CsvPath.c_str(), "w") && file, "Failed to open the CSV file");
+                fmt::print(file, "Metric,Value,Count,Mean,P50,P90,P99,Max\n");
+                for (const auto& [name, value] : rates) {
+                    fmt::print(file, "{},{:.6f},,,,,,\n", name, value);
+                }
+                for (const auto& [name, statistics] : distributions) {
+                    fmt::print(file,
+                               "{},,{},{:.6f},{:.6f},{:.6f},{:.6f},{:.6f}\n",
+                               name,
+                               statistics.Count,
+                               statistics.Average,
+                               statistics.P50,
+                               statistics.P90,
+                               statistics.P99,
+                               statistics.Max);
+                }
+                fclose(file);
+            }
+
+            if (!Options.JsonPath.empty()) {
+                FILE* file = nullptr;
+                CHECK_MSG(!fopen_s(&file, Options.JsonPath.c_str(), "w") && file, "Failed to open the JSON file");
+                fmt::print(file, "{{\n  \"metrics\": {{\n");
+                for (size_t i = 0; i < std::size(rates); i++) {
+                    fmt::print(file,
+                               "    \"{}\": {:.6f}{}\n",
+                               rates[i].first,
+                               rates[i].second,
+                               i + 1 < std::size(rates) ? "," : "");
+                }
+                fmt::print(file, "  }},\n  \"distributions\": {{\n");
+                for (size_t i = 0; i < distributions.size(); i++) {
+                    const Statistics::Distribution& statistics = distributions[i].second;
+                    fmt::print(file,
+                               "    \"{}\": {{\"count\": {}, \"mean\": {:.6f}, \"p50\": {:.6f}, \"p90\": {:.6f}, "
+                               "\"p99\": {:.6f}, \"max\": {:.6f}}}{}\n",
+                               EscapeJson(distributions[i].first),
+                               statistics.Count,
+                               statistics.Average,
+                               statistics.P50,
+                               statistics.P90,
+                               statistics.P99,
+                               statistics.Max,
+                               i + 1 < distributions.size() ? "," : "");
+                }
+                fmt::print(file, "  }}\n}}\n");
+                fclose(file);
+            }
+        }
+
+      private:
+        struct PendingActivity {
+            std::string Name;
+            int64_t Timestamp;
+        };
+
+        static void WINAPI OnEventRecord(PEVENT_RECORD Record) {
+            static_cast<TraceAnalyzer*>(Record->UserContext)->OnEvent(Record);
+        }
+
+        void OnEvent(PEVENT_RECORD Record) {
+            const EVENT_HEADER& header = Record->EventHeader;
+            if (!IsEqualGUID(header.ProviderId, VRSInjectorProviderGuid) ||
+                (m_ProcessId && header.ProcessId != m_ProcessId)) {
+                return;
+            }
+            m_NumEvents++;
+
+            const std::string& name = GetEventName(Record);
+            const int64_t timestamp = header.TimeStamp.QuadPart;
+            const UCHAR opcode = header.EventDescriptor.Opcode;
+
+            // The start and the stop of an activity share its activity ID. The stop may be named differently (eg:
+            // "TobiiGetGaze_NotAvailable"), so the duration is attributed to the name of the start.
+            const std::string activityId(reinterpret_cast<const char*>(&header.ActivityId), sizeof(GUID));
+            if (opcode == WINEVENT_OPCODE_START) {
+                m_PendingActivities[activityId] = {name, timestamp};
+            } else if (opcode == WINEVENT_OPCODE_STOP) {
+                auto it = m_PendingActivities.find(activityId);
+                if (it != m_PendingActivities.end()) {
+                    m_ActivityDurations[it->second.Name].push_back(ToMilliseconds(timestamp - it->second.Timestamp));
+                    m_PendingActivities.erase(it);
+                }
+            }
+
+            if (name == "IDXGISwapChain_Present" && opcode == WINEVENT_OPCODE_START) {
+                if (m_LastPresentTimestamp) {
+                    m_FrameIntervals.push_back(ToMilliseconds(timestamp - m_LastPresentTimestamp));
+                }
+                m_LastPresentTimestamp = timestamp;
+                m_NumFrames++;
+            } else if (name == "VRSEnable_Bind") {
+                m_NumBinds++;
+                m_NumReadyBinds += GetIntegerProperty(Record, L"IsReady").value_or(0) ? 1 : 0;
+            } else if (name == "VRSUpdateShadingRateMaps" && opcode == WINEVENT_OPCODE_STOP) {
+                m_NumUpdatedShadingRateMaps += GetIntegerProperty(Record, L"NumUpdatedShadingRateMaps").value_or(0);
+                m_NumUnchangedShadingRateMaps += GetIntegerProperty(Record, L"NumUnchangedShadingRateMaps").value_or(0);
+            } else if (name == "VRSCreateShadingRateMap" && opcode == WINEVENT_OPCODE_START) {
+                m_NumCreatedShadingRateMaps++;
+            } else if (name == "SyncQueue_Wait") {
+                m_NumQueueWaitEvents++;
+            } else if (name == "FrameCounters") {
+                m_NumQueueWaitsCounted += GetIntegerProperty(Record, L"NumQueueWait").value_or(0);
+            } else if (name == "VRSGpuOverhead" && opcode == WINEVENT_OPCODE_STOP) {
+                m_NumQueueWaitsGpu += GetIntegerProperty(Record, L"NumQueueWaits").value_or(0);
+            } else if (name == "TobiiUpdate_Sample") {
+                m_LastGazeSampleTimestamp = timestamp;
+            } else if (name == "TobiiGetGaze" && opcode == WINEVENT_OPCODE_STOP) {
+                // The age of the latest sample when the gaze is used.
+                m_NumGazeQueries++;
+                if (m_LastGazeSampleTimestamp) {
+                    m_GazeStaleness.push_back(ToMilliseconds(timestamp - m_LastGazeSampleTimestamp));
+                }
+            } else if (name == "TobiiGetGaze_NotAvailable") {
+                m_NumGazeQueries++;
+                m_NumGazeUnavailable++;
+            }
+        }
+
+        // TraceLogging events carry their name in their metadata, which TDH reports as the task name. The metadata is
+        // the same for all the events written at the same place, so we decode it only once.
+        const std::string& GetEventName(PEVENT_RECORD Record) {
+            std::string key;
+            for (USHORT i = 0; i < Record->ExtendedDataCount; i++) {
+                const EVENT_HEADER_EXTENDED_DATA_ITEM& item = Record->ExtendedData[i];
+                if (item.ExtType == EVENT_HEADER_EXT_TYPE_EVENT_SCHEMA_TL) {
+                    key.assign(reinterpret_cast<const char*>(item.DataPtr), item.DataSize);
+                    break;
+                }
+            }
+            auto it = m_EventNames.find(key);
+            if (it != m_EventNames.end() && !key.empty()) {
+                return it->second;
+            }
+
+            std::string name;
+            ULONG size = 0;
+            if (TdhGetEventInformation(Record, 0, nullptr, nullptr, &size) == ERROR_INSUFFICIENT_BUFFER) {
+                std::vector<uint8_t> buffer(size);
+                TRACE_EVENT_INFO* const info = reinterpret_cast<TRACE_EVENT_INFO*>(buffer.data());
+                if (TdhGetEventInformation(Record, 0, nullptr, info, &size) == ERROR_SUCCESS && info->TaskNameOffset) {
+                    name = ToUtf8(reinterpret_cast<const wchar_t*>(buffer.data() + info->TaskNameOffset));
+                }
+            }
+            return m_EventNames[key] = std::move(name);
+        }
+
+        // The timestamps are in 100 ns units.
+        static double ToMilliseconds(int64_t Duration) {
+            return Duration / 10'000.0;
+        }
+
+        static double Ratio(uint64_t Numerator, uint64_t Denominator) {
+            return Denominator ? static_cast<double>(Numerator) / Denominator : 0.0;
+        }
+
+        static std::string EscapeJson(const std::string& String) {
+            std::string escaped;
+            for (const char c : String) {
+                if (c == '"' || c == '\\') {
+                    escaped += '\\';
+                }
+                escaped += c;
+            }
+            return escaped;
+        }
+
+        DWORD m_ProcessId{0};
+        uint64_t m_NumEvents{0};
+        std::unordered_map<std::string, std::string> m_EventNames;
+        std::unordered_map<std::string, PendingActivity> m_PendingActivities;
+        std::map<std::string, std::vector<double>> m_ActivityDurations;
+
+        uint64_t m_NumFrames{0};
+        int64_t m_LastPresentTimestamp{0};
+        std::vector<double> m_FrameIntervals;
+
+        uint64_t m_NumBinds{0};
+        uint64_t m_NumReadyBinds{0};
+        uint64_t m_NumUpdatedShadingRateMaps{0};
+        uint64_t m_NumUnchangedShadingRateMaps{0};
+        uint64_t m_NumCreatedShadingRateMaps{0};
+
+        // The waits are counted by several events, depending on the keywords of the capture.
+        uint64_t m_NumQueueWaitEvents{0};
+        uint64_t m_NumQueueWaitsCounted{0};
+        uint64_t m_NumQueueWaitsGpu{0};
+
+        int64_t m_LastGazeSampleTimestamp{0};
+        uint64_t m_NumGazeQueries{0};
+        uint64_t m_NumGazeUnavailable{0};
+        std::vector<double> m_GazeStaleness;
+    };
+
+} // namespace
+
+int main(int argc, char** argv) {
+    TraceLoggingRegister(Tracing::g_traceProvider);
+
+    int result = 0;
+    try {
+        Options options;
+        if (!ParseOptions(argc, argv, options)) {
+            PrintUsage();
+            return 1;
+        }
+
+        TraceAnalyzer analyzer;
+        analyzer.Analyze(options);
+        analyzer.Report(options);
+    } catch (std::exception& exc) {
+        fmt::print(stderr, "{}\n", exc.what());
+        result = 1;
+    }
+
+    TraceLoggingUnregister(Tracing::g_traceProvider);
+    return result;
+}